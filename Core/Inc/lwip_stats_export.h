@@ -0,0 +1,65 @@
+/**
+ * @file       lwip_stats_export.h
+ * @brief      Periodic export of the lwIP statistics as CSV records
+ *
+ * A low priority thread takes a snapshot of the lwIP statistics (stats.c)
+ * and of the Ethernet RX pool every LWIP_STATS_EXPORT_PERIOD milliseconds
+ * and prints it. The records are therefore published through the MRRB
+ * retarget path (UART, ITM, UDP and the FTP live file).
+ *
+ * Every line starts with "lwip,<time in ms>,<record>" and is followed by
+ * the fields of the record:
+ *
+ *   proto: <name>,<xmit>,<recv>,<drop>,<memerr>,<err> for each of link,
+ *          etharp, ip, icmp, udp and tcp, where err is the sum of all other
+ *          error counters of the protocol
+ *   mem:   <name>,<used>,<max>,<err> for the heap and for every memory pool
+ *          that has been used, split over several lines if needed
+ *   sys:   <mbox used>,<mbox max>,<mbox err>,<sem err>,<mutex err>
+ *   rx:    <pool size>,<in use>,<peak in use>,<exhausted>,<exhausted ms>,
+ *          <max refill us> of the zero-copy RX pool of the Ethernet driver
+ *
+ * All counters are absolute since boot, the 16-bit counters of lwIP wrap.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __LWIP_STATS_EXPORT_H
+#define __LWIP_STATS_EXPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+/* Exported constants --------------------------------------------------------*/
+
+// Enable the export thread
+#define LWIP_STATS_EXPORT 1
+
+// Time between two snapshots in milliseconds
+#define LWIP_STATS_EXPORT_PERIOD 10000
+
+// Maximum length of an exported line
+#define LWIP_STATS_EXPORT_LINE_LENGTH 384
+
+/* Exported macros -----------------------------------------------------------*/
+
+/* Exported types ------------------------------------------------------------*/
+
+/* Exported variables --------------------------------------------------------*/
+
+/* Exported functions --------------------------------------------------------*/
+
+int lwip_stats_export_init(void);
+void lwip_stats_export_snapshot(void);
+
+/* Inline functions --------------------------------------------------------*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __LWIP_STATS_EXPORT_H included
@@ -24,9 +24,18 @@ extern "C" {
 #define MRRB_RETARGET_BUFFER_LENGTH 1024
 
 // Readers
+#ifndef MRRB_RETARGET_UART
 #define MRRB_RETARGET_UART 1
+#endif
+#ifndef MRRB_RETARGET_ITM
 #define MRRB_RETARGET_ITM 1
+#endif
+#ifndef MRRB_RETARGET_UDP
 #define MRRB_RETARGET_UDP 1
+#endif
+#ifndef MRRB_RETARGET_FTP
+#define MRRB_RETARGET_FTP 1
+#endif
 
 // UART settings
 #define MRRB_RETARGET_UART_HANDLE huart3
@@ -35,6 +44,9 @@ extern "C" {
 #define MRRB_RETARGET_UDP_RECV_PORT 13869
 #define MRRB_RETARGET_UDP_RECV_IP MRRB_RETARGET_IP_TO_INT(192, 168, 0, 9)
 
+// FTP settings
+#define MRRB_RETARGET_FTP_PATH "/live/console.log"
+
 /* Exported macros -----------------------------------------------------------*/
 
 /* Exported types ------------------------------------------------------------*/
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include "sys.h"
 #include "tim.h"
+#include "lwip_stats_export.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -206,6 +207,11 @@ void StartDefaultTask(void *argument)
   // Print the header
   printf(header);
 
+#if LWIP_STATS_EXPORT
+  // Start the periodic export of the network statistics
+  lwip_stats_export_init();
+#endif /* LWIP_STATS_EXPORT */
+
   int button_was_pressed = 0;
 
   /* Infinite loop */
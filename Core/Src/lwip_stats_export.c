@@ -0,0 +1,226 @@
+/**
+ * @file       lwip_stats_export.c
+ * @brief      Periodic export of the lwIP statistics as CSV records
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+// Header
+#include "lwip_stats_export.h"
+
+// Standard libraries
+#include <stdarg.h>
+#include <stdio.h>
+
+// Operating System for Threading
+#include "cmsis_os.h"
+
+// lwIP statistics
+#include "lwip/opt.h"
+#include "lwip/stats.h"
+#include "lwip/memp.h"
+
+// RX pool statistics of the Ethernet driver
+#include "ethernetif.h"
+
+#if LWIP_STATS_EXPORT
+
+#if !LWIP_STATS
+#error "LWIP_STATS_EXPORT requires LWIP_STATS"
+#endif /* !LWIP_STATS */
+
+/* Private typedef -----------------------------------------------------------*/
+
+typedef struct {
+  const char *record;
+  uint32_t time;
+  unsigned int length;
+  char buffer[LWIP_STATS_EXPORT_LINE_LENGTH];
+} stats_line_t;
+
+/* Private function prototypes -----------------------------------------------*/
+
+void _stats_export_thread(void *args);
+
+static void _line_start(stats_line_t *line, const char *record);
+static void _line_add(stats_line_t *line, const char *format, ...);
+static void _line_flush(stats_line_t *line);
+
+#if LINK_STATS || ETHARP_STATS || IP_STATS || ICMP_STATS || UDP_STATS || TCP_STATS
+static void _line_add_proto(stats_line_t *line, const char *name, struct stats_proto *proto);
+#endif
+
+/* Private variables ---------------------------------------------------------*/
+
+// Export thread attributes
+const osThreadAttr_t stats_export_thread_attr = {
+  .priority = osPriorityLow,
+  .stack_size = 256 * 4,
+  .name = "lwip_stats"
+};
+
+// Line buffer, only used by the export thread
+static stats_line_t stats_line;
+
+#if MEMP_STATS
+// Names of the memory pools, in the order of lwip_stats.memp
+static const char *const stats_memp_names[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc) #name,
+#include "lwip/priv/memp_std.h"
+};
+#endif /* MEMP_STATS */
+
+/* Exported functions --------------------------------------------------------*/
+
+int lwip_stats_export_init() {
+  if (osThreadNew(_stats_export_thread, NULL, &stats_export_thread_attr) == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+void lwip_stats_export_snapshot() {
+  stats_line_t *line = &stats_line;
+
+  // Protocol counters
+  _line_start(line, "proto");
+#if LINK_STATS
+  _line_add_proto(line, "link", &lwip_stats.link);
+#endif /* LINK_STATS */
+#if ETHARP_STATS
+  _line_add_proto(line, "etharp", &lwip_stats.etharp);
+#endif /* ETHARP_STATS */
+#if IP_STATS
+  _line_add_proto(line, "ip", &lwip_stats.ip);
+#endif /* IP_STATS */
+#if ICMP_STATS
+  _line_add_proto(line, "icmp", &lwip_stats.icmp);
+#endif /* ICMP_STATS */
+#if UDP_STATS
+  _line_add_proto(line, "udp", &lwip_stats.udp);
+#endif /* UDP_STATS */
+#if TCP_STATS
+  _line_add_proto(line, "tcp", &lwip_stats.tcp);
+#endif /* TCP_STATS */
+  _line_flush(line);
+
+  // Heap and memory pools, unused pools are skipped
+  _line_start(line, "mem");
+#if MEM_STATS
+  _line_add(line, ",heap,%u,%u,%u",
+            (unsigned int) lwip_stats.mem.used,
+            (unsigned int) lwip_stats.mem.max,
+            (unsigned int) lwip_stats.mem.err);
+#endif /* MEM_STATS */
+#if MEMP_STATS
+  for (int i = 0; i < MEMP_MAX; i++) {
+    const struct stats_mem *memp = lwip_stats.memp[i];
+    if (memp == NULL || (memp->max == 0 && memp->err == 0)) {
+      continue;
+    }
+    _line_add(line, ",%s,%u,%u,%u",
+              stats_memp_names[i],
+              (unsigned int) memp->used,
+              (unsigned int) memp->max,
+              (unsigned int) memp->err);
+  }
+#endif /* MEMP_STATS */
+  _line_flush(line);
+
+#if SYS_STATS
+  // Operating system objects
+  _line_start(line, "sys");
+  _line_add(line, ",%u,%u,%u,%u,%u",
+            (unsigned int) lwip_stats.sys.mbox.used,
+            (unsigned int) lwip_stats.sys.mbox.max,
+            (unsigned int) lwip_stats.sys.mbox.err,
+            (unsigned int) lwip_stats.sys.sem.err,
+            (unsigned int) lwip_stats.sys.mutex.err);
+  _line_flush(line);
+#endif /* SYS_STATS */
+
+  // Zero-copy RX pool of the Ethernet driver
+  ethernetif_rx_stats_t rx;
+  ethernetif_get_rx_stats(&rx);
+  _line_start(line, "rx");
+  _line_add(line, ",%lu,%lu,%lu,%lu,%lu,%lu",
+            (unsigned long) rx.pool_size,
+            (unsigned long) rx.in_use,
+            (unsigned long) rx.peak_in_use,
+            (unsigned long) rx.exhausted,
+            (unsigned long) rx.exhausted_ms,
+            (unsigned long) rx.refill_max_us);
+  _line_flush(line);
+}
+
+/* Private functions ---------------------------------------------------------*/
+
+void _stats_export_thread(void *args) {
+  uint32_t next = osKernelGetTickCount();
+  // Enter thread loop
+  while (1) {
+    next += LWIP_STATS_EXPORT_PERIOD;
+    osDelayUntil(next);
+    lwip_stats_export_snapshot();
+  }
+}
+
+static void _line_start(stats_line_t *line, const char *record) {
+  line->record = record;
+  line->time = osKernelGetTickCount();
+  line->length = snprintf(line->buffer, sizeof(line->buffer), "lwip,%lu,%s",
+                          (unsigned long) line->time, record);
+}
+
+// Append a group of fields. Groups that do not fit anymore continue the
+// record on a new line with the same time.
+static void _line_add(stats_line_t *line, const char *format, ...) {
+  va_list args;
+  for (int retry = 0; retry < 2; retry++) {
+    va_start(args, format);
+    unsigned int space = sizeof(line->buffer) - line->length - 1;
+    int len = vsnprintf(&line->buffer[line->length], space + 1, format, args);
+    va_end(args);
+    if (len >= 0 && (unsigned int) len <= space) {
+      line->length += len;
+      return;
+    }
+    // Remove the partial group and continue on the next line
+    line->buffer[line->length] = '\0';
+    uint32_t time = line->time;
+    _line_flush(line);
+    line->length = snprintf(line->buffer, sizeof(line->buffer), "lwip,%lu,%s",
+                            (unsigned long) time, line->record);
+  }
+}
+
+static void _line_flush(stats_line_t *line) {
+  printf("%s\n", line->buffer);
+}
+
+#if LINK_STATS || ETHARP_STATS || IP_STATS || ICMP_STATS || UDP_STATS || TCP_STATS
+static void _line_add_proto(stats_line_t *line, const char *name, struct stats_proto *proto) {
+  unsigned long err = (unsigned long) proto->chkerr + proto->lenerr + proto->rterr +
+                      proto->proterr + proto->opterr + proto->err;
+  _line_add(line, ",%s,%u,%u,%u,%u,%lu",
+            name,
+            (unsigned int) proto->xmit,
+            (unsigned int) proto->recv,
+            (unsigned int) proto->drop,
+            (unsigned int) proto->memerr,
+            err);
+}
+#endif
+
+#endif /* LWIP_STATS_EXPORT */
+
+#ifdef __cplusplus
+}
+#endif
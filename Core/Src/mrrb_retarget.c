@@ -28,11 +28,17 @@ extern "C" {
 // Sockets for UDP
 #include "socket.h"
 
+// FTP Server for live file
+#if MRRB_RETARGET_FTP
+#include "ftp.h"
+#endif /* MRRB_RETARGET_FTP */
+
 /* Private defines -----------------------------------------------------------*/
 
 #define MRRB_RETARGET_NUM_READERS (((MRRB_RETARGET_UART) == 0 ? 0 : 1) + \
                                    ((MRRB_RETARGET_ITM)  == 0 ? 0 : 1) + \
-                                   ((MRRB_RETARGET_UDP)  == 0 ? 0 : 1))
+                                   ((MRRB_RETARGET_UDP)  == 0 ? 0 : 1) + \
+                                   ((MRRB_RETARGET_FTP)  == 0 ? 0 : 1))
 
 #define MRRB_RETARGET_UDP_FLAG_NEW_DATA 0x0001
 #define MRRB_RETARGET_UDP_FLAG_EXIT     0x0002
@@ -108,6 +114,11 @@ retarget_itm_state_t ITM_handle;
 retarget_udp_state_t udp_state;
 #endif /* MRRB_RETARGET_UDP */
 
+// FTP live file
+#if MRRB_RETARGET_FTP
+ftp_live_file_t retarget_ftp_file;
+#endif /* MRRB_RETARGET_FTP */
+
 // Multiple Reader Ring Buffer
 multi_reader_ring_buffer_t retarget_mrrb;
 unsigned char retarget_buffer[MRRB_RETARGET_BUFFER_LENGTH];
@@ -186,7 +197,7 @@ int mrrb_retarget_init() {
   }
 #endif /* MRRB_RETARGET_ITM */
 #if MRRB_RETARGET_UDP
-  udp_state.reader = &retarget_mrrb_readers[2];
+  udp_state.reader = current_reader;
   if(mrrb_reader_init(current_reader++,
                       &udp_state,
                       MRRB_READER_OVERRUN_SKIP,
@@ -195,6 +206,15 @@ int mrrb_retarget_init() {
     return -1;
   }
 #endif /* MRRB_RETARGET_UDP */
+#if MRRB_RETARGET_FTP
+  ring_buffer_reader_t *ftp_reader = current_reader;
+  if(ftp_server_live_file_init(&retarget_ftp_file,
+                               MRRB_RETARGET_FTP_PATH,
+                               &retarget_mrrb,
+                               current_reader++)) {
+    return -1;
+  }
+#endif /* MRRB_RETARGET_FTP */
 
   // Initialize MRRB
   if(mrrb_init(&retarget_mrrb,
@@ -204,6 +224,13 @@ int mrrb_retarget_init() {
                MRRB_RETARGET_NUM_READERS) < 0) {
     return -1;
   }
+
+#if MRRB_RETARGET_FTP
+  // The FTP reader is only enabled while a client streams the live file
+  if(mrrb_reader_disable(&retarget_mrrb, ftp_reader) < 0) {
+    return -1;
+  }
+#endif /* MRRB_RETARGET_FTP */
   return 0;
 }
 
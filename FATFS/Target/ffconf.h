@@ -66,6 +66,14 @@
 #define	_USE_EXPAND		1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
+#define	_USE_LOG		1
+/* This option switches append-only log functions, f_log_open(), f_log_write(),
+/  f_log_sync() and f_log_close(). (0:Disable or 1:Enable) A log is preallocated
+/  contiguously and appended to in whole sectors without updating the FAT or the
+/  directory entry, so a synchronized append costs about one sector write. To
+/  enable this option, _USE_EXPAND needs to be 1, _FS_MINIMIZE needs to be 0 and
+/  _FS_READONLY needs to be 0. */
+
 #define _USE_CHMOD		0
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also _FS_READONLY needs to be 0 to enable this option. */
@@ -209,6 +217,32 @@
 /  Instead of private sector buffer eliminated from the file object, common sector
 /  buffer in the file system object (FATFS) is used for the file data transfer. */
 
+#define _FS_CACHE_WAYS	0	/* 0:Disable or >=1:Enable */
+/* This option sets the number of sectors held by a write-back cache between the
+/  sector window of the file system object (FATFS) and the disk. Only FAT,
+/  directory and FSINFO sectors pass through it, so file data never evicts them.
+/  Dirty sectors are written back on eviction and when the volume is synchronized.
+/  Each way adds _MAX_SS bytes to the file system object. This option must be 0
+/  at tiny or read-only configuration. It only pays off on slow media: on the RAM
+/  disk, copying the sector costs as much as the disk access it saves. */
+
+#define _FS_FREEMAP	32768	/* 0:Disable or maximum number of clusters */
+/* This option enables an in-RAM bitmap of the free clusters on FAT12/16/32
+/  volumes. It is built from the FAT on the first cluster allocation after the
+/  volume is mounted and kept in sync with every FAT change, so allocation no
+/  longer scans the FAT. Volumes with more clusters than the value fall back to
+/  the FAT scan. The bitmap adds (_FS_FREEMAP + 7) / 8 bytes to the file system
+/  object. This option has no effect at read-only configuration. */
+
+#define _FS_DIRCACHE	64	/* 0:Disable or number of entries (power of 2) */
+/* This option enables a per-volume hash table of directory lookups. Each entry
+/  maps a directory start cluster and an SFN to the offset of its directory entry,
+/  so that finding a recently used object does not scan the directory. Entries are
+/  added when an object is found or created and dropped when it is removed, and a
+/  hit is checked against the directory entry before it is used. Each entry adds
+/  19 bytes to the file system object. This option must be 0 at LFN or exFAT
+/  configuration. */
+
 #define _FS_EXFAT	0
 /* This option switches support of exFAT file system. (0:Disable or 1:Enable)
 /  When enable exFAT, also LFN needs to be enabled. (_USE_LFN >= 1)
@@ -260,6 +294,18 @@
 /  SemaphoreHandle_t and etc.. A header file for O/S definitions needs to be
 /  included somewhere in the scope of ff.h. */
 
+#define _FS_PARALLEL_IO  1  /* 0:Disable or 1:Enable */
+/* The option _FS_PARALLEL_IO releases the volume lock of _FS_REENTRANT while
+/  f_read() and f_write() transfer whole sectors of file data directly from/to
+/  the disk, and while f_log_write() writes log sectors. The FAT, directory and
+/  partial sector accesses are still done with the volume locked. This lets
+/  tasks working on different files of the same volume share the disk, e.g. a
+/  long FTP transfer does not hold off the log file or a directory listing.
+/  disk_read() and disk_write() must be re-entrant. A file object must only be
+/  used by one task at a time, and _FS_LOCK should be enabled to reject the
+/  removal of open files. This option has no effect when _FS_REENTRANT is 0
+/  and must be 0 when _FS_TINY is 1. */
+
 /* define the ff_malloc ff_free macros as FreeRTOS pvPortMalloc and vPortFree macros */
 #if !defined(ff_malloc) && !defined(ff_free)
 #define ff_malloc  pvPortMalloc
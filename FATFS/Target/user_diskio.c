@@ -34,23 +34,242 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include <string.h>
+#include "main.h"
+#include "cmsis_os.h"
 #include "ff_gen_drv.h"
 
 /* Private typedef -----------------------------------------------------------*/
+
+// A contiguous part of the disk in one SRAM
+typedef struct {
+  BYTE *base;
+  DWORD num_sectors;
+} ram_disk_region_t;
+
 /* Private define ------------------------------------------------------------*/
 
-// Number of sectors
-#define NS 256
+// Number of sectors per SRAM region. The disk consists of all regions in the
+// order AXI SRAM, DTCM, SRAM4. A region of size 0 is left out. SRAM1/2 are
+// used by lwIP and are therefore not part of the disk.
+#ifndef RAM_DISK_D1_SECTORS
+#define RAM_DISK_D1_SECTORS 256
+#endif
+#ifndef RAM_DISK_DTCM_SECTORS
+#define RAM_DISK_DTCM_SECTORS 192
+#endif
+#ifndef RAM_DISK_D3_SECTORS
+#define RAM_DISK_D3_SECTORS 24
+#endif
+
+#define RAM_DISK_SECTORS (RAM_DISK_D1_SECTORS + RAM_DISK_DTCM_SECTORS + RAM_DISK_D3_SECTORS)
+
+// Alignment of the data area reported to FatFS in sectors. All region sizes
+// are a multiple of it, so that clusters up to this size never span two
+// regions and each cluster access is a single copy.
+#ifndef RAM_DISK_BLOCK_SIZE
+#define RAM_DISK_BLOCK_SIZE 8
+#endif
+
+#if (RAM_DISK_D1_SECTORS % RAM_DISK_BLOCK_SIZE) || \
+    (RAM_DISK_DTCM_SECTORS % RAM_DISK_BLOCK_SIZE) || \
+    (RAM_DISK_D3_SECTORS % RAM_DISK_BLOCK_SIZE)
+#error "RAM disk region sizes must be a multiple of RAM_DISK_BLOCK_SIZE"
+#endif
+
+// Copies of at least this many sectors are done by the MDMA, while the
+// calling thread sleeps. Smaller copies are done by the CPU, as the DMA setup
+// and the context switches cost more than they save.
+#ifndef RAM_DISK_USE_MDMA
+#define RAM_DISK_USE_MDMA 1
+#endif
+#ifndef RAM_DISK_MDMA_MIN_SECTORS
+#define RAM_DISK_MDMA_MIN_SECTORS 4
+#endif
+#define RAM_DISK_MDMA_TIMEOUT 100
+#define RAM_DISK_MDMA_IRQ_PRIORITY 5
+
+#if RAM_DISK_USE_MDMA && defined(HAL_MDMA_MODULE_ENABLED)
+#define RAM_DISK_MDMA 1
+#else
+#define RAM_DISK_MDMA 0
+#endif
 
 // Define File System RAM attributes and section location if not defined elsewhere
 #ifndef FS_RAM
 #define FS_RAM __attribute__((section(".FS_RAM")))
 #endif
+#ifndef FS_RAM_DTCM
+#define FS_RAM_DTCM __attribute__((section(".FS_RAM_DTCM")))
+#endif
+#ifndef FS_RAM_D3
+#define FS_RAM_D3 __attribute__((section(".FS_RAM_D3")))
+#endif
 
 /* Private variables ---------------------------------------------------------*/
 
 // Memory
-FS_RAM signed char mem[NS * _MAX_SS];
+#if RAM_DISK_D1_SECTORS > 0
+FS_RAM static BYTE mem_d1[RAM_DISK_D1_SECTORS * _MAX_SS] __attribute__((aligned(32)));
+#endif
+#if RAM_DISK_DTCM_SECTORS > 0
+FS_RAM_DTCM static BYTE mem_dtcm[RAM_DISK_DTCM_SECTORS * _MAX_SS] __attribute__((aligned(32)));
+#endif
+#if RAM_DISK_D3_SECTORS > 0
+FS_RAM_D3 static BYTE mem_d3[RAM_DISK_D3_SECTORS * _MAX_SS] __attribute__((aligned(32)));
+#endif
+
+static const ram_disk_region_t regions[] = {
+#if RAM_DISK_D1_SECTORS > 0
+  { mem_d1, RAM_DISK_D1_SECTORS },
+#endif
+#if RAM_DISK_DTCM_SECTORS > 0
+  { mem_dtcm, RAM_DISK_DTCM_SECTORS },
+#endif
+#if RAM_DISK_D3_SECTORS > 0
+  { mem_d3, RAM_DISK_D3_SECTORS },
+#endif
+};
+
+#if RAM_DISK_MDMA
+static MDMA_HandleTypeDef hmdma_disk;
+static osSemaphoreId_t mdma_done;
+// The disk is accessed by several tasks at once with _FS_PARALLEL_IO
+static osMutexId_t mdma_lock;
+static volatile int mdma_error;
+#endif /* RAM_DISK_MDMA */
+
+/* Private functions ---------------------------------------------------------*/
+
+#if RAM_DISK_MDMA
+// MDMA callbacks, called from the MDMA interrupt
+static void _mdma_complete(MDMA_HandleTypeDef *hmdma) {
+  mdma_error = 0;
+  osSemaphoreRelease(mdma_done);
+}
+
+static void _mdma_failed(MDMA_HandleTypeDef *hmdma) {
+  mdma_error = 1;
+  osSemaphoreRelease(mdma_done);
+}
+
+// The MDMA is used by this driver only
+void MDMA_IRQHandler(void) {
+  HAL_MDMA_IRQHandler(&hmdma_disk);
+}
+
+static int _mdma_init(void) {
+  // Memory to memory transfer of whole sectors, started by software
+  __HAL_RCC_MDMA_CLK_ENABLE();
+  hmdma_disk.Instance = MDMA_Channel0;
+  hmdma_disk.Init.Request = MDMA_REQUEST_SW;
+  hmdma_disk.Init.TransferTriggerMode = MDMA_FULL_TRANSFER;
+  hmdma_disk.Init.Priority = MDMA_PRIORITY_LOW;
+  hmdma_disk.Init.Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE;
+  hmdma_disk.Init.SourceInc = MDMA_SRC_INC_WORD;
+  hmdma_disk.Init.DestinationInc = MDMA_DEST_INC_WORD;
+  hmdma_disk.Init.SourceDataSize = MDMA_SRC_DATASIZE_WORD;
+  hmdma_disk.Init.DestDataSize = MDMA_DEST_DATASIZE_WORD;
+  hmdma_disk.Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+  hmdma_disk.Init.BufferTransferLength = 128;
+  hmdma_disk.Init.SourceBurst = MDMA_SOURCE_BURST_16BEATS;
+  hmdma_disk.Init.DestBurst = MDMA_DEST_BURST_16BEATS;
+  hmdma_disk.Init.SourceBlockAddressOffset = 0;
+  hmdma_disk.Init.DestBlockAddressOffset = 0;
+  if (HAL_MDMA_Init(&hmdma_disk) != HAL_OK) {
+    return -1;
+  }
+  HAL_MDMA_RegisterCallback(&hmdma_disk, HAL_MDMA_XFER_CPLT_CB_ID, _mdma_complete);
+  HAL_MDMA_RegisterCallback(&hmdma_disk, HAL_MDMA_XFER_ERROR_CB_ID, _mdma_failed);
+  // The interrupt releases a semaphore, so it must be below the FreeRTOS limit
+  HAL_NVIC_SetPriority(MDMA_IRQn, RAM_DISK_MDMA_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(MDMA_IRQn);
+  mdma_done = osSemaphoreNew(1, 0, NULL);
+  mdma_lock = osMutexNew(NULL);
+  return (mdma_done != NULL && mdma_lock != NULL) ? 0 : -1;
+}
+
+// Copy with the MDMA and wait for it to finish.
+// Returns 1 if the copy was done, 0 if the CPU has to do it and -1 on errors.
+static int _mdma_copy(BYTE *dst, const BYTE *src, UINT count) {
+  uint32_t len = count * _MAX_SS;
+  int dcache = (SCB->CCR & SCB_CCR_DC_Msk) != 0;
+  int res = 1;
+
+  // Only worth it for long copies, and waiting requires the scheduler
+  if (count < RAM_DISK_MDMA_MIN_SECTORS || mdma_lock == NULL ||
+      osKernelGetState() != osKernelRunning || __get_IPSR() != 0) {
+    return 0;
+  }
+  // Word transfers need aligned buffers. With the data cache enabled, the
+  // destination must consist of whole cache lines to be invalidated safely.
+  if ((((uintptr_t) dst | (uintptr_t) src) & 0x3) ||
+      (dcache && ((uintptr_t) dst & 0x1F))) {
+    return 0;
+  }
+  // The CPU copies in parallel if another task is using the MDMA
+  if (osMutexAcquire(mdma_lock, 0) != osOK) {
+    return 0;
+  }
+
+  // Write back the source. Dirty lines of the destination are written back and
+  // dropped as well, as their eviction during the transfer would overwrite it.
+  if (dcache) {
+    SCB_CleanDCache_by_Addr((uint32_t *) src, len);
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t *) dst, len);
+  }
+  if (HAL_MDMA_Start_IT(&hmdma_disk, (uint32_t) src, (uint32_t) dst, _MAX_SS, count) != HAL_OK) {
+    res = 0;
+  } else if (osSemaphoreAcquire(mdma_done, RAM_DISK_MDMA_TIMEOUT) != osOK) {
+    HAL_MDMA_Abort(&hmdma_disk);
+    // Drop a completion that raced with the abort
+    osSemaphoreAcquire(mdma_done, 0);
+    res = -1;
+  } else {
+    // Drop lines speculatively loaded during the transfer
+    if (dcache) {
+      SCB_InvalidateDCache_by_Addr((uint32_t *) dst, len);
+    }
+    res = mdma_error ? -1 : 1;
+  }
+  osMutexRelease(mdma_lock);
+  return res;
+}
+#endif /* RAM_DISK_MDMA */
+
+// Copy 'count' sectors between the disk and a buffer, splitting the copy at
+// region boundaries. Returns 0 on success, -1 on errors.
+static int _ram_disk_copy(BYTE *buff, DWORD sector, UINT count, int write) {
+  // Check if the sectors are in range
+  if (count == 0 || sector >= RAM_DISK_SECTORS || count > RAM_DISK_SECTORS - sector) {
+    return -1;
+  }
+  for (unsigned int i = 0; count > 0; i++) {
+    // Skip the regions before the first sector
+    if (sector >= regions[i].num_sectors) {
+      sector -= regions[i].num_sectors;
+      continue;
+    }
+    UINT n = regions[i].num_sectors - sector;
+    if (n > count) n = count;
+    BYTE *mem_ptr = regions[i].base + _MAX_SS * sector;
+    BYTE *dst = write ? mem_ptr : buff;
+    const BYTE *src = write ? buff : mem_ptr;
+#if RAM_DISK_MDMA
+    int res = _mdma_copy(dst, src, n);
+    if (res < 0) {
+      return -1;
+    } else if (res == 0) {
+      memcpy(dst, src, n * _MAX_SS);
+    }
+#else
+    memcpy(dst, src, n * _MAX_SS);
+#endif /* RAM_DISK_MDMA */
+    buff += n * _MAX_SS;
+    count -= n;
+    sector = 0;
+  }
+  return 0;
+}
 
 /* USER CODE END DECL */
 
@@ -94,6 +313,12 @@ DSTATUS USER_initialize (
   if (pdrv != 0) {
     return STA_NODISK;
   }
+#if RAM_DISK_MDMA
+  // Copy with the CPU only if the MDMA is not available
+  if (mdma_done == NULL) {
+    _mdma_init();
+  }
+#endif /* RAM_DISK_MDMA */
   return RES_OK;
   /* USER CODE END INIT */
 }
@@ -136,15 +361,8 @@ DRESULT USER_read (
   if (pdrv != 0) {
     return RES_PARERR;
   }
-  // Check if the sector is in range
-  if (sector + count > NS) {
-    return RES_ERROR;
-  }
-  // Compute the memory pointer
-  signed char *mem_ptr = mem + _MAX_SS * sector;
   // Copy data into read buffer
-  memcpy(buff, mem_ptr, count * _MAX_SS);
-  return RES_OK;
+  return (_ram_disk_copy(buff, sector, count, 0) == 0) ? RES_OK : RES_ERROR;
   /* USER CODE END READ */
 }
 
@@ -169,15 +387,8 @@ DRESULT USER_write (
   if (pdrv != 0) {
     return RES_PARERR;
   }
-  // Check if the sector is in range
-  if (sector + count > NS) {
-    return RES_ERROR;
-  }
-  // Compute the memory pointer
-  signed char *mem_ptr = mem + _MAX_SS * sector;
-  // Copy data into read buffer
-  memcpy(mem_ptr, buff, count * _MAX_SS);
-  return RES_OK;
+  // Copy data from the write buffer
+  return (_ram_disk_copy((BYTE *) buff, sector, count, 1) == 0) ? RES_OK : RES_ERROR;
   /* USER CODE END WRITE */
 }
 #endif /* _USE_WRITE == 1 */
@@ -208,7 +419,7 @@ DRESULT USER_ioctl (
       res = RES_OK;
       break;
     case GET_SECTOR_COUNT:
-      *((DWORD *) buff) = NS;
+      *((DWORD *) buff) = RAM_DISK_SECTORS;
       res = RES_OK;
       break;
     case GET_SECTOR_SIZE:
@@ -216,17 +427,33 @@ DRESULT USER_ioctl (
       res = RES_OK;
       break;
     case GET_BLOCK_SIZE:
-      *((DWORD *) buff) = 1;
+      *((DWORD *) buff) = RAM_DISK_BLOCK_SIZE;
       res = RES_OK;
       break;
     case CTRL_TRIM:
     {
       DWORD sec_start = *((DWORD *) buff);
       DWORD sec_end = *(((DWORD *) buff) + 1);
-      for (DWORD sec = sec_start; sec <= sec_end; sec++) {
-        memset(mem + NS * sec, 0x00, _MAX_SS);
-      }
       res = RES_OK;
+      if (sec_end >= RAM_DISK_SECTORS || sec_start > sec_end) {
+        res = RES_PARERR;
+        break;
+      }
+      // Clear the sectors region by region
+      for (unsigned int i = 0; sec_start <= sec_end; i++) {
+        if (sec_start >= regions[i].num_sectors) {
+          sec_start -= regions[i].num_sectors;
+          sec_end -= regions[i].num_sectors;
+          continue;
+        }
+        if (sec_end < regions[i].num_sectors) {
+          memset(regions[i].base + _MAX_SS * sec_start, 0x00, _MAX_SS * (sec_end - sec_start + 1));
+          break;
+        }
+        memset(regions[i].base + _MAX_SS * sec_start, 0x00, _MAX_SS * (regions[i].num_sectors - sec_start));
+        sec_start = 0;
+        sec_end -= regions[i].num_sectors;
+      }
       break;
     }
     default:
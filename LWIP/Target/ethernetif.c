@@ -33,15 +33,15 @@
 
 /* Within 'USER CODE' section, code will be kept by default at each generation */
 /* USER CODE BEGIN 0 */
-
+#include "lwip/stats.h"
 /* USER CODE END 0 */
 
 /* Private define ------------------------------------------------------------*/
 /* The time to block waiting for input. */
 #define TIME_WAITING_FOR_INPUT ( portMAX_DELAY )
 /* USER CODE BEGIN OS_THREAD_STACK_SIZE_WITH_RTOS */
-/* Stack size of the interface thread */
-#define INTERFACE_THREAD_STACK_SIZE ( 1024 )
+/* Stack size of the interface thread, which also runs the lwIP input path */
+#define INTERFACE_THREAD_STACK_SIZE ( 2048 )
 /* USER CODE END OS_THREAD_STACK_SIZE_WITH_RTOS */
 /* Network interface name */
 #define IFNAME0 's'
@@ -53,7 +53,9 @@
 /* ETH_RX_BUFFER_SIZE parameter is defined in lwipopts.h */
 
 /* USER CODE BEGIN 1 */
-
+/* Maximum number of frames handed to lwIP at once. The RX pool has to
+   refill the descriptors while the frames of a batch are held. */
+#define ETH_RX_BATCH_SIZE             ((ETH_RX_BUFFER_CNT) - (ETH_RX_DESC_CNT))
 /* USER CODE END 1 */
 
 /* Private variables ---------------------------------------------------------*/
@@ -93,12 +95,50 @@ typedef struct
 } RxBuff_t;
 
 /* Memory Pool Declaration */
+/* The pool holds ETH_RX_BUFFER_CNT buffers in .bss by default. When
+   ETH_RX_POOL_IN_D2 is set, the pool is placed in the .Rx_PoolSection of the
+   D2 SRAM instead (see the linker script), below the lwIP heap. On the H723,
+   the 15 KiB there only hold 9 buffers, so this option reduces the pool and
+   requires a lower ETH_RX_BUFFER_CNT. */
+#ifndef ETH_RX_BUFFER_CNT
 #define ETH_RX_BUFFER_CNT             12U
+#endif
+#ifndef ETH_RX_POOL_IN_D2
+#define ETH_RX_POOL_IN_D2             0
+#endif
+#if ETH_RX_POOL_IN_D2
+/* Start of the .Rx_PoolSection in the linker script */
+#define ETH_RX_POOL_D2_BASE           0x30000400U
+extern u8_t memp_memory_RX_POOL_base[] __attribute__((section(".Rx_PoolSection"), aligned(32)));
+#endif
 LWIP_MEMPOOL_DECLARE(RX_POOL, ETH_RX_BUFFER_CNT, sizeof(RxBuff_t), "Zero-copy RX PBUF pool");
+#if ETH_RX_POOL_IN_D2
+_Static_assert(sizeof(memp_memory_RX_POOL_base) <= LWIP_RAM_HEAP_POINTER - ETH_RX_POOL_D2_BASE,
+               "ETH_RX_BUFFER_CNT RX buffers do not fit into the D2 SRAM below the lwIP heap");
+#endif
 
 /* Variable Definitions */
 static uint8_t RxAllocStatus;
 
+/* Set by the TX completion interrupt, the interface thread reclaims the sent frames */
+static volatile uint8_t TxReleasePending;
+
+/* RX pool telemetry. The time the pool is exhausted is measured in kernel
+   ticks, as the DWT cycle counter wraps after a few seconds. The refill
+   latency is measured in DWT cycles. */
+static struct
+{
+  uint32_t in_use;
+  uint32_t peak_in_use;
+  uint32_t exhausted;
+  uint32_t exhausted_ticks;
+  uint32_t exhausted_since;
+  uint32_t freed_at;
+  uint8_t refill_pending;
+  uint32_t refill_last_cycles;
+  uint32_t refill_max_cycles;
+} RxPoolStats;
+
 #if defined ( __ICCARM__ ) /*!< IAR Compiler */
 
 #pragma location=0x30000000
@@ -149,6 +189,7 @@ lan8742_IOCtx_t  LAN8742_IOCtx = {ETH_PHY_IO_Init,
 
 /* Private functions ---------------------------------------------------------*/
 void pbuf_free_custom(struct pbuf *p);
+static void ethernetif_release_tx(void *arg);
 
 /**
   * @brief  Ethernet Rx Transfer completed callback
@@ -167,6 +208,11 @@ void HAL_ETH_RxCpltCallback(ETH_HandleTypeDef *handlerEth)
 void HAL_ETH_TxCpltCallback(ETH_HandleTypeDef *handlerEth)
 {
   osSemaphoreRelease(TxPktSemaphore);
+
+  /* Wake the interface thread to hand the sent frames back to lwIP. TCP does
+     not retransmit a segment that is still referenced by the TX ring. */
+  TxReleasePending = 1U;
+  osSemaphoreRelease(RxPktSemaphore);
 }
 /**
   * @brief  Ethernet DMA transfer error callback
@@ -264,7 +310,7 @@ static void low_level_init(struct netif *netif)
   RxPktSemaphore = osSemaphoreNew(1, 1, NULL);
 
   /* create a binary semaphore used for informing ethernetif of frame transmission */
-  TxPktSemaphore = osSemaphoreNew(1, 1, NULL);
+  TxPktSemaphore = osSemaphoreNew(1, 0, NULL);
 
   /* create the task that handles the ETH_MAC */
 /* USER CODE BEGIN OS_THREAD_NEW_CMSIS_RTOS_V2 */
@@ -343,7 +389,10 @@ static void low_level_init(struct netif *netif)
 #endif /* LWIP_ARP || LWIP_ETHERNET */
 
 /* USER CODE BEGIN LOW_LEVEL_INIT */
-
+  /* Enable the cycle counter used to time the RX pool telemetry */
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->LAR = 0xC5ACCE55U;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 /* USER CODE END LOW_LEVEL_INIT */
 }
 
@@ -368,14 +417,46 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p)
   uint32_t i = 0U;
   struct pbuf *q = NULL;
   err_t errval = ERR_OK;
+  uint8_t timeout = 0U;
   ETH_BufferTypeDef Txbuffer[ETH_TX_DESC_CNT] = {0};
 
   memset(Txbuffer, 0 , ETH_TX_DESC_CNT*sizeof(ETH_BufferTypeDef));
 
+  /* The frame is sent after this function returned. Referenced payloads, like
+     UDP data sent straight from the caller's buffer, may be overwritten by then
+     and are copied. Otherwise the frame is kept with a reference, which is
+     released by HAL_ETH_TxFreeCallback once the interface thread reclaims it
+     after the transmission completed. TCP does not touch referenced segments. */
+  for(q = p; q != NULL; q = q->next)
+  {
+    if(PBUF_NEEDS_COPY(q) || (q->type_internal == PBUF_ROM))
+    {
+      break;
+    }
+  }
+  if(q != NULL)
+  {
+    p = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+    if(p == NULL)
+    {
+      LINK_STATS_INC(link.memerr);
+      LINK_STATS_INC(link.drop);
+      return ERR_MEM;
+    }
+  }
+  else
+  {
+    pbuf_ref(p);
+  }
+
   for(q = p; q != NULL; q = q->next)
   {
     if(i >= ETH_TX_DESC_CNT)
+    {
+      pbuf_free(p);
+      LINK_STATS_INC(link.err);
       return ERR_IF;
+    }
 
     Txbuffer[i].buffer = q->payload;
     Txbuffer[i].len = q->len;
@@ -397,15 +478,26 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p)
   TxConfig.TxBuffer = Txbuffer;
   TxConfig.pData = p;
 
-  pbuf_ref(p);
-
-  HAL_ETH_Transmit_IT(&heth, &TxConfig);
-  while(osSemaphoreAcquire(TxPktSemaphore, TIME_WAITING_FOR_INPUT)!=osOK)
+  /* Reclaim the descriptors of frames sent in the meantime */
+  HAL_ETH_ReleaseTxPacket(&heth);
 
+  while(HAL_ETH_Transmit_IT(&heth, &TxConfig) != HAL_OK)
   {
-  }
+    /* Drop the frame if the interface is stopped or the DMA got stuck */
+    if(((HAL_ETH_GetError(&heth) & HAL_ETH_ERROR_BUSY) == 0U) || timeout)
+    {
+      heth.ErrorCode &= ~HAL_ETH_ERROR_BUSY;
+      pbuf_free(p);
+      LINK_STATS_INC(link.drop);
+      return ERR_IF;
+    }
+    heth.ErrorCode &= ~HAL_ETH_ERROR_BUSY;
 
-  HAL_ETH_ReleaseTxPacket(&heth);
+    /* All descriptors are in flight, wait for a transmission to complete */
+    timeout = (osSemaphoreAcquire(TxPktSemaphore, ETH_DMA_TRANSMIT_TIMEOUT) != osOK);
+    HAL_ETH_ReleaseTxPacket(&heth);
+  }
+  LINK_STATS_INC(link.xmit);
 
   return errval;
 }
@@ -442,27 +534,87 @@ static struct pbuf * low_level_input(struct netif *netif)
 void ethernetif_input(void* argument)
 {
   struct pbuf *p = NULL;
+  struct pbuf *batch[ETH_RX_BATCH_SIZE];
+  uint32_t i, n;
   struct netif *netif = (struct netif *) argument;
 
   for( ;; )
   {
     if (osSemaphoreAcquire(RxPktSemaphore, TIME_WAITING_FOR_INPUT) == osOK)
     {
+      /* Reclaim the frames whose transmission completed */
+      if (TxReleasePending)
+      {
+        TxReleasePending = 0U;
+#if LWIP_TCPIP_CORE_LOCKING
+        LOCK_TCPIP_CORE();
+        ethernetif_release_tx(NULL);
+        UNLOCK_TCPIP_CORE();
+#else
+        if (tcpip_try_callback(ethernetif_release_tx, NULL) != ERR_OK)
+        {
+          /* The next output reclaims them */
+          TxReleasePending = 1U;
+        }
+#endif /* LWIP_TCPIP_CORE_LOCKING */
+      }
+
       do
       {
-        p = low_level_input( netif );
-        if (p != NULL)
+        /* Collect the frames that are ready */
+        for(n = 0U; n < ETH_RX_BATCH_SIZE; n++)
         {
-          if (netif->input( p, netif) != ERR_OK )
+          p = low_level_input( netif );
+          if (p == NULL)
           {
-            pbuf_free(p);
+            break;
           }
+          batch[n] = p;
+          LINK_STATS_INC(link.recv);
         }
+        if (n == 0U)
+        {
+          continue;
+        }
+
+#if LWIP_TCPIP_CORE_LOCKING
+        /* Process the whole batch in this thread, taking the core lock once
+           instead of posting every frame to the tcpip thread mailbox */
+        LOCK_TCPIP_CORE();
+        for(i = 0U; i < n; i++)
+        {
+          if (ethernet_input( batch[i], netif) != ERR_OK )
+          {
+            pbuf_free(batch[i]);
+          }
+        }
+        UNLOCK_TCPIP_CORE();
+#else
+        for(i = 0U; i < n; i++)
+        {
+          if (netif->input( batch[i], netif) != ERR_OK )
+          {
+            pbuf_free(batch[i]);
+          }
+        }
+#endif /* LWIP_TCPIP_CORE_LOCKING */
       } while(p!=NULL);
     }
   }
 }
 
+/**
+ * @brief Hands the frames whose transmission completed back to lwIP. Must be
+ * called with the core locked, like low_level_output().
+ *
+ * @param arg unused
+ */
+static void ethernetif_release_tx(void *arg)
+{
+  LWIP_UNUSED_ARG(arg);
+  HAL_ETH_ReleaseTxPacket(&heth);
+}
+
 #if !LWIP_ARP
 /**
  * This function has to be completed by user in case of ARP OFF.
@@ -550,14 +702,28 @@ err_t ethernetif_init(struct netif *netif)
 void pbuf_free_custom(struct pbuf *p)
 {
   struct pbuf_custom* custom_pbuf = (struct pbuf_custom*)p;
+  uint8_t refill = 0U;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
   LWIP_MEMPOOL_FREE(RX_POOL, custom_pbuf);
 
   /* If the Rx Buffer Pool was exhausted, signal the ethernetif_input task to
    * call HAL_ETH_GetRxDataBuffer to rebuild the Rx descriptors. */
 
+  SYS_ARCH_PROTECT(old_level);
+  RxPoolStats.in_use--;
   if (RxAllocStatus == RX_ALLOC_ERROR)
   {
+    RxPoolStats.freed_at = DWT->CYCCNT;
+    RxPoolStats.exhausted_ticks += osKernelGetTickCount() - RxPoolStats.exhausted_since;
+    RxPoolStats.refill_pending = 1U;
     RxAllocStatus = RX_ALLOC_OK;
+    refill = 1U;
+  }
+  SYS_ARCH_UNPROTECT(old_level);
+
+  if (refill)
+  {
     osSemaphoreRelease(RxPktSemaphore);
   }
 }
@@ -575,6 +741,34 @@ u32_t sys_now(void)
   return HAL_GetTick();
 }
 
+/**
+  * @brief  Get the statistics of the zero-copy RX pool
+  * @param  stats: filled with the current statistics
+  * @retval None
+  */
+void ethernetif_get_rx_stats(ethernetif_rx_stats_t *stats)
+{
+  uint32_t cycles_per_us = SystemCoreClock / 1000000U;
+  uint32_t exhausted_ticks;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  SYS_ARCH_PROTECT(old_level);
+  stats->pool_size = ETH_RX_BUFFER_CNT;
+  stats->in_use = RxPoolStats.in_use;
+  stats->peak_in_use = RxPoolStats.peak_in_use;
+  stats->exhausted = RxPoolStats.exhausted;
+  exhausted_ticks = RxPoolStats.exhausted_ticks;
+  if (RxAllocStatus == RX_ALLOC_ERROR)
+  {
+    exhausted_ticks += osKernelGetTickCount() - RxPoolStats.exhausted_since;
+  }
+  stats->refill_last_us = RxPoolStats.refill_last_cycles / cycles_per_us;
+  stats->refill_max_us = RxPoolStats.refill_max_cycles / cycles_per_us;
+  SYS_ARCH_UNPROTECT(old_level);
+
+  stats->exhausted_ms = (uint32_t)(((uint64_t) exhausted_ticks * 1000U) / osKernelGetTickFreq());
+}
+
 /* USER CODE END 6 */
 
 /**
@@ -840,6 +1034,9 @@ void HAL_ETH_RxAllocateCallback(uint8_t **buff)
 /* USER CODE BEGIN HAL ETH RxAllocateCallback */
 
   struct pbuf_custom *p = LWIP_MEMPOOL_ALLOC(RX_POOL);
+  uint32_t now = DWT->CYCCNT;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
   if (p)
   {
     /* Get the buff from the struct pbuf address. */
@@ -849,10 +1046,35 @@ void HAL_ETH_RxAllocateCallback(uint8_t **buff)
     * This must be performed whenever a buffer's allocated because it may be
     * changed by lwIP or the app, e.g., pbuf_free decrements ref. */
     pbuf_alloced_custom(PBUF_RAW, 0, PBUF_REF, p, *buff, ETH_RX_BUFFER_SIZE);
+
+    SYS_ARCH_PROTECT(old_level);
+    if (++RxPoolStats.in_use > RxPoolStats.peak_in_use)
+    {
+      RxPoolStats.peak_in_use = RxPoolStats.in_use;
+    }
+    /* First refill of a descriptor after the pool ran empty */
+    if (RxPoolStats.refill_pending)
+    {
+      RxPoolStats.refill_pending = 0U;
+      RxPoolStats.refill_last_cycles = now - RxPoolStats.freed_at;
+      if (RxPoolStats.refill_last_cycles > RxPoolStats.refill_max_cycles)
+      {
+        RxPoolStats.refill_max_cycles = RxPoolStats.refill_last_cycles;
+      }
+    }
+    SYS_ARCH_UNPROTECT(old_level);
   }
   else
   {
+    SYS_ARCH_PROTECT(old_level);
+    if (RxAllocStatus == RX_ALLOC_OK)
+    {
+      RxPoolStats.exhausted++;
+      RxPoolStats.exhausted_since = osKernelGetTickCount();
+      LINK_STATS_INC(link.memerr);
+    }
     RxAllocStatus = RX_ALLOC_ERROR;
+    SYS_ARCH_UNPROTECT(old_level);
     *buff = NULL;
   }
 /* USER CODE END HAL ETH RxAllocateCallback */
@@ -41,6 +41,18 @@ u32_t sys_jiffies(void);
 u32_t sys_now(void);
 
 /* USER CODE BEGIN 1 */
-
+/* Statistics of the zero-copy RX buffer pool */
+typedef struct
+{
+  uint32_t pool_size;       /* Number of buffers in the pool */
+  uint32_t in_use;          /* Buffers held by the RX descriptors and by lwIP */
+  uint32_t peak_in_use;     /* Highest number of buffers in use */
+  uint32_t exhausted;       /* Number of times the pool ran empty */
+  uint32_t exhausted_ms;    /* Total time the pool was empty, RX frames are dropped meanwhile */
+  uint32_t refill_last_us;  /* Time from a buffer being freed after exhaustion to a descriptor being refilled */
+  uint32_t refill_max_us;   /* Longest of these refill times */
+} ethernetif_rx_stats_t;
+
+void ethernetif_get_rx_stats(ethernetif_rx_stats_t *stats);
 /* USER CODE END 1 */
 #endif
@@ -54,25 +54,27 @@
 /*----- Value in opt.h for MEM_ALIGNMENT: 1 -----*/
 #define MEM_ALIGNMENT 4
 /*----- Default Value for MEM_SIZE: 1600 ---*/
-#define MEM_SIZE 4096
+#define MEM_SIZE 15360
 /*----- Default Value for H7 devices: 0x30044000 -----*/
 #define LWIP_RAM_HEAP_POINTER 0x30004000
 /*----- Default Value for MEMP_NUM_NETCONN: 4 ---*/
-#define MEMP_NUM_NETCONN 8
+#define MEMP_NUM_NETCONN 16
 /*----- Value supported for H7 devices: 1 -----*/
 #define LWIP_SUPPORT_CUSTOM_PBUF 1
 /*----- Value in opt.h for LWIP_ETHERNET: LWIP_ARP || PPPOE_SUPPORT -*/
 #define LWIP_ETHERNET 1
 /*----- Value in opt.h for LWIP_DNS_SECURE: (LWIP_DNS_SECURE_RAND_XID | LWIP_DNS_SECURE_NO_MULTIPLE_OUTSTANDING | LWIP_DNS_SECURE_RAND_SRC_PORT) -*/
 #define LWIP_DNS_SECURE 7
+/*----- Default Value for TCP_MSS: 536 ---*/
+#define TCP_MSS 1024
 /*----- Value in opt.h for TCP_SND_QUEUELEN: (4*TCP_SND_BUF + (TCP_MSS - 1))/TCP_MSS -----*/
-#define TCP_SND_QUEUELEN 9
+#define TCP_SND_QUEUELEN 8
 /*----- Value in opt.h for TCP_SNDLOWAT: LWIP_MIN(LWIP_MAX(((TCP_SND_BUF)/2), (2 * TCP_MSS) + 1), (TCP_SND_BUF) - 1) -*/
-#define TCP_SNDLOWAT 1071
+#define TCP_SNDLOWAT 2047
 /*----- Value in opt.h for TCP_SNDQUEUELOWAT: LWIP_MAX(TCP_SND_QUEUELEN)/2, 5) -*/
 #define TCP_SNDQUEUELOWAT 5
 /*----- Value in opt.h for TCP_WND_UPDATE_THRESHOLD: LWIP_MIN(TCP_WND/4, TCP_MSS*4) -----*/
-#define TCP_WND_UPDATE_THRESHOLD 536
+#define TCP_WND_UPDATE_THRESHOLD 1024
 /*----- Default Value for LWIP_SINGLE_NETIF: 0 ---*/
 #define LWIP_SINGLE_NETIF 1
 /*----- Value in opt.h for LWIP_NETIF_LINK_CALLBACK: 0 -----*/
@@ -101,8 +103,6 @@
 #define RECV_BUFSIZE_DEFAULT 2000000000
 /*----- Default Value for SO_REUSE: 0 ---*/
 #define SO_REUSE 1
-/*----- Value in opt.h for LWIP_STATS: 1 -----*/
-#define LWIP_STATS 0
 /*----- Value in opt.h for CHECKSUM_GEN_IP: 1 -----*/
 #define CHECKSUM_GEN_IP 0
 /*----- Value in opt.h for CHECKSUM_GEN_UDP: 1 -----*/
@@ -135,7 +135,16 @@
 #define SYS_DEBUG LWIP_DBG_ON
 /*-----------------------------------------------------------------------------*/
 /* USER CODE BEGIN 1 */
-
+/*----- Loopback traffic is used by the FTP server to wake its PI and DTP threads -----*/
+#define LWIP_NETIF_LOOPBACK 1
+/*----- One UDP PCB for the retarget reader and two wake sockets per FTP session -----*/
+#define MEMP_NUM_UDP_PCB 10
+/*----- The tcpip thread registers itself to wait for its mailbox on a thread flag -----*/
+#define LWIP_MARK_TCPIP_THREAD() sys_mark_tcpip_thread()
+/*----- The heap and its two 8 Byte list markers must end within the D2 SRAM -----*/
+#if LWIP_RAM_HEAP_POINTER + MEM_SIZE + 16 > 0x30008000
+#error "MEM_SIZE does not fit into the D2 SRAM above LWIP_RAM_HEAP_POINTER"
+#endif
 /* USER CODE END 1 */
 
 #ifdef __cplusplus
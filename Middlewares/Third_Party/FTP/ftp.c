@@ -15,6 +15,7 @@ extern "C" {
 
 // Std includes
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // Header
@@ -26,14 +27,21 @@ extern "C" {
 // File system
 #include "ff.h"
 
+// Compression
+#if FTP_SERVER_MODE_Z
+#include "ftp_zlib.h"
+#endif /* FTP_SERVER_MODE_Z */
+
 /* Private defines -----------------------------------------------------------*/
 
 // Debug options
+#ifndef FTP_DEBUG_ON
 #define FTP_DEBUG_ON               1
 #define FTP_DEBUG_LEVEL            1
 #define FTP_SERVER_DEBUG_LEVEL     1
 #define FTP_SERVER_PI_DEBUG_LEVEL  2
 #define FTP_SERVER_DTP_DEBUG_LEVEL 3
+#endif /* FTP_DEBUG_ON */
 
 // check settings
 #if FTP_SERVER_RECV_BUF_LEN < 7
@@ -48,11 +56,69 @@ extern "C" {
 #warning "FTP File info will not fit onto buffer and filename will be truncated"
 #endif
 
+#if FTP_SERVER_DTP_BUFFER_LEN % _MAX_SS != 0
+#error "FTP DTP Buffer must be a multiple of the sector size to avoid partial sector writes"
+#endif
+
+#if FTP_SERVER_DTP_BUFFER_LEN % TCP_MSS != 0
+#warning "FTP DTP Buffer is not a multiple of the TCP MSS and will be sent in partial segments"
+#endif
+
+#if FTP_SERVER_DTP_NUM_BUFFERS < 1
+#error "FTP DTP requires at least one buffer"
+#endif
+
+#if _USE_FASTSEEK && FTP_SERVER_DTP_CLMT_LEN < 4
+#error "FTP DTP cluster link map table must hold at least one fragment"
+#endif
+
+// Stream RETR data from the FatFS sector buffer directly into the socket. The
+// multiplexer serves every session from one thread, which must not hold the
+// volume locked while a single client takes its data.
+#if FTP_SERVER_MULTIPLEX
+#undef FTP_SERVER_DTP_USE_FORWARD
+#define FTP_SERVER_DTP_USE_FORWARD 0
+#elif !defined(FTP_SERVER_DTP_USE_FORWARD)
+#define FTP_SERVER_DTP_USE_FORWARD _USE_FORWARD
+#endif
+
+#if FTP_SERVER_MODE_Z && FTP_SERVER_MODE_Z_OUTPUT_LEN < FTP_DEFLATE_MIN_OUTPUT
+#error "FTP MODE Z output buffer is too small"
+#endif
+
+#if FTP_SERVER_DTP_USE_FORWARD && !_USE_FORWARD
+#error "FTP_SERVER_DTP_USE_FORWARD requires _USE_FORWARD to be enabled in ffconf.h"
+#endif
+
+#if !LWIP_NETIF_LOOPBACK
+#warning "FTP PI and DTP cannot wake each other without LWIP_NETIF_LOOPBACK and will poll instead"
+#endif
+
+// Sessions are indexed by PI index, which is either a worker or a multiplexed session
+#if FTP_SERVER_MULTIPLEX
+#define FTP_SERVER_NUM_SESSIONS FTP_SERVER_MUX_MAX_SESSIONS
+#else
+#define FTP_SERVER_NUM_SESSIONS FTP_SERVER_MAX_PI_NUM
+#endif /* FTP_SERVER_MULTIPLEX */
+
 // Other defines
 #define LOCAL_IP (netif_default->ip_addr.addr)
 #define FTP_MAX_THREAD_NAME_LENGTH configMAX_TASK_NAME_LEN
 #define MAX_NUM_PI_ARGS 3
 
+// Perfect hash of the command names, see cmd_hash_table
+#define CMD_HASH_BITS 6
+#define CMD_HASH_MULT 0xefbf0709U
+#define CMD_HASH( key ) ((uint32_t) ((key) * CMD_HASH_MULT) >> (32 - CMD_HASH_BITS))
+
+// Events returned by _wait_for_event
+#define FTP_EVENT_READ  0x01
+#define FTP_EVENT_WRITE 0x02
+#define FTP_EVENT_WAKE  0x04
+
+// Thread flag with which the MRRB wakes a DTP streaming a live file
+#define FTP_LIVE_FILE_FLAG_NEW_DATA 0x0001
+
 /* Exported macros -----------------------------------------------------------*/
 
 #define FTP_PRINTF(...)      \
@@ -108,6 +174,22 @@ extern "C" {
 #define FTP_SERVER_DTP_DEBUG(...)
 #endif
 
+#if FTP_SERVER_STATS
+#define FTP_STATS_TIMESTAMP( var ) uint32_t var = osKernelGetSysTimerCount()
+#define FTP_STATS_ADD( dtp, field, value ) ((dtp)->stats->current.field += (value))
+#define FTP_STATS_ADD_ELAPSED( dtp, field, var ) FTP_STATS_ADD(dtp, field, _stats_elapsed_us(var))
+#else
+#define FTP_STATS_TIMESTAMP( var )
+#define FTP_STATS_ADD( dtp, field, value )
+#define FTP_STATS_ADD_ELAPSED( dtp, field, var )
+#endif /* FTP_SERVER_STATS */
+
+#if FTP_SERVER_MODE_Z
+#define FTP_DTP_COMPRESSED( dtp ) ((dtp)->zlib != NULL)
+#else
+#define FTP_DTP_COMPRESSED( dtp ) 0
+#endif /* FTP_SERVER_MODE_Z */
+
 #define APPEND_RESPONSE_DATA( server, data_str )                                   \
   do {                                                                             \
     int max_len = FTP_SERVER_SEND_BUF_LEN - (server)->pi.send_buff_put_offset - 2; \
@@ -121,17 +203,25 @@ extern "C" {
 #define APPEND_RESPONSE_MSG( server, msg ) (void) (msg)
 #endif
 
-#define SET_RESPONSE( server, code_str, msg_str)   \
-  do {                                             \
-    memcpy((server)->pi.send_buffer, code_str, 3); \
-    (server)->pi.send_buffer[3] = ' ';             \
-    (server)->pi.send_buff_put_offset = 4;         \
-    APPEND_RESPONSE_MSG(server, msg_str);          \
+// Responses are built behind the replies still queued for the socket
+#define SET_RESPONSE( server, code_str, msg_str)                                   \
+  do {                                                                             \
+    memcpy((server)->pi.send_buffer + (server)->pi.send_buff_queued, code_str, 3); \
+    (server)->pi.send_buffer[(server)->pi.send_buff_queued + 3] = ' ';             \
+    (server)->pi.send_buff_put_offset = (server)->pi.send_buff_queued + 4;         \
+    APPEND_RESPONSE_MSG(server, msg_str);                                          \
   } while (0)
 
+// Marks the response as multi-line, must directly follow SET_RESPONSE
+#define SET_RESPONSE_MULTILINE( server ) ((server)->pi.send_buffer[(server)->pi.send_buff_queued + 3] = '-')
+
 #define APPEND_TERM( server ) APPEND_RESPONSE_DATA(server, "\r\n")
 
-#define CLEAR_RESPONSE( server ) ((server)->pi.send_buff_put_offset = 0)
+#define CLEAR_RESPONSE( server ) ((server)->pi.send_buff_put_offset = (server)->pi.send_buff_queued)
+
+#define RESPONSE_SET( server ) ((server)->pi.send_buff_put_offset != (server)->pi.send_buff_queued)
+
+#define PI_RECV_BUFF_FULL( server ) ((server)->pi.recv_buff_length >= FTP_SERVER_RECV_BUF_LEN - 1)
 
 /* Private typedef -----------------------------------------------------------*/
 
@@ -173,6 +263,7 @@ typedef enum {
   TRANSFER_MODE_STREAM = 0,
   TRANSFER_MODE_BLOCK,
   TRANSFER_MODE_COMPRESSED,
+  TRANSFER_MODE_DEFLATE,
 } transfer_mode_t;
 
 typedef enum {
@@ -185,7 +276,7 @@ typedef enum {
   CMD_PORT, CMD_PASV, CMD_TYPE, CMD_STRU, CMD_MODE, CMD_RETR, CMD_STOR, CMD_STOU,
   CMD_APPE, CMD_ALLO, CMD_REST, CMD_RNFR, CMD_RNTO, CMD_ABOR, CMD_DELE, CMD_RMD,
   CMD_MKD,  CMD_PWD,  CMD_LIST, CMD_NLST, CMD_SITE, CMD_SYST, CMD_STAT, CMD_HELP,
-  CMD_NOOP, NUM_CMD
+  CMD_NOOP, CMD_FEAT, CMD_MLSD, CMD_MLST, NUM_CMD
 } cmd_t;
 
 typedef enum {
@@ -193,10 +284,10 @@ typedef enum {
   FTP_SERVER_DTP_COMMAND_RETR,
   FTP_SERVER_DTP_COMMAND_STOR,
   FTP_SERVER_DTP_COMMAND_APPE,
-  FTP_SERVER_DTP_COMMAND_REST,
   FTP_SERVER_DTP_COMMAND_ABOR,
   FTP_SERVER_DTP_COMMAND_LIST,
   FTP_SERVER_DTP_COMMAND_NLST,
+  FTP_SERVER_DTP_COMMAND_MLSD,
   FTP_SERVER_DTP_COMMAND_CLOSE,
   FTP_SERVER_DTP_COMMAND_NUM
 } ftp_server_dtp_command_t;
@@ -210,6 +301,52 @@ typedef enum {
   FTP_SERVER_DTP_COMMAND_RESP_NUM
 } ftp_server_dtp_command_response_t;
 
+/* Statistics */
+
+#if FTP_SERVER_STATS
+typedef struct {
+  uint32_t start_tick;     /*!< Kernel tick at which the transfer was accepted */
+  uint32_t duration_ms;    /*!< Only valid once the transfer ended */
+  uint32_t bytes;
+  uint64_t wait_us;        /*!< Time blocked until the data socket was ready */
+  uint64_t socket_us;      /*!< Time spent in send and recv */
+  uint64_t fs_us;          /*!< Time spent in f_read, f_forward and f_write */
+  uint32_t would_block;    /*!< Number of socket calls that returned EWOULDBLOCK */
+} ftp_server_transfer_stats_t;
+
+typedef struct {
+  uint32_t count;
+  uint64_t total_us;       /*!< 32 bits of microseconds wrap after 71 minutes */
+  uint32_t max_us;
+} ftp_server_cmd_stats_t;
+
+typedef struct {
+  ftp_server_transfer_stats_t current;  /*!< Written by the DTP, read by the PI */
+  ftp_server_transfer_stats_t sent;     /*!< Sum of all RETR and listing transfers */
+  ftp_server_transfer_stats_t received; /*!< Sum of all STOR and APPE transfers */
+  ftp_server_dtp_command_t current_cmd;
+  volatile int transfer_active;
+  uint32_t num_transfers;
+  uint32_t last_log_tick;
+  ftp_server_cmd_stats_t cmds[NUM_CMD];
+} ftp_server_stats_t;
+#endif /* FTP_SERVER_STATS */
+
+/* Compression */
+
+#if FTP_SERVER_MODE_Z
+typedef struct {
+  volatile unsigned int owner; /*!< PI index of the DTP using the stream plus one, 0 if free */
+  union {
+    ftp_deflate_t deflate;     /*!< Downloads */
+    ftp_inflate_t inflate;     /*!< Uploads */
+  } codec;
+  unsigned int out_length;
+  unsigned int out_offset;
+  unsigned char out[FTP_SERVER_MODE_Z_OUTPUT_LEN];
+} ftp_server_zlib_stream_t;
+#endif /* FTP_SERVER_MODE_Z */
+
 /* States */
 
 typedef struct {
@@ -229,13 +366,24 @@ typedef struct {
   unsigned char *recv_buffer;
   unsigned char *send_buffer;
   unsigned char *path_buffer;
+  unsigned int recv_buff_length;
+  int recv_buff_discard;
+  int transfer_pending;
   unsigned int send_buff_put_offset;
+  unsigned int send_buff_queued;  /*!< Bytes of sent replies the socket did not take yet */
   int path_buffer_used;
   osThreadId_t dtp_thread;
   osMessageQueueId_t pi_to_dtp_msg_queue;
   osMessageQueueId_t dtp_to_pi_msg_queue;
+  int wake_sd;
+  struct sockaddr_in wake_address;
+  struct sockaddr_in dtp_wake_address;
   pi_fs_state_t fs;
   cmd_t prev_cmd;
+  FSIZE_t restart_offset;
+#if FTP_SERVER_STATS
+  ftp_server_stats_t *stats;
+#endif /* FTP_SERVER_STATS */
 } ftp_server_pi_t;
 
 typedef struct {
@@ -250,20 +398,59 @@ typedef struct {
   struct sockaddr_in client_address;
 } ftp_server_dtp_settings_t;
 
+typedef struct {
+  char path[FTP_SERVER_LIST_CACHE_PATH_LEN];
+  ftp_server_dtp_command_t format;
+  unsigned int generation; /*!< Cache generation the listing was started in */
+  unsigned int refs;       /*!< Number of DTPs filling or sending this entry */
+  int valid;               /*!< Listing is complete and up to date */
+  unsigned int length;
+  char data[FTP_SERVER_LIST_CACHE_LEN];
+} ftp_server_list_cache_entry_t;
+
+typedef struct {
+  char *data;
+  unsigned int length;   /*!< Number of valid Bytes in data */
+  unsigned int offset;   /*!< Number of Bytes already sent or written */
+  unsigned int capacity; /*!< Number of Bytes the buffer may be filled with */
+} ftp_server_dtp_buffer_t;
+
 typedef struct {
   osMessageQueueId_t pi_to_dtp_msg_queue;
   osMessageQueueId_t dtp_to_pi_msg_queue;
+  int wake_sd;
+  struct sockaddr_in pi_wake_address;
+  osThreadId_t thread;
+  unsigned int pi_index;
   ftp_server_dtp_settings_t settings;
   ftp_server_dtp_command_t active_cmd;
   int conn;
+  int forwarding;    /*!< f_forward is running on this channel */
+  int forward_error;
   FIL current_file;
+#if _USE_FASTSEEK
+  DWORD *clmt;
+#endif /* _USE_FASTSEEK */
   DIR current_dir;
   FILINFO current_info;
   int list_file_only;
-  char buff[FTP_SERVER_DTP_BUFFER_LEN];
-  int buff_len_used;
-  int buff_offset;
+  ftp_server_list_cache_entry_t *list_cache_entry;
+  int list_cache_hit;
+  unsigned int list_cache_offset;
+#if FTP_SERVER_LIVE_FILES
+  ftp_live_file_t *live_file;
+  unsigned int live_offset;
+#endif /* FTP_SERVER_LIVE_FILES */
+  ftp_server_dtp_buffer_t buffers[FTP_SERVER_DTP_NUM_BUFFERS];
+  unsigned int drain_index;
+  unsigned int num_ready;
   int finish_pending;
+#if FTP_SERVER_STATS
+  ftp_server_stats_t *stats;
+#endif /* FTP_SERVER_STATS */
+#if FTP_SERVER_MODE_Z
+  ftp_server_zlib_stream_t *zlib;
+#endif /* FTP_SERVER_MODE_Z */
 } ftp_server_dtp_channel_t;
 
 typedef struct {
@@ -282,9 +469,12 @@ typedef struct {
 } server_pi_args_t;
 
 typedef struct {
+  unsigned int pi_index;
   osMessageQueueId_t pi_to_dtp_msg_queue;
   osMessageQueueId_t dtp_to_pi_msg_queue;
   ftp_server_dtp_settings_t *settings;
+  struct sockaddr_in pi_wake_address;
+  struct sockaddr_in *dtp_wake_address;
 } server_dtp_args_t;
 
 /* Message Queue Types */
@@ -292,23 +482,123 @@ typedef struct {
 typedef struct {
   ftp_server_dtp_command_t command;
   char *filename_buff;
+  FSIZE_t offset;
+  transfer_mode_t transfer_mode; /*!< MODE may change after the DTP was started */
 } ftp_server_pi_to_dtp_msg_t;
 
 typedef struct {
   ftp_server_dtp_command_response_t cmd_resp;
 } ftp_server_dtp_to_pi_msg_t;
 
+/* Worker Pool */
+
+#if !FTP_SERVER_MULTIPLEX
+typedef struct {
+  osThreadId_t thread;
+  osMessageQueueId_t start_queue;
+  volatile int busy;
+#if FTP_SERVER_STATS
+  ftp_server_stats_t stats;
+#endif /* FTP_SERVER_STATS */
+  StaticTask_t thread_cb;
+  uint64_t stack[FTP_SERVER_PI_THREAD_STACKSIZE / sizeof(uint64_t)];
+  StaticQueue_t start_queue_cb;
+  server_pi_args_t start_queue_mem[1];
+} ftp_server_pi_worker_t;
+
+typedef struct {
+  osThreadId_t thread;
+  osMessageQueueId_t start_queue;
+  osMessageQueueId_t pi_to_dtp_msg_queue;
+  osMessageQueueId_t dtp_to_pi_msg_queue;
+  volatile int stop;      /*!< The PI asks the DTP to exit before it is connected */
+  volatile int conn;      /*!< Data connection, shut down by the PI if the DTP does not exit */
+  volatile int abandoned; /*!< The PI stopped waiting for the DTP to exit */
+  StaticTask_t thread_cb;
+  uint64_t stack[FTP_SERVER_DTP_THREAD_STACKSIZE / sizeof(uint64_t)];
+  StaticQueue_t start_queue_cb;
+  StaticQueue_t pi_to_dtp_queue_cb;
+  StaticQueue_t dtp_to_pi_queue_cb;
+  server_dtp_args_t start_queue_mem[1];
+  ftp_server_pi_to_dtp_msg_t pi_to_dtp_queue_mem[1];
+  ftp_server_dtp_to_pi_msg_t dtp_to_pi_queue_mem[1];
+  char buffers[FTP_SERVER_DTP_NUM_BUFFERS][FTP_SERVER_DTP_BUFFER_LEN] __attribute__((aligned(4)));
+#if _USE_FASTSEEK
+  DWORD clmt[FTP_SERVER_DTP_CLMT_LEN];
+#endif /* _USE_FASTSEEK */
+} ftp_server_dtp_worker_t;
+#endif /* !FTP_SERVER_MULTIPLEX */
+
+/* Multiplexed Sessions */
+
+#if FTP_SERVER_MULTIPLEX
+typedef struct {
+  int used;
+  ftp_server_t server;
+  ftp_server_dtp_channel_t dtp;
+  int connect_sd;   /*!< Active mode data connection in progress, -1 if none */
+  int cmd_pending;  /*!< A command arrived before the data connection was established */
+  ftp_server_pi_to_dtp_msg_t cmd;
+#if FTP_SERVER_STATS
+  ftp_server_stats_t stats;
+#endif /* FTP_SERVER_STATS */
+  unsigned char recv_buffer[FTP_SERVER_RECV_BUF_LEN];
+  unsigned char send_buffer[FTP_SERVER_SEND_BUF_LEN];
+  unsigned char path_buffer[FTP_SERVER_PATH_BUF_LEN];
+  char buffers[FTP_SERVER_DTP_NUM_BUFFERS][FTP_SERVER_DTP_BUFFER_LEN] __attribute__((aligned(4)));
+#if _USE_FASTSEEK
+  DWORD clmt[FTP_SERVER_DTP_CLMT_LEN];
+#endif /* _USE_FASTSEEK */
+} ftp_server_mux_session_t;
+#endif /* FTP_SERVER_MULTIPLEX */
+
 /* Private function prototypes -----------------------------------------------*/
 
+// Server functions
+int _server_socket_open(int backlog);
+
+#if FTP_SERVER_MULTIPLEX
+// Multiplexing functions
+void _ftp_server_mux_thread(void *);
+int _mux_session_open(int conn, const struct sockaddr_in *client);
+void _mux_session_close(ftp_server_mux_session_t *session);
+void _mux_dtp_connected(ftp_server_mux_session_t *session);
+void _mux_dtp_exit(ftp_server_mux_session_t *session, int sts);
+void _fd_set_add(int sd, fd_set *set, int *max_sd);
+#else
 // Thread functions
 void _ftp_server_thread(void *);
-void _ftp_server_pi_thread(void *);
-void _ftp_server_dtp_thread(void *);
+void _ftp_server_pi_worker(void *);
+void _ftp_server_dtp_worker(void *);
+void _ftp_server_pi_session(server_pi_args_t *pi_args);
+void _ftp_server_dtp_session(server_dtp_args_t *dtp_args);
+int _dtp_wait_for_connection(ftp_server_dtp_channel_t *dtp, int read_sd, int write_sd);
+int _wait_for_dtp_exit(ftp_server_t *server, uint32_t timeout);
+
+// Worker pool functions
+int _worker_pool_init(osPriority_t pi_priority);
+int _pi_worker_start(unsigned int index, osPriority_t priority);
+int _dtp_worker_start(unsigned int index);
+#endif /* FTP_SERVER_MULTIPLEX */
 
 // PI functions
+void _pi_init(ftp_server_t *server,
+              const server_pi_args_t *pi_args,
+              unsigned char *recv_buffer,
+              unsigned char *send_buffer,
+              unsigned char *path_buffer);
+void _pi_close(ftp_server_t *server);
 int _send_status_msg(ftp_server_t *server);
+#if FTP_SERVER_MULTIPLEX
+int _flush_status_msgs(ftp_server_t *server);
+#endif /* FTP_SERVER_MULTIPLEX */
 int _receive_and_process_ctrl_msg(ftp_server_t *server, int blocking);
+int _process_ctrl_msgs(ftp_server_t *server);
+cmd_t _lookup_cmd(const char *name, unsigned int len);
+#if !FTP_SERVER_MULTIPLEX
 int _check_dtp_response(ftp_server_t *server);
+#endif /* !FTP_SERVER_MULTIPLEX */
+int _handle_dtp_response(ftp_server_t *server, ftp_server_dtp_command_response_t cmd_resp);
 int _process_ctrl_msg(ftp_server_t *server, char *buff, int len);
 int _check_global_permission(ftp_server_t *server, cmd_t cmd);
 void _check_login_credentials(ftp_server_t *server, login_info_type type, const char *str, unsigned int str_len);
@@ -317,20 +607,104 @@ void _set_structure(ftp_server_t *server, int num_args, char *args[], unsigned i
 void _set_transfer_mode(ftp_server_t *server, int num_args, char *args[], unsigned int arglens[]);
 void _set_passive(ftp_server_t *server);
 void _set_data_port(ftp_server_t *server, char *arg, unsigned int arglen);
+void _set_restart_offset(ftp_server_t *server, char *arg, unsigned int arglen);
 void _get_stat(ftp_server_t *server, char *path, unsigned int arglen);
+void _get_features(ftp_server_t *server);
+void _get_mlst(ftp_server_t *server, char *path);
+void _site_command(ftp_server_t *server, char *arg, unsigned int arglen);
 void _execute_fs_command(ftp_server_t *server, ftp_server_dtp_command_t fs_cmd, char *path, unsigned int arglen);
 
 int _open_dtp_channel(ftp_server_t *server);
 int _close_dtp_channel(ftp_server_t *server);
+int _send_dtp_command(ftp_server_t *server, const ftp_server_pi_to_dtp_msg_t *msg);
 
 // DTP functions
+void _dtp_init(ftp_server_dtp_channel_t *dtp,
+               unsigned int pi_index,
+               const ftp_server_dtp_settings_t *settings,
+               char (*buffers)[FTP_SERVER_DTP_BUFFER_LEN]);
+int _dtp_connected(ftp_server_dtp_channel_t *dtp);
+int _dtp_set_transfer_mode(ftp_server_dtp_channel_t *dtp, transfer_mode_t mode);
+void _dtp_cleanup(ftp_server_dtp_channel_t *dtp);
+void _dtp_get_wait(ftp_server_dtp_channel_t *dtp, int *read_sd, int *write_sd, uint32_t *timeout);
 int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
                          ftp_server_dtp_command_t dtp_cmd,
                          char *args,
+                         FSIZE_t offset,
+                         transfer_mode_t transfer_mode,
                          ftp_server_dtp_to_pi_msg_t *resp);
+int _dtp_seek_file(ftp_server_dtp_channel_t *dtp, FSIZE_t offset, int keep_map);
 int _dtp_send_receive(ftp_server_dtp_channel_t *dtp);
+int _dtp_send(ftp_server_dtp_channel_t *dtp, const char *data, unsigned int length);
+int _dtp_fill_from_source(ftp_server_dtp_channel_t *dtp);
+int _dtp_drain_to_socket(ftp_server_dtp_channel_t *dtp);
+int _dtp_fill_from_socket(ftp_server_dtp_channel_t *dtp);
+int _dtp_drain_to_file(ftp_server_dtp_channel_t *dtp);
+void _dtp_reset_buffers(ftp_server_dtp_channel_t *dtp);
+ftp_server_dtp_buffer_t *_dtp_fill_buffer(ftp_server_dtp_channel_t *dtp);
+void _dtp_seal_buffer(ftp_server_dtp_channel_t *dtp);
+void _dtp_release_buffer(ftp_server_dtp_channel_t *dtp);
+int _dtp_buffers_empty(ftp_server_dtp_channel_t *dtp);
+#if FTP_SERVER_DTP_USE_FORWARD
+int _dtp_forward_file(ftp_server_dtp_channel_t *dtp);
+UINT _dtp_forward_stream(const BYTE *data, UINT length);
+#endif /* FTP_SERVER_DTP_USE_FORWARD */
 int _dtp_listitem_fat(char *buff, FILINFO* info, unsigned int buff_length);
 int _dtp_listitem_unix(char *buff, FILINFO* info, unsigned int buff_length);
+int _dtp_listitem_mlsx(char *buff, FILINFO* info, unsigned int buff_length);
+int _mlsx_facts(char *buff, FILINFO* info, unsigned int buff_length);
+
+// Listing cache functions
+int _list_cache_init(void);
+void _list_cache_invalidate(void);
+int _dtp_list_cache_open(ftp_server_dtp_channel_t *dtp, const char *path, ftp_server_dtp_command_t format);
+void _dtp_list_cache_append(ftp_server_dtp_channel_t *dtp, const char *data, unsigned int length);
+int _dtp_list_cache_send(ftp_server_dtp_channel_t *dtp);
+void _dtp_list_cache_close(ftp_server_dtp_channel_t *dtp, int commit);
+
+#if FTP_SERVER_STATS
+// Statistics functions
+uint32_t _stats_elapsed_us(uint32_t start);
+void _stats_command(ftp_server_t *server, cmd_t cmd, uint32_t start);
+int _stats_format_transfer(char *buff, unsigned int buff_length, const char *label, const ftp_server_transfer_stats_t *stats);
+void _stats_log(ftp_server_t *server, const char *label);
+void _stats_log_running(ftp_server_t *server);
+void _get_stats(ftp_server_t *server);
+void _dtp_stats_begin(ftp_server_dtp_channel_t *dtp);
+void _dtp_stats_end(ftp_server_dtp_channel_t *dtp);
+#endif /* FTP_SERVER_STATS */
+
+#if FTP_SERVER_MODE_Z
+// MODE Z functions
+ftp_server_zlib_stream_t *_zlib_stream_claim(unsigned int pi_index);
+void _zlib_stream_release(unsigned int pi_index);
+void _dtp_zlib_begin(ftp_server_dtp_channel_t *dtp);
+int _dtp_zlib_flush(ftp_server_dtp_channel_t *dtp);
+int _dtp_zlib_send(ftp_server_dtp_channel_t *dtp, const unsigned char *data, unsigned int length);
+int _dtp_zlib_finish(ftp_server_dtp_channel_t *dtp);
+int _dtp_zlib_drain_to_file(ftp_server_dtp_channel_t *dtp);
+#endif /* FTP_SERVER_MODE_Z */
+
+#if FTP_SERVER_LIVE_FILES
+// Live file functions
+ftp_live_file_t *_live_file_find(const char *path);
+int _dtp_live_file_attach(ftp_server_dtp_channel_t *dtp, const char *path);
+void _dtp_live_file_detach(ftp_server_dtp_channel_t *dtp);
+int _dtp_live_file_send(ftp_server_dtp_channel_t *dtp);
+void _live_file_wake(ftp_live_file_t *file);
+void _live_file_data_notify(multi_reader_ring_buffer_t *mrrb,
+                            void *handle,
+                            const unsigned char *data,
+                            const unsigned int data_length);
+void _live_file_data_abort(multi_reader_ring_buffer_t *mrrb,
+                           void *handle);
+#endif /* FTP_SERVER_LIVE_FILES */
+
+// Event functions
+int _wake_socket_open(struct sockaddr_in *address);
+void _wake_socket_signal(int sd, const struct sockaddr_in *address);
+void _wake_socket_drain(int sd);
+int _wait_for_event(int read_sd, int write_sd, int wake_sd, uint32_t timeout);
 
 // Other functions
 void _dump_binary(const unsigned char *buff, const unsigned int len);
@@ -372,7 +746,20 @@ const char *const cmd_str[NUM_CMD] = {
   "PORT", "PASV", "TYPE", "STRU", "MODE", "RETR", "STOR", "STOU",
   "APPE", "ALLO", "REST", "RNFR", "RNTO", "ABOR", "DELE", "RMD",
   "MKD", "PWD", "LIST", "NLST", "SITE", "SYST", "STAT", "HELP",
-  "NOOP"
+  "NOOP", "FEAT", "MLSD", "MLST"
+};
+
+// Maps CMD_HASH of the command names, packed little endian into 32 bits, to
+// the command. Generated offline by searching for a collision-free multiplier.
+const unsigned char cmd_hash_table[1 << CMD_HASH_BITS] = {
+  NUM_CMD,  CMD_REIN, NUM_CMD,  CMD_MLST, CMD_PORT, CMD_RNTO, NUM_CMD,  CMD_RMD,
+  NUM_CMD,  CMD_STAT, NUM_CMD,  CMD_ABOR, CMD_APPE, NUM_CMD,  NUM_CMD,  CMD_QUIT,
+  NUM_CMD,  NUM_CMD,  CMD_SMNT, NUM_CMD,  CMD_USER, NUM_CMD,  CMD_MODE, NUM_CMD,
+  CMD_SYST, NUM_CMD,  NUM_CMD,  NUM_CMD,  CMD_ALLO, CMD_STOR, CMD_RETR, CMD_MLSD,
+  NUM_CMD,  CMD_REST, CMD_CWD,  NUM_CMD,  CMD_STOU, NUM_CMD,  NUM_CMD,  CMD_PASS,
+  CMD_CDUP, CMD_STRU, CMD_ACCT, CMD_DELE, CMD_TYPE, CMD_PWD,  CMD_PASV, NUM_CMD,
+  NUM_CMD,  NUM_CMD,  CMD_FEAT, CMD_RNFR, CMD_HELP, NUM_CMD,  NUM_CMD,  NUM_CMD,
+  CMD_LIST, NUM_CMD,  NUM_CMD,  CMD_SITE, CMD_MKD,  NUM_CMD,  CMD_NOOP, CMD_NLST,
 };
 
 const unsigned char cmd_min_num_args[NUM_CMD] = {
@@ -380,7 +767,7 @@ const unsigned char cmd_min_num_args[NUM_CMD] = {
   1, 0, 1, 1, 1, 1, 1, 0,
   1, 1, 1, 1, 1, 0, 1, 1,
   1, 0, 0, 0, 1, 0, 0, 0,
-  0,
+  0, 0, 0, 0,
 };
 
 const unsigned char cmd_num_opt_args[NUM_CMD] = {
@@ -388,7 +775,7 @@ const unsigned char cmd_num_opt_args[NUM_CMD] = {
   0, 0, 1, 0, 0, 0, 0, 0,
   0, 2, 0, 0, 0, 0, 0, 0,
   0, 0, 1, 1, 0, 0, 1, 1,
-  0,
+  0, 0, 1, 1,
 };
 
 const ftp_permission_t cmd_perm_req[NUM_CMD] = {
@@ -400,7 +787,7 @@ const ftp_permission_t cmd_perm_req[NUM_CMD] = {
   FTP_PERM_ADMIN, FTP_PERM_VIEW,  FTP_PERM_ADMIN, FTP_PERM_ADMIN,
   FTP_PERM_WRITE, FTP_PERM_VIEW,  FTP_PERM_VIEW,  FTP_PERM_VIEW,
   FTP_PERM_VIEW,  FTP_PERM_VIEW,  FTP_PERM_VIEW,  FTP_PERM_NONE,
-  FTP_PERM_NONE,
+  FTP_PERM_NONE,  FTP_PERM_NONE,  FTP_PERM_VIEW,  FTP_PERM_VIEW,
 };
 
 const ftp_server_dtp_settings_t _ftp_dtp_default_settings = {
@@ -416,7 +803,7 @@ const ftp_server_dtp_settings_t _ftp_dtp_default_settings = {
 };
 
 const char *const dtp_cmd_str[FTP_SERVER_DTP_COMMAND_NUM] = {
-  "NONE", "RETR", "STOR", "APPE", "REST", "ABOR", "LIST", "NLST",
+  "NONE", "RETR", "STOR", "APPE", "ABOR", "LIST", "NLST", "MLSD",
   "CLOSE",
 };
 
@@ -424,6 +811,39 @@ const char *const dtp_cmd_resp_str[FTP_SERVER_DTP_COMMAND_RESP_NUM] = {
   "ACCEPTED", "REJECTED", "SUPERFLUOUS", "FINISHED", "EXITING_ERROR",
 };
 
+#if FTP_SERVER_MULTIPLEX
+// Statically allocated sessions of the multiplexing server, indexed by PI index
+ftp_server_mux_session_t _mux_sessions[FTP_SERVER_MUX_MAX_SESSIONS];
+#else
+// Statically allocated PI and DTP workers, indexed by PI index.
+// Each PI has its own DTP worker, as a PI only runs one DTP at a time.
+ftp_server_pi_worker_t _pi_workers[FTP_SERVER_MAX_PI_NUM];
+ftp_server_dtp_worker_t _dtp_workers[FTP_SERVER_MAX_PI_NUM];
+#endif /* FTP_SERVER_MULTIPLEX */
+
+// Directory listings shared by all sessions. Entries are only reused once no DTP
+// refers to them anymore. Modifications bump the generation to invalidate all.
+ftp_server_list_cache_entry_t _list_cache[FTP_SERVER_LIST_CACHE_NUM];
+unsigned int _list_cache_generation;
+unsigned int _list_cache_next;
+osMutexId_t _list_cache_mutex;
+
+#if FTP_SERVER_LIVE_FILES
+// Registered live files
+ftp_live_file_t *_live_files[FTP_SERVER_MAX_LIVE_FILES];
+#endif /* FTP_SERVER_LIVE_FILES */
+
+#if FTP_SERVER_MODE_Z
+// zlib streams shared by all MODE Z transfers
+ftp_server_zlib_stream_t _zlib_streams[FTP_SERVER_MODE_Z_NUM_STREAMS];
+#endif /* FTP_SERVER_MODE_Z */
+
+#if FTP_SERVER_DTP_USE_FORWARD
+// DTP channels by PI index. The f_forward stream function has no context
+// argument and finds the forwarding channel of the calling thread.
+ftp_server_dtp_channel_t *volatile _dtp_forward_channels[FTP_SERVER_NUM_SESSIONS];
+#endif /* FTP_SERVER_DTP_USE_FORWARD */
+
 const char *const dtp_month_str[16] = {
   "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec", "???", "???", "???", "???"
 };
@@ -433,6 +853,16 @@ const char *const dtp_month_str[16] = {
 osThreadId_t ftp_server_init() {
 
   osThreadId_t taskHandle;
+#if FTP_SERVER_MULTIPLEX
+  const osThreadAttr_t task_attributes = {
+    .name = "FTP_Thread",
+    .stack_size = FTP_SERVER_MUX_THREAD_STACKSIZE,
+    .priority = (osPriority_t) osPriorityLow,
+  };
+
+  // Create the thread that serves all sessions
+  taskHandle = osThreadNew(_ftp_server_mux_thread, NULL, &task_attributes);
+#else
   const osThreadAttr_t task_attributes = {
     .name = "FTP_Thread",
     .stack_size = FTP_SERVER_THREAD_STACKSIZE,
@@ -441,6 +871,7 @@ osThreadId_t ftp_server_init() {
 
   // Create a thread for the FTP server
   taskHandle = osThreadNew(_ftp_server_thread, NULL, &task_attributes);
+#endif /* FTP_SERVER_MULTIPLEX */
 
   // Check if task was created
   if (taskHandle == 0) {
@@ -451,34 +882,58 @@ osThreadId_t ftp_server_init() {
   return taskHandle;
 }
 
-/* Private functions ---------------------------------------------------------*/
-
-void _ftp_server_thread(void *args) {
-  (void) args;
+#if FTP_SERVER_LIVE_FILES
+int ftp_server_live_file_init(ftp_live_file_t *file,
+                              const char *path,
+                              multi_reader_ring_buffer_t *mrrb,
+                              ring_buffer_reader_t *reader) {
+  unsigned int i;
 
-  // Connection-related
-  int sd, size;
-  struct sockaddr_in address;
+  // Check arguments
+  if (file == NULL || path == NULL || mrrb == NULL || reader == NULL) return -1;
+
+  // Initialize the file
+  file->path = path;
+  file->mrrb = mrrb;
+  file->reader = reader;
+  file->data = NULL;
+  file->data_length = 0;
+  file->pending = 0;
+  file->abort = 0;
+  file->attached = 0;
+  file->thread = NULL;
+
+  // The reader skips data if the client cannot keep up
+  if (mrrb_reader_init(reader,
+                       file,
+                       MRRB_READER_OVERRUN_SKIP,
+                       _live_file_data_notify,
+                       _live_file_data_abort) < 0) {
+    return -1;
+  }
 
-  // List of PI threads
-  osThreadId_t *pi_task = NULL;
-  osThreadId_t pi_threads[FTP_SERVER_MAX_PI_NUM] = { 0 };
-  unsigned int pi_task_index;
+  // Register the file
+  for (i = 0; i < FTP_SERVER_MAX_LIVE_FILES; i++) {
+    if (_live_files[i] == NULL) {
+      _live_files[i] = file;
+      return 0;
+    }
+  }
+  FTP_DEBUG(1, "No free slot for live file %s.\n", path);
+  return -1;
+}
+#endif /* FTP_SERVER_LIVE_FILES */
 
-  // Arguments used for protocol interpreter creation
-  osThreadAttr_t pi_task_attributes;
-  server_pi_args_t pi_args;
-  char pi_thread_name[FTP_MAX_THREAD_NAME_LENGTH];
+/* Private functions ---------------------------------------------------------*/
 
-  // Initialize PI attributes
-  memset(&pi_task_attributes, 0x00, sizeof(pi_task_attributes));
-  pi_task_attributes.name = pi_thread_name;
-  pi_task_attributes.stack_size = FTP_SERVER_PI_THREAD_STACKSIZE;
+int _server_socket_open(int backlog) {
+  int sd;
+  struct sockaddr_in address;
 
   // Create a TCP socket
   if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
     FTP_SERVER_DEBUG(1, "Failed to open socket.\n");
-    return;
+    return -1;
   }
 
   // Setup the port information
@@ -489,49 +944,76 @@ void _ftp_server_thread(void *args) {
   // Bind the port
   if (bind(sd, (struct sockaddr *)&address, sizeof(address)) < 0) {
     FTP_SERVER_DEBUG(1, "Failed to bind socket to port %u.\n", FTP_SERVER_DEFAULT_CONTROL_PORT);
-    return;
+    close(sd);
+    return -1;
   }
 
   // Start listening for incomming connections
   FTP_SERVER_DEBUG(2, "Started listening for incomming connections.\n");
-  listen(sd, 1);
+  listen(sd, backlog);
+  return sd;
+}
+
+#if !FTP_SERVER_MULTIPLEX
+void _ftp_server_thread(void *args) {
+  (void) args;
+
+  // Connection-related
+  int sd, size;
+
+  // PI worker selection
+  ftp_server_pi_worker_t *pi_worker = NULL;
+  unsigned int pi_task_index;
+
+  // Arguments used to start a protocol interpreter
+  server_pi_args_t pi_args;
+
+  // Create the listing cache
+  if (_list_cache_init() < 0) {
+    FTP_SERVER_DEBUG(1, "Failed to create listing cache.\n");
+    return;
+  }
+
+  // Start the worker pool. Set the PI priority greater than this priority for instant start.
+  if (_worker_pool_init((osPriority_t) osThreadGetPriority(osThreadGetId()) + 1) < 0) {
+    FTP_SERVER_DEBUG(1, "Failed to create worker pool.\n");
+    return;
+  }
+
+  // Open the control port
+  if ((sd = _server_socket_open(1)) < 0) {
+    return;
+  }
   size = sizeof(pi_args.client);
 
   while (1) {
     // Start accepting connections
     pi_args.conn = accept(sd, (struct sockaddr *)&pi_args.client, (socklen_t *)&size);
 
-    // Check if any PI task is available
-    pi_task = NULL;
+    // Check if any PI worker is idle
+    pi_worker = NULL;
     for (pi_task_index = 0; pi_task_index < FTP_SERVER_MAX_PI_NUM; pi_task_index++) {
-      if (pi_threads[pi_task_index] == NULL ||
-          osThreadGetState(pi_threads[pi_task_index]) == osThreadTerminated) {
-        pi_task = &pi_threads[pi_task_index];
+      if (!_pi_workers[pi_task_index].busy) {
+        pi_worker = &_pi_workers[pi_task_index];
         break;
       }
     }
-    if (pi_task == NULL) {
+    if (pi_worker == NULL) {
       FTP_SERVER_DEBUG(1, "Cannot accept any new server connection. No PIs available.\n");
       close(pi_args.conn);
       continue;
     }
     FTP_SERVER_DEBUG(2, "Accepted new Server connection.\n");
 
-    // Set the PI name
-    snprintf(pi_thread_name, sizeof(pi_thread_name), "FTP_S_%03u_PI", pi_task_index);
-
-    // Set the PI priority greater than this priority for instant cration
-    pi_task_attributes.priority = (osPriority_t) osThreadGetPriority(osThreadGetId()) + 1;
+    // Hand the connection over to the PI worker
     pi_args.pi_index = pi_task_index;
-
-    // Create a new task for the PI
-    *pi_task = osThreadNew(_ftp_server_pi_thread, (void*) &pi_args, &pi_task_attributes);
-
-    if (*pi_task == NULL) {
-      FTP_SERVER_DEBUG(1, "Failed to create new FTP PI thread.\n");
+    pi_worker->busy = 1;
+    if (osMessageQueuePut(pi_worker->start_queue, &pi_args, 0, 0) != osOK) {
+      FTP_SERVER_DEBUG(1, "Failed to start FTP PI worker.\n");
+      pi_worker->busy = 0;
       close(pi_args.conn);
     } else {
-      FTP_SERVER_DEBUG(1, "Created new FTP PI thread.\n");
+      FTP_SERVER_DEBUG(1, "Started FTP PI worker.\n");
     }
   }
 
@@ -539,39 +1021,55 @@ void _ftp_server_thread(void *args) {
   close(sd);
 }
 
-void _ftp_server_pi_thread(void *args) {
-  // Argument parsing
-  server_pi_args_t *pi_args = (server_pi_args_t *)args;
+void _ftp_server_pi_worker(void *args) {
+  ftp_server_pi_worker_t *worker = (ftp_server_pi_worker_t *)args;
+  server_pi_args_t pi_args;
+
+  // Serve one control connection after the other
+  while (1) {
+    if (osMessageQueueGet(worker->start_queue, &pi_args, NULL, osWaitForever) == osOK) {
+      _ftp_server_pi_session(&pi_args);
+    }
+    worker->busy = 0;
+  }
+}
+
+void _ftp_server_dtp_worker(void *args) {
+  ftp_server_dtp_worker_t *worker = (ftp_server_dtp_worker_t *)args;
+  server_dtp_args_t dtp_args;
+
+  // Serve one data connection after the other
+  while (1) {
+    if (osMessageQueueGet(worker->start_queue, &dtp_args, NULL, osWaitForever) == osOK) {
+      _ftp_server_dtp_session(&dtp_args);
+    }
+  }
+}
 
+void _ftp_server_pi_session(server_pi_args_t *pi_args) {
   // Server related information
   ftp_server_t server;
   unsigned char recv_buffer[FTP_SERVER_RECV_BUF_LEN];
   unsigned char send_buffer[FTP_SERVER_SEND_BUF_LEN];
   unsigned char path_buffer[FTP_SERVER_PATH_BUF_LEN];
   int sts = 0;
-  int blocking = 0;
+  int events;
+  uint32_t timeout;
 
   // Initialize the server state
-  memset(&server, 0x00, sizeof(server));
-  server.credentials_check_fn = _default_credentials_check_fn;
-  server.pi.recv_buffer = recv_buffer;
-  server.pi.send_buffer = send_buffer;
-  server.pi.path_buffer = path_buffer;
-  server.pi.path_buffer_used = 0;
-  server.pi.prev_cmd = CMD_NOOP;
-  memcpy(&server.dtp_settings, &_ftp_dtp_default_settings, sizeof(ftp_server_dtp_settings_t));
-
-  // Copy arguments
-  server.dtp_settings.client_address.sin_addr.s_addr = pi_args->client.sin_addr.s_addr;
-  server.dtp_settings.client_address.sin_port = pi_args->client.sin_port;
-  server.pi.pi_index = pi_args->pi_index;
-  server.pi.conn = pi_args->conn;
-
-  // Initialize the file system
-  f_chdir("/");
-
-  // Created and initialized FTP server
-  FTP_SERVER_PI_DEBUG(1, "Created new Protocol Interpreter for FTP Server.\n");
+  _pi_init(&server, pi_args, recv_buffer, send_buffer, path_buffer);
+  server.pi.pi_to_dtp_msg_queue = _dtp_workers[pi_args->pi_index].pi_to_dtp_msg_queue;
+  server.pi.dtp_to_pi_msg_queue = _dtp_workers[pi_args->pi_index].dtp_to_pi_msg_queue;
+#if FTP_SERVER_STATS
+  server.pi.stats = &_pi_workers[pi_args->pi_index].stats;
+  memset(server.pi.stats, 0x00, sizeof(ftp_server_stats_t));
+#endif /* FTP_SERVER_STATS */
+
+  // Open the socket on which the DTP wakes the PI
+  server.pi.wake_sd = _wake_socket_open(&server.pi.wake_address);
+  if (server.pi.wake_sd < 0) {
+    FTP_SERVER_PI_DEBUG(1, "Failed to open wake socket, falling back to polling.\n");
+  }
 
   // Send a welcome message
   SET_RESPONSE( &server, "220", "awaiting input.");
@@ -579,11 +1077,22 @@ void _ftp_server_pi_thread(void *args) {
 
   // Enter the command cycle
   while (sts >= 0) {
-    blocking = (server.pi.dtp_thread == NULL);
+    // Sleep until the client sends data or the DTP posts a response
+    timeout = (server.pi.dtp_thread == NULL) ? osWaitForever : FTP_SERVER_SELECT_TIMEOUT;
+    events = _wait_for_event(PI_RECV_BUFF_FULL(&server) ? -1 : server.pi.conn, -1, server.pi.wake_sd, timeout);
+    if (events < 0) {
+      FTP_SERVER_PI_DEBUG(1, "Failed to wait for events.\n");
+      break;
+    }
+    if (events & FTP_EVENT_WAKE) {
+      _wake_socket_drain(server.pi.wake_sd);
+    }
 
     // Read new data and execute command
-    if (_receive_and_process_ctrl_msg(&server, blocking) < 0) {
-      break;
+    if (events & FTP_EVENT_READ) {
+      if (_receive_and_process_ctrl_msg(&server, 0) < 0) {
+        break;
+      }
     }
 
     // Check for responses from the DTP
@@ -591,41 +1100,59 @@ void _ftp_server_pi_thread(void *args) {
       break;
     }
 
-    // Yield at the end of the command cycle
-    osThreadYield();
+    // Execute the commands held back until the transfer finished
+    if (_process_ctrl_msgs(&server) < 0) {
+      break;
+    }
+
+#if FTP_SERVER_STATS && FTP_SERVER_STATS_LOG_INTERVAL
+    _stats_log_running(&server);
+#endif /* FTP_SERVER_STATS && FTP_SERVER_STATS_LOG_INTERVAL */
   }
-  // Close the connection
-  close(server.pi.conn);
-  FTP_SERVER_PI_DEBUG(2, "Closed connection.\n");
 
-  // Exit the thread
-  osThreadExit();
+  // Close the DTP and the connection
+  _pi_close(&server);
 }
 
-void _ftp_server_dtp_thread(void *args) {
-  // Argument parsing
-  server_dtp_args_t *dtp_args = (server_dtp_args_t *)args;
-
+void _ftp_server_dtp_session(server_dtp_args_t *dtp_args) {
   // DTP informantion
   ftp_server_dtp_channel_t dtp;
   ftp_server_pi_to_dtp_msg_t pi_to_dtp_msg;
   ftp_server_dtp_to_pi_msg_t dtp_to_pi_msg;
 
   // Socket-related
+  ftp_server_dtp_worker_t *worker = &_dtp_workers[dtp_args->pi_index];
   int sd = -1;
   int sts = 0;
+  int err;
+  socklen_t size;
 
   // Other state
+  int read_sd, write_sd, events;
   uint32_t timeout;
   osStatus_t q_sts;
 
   // Copy arguments
+  _dtp_init(&dtp, dtp_args->pi_index, dtp_args->settings, _dtp_workers[dtp_args->pi_index].buffers);
+#if _USE_FASTSEEK
+  dtp.clmt = _dtp_workers[dtp_args->pi_index].clmt;
+#endif /* _USE_FASTSEEK */
+#if FTP_SERVER_STATS
+  dtp.stats = &_pi_workers[dtp_args->pi_index].stats;
+#endif /* FTP_SERVER_STATS */
   dtp.dtp_to_pi_msg_queue = dtp_args->dtp_to_pi_msg_queue;
   dtp.pi_to_dtp_msg_queue = dtp_args->pi_to_dtp_msg_queue;
-  memcpy(&dtp.settings, dtp_args->settings, sizeof(ftp_server_dtp_settings_t));
-  dtp.active_cmd = FTP_SERVER_DTP_COMMAND_NONE;
+  memcpy(&dtp.pi_wake_address, &dtp_args->pi_wake_address, sizeof(struct sockaddr_in));
 
-  // Try to initialize DTP connection
+  // Open the socket on which the PI wakes the DTP and publish its address.
+  // Commands sent before the address is published are found on the next queue check.
+  dtp.wake_sd = _wake_socket_open(dtp_args->dtp_wake_address);
+  if (dtp.wake_sd < 0) {
+    FTP_SERVER_DTP_DEBUG(1, "Failed to open wake socket, falling back to polling.\n");
+  }
+
+  // Try to initialize DTP connection. The DTP never blocks in connect() or
+  // accept(), so the PI can stop it while it waits for the client.
   do {
     // Check DTP mode
     if (dtp.settings.mode == DTP_MODE_ACTIVE) {
@@ -636,11 +1163,25 @@ void _ftp_server_dtp_thread(void *args) {
         sts = -1;
         break;
       }
-      dtp.conn = connect(sd, (struct sockaddr *) &dtp.settings.client_address, sizeof(dtp.settings.client_address));
+      fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+      if (connect(sd, (struct sockaddr *) &dtp.settings.client_address, sizeof(dtp.settings.client_address)) < 0) {
+        err = 0;
+        size = sizeof(err);
+        if (errno != EINPROGRESS || _dtp_wait_for_connection(&dtp, -1, sd) < 0 ||
+            getsockopt(sd, SOL_SOCKET, SO_ERROR, &err, &size) < 0 || err != 0) {
+          FTP_SERVER_DTP_DEBUG(1, "Failed to connect to client address.\n");
+          sts = -1;
+          break;
+        }
+      }
+      dtp.conn = sd;
+      sd = -1;
     } else {
       // Passive mode: Wait for User to establish connection
       FTP_SERVER_DTP_DEBUG(1, "Waiting for user to establish connection.\n");
-      dtp.conn = accept(dtp.settings.passive_sd, NULL, NULL);
+      if (_dtp_wait_for_connection(&dtp, dtp.settings.passive_sd, -1) == 0) {
+        dtp.conn = accept(dtp.settings.passive_sd, NULL, NULL);
+      }
     }
 
     // Check the connection
@@ -651,13 +1192,49 @@ void _ftp_server_dtp_thread(void *args) {
     }
   } while (0);
 
-  FTP_SERVER_DTP_DEBUG(1, "Initialized DTP.\n");
+  // Prepare the channel for transfers
+  if (sts >= 0) {
+    worker->conn = dtp.conn;
+    sts = _dtp_connected(&dtp);
+  }
 
   // Loop until broken
   while(sts >= 0) {
-    // Check for new command from the PI
-    timeout = (dtp.active_cmd == FTP_SERVER_DTP_COMMAND_NONE) ? osWaitForever : 0;
-    q_sts = osMessageQueueGet(dtp.pi_to_dtp_msg_queue, &pi_to_dtp_msg, NULL, timeout);
+    if (dtp.active_cmd == FTP_SERVER_DTP_COMMAND_NONE) {
+      // No transfer active, sleep until the PI sends a command
+      q_sts = osMessageQueueGet(dtp.pi_to_dtp_msg_queue, &pi_to_dtp_msg, NULL, osWaitForever);
+    } else {
+      // Transfer active, sleep until the data connection is ready or the PI wakes us
+      _dtp_get_wait(&dtp, &read_sd, &write_sd, &timeout);
+#if FTP_SERVER_LIVE_FILES
+      if (dtp.live_file != NULL && read_sd < 0 && write_sd < 0) {
+        // Sleep until the MRRB hands over data. Commands of the PI are seen after the poll interval.
+        if (timeout != 0) {
+          (void) osThreadFlagsWait(FTP_LIVE_FILE_FLAG_NEW_DATA, osFlagsWaitAny, timeout);
+        }
+        timeout = 0;
+      }
+#endif /* FTP_SERVER_LIVE_FILES */
+      if (timeout != FTP_SERVER_SELECT_TIMEOUT && dtp.wake_sd < 0) {
+        osDelay(timeout);
+      }
+      if (read_sd >= 0 || write_sd >= 0 || (dtp.wake_sd >= 0 && timeout != FTP_SERVER_SELECT_TIMEOUT)) {
+        FTP_STATS_TIMESTAMP(wait_start);
+        events = _wait_for_event(read_sd, write_sd, dtp.wake_sd, timeout);
+        if (read_sd >= 0 || write_sd >= 0) {
+          FTP_STATS_ADD_ELAPSED(&dtp, wait_us, wait_start);
+        }
+        if (events < 0) {
+          FTP_SERVER_DTP_DEBUG(1, "Failed to wait for events.\n");
+          sts = -1;
+          break;
+        }
+        if (events & FTP_EVENT_WAKE) {
+          _wake_socket_drain(dtp.wake_sd);
+        }
+      }
+      q_sts = osMessageQueueGet(dtp.pi_to_dtp_msg_queue, &pi_to_dtp_msg, NULL, 0);
+    }
     // Check if we actually got a command
     if (q_sts == osErrorParameter) {
       FTP_SERVER_DTP_DEBUG(1, "Failed to receive control message from PI.\n");
@@ -665,154 +1242,857 @@ void _ftp_server_dtp_thread(void *args) {
       break;
     } else if (q_sts == osOK) {
       // Execute the command (prepare for sending/receiving)
-      sts = _dtp_execute_command(&dtp, pi_to_dtp_msg.command, pi_to_dtp_msg.filename_buff, &dtp_to_pi_msg);
+      sts = _dtp_execute_command(&dtp,
+                                 pi_to_dtp_msg.command,
+                                 pi_to_dtp_msg.filename_buff,
+                                 pi_to_dtp_msg.offset,
+                                 pi_to_dtp_msg.transfer_mode,
+                                 &dtp_to_pi_msg);
       if (sts < 0) break;
 
       // Send a response to the PI. Always wait for the PI to read the messages
       if (osMessageQueuePut(dtp.dtp_to_pi_msg_queue, &dtp_to_pi_msg, 0, osWaitForever) != osOK) {
         FTP_SERVER_DTP_DEBUG(1, "Failed to send response message to PI.\n");
       }
+      _wake_socket_signal(dtp.wake_sd, &dtp.pi_wake_address);
     }
 
     // check send/recieve functions depending on active command
     sts = _dtp_send_receive(&dtp);
     if (sts != 0) break;
-
-    // Always yield at the end of the execution cycle
-    osThreadYield();
   }
 
   FTP_SERVER_DTP_DEBUG(1, "Exited command cycle with sts %i.\n", sts);
 
   // Make sure to close files/folders in case they are open
-  f_close(&dtp.current_file);
-  f_closedir(&dtp.current_dir);
+  _dtp_cleanup(&dtp);
+
+  // Close the data connection before the PI may reuse the worker
+  worker->conn = -1;
+  if (dtp.conn >= 0) close(dtp.conn);
+  if (sd >= 0) close(sd);
 
-  // Send the exiting state to the PI
+  // Send the exiting state to the PI, unless it stopped waiting for it
   if (sts > 0) {
     dtp_to_pi_msg.cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_FINISHED;
   } else {
     dtp_to_pi_msg.cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_EXITING_ERROR;
   }
-  if (osMessageQueuePut(dtp.dtp_to_pi_msg_queue, &dtp_to_pi_msg, 0, osWaitForever) != osOK) {
-    FTP_SERVER_DTP_DEBUG(1, "Could not send exiting message to PI.\n");
+  if (!worker->abandoned) {
+    if (osMessageQueuePut(dtp.dtp_to_pi_msg_queue, &dtp_to_pi_msg, 0, osWaitForever) != osOK) {
+      FTP_SERVER_DTP_DEBUG(1, "Could not send exiting message to PI.\n");
+    }
+    _wake_socket_signal(dtp.wake_sd, &dtp.pi_wake_address);
   }
+  if (dtp.wake_sd >= 0) close(dtp.wake_sd);
+  worker->abandoned = 0;
 
-  // Close the sockets
-  if (dtp.conn >= 0) close(dtp.conn);
-  if (sd >= 0) close(sd);
-
-  // Exit the DTP Thread
+  // Return to the DTP worker
   FTP_SERVER_DTP_DEBUG(1, "Exiting...\n");
-  osThreadExit();
 }
 
-int _send_status_msg(ftp_server_t *server) {
-  int send_len;
-
-  // Include the CRLN
-  strcpy(server->pi.send_buffer + server->pi.send_buff_put_offset, "\r\n");
-  send_len = server->pi.send_buff_put_offset + 2;
-  FTP_SERVER_PI_DEBUG(2, "Sending Control Data: %.*s", send_len, server->pi.send_buffer);
+int _dtp_wait_for_connection(ftp_server_dtp_channel_t *dtp, int read_sd, int write_sd) {
+  ftp_server_dtp_worker_t *worker = &_dtp_workers[dtp->pi_index];
+  int events;
 
-  // Send the data
-  if (send(server->pi.conn, server->pi.send_buffer, send_len, 0) != send_len) {
-    FTP_SERVER_PI_DEBUG(1, "Failed to send Control Data.\n");
-    return -1;
+  // Sleep until the socket is ready or the PI asks the DTP to exit
+  while (!worker->stop) {
+    events = _wait_for_event(read_sd, write_sd, dtp->wake_sd, FTP_SERVER_SELECT_TIMEOUT);
+    if (events < 0) {
+      FTP_SERVER_DTP_DEBUG(1, "Failed to wait for events.\n");
+      return -1;
+    }
+    if (events & FTP_EVENT_WAKE) {
+      _wake_socket_drain(dtp->wake_sd);
+    }
+    if (events & (FTP_EVENT_READ | FTP_EVENT_WRITE)) {
+      return 0;
+    }
   }
-
-  // Clear the response buffer
-  CLEAR_RESPONSE(server);
-  return 0;
+  return -1;
 }
 
-int _receive_and_process_ctrl_msg(ftp_server_t *server, int blocking) {
-  int recv_len;
-  int sts;
-
-  recv_len = recv(server->pi.conn, server->pi.recv_buffer, FTP_SERVER_RECV_BUF_LEN, blocking ? 0 : MSG_DONTWAIT);
-  if (recv_len < 0) {
-    if (blocking || errno != EWOULDBLOCK) {
-      FTP_SERVER_PI_DEBUG(1, "Failed to read data.\n");
-      return -1;
-    } else {
-      sts = 0;
-    }
-  } else if (recv_len == 0) {
-    if (!blocking) {
-      FTP_SERVER_PI_DEBUG(1, "Connection closed by Client.\n");
+int _worker_pool_init(osPriority_t pi_priority) {
+  osMessageQueueAttr_t queue_attributes;
+
+  for (unsigned int i = 0; i < FTP_SERVER_MAX_PI_NUM; i++) {
+    ftp_server_pi_worker_t *pi_worker = &_pi_workers[i];
+    ftp_server_dtp_worker_t *dtp_worker = &_dtp_workers[i];
+
+    // Create the PI start queue
+    memset(&queue_attributes, 0x00, sizeof(queue_attributes));
+    queue_attributes.cb_mem = &pi_worker->start_queue_cb;
+    queue_attributes.cb_size = sizeof(pi_worker->start_queue_cb);
+    queue_attributes.mq_mem = pi_worker->start_queue_mem;
+    queue_attributes.mq_size = sizeof(pi_worker->start_queue_mem);
+    pi_worker->start_queue = osMessageQueueNew(1, sizeof(server_pi_args_t), &queue_attributes);
+
+    // Create the DTP start queue
+    queue_attributes.cb_mem = &dtp_worker->start_queue_cb;
+    queue_attributes.cb_size = sizeof(dtp_worker->start_queue_cb);
+    queue_attributes.mq_mem = dtp_worker->start_queue_mem;
+    queue_attributes.mq_size = sizeof(dtp_worker->start_queue_mem);
+    dtp_worker->start_queue = osMessageQueueNew(1, sizeof(server_dtp_args_t), &queue_attributes);
+
+    // Create Message Queues between PI and DTP threads
+    queue_attributes.cb_mem = &dtp_worker->pi_to_dtp_queue_cb;
+    queue_attributes.cb_size = sizeof(dtp_worker->pi_to_dtp_queue_cb);
+    queue_attributes.mq_mem = dtp_worker->pi_to_dtp_queue_mem;
+    queue_attributes.mq_size = sizeof(dtp_worker->pi_to_dtp_queue_mem);
+    dtp_worker->pi_to_dtp_msg_queue = osMessageQueueNew(1, sizeof(ftp_server_pi_to_dtp_msg_t), &queue_attributes);
+    queue_attributes.cb_mem = &dtp_worker->dtp_to_pi_queue_cb;
+    queue_attributes.cb_size = sizeof(dtp_worker->dtp_to_pi_queue_cb);
+    queue_attributes.mq_mem = dtp_worker->dtp_to_pi_queue_mem;
+    queue_attributes.mq_size = sizeof(dtp_worker->dtp_to_pi_queue_mem);
+    dtp_worker->dtp_to_pi_msg_queue = osMessageQueueNew(1, sizeof(ftp_server_dtp_to_pi_msg_t), &queue_attributes);
+
+    if (pi_worker->start_queue == NULL || dtp_worker->start_queue == NULL ||
+        dtp_worker->pi_to_dtp_msg_queue == NULL || dtp_worker->dtp_to_pi_msg_queue == NULL) {
+      FTP_SERVER_DEBUG(1, "Failed to create worker message queues.\n");
       return -1;
     }
-  } else {
-    FTP_SERVER_PI_DEBUG(2, "Received Control Data: %.*s", recv_len, server->pi.recv_buffer);
-
-    // Zero-terminate the receive buffer
-    server->pi.recv_buffer[recv_len == FTP_SERVER_RECV_BUF_LEN ? (recv_len - 1) : recv_len] = '\0';
-
-    // Correctly received a message. Process it
-    sts = _process_ctrl_msg(server, server->pi.recv_buffer, recv_len);
 
-    // If processing set a response, send it
-    if (server->pi.send_buff_put_offset != 0) {
-      if (_send_status_msg(server) < 0) {
-        sts = -1;
-      }
+    // Start the worker threads
+    pi_worker->busy = 0;
+    dtp_worker->stop = 0;
+    dtp_worker->conn = -1;
+    dtp_worker->abandoned = 0;
+    if (_pi_worker_start(i, pi_priority) < 0 || _dtp_worker_start(i) < 0) {
+      return -1;
     }
   }
-  return sts;
+  FTP_SERVER_DEBUG(2, "Created %u PI and DTP workers.\n", FTP_SERVER_MAX_PI_NUM);
+  return 0;
 }
 
-int _check_dtp_response(ftp_server_t *server) {
-  ftp_server_dtp_to_pi_msg_t dtp_to_pi_msg;
-  int sts = 0;
+int _pi_worker_start(unsigned int index, osPriority_t priority) {
+  ftp_server_pi_worker_t *worker = &_pi_workers[index];
+  osThreadAttr_t thread_attributes;
+  char thread_name[FTP_MAX_THREAD_NAME_LENGTH];
 
-  // Check if the DTP sent a response
-  if (osMessageQueueGetCount(server->pi.dtp_to_pi_msg_queue) == 0) {
-    return 0;
+  // Initialize PI attributes
+  memset(&thread_attributes, 0x00, sizeof(thread_attributes));
+  snprintf(thread_name, sizeof(thread_name), "FTP_S_%03u_PI", index);
+  thread_attributes.name = thread_name;
+  thread_attributes.priority = priority;
+  thread_attributes.cb_mem = &worker->thread_cb;
+  thread_attributes.cb_size = sizeof(worker->thread_cb);
+  thread_attributes.stack_mem = worker->stack;
+  thread_attributes.stack_size = sizeof(worker->stack);
+
+  // Create the PI thread in the static memory of the worker
+  worker->thread = osThreadNew(_ftp_server_pi_worker, (void*) worker, &thread_attributes);
+  if (worker->thread == NULL) {
+    FTP_SERVER_DEBUG(1, "Failed to create new FTP PI thread.\n");
+    return -1;
   }
+  return 0;
+}
 
-  // Retrieve the response
-  if (osMessageQueueGet(server->pi.dtp_to_pi_msg_queue, &dtp_to_pi_msg, 0, 0) != osOK) {
-    FTP_SERVER_PI_DEBUG(1, "Failed to get response from DTP.\n");
+int _dtp_worker_start(unsigned int index) {
+  ftp_server_dtp_worker_t *worker = &_dtp_workers[index];
+  osThreadAttr_t thread_attributes;
+  char thread_name[FTP_MAX_THREAD_NAME_LENGTH];
+
+  // Initialize DTP attributes
+  memset(&thread_attributes, 0x00, sizeof(thread_attributes));
+  snprintf(thread_name, sizeof(thread_name), "FTP_S_%03u_DTP", index);
+  thread_attributes.name = thread_name;
+  thread_attributes.cb_mem = &worker->thread_cb;
+  thread_attributes.cb_size = sizeof(worker->thread_cb);
+  thread_attributes.stack_mem = worker->stack;
+  thread_attributes.stack_size = sizeof(worker->stack);
+
+  // Create the DTP thread in the static memory of the worker
+  worker->thread = osThreadNew(_ftp_server_dtp_worker, (void*) worker, &thread_attributes);
+  if (worker->thread == NULL) {
+    FTP_SERVER_DEBUG(1, "Failed to create new FTP DTP thread.\n");
     return -1;
   }
+  return 0;
+}
 
-  FTP_SERVER_PI_DEBUG(2, "Received Response from DTP: %s.\n", dtp_cmd_resp_str[dtp_to_pi_msg.cmd_resp]);
+#endif /* !FTP_SERVER_MULTIPLEX */
 
-  // Set response depending on DTP response
-  switch (dtp_to_pi_msg.cmd_resp) {
-    case FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED:
-      SET_RESPONSE(server, "150", "File status okay; about to open data connection.");
-      break;
-    case FTP_SERVER_DTP_COMMAND_RESP_REJECTED:
-      SET_RESPONSE(server, "450", "Requested file action not taken.");
-      break;
-    case FTP_SERVER_DTP_COMMAND_RESP_SUPERFLUOUS:
-    case FTP_SERVER_DTP_COMMAND_RESP_FINISHED:
-      SET_RESPONSE(server, "250", "Requested file action okay, completed.");
-      break;
-    case FTP_SERVER_DTP_COMMAND_RESP_EXITING_ERROR:
-      SET_RESPONSE(server, "451", "Requested action aborted: local error in processing.");
-      break;
-    default:
-      sts = -1;
-      break;
+#if FTP_SERVER_MULTIPLEX
+void _ftp_server_mux_thread(void *args) {
+  (void) args;
+
+  // Connection-related
+  int sd, conn, max_sd, err;
+  socklen_t size;
+  struct sockaddr_in client;
+  fd_set read_set, write_set;
+  struct timeval tv;
+
+  // Session-related
+  ftp_server_mux_session_t *session;
+  ftp_server_t *server;
+  ftp_server_dtp_channel_t *dtp;
+  unsigned int num_sessions;
+  int read_sd, write_sd, sts;
+  uint32_t timeout, dtp_timeout;
+
+  // Create the listing cache
+  if (_list_cache_init() < 0) {
+    FTP_SERVER_DEBUG(1, "Failed to create listing cache.\n");
+    return;
+  }
+
+  // Open the control port. Clients connecting at the same time must not
+  // overflow the backlog while the thread is busy with other sessions.
+  if ((sd = _server_socket_open(FTP_SERVER_MUX_MAX_SESSIONS)) < 0) {
+    return;
+  }
+  FTP_SERVER_DEBUG(2, "Serving up to %u sessions.\n", FTP_SERVER_MUX_MAX_SESSIONS);
+
+  while (1) {
+    // Collect the sockets every session waits for
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    max_sd = -1;
+    num_sessions = 0;
+    timeout = osWaitForever;
+    for (unsigned int i = 0; i < FTP_SERVER_MUX_MAX_SESSIONS; i++) {
+      session = &_mux_sessions[i];
+      if (!session->used) continue;
+      num_sessions++;
+      server = &session->server;
+      dtp = &session->dtp;
+      // Queued replies hold back the whole session until the client takes them
+      if (server->pi.send_buff_queued != 0) {
+        _fd_set_add(server->pi.conn, &write_set, &max_sd);
+        continue;
+      }
+      if (!PI_RECV_BUFF_FULL(server)) {
+        _fd_set_add(server->pi.conn, &read_set, &max_sd);
+      }
+      if (server->pi.dtp_thread == NULL) continue;
+      if (dtp->conn < 0) {
+        // Wait for the data connection to be established
+        if (session->connect_sd >= 0) {
+          _fd_set_add(session->connect_sd, &write_set, &max_sd);
+        } else {
+          _fd_set_add(dtp->settings.passive_sd, &read_set, &max_sd);
+        }
+      } else if (dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
+        // A transfer that can progress without its socket must not wait at all
+        _dtp_get_wait(dtp, &read_sd, &write_sd, &dtp_timeout);
+        _fd_set_add(read_sd, &read_set, &max_sd);
+        _fd_set_add(write_sd, &write_set, &max_sd);
+        if (read_sd < 0 && write_sd < 0) {
+          if (dtp_timeout == FTP_SERVER_SELECT_TIMEOUT) dtp_timeout = 0;
+          if (dtp_timeout < timeout) timeout = dtp_timeout;
+        }
+      }
+    }
+    // Only accept new connections while a session is free
+    if (num_sessions < FTP_SERVER_MUX_MAX_SESSIONS) {
+      _fd_set_add(sd, &read_set, &max_sd);
+    }
+
+    // Sleep until any socket is ready
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (select(max_sd + 1, &read_set, &write_set, NULL, (timeout == osWaitForever) ? NULL : &tv) < 0) {
+      FTP_SERVER_DEBUG(1, "Failed to wait for events.\n");
+      osDelay(FTP_SERVER_DEFAULT_TIMEOUT);
+      continue;
+    }
+
+    // Serve the sessions
+    for (unsigned int i = 0; i < FTP_SERVER_MUX_MAX_SESSIONS; i++) {
+      session = &_mux_sessions[i];
+      if (!session->used) continue;
+      server = &session->server;
+      dtp = &session->dtp;
+
+      // Send the queued replies first
+      if (server->pi.send_buff_queued != 0) {
+        if (!FD_ISSET(server->pi.conn, &write_set)) continue;
+        if (_flush_status_msgs(server) < 0) {
+          _mux_session_close(session);
+          continue;
+        }
+        if (server->pi.send_buff_queued != 0) continue;
+      }
+
+      // Data connection
+      if (server->pi.dtp_thread != NULL) {
+        if (dtp->conn < 0 && session->connect_sd >= 0) {
+          // Active mode: check the result of the connection attempt
+          if (FD_ISSET(session->connect_sd, &write_set)) {
+            err = 0;
+            size = sizeof(err);
+            if (getsockopt(session->connect_sd, SOL_SOCKET, SO_ERROR, &err, &size) < 0 || err != 0) {
+              FTP_SERVER_DTP_DEBUG(1, "Failed to connect to client address.\n");
+              _mux_dtp_exit(session, -1);
+            } else {
+              dtp->conn = session->connect_sd;
+              session->connect_sd = -1;
+              _mux_dtp_connected(session);
+            }
+          }
+        } else if (dtp->conn < 0) {
+          // Passive mode: accept the connection of the client
+          if (FD_ISSET(dtp->settings.passive_sd, &read_set)) {
+            dtp->conn = accept(dtp->settings.passive_sd, NULL, NULL);
+            if (dtp->conn < 0) {
+              FTP_SERVER_DTP_DEBUG(1, "Failed to connect to client address.\n");
+              _mux_dtp_exit(session, -1);
+            } else {
+              _mux_dtp_connected(session);
+            }
+          }
+        } else if (dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
+          // Run the transfer once its socket is ready
+          _dtp_get_wait(dtp, &read_sd, &write_sd, &dtp_timeout);
+          if ((read_sd < 0 && write_sd < 0) ||
+              (read_sd >= 0 && FD_ISSET(read_sd, &read_set)) ||
+              (write_sd >= 0 && FD_ISSET(write_sd, &write_set))) {
+            sts = _dtp_send_receive(dtp);
+            if (sts != 0) {
+              _mux_dtp_exit(session, sts);
+            }
+          }
+        }
+      }
+
+      // Control connection, including the commands held back by a transfer
+      if (FD_ISSET(server->pi.conn, &read_set)) {
+        sts = _receive_and_process_ctrl_msg(server, 0);
+      } else {
+        sts = _process_ctrl_msgs(server);
+      }
+      if (sts < 0) {
+        _mux_session_close(session);
+        continue;
+      }
+
+#if FTP_SERVER_STATS && FTP_SERVER_STATS_LOG_INTERVAL
+      _stats_log_running(server);
+#endif /* FTP_SERVER_STATS && FTP_SERVER_STATS_LOG_INTERVAL */
+    }
+
+    // Accept a new session only after serving the others, as their sockets
+    // could otherwise be mistaken for those of the new session
+    if (num_sessions < FTP_SERVER_MUX_MAX_SESSIONS && FD_ISSET(sd, &read_set)) {
+      size = sizeof(client);
+      conn = accept(sd, (struct sockaddr *)&client, &size);
+      if (conn >= 0) {
+        _mux_session_open(conn, &client);
+      }
+    }
+  }
+
+  // On thermination, close the socket (this should never happen)
+  close(sd);
+}
+
+int _mux_session_open(int conn, const struct sockaddr_in *client) {
+  ftp_server_mux_session_t *session = NULL;
+  server_pi_args_t pi_args;
+  unsigned int index;
+
+  // Find a free session
+  for (index = 0; index < FTP_SERVER_MUX_MAX_SESSIONS; index++) {
+    if (!_mux_sessions[index].used) {
+      session = &_mux_sessions[index];
+      break;
+    }
+  }
+  if (session == NULL) {
+    FTP_SERVER_DEBUG(1, "Cannot accept any new server connection. No sessions available.\n");
+    close(conn);
+    return -1;
+  }
+  FTP_SERVER_DEBUG(2, "Accepted new Server connection.\n");
+
+  // Initialize the PI. The DTP runs on this thread as well and needs no wake socket.
+  pi_args.pi_index = index;
+  pi_args.conn = conn;
+  memcpy(&pi_args.client, client, sizeof(struct sockaddr_in));
+  _pi_init(&session->server, &pi_args, session->recv_buffer, session->send_buffer, session->path_buffer);
+  session->server.pi.wake_sd = -1;
+#if FTP_SERVER_STATS
+  session->server.pi.stats = &session->stats;
+  memset(&session->stats, 0x00, sizeof(ftp_server_stats_t));
+#endif /* FTP_SERVER_STATS */
+  session->connect_sd = -1;
+  session->cmd_pending = 0;
+  session->used = 1;
+
+  // Send a welcome message
+  SET_RESPONSE(&session->server, "220", "awaiting input.");
+  if (_send_status_msg(&session->server) < 0) {
+    _mux_session_close(session);
+    return -1;
+  }
+  return 0;
+}
+
+void _mux_session_close(ftp_server_mux_session_t *session) {
+  // Close the DTP and the connection
+  _pi_close(&session->server);
+  session->used = 0;
+}
+
+void _mux_dtp_connected(ftp_server_mux_session_t *session) {
+  ftp_server_dtp_to_pi_msg_t dtp_to_pi_msg;
+  int sts;
+
+  // Prepare the channel for transfers
+  if (_dtp_connected(&session->dtp) < 0) {
+    _mux_dtp_exit(session, -1);
+    return;
+  }
+
+  // Execute a command that arrived while connecting
+  if (session->cmd_pending) {
+    session->cmd_pending = 0;
+    sts = _dtp_execute_command(&session->dtp,
+                               session->cmd.command,
+                               session->cmd.filename_buff,
+                               session->cmd.offset,
+                               session->cmd.transfer_mode,
+                               &dtp_to_pi_msg);
+    if (sts < 0) {
+      _mux_dtp_exit(session, sts);
+    } else {
+      _handle_dtp_response(&session->server, dtp_to_pi_msg.cmd_resp);
+    }
+  }
+}
+
+void _mux_dtp_exit(ftp_server_mux_session_t *session, int sts) {
+  ftp_server_dtp_channel_t *dtp = &session->dtp;
+
+  FTP_SERVER_DTP_DEBUG(1, "Exited command cycle with sts %i.\n", sts);
+
+  // Release everything the channel holds
+  _dtp_cleanup(dtp);
+  if (dtp->conn >= 0) close(dtp->conn);
+  if (session->connect_sd >= 0) close(session->connect_sd);
+  dtp->conn = -1;
+  session->connect_sd = -1;
+  session->cmd_pending = 0;
+
+  // Report the exiting state to the PI, which closes the channel
+  session->server.pi.dtp_thread = NULL;
+  _handle_dtp_response(&session->server,
+                       (sts > 0) ? FTP_SERVER_DTP_COMMAND_RESP_FINISHED : FTP_SERVER_DTP_COMMAND_RESP_EXITING_ERROR);
+}
+
+int _open_dtp_channel(ftp_server_t *server) {
+  // Check arguments
+  if (server == NULL) return -1;
+
+  ftp_server_mux_session_t *session = &_mux_sessions[server->pi.pi_index];
+  ftp_server_dtp_channel_t *dtp = &session->dtp;
+  int sd;
+
+  // Check if server is already open
+  if (server->pi.dtp_thread != NULL) {
+    FTP_SERVER_PI_DEBUG(2, "Cannot open DTP channel: already open.\n");
+    return 0;
+  }
+
+  // Set up the channel with the current settings
+  _dtp_init(dtp, server->pi.pi_index, &server->dtp_settings, session->buffers);
+#if _USE_FASTSEEK
+  dtp->clmt = session->clmt;
+#endif /* _USE_FASTSEEK */
+#if FTP_SERVER_STATS
+  dtp->stats = &session->stats;
+#endif /* FTP_SERVER_STATS */
+  session->connect_sd = -1;
+  session->cmd_pending = 0;
+
+  // Active mode: start connecting to the client without waiting for the result.
+  // Passive mode: the client connects to the passive socket later.
+  if (dtp->settings.mode == DTP_MODE_ACTIVE) {
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+      FTP_SERVER_PI_DEBUG(1, "Failed to open socket.\n");
+      _dtp_cleanup(dtp);
+      return -1;
+    }
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sd, (struct sockaddr *) &dtp->settings.client_address, sizeof(dtp->settings.client_address)) == 0) {
+      dtp->conn = sd;
+    } else if (errno == EINPROGRESS) {
+      session->connect_sd = sd;
+    } else {
+      FTP_SERVER_PI_DEBUG(1, "Failed to connect to client address.\n");
+      close(sd);
+      _dtp_cleanup(dtp);
+      return -1;
+    }
+  }
+
+  // Prepare the channel right away if the connection was established
+  if (dtp->conn >= 0 && _dtp_connected(dtp) < 0) {
+    _dtp_cleanup(dtp);
+    close(dtp->conn);
+    dtp->conn = -1;
+    return -1;
+  }
+
+  // The DTP is served by this thread
+  server->pi.dtp_thread = osThreadGetId();
+  FTP_SERVER_PI_DEBUG(2, "Opened DTP channel.\n");
+  return 0;
+}
+
+int _close_dtp_channel(ftp_server_t *server) {
+  // Check Arguments
+  if (server == NULL) return -1;
+
+  ftp_server_mux_session_t *session = &_mux_sessions[server->pi.pi_index];
+
+  // Release the channel if it is still open
+  if (server->pi.dtp_thread != NULL) {
+    _dtp_cleanup(&session->dtp);
+    if (session->dtp.conn >= 0) close(session->dtp.conn);
+    if (session->connect_sd >= 0) close(session->connect_sd);
+    session->dtp.conn = -1;
+    session->connect_sd = -1;
+    session->cmd_pending = 0;
+    server->pi.dtp_thread = NULL;
+  }
+
+  // Misc cleanup
+  server->pi.path_buffer_used = 0;
+  server->pi.transfer_pending = 0;
+  FTP_SERVER_PI_DEBUG(1, "Closed DTP.\n");
+  return 0;
+}
+
+int _send_dtp_command(ftp_server_t *server, const ftp_server_pi_to_dtp_msg_t *msg) {
+  ftp_server_mux_session_t *session = &_mux_sessions[server->pi.pi_index];
+  ftp_server_dtp_to_pi_msg_t dtp_to_pi_msg;
+  int sts;
+
+  // Hold the command until the data connection is established
+  if (session->dtp.conn < 0) {
+    if (session->cmd_pending) return -1;
+    memcpy(&session->cmd, msg, sizeof(ftp_server_pi_to_dtp_msg_t));
+    session->cmd_pending = 1;
+    return 0;
+  }
+
+  // Execute the command right away and respond like a DTP thread would
+  sts = _dtp_execute_command(&session->dtp,
+                             msg->command,
+                             msg->filename_buff,
+                             msg->offset,
+                             msg->transfer_mode,
+                             &dtp_to_pi_msg);
+  if (sts < 0) {
+    _mux_dtp_exit(session, sts);
+  } else {
+    _handle_dtp_response(server, dtp_to_pi_msg.cmd_resp);
+  }
+  return 0;
+}
+
+void _fd_set_add(int sd, fd_set *set, int *max_sd) {
+  if (sd < 0) return;
+  FD_SET(sd, set);
+  if (sd > *max_sd) *max_sd = sd;
+}
+#endif /* FTP_SERVER_MULTIPLEX */
+
+void _pi_init(ftp_server_t *server,
+              const server_pi_args_t *pi_args,
+              unsigned char *recv_buffer,
+              unsigned char *send_buffer,
+              unsigned char *path_buffer)
+{
+  // Initialize the server state
+  memset(server, 0x00, sizeof(ftp_server_t));
+  server->credentials_check_fn = _default_credentials_check_fn;
+  server->pi.recv_buffer = recv_buffer;
+  server->pi.send_buffer = send_buffer;
+  server->pi.path_buffer = path_buffer;
+  server->pi.path_buffer_used = 0;
+  server->pi.prev_cmd = CMD_NOOP;
+  memcpy(&server->dtp_settings, &_ftp_dtp_default_settings, sizeof(ftp_server_dtp_settings_t));
+
+  // Copy arguments
+  server->dtp_settings.client_address.sin_addr.s_addr = pi_args->client.sin_addr.s_addr;
+  server->dtp_settings.client_address.sin_port = pi_args->client.sin_port;
+  server->pi.pi_index = pi_args->pi_index;
+  server->pi.conn = pi_args->conn;
+
+  // Initialize the file system
+  f_chdir("/");
+
+  // Created and initialized FTP server
+  FTP_SERVER_PI_DEBUG(1, "Created new Protocol Interpreter for FTP Server.\n");
+}
+
+void _pi_close(ftp_server_t *server) {
+  // Close the DTP if it is still open
+  if (server->pi.dtp_thread != NULL) {
+    _close_dtp_channel(server);
+  }
+
+  // Close the connections
+  if (server->dtp_settings.mode == DTP_MODE_PASSIVE) close(server->dtp_settings.passive_sd);
+  if (server->pi.wake_sd >= 0) close(server->pi.wake_sd);
+  close(server->pi.conn);
+  FTP_SERVER_PI_DEBUG(2, "Closed connection.\n");
+}
+
+int _send_status_msg(ftp_server_t *server) {
+  int send_len;
+
+  // Include the CRLN
+  strcpy(server->pi.send_buffer + server->pi.send_buff_put_offset, "\r\n");
+  send_len = server->pi.send_buff_put_offset + 2;
+  FTP_SERVER_PI_DEBUG(2, "Sending Control Data: %.*s",
+                      send_len - server->pi.send_buff_queued,
+                      server->pi.send_buffer + server->pi.send_buff_queued);
+
+#if FTP_SERVER_MULTIPLEX
+  // The multiplexer must not wait for a single client. What the socket does
+  // not take stays queued and is sent once the socket is writable again.
+  server->pi.send_buff_queued = send_len;
+  CLEAR_RESPONSE(server);
+  return _flush_status_msgs(server);
+#else
+  // Send the data
+  if (send(server->pi.conn, server->pi.send_buffer, send_len, 0) != send_len) {
+    FTP_SERVER_PI_DEBUG(1, "Failed to send Control Data.\n");
+    return -1;
+  }
+
+  // Clear the response buffer
+  CLEAR_RESPONSE(server);
+  return 0;
+#endif /* FTP_SERVER_MULTIPLEX */
+}
+
+#if FTP_SERVER_MULTIPLEX
+int _flush_status_msgs(ftp_server_t *server) {
+  int sock_sts;
+
+  if (server->pi.send_buff_queued == 0) return 0;
+
+  // Send as much as the socket takes without blocking
+  sock_sts = send(server->pi.conn, server->pi.send_buffer, server->pi.send_buff_queued, MSG_DONTWAIT);
+  if (sock_sts < 0) {
+    if (errno != EWOULDBLOCK) {
+      FTP_SERVER_PI_DEBUG(1, "Failed to send Control Data.\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  // Keep the rest at the front of the buffer
+  server->pi.send_buff_queued -= sock_sts;
+  memmove(server->pi.send_buffer, server->pi.send_buffer + sock_sts, server->pi.send_buff_queued);
+  CLEAR_RESPONSE(server);
+  return 0;
+}
+#endif /* FTP_SERVER_MULTIPLEX */
+
+int _receive_and_process_ctrl_msg(ftp_server_t *server, int blocking) {
+  unsigned char *recv_ptr = server->pi.recv_buffer + server->pi.recv_buff_length;
+  int recv_len;
+  int sts = 0;
+
+  // Commands held back behind a transfer may fill the buffer
+  if (PI_RECV_BUFF_FULL(server)) {
+    return _process_ctrl_msgs(server);
+  }
+
+  // Append to the data carried over from previous segments
+  recv_len = recv(server->pi.conn, recv_ptr, FTP_SERVER_RECV_BUF_LEN - 1 - server->pi.recv_buff_length, blocking ? 0 : MSG_DONTWAIT);
+  if (recv_len < 0) {
+    if (blocking || errno != EWOULDBLOCK) {
+      FTP_SERVER_PI_DEBUG(1, "Failed to read data.\n");
+      return -1;
+    } else {
+      sts = 0;
+    }
+  } else if (recv_len == 0) {
+    if (!blocking) {
+      FTP_SERVER_PI_DEBUG(1, "Connection closed by Client.\n");
+      return -1;
+    }
+  } else {
+    FTP_SERVER_PI_DEBUG(2, "Received Control Data: %.*s", recv_len, recv_ptr);
+
+    // Zero-terminate the receive buffer
+    server->pi.recv_buff_length += recv_len;
+    server->pi.recv_buffer[server->pi.recv_buff_length] = '\0';
+
+    // Correctly received data. Process all complete commands
+    sts = _process_ctrl_msgs(server);
+  }
+  return sts;
+}
+
+int _process_ctrl_msgs(ftp_server_t *server) {
+  char *buff = (char *) server->pi.recv_buffer;
+  char *line, *end;
+  unsigned int offset = 0;
+  unsigned int len;
+  cmd_t cmd;
+  int sts = 0;
+
+  // Queued replies hold back further commands, so only the replies of one
+  // command can pile up in the send buffer
+  while (sts >= 0 && offset < server->pi.recv_buff_length && server->pi.send_buff_queued == 0) {
+    line = buff + offset;
+    end = memchr(line, '\n', server->pi.recv_buff_length - offset);
+
+    // Wait for the rest of the command, unless it cannot fit the buffer
+    if (end == NULL) {
+      if (offset == 0 && PI_RECV_BUFF_FULL(server)) {
+        FTP_SERVER_PI_DEBUG(1, "Command too long.\n");
+        SET_RESPONSE(server, "500", "Syntax Error: Command too long.");
+        if (_send_status_msg(server) < 0) sts = -1;
+        server->pi.recv_buff_discard = 1;
+        offset = server->pi.recv_buff_length;
+      }
+      break;
+    }
+    len = end - line + 1;
+
+    // Drop the remainder of a command that did not fit the buffer
+    if (server->pi.recv_buff_discard) {
+      server->pi.recv_buff_discard = 0;
+      offset += len;
+      continue;
+    }
+
+    // Commands following a transfer wait for its completion, except
+    // those that may be sent during the transfer
+    if (server->pi.transfer_pending) {
+      cmd = _lookup_cmd(line, strcspn(line, " \r\n"));
+      if (cmd != CMD_ABOR && cmd != CMD_QUIT) break;
+    }
+    offset += len;
+
+    // Check the termination and remove CRLF
+    if (len < 2 || line[len - 2] != '\r') {
+      FTP_SERVER_PI_DEBUG(1, "Invalid Command Termination.\n");
+      SET_RESPONSE(server, "500", "Syntax Error: Invalid command termination.");
+    } else {
+      line[len - 2] = '\0';
+      sts = _process_ctrl_msg(server, line, len - 2);
+    }
+
+    // If processing set a response, send it
+    if (RESPONSE_SET(server)) {
+      if (_send_status_msg(server) < 0) {
+        sts = -1;
+      }
+    }
+  }
+
+  // Move the unprocessed data to the front
+  server->pi.recv_buff_length -= offset;
+  memmove(buff, buff + offset, server->pi.recv_buff_length);
+  buff[server->pi.recv_buff_length] = '\0';
+  return sts;
+}
+
+cmd_t _lookup_cmd(const char *name, unsigned int len) {
+  char upper[4];
+  uint32_t key = 0;
+  cmd_t cmd;
+
+  // All commands have three or four letters
+  if (len < 3 || len > 4) return NUM_CMD;
+
+  // Commands are case insensitive
+  for (unsigned int i = 0; i < len; i++) {
+    upper[i] = (name[i] >= 'a' && name[i] <= 'z') ? (name[i] - 'a' + 'A') : name[i];
+    key |= (uint32_t) (unsigned char) upper[i] << (8 * i);
+  }
+
+  // Unknown names may hash to a command as well
+  cmd = (cmd_t) cmd_hash_table[CMD_HASH(key)];
+  if (cmd >= NUM_CMD || cmd_str[cmd][len] != '\0' || strncmp(upper, cmd_str[cmd], len) != 0) {
+    return NUM_CMD;
+  }
+  return cmd;
+}
+
+#if !FTP_SERVER_MULTIPLEX
+int _check_dtp_response(ftp_server_t *server) {
+  ftp_server_dtp_to_pi_msg_t dtp_to_pi_msg;
+
+  // Check if the DTP sent a response
+  if (osMessageQueueGetCount(server->pi.dtp_to_pi_msg_queue) == 0) {
+    return 0;
+  }
+
+  // Retrieve the response
+  if (osMessageQueueGet(server->pi.dtp_to_pi_msg_queue, &dtp_to_pi_msg, 0, 0) != osOK) {
+    FTP_SERVER_PI_DEBUG(1, "Failed to get response from DTP.\n");
+    return -1;
+  }
+  return _handle_dtp_response(server, dtp_to_pi_msg.cmd_resp);
+}
+#endif /* !FTP_SERVER_MULTIPLEX */
+
+int _handle_dtp_response(ftp_server_t *server, ftp_server_dtp_command_response_t cmd_resp) {
+  int sts = 0;
+
+  FTP_SERVER_PI_DEBUG(2, "Received Response from DTP: %s.\n", dtp_cmd_resp_str[cmd_resp]);
+
+  // Any response except the acceptance completes the command
+  if (cmd_resp != FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED) {
+    server->pi.transfer_pending = 0;
+  }
+
+  // A rejected command no longer needs its path or restart offset
+  if (cmd_resp == FTP_SERVER_DTP_COMMAND_RESP_REJECTED) {
+    server->pi.path_buffer_used = 0;
+    server->pi.restart_offset = 0;
+  }
+
+  // Set response depending on DTP response
+  switch (cmd_resp) {
+    case FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED:
+      SET_RESPONSE(server, "150", "File status okay; about to open data connection.");
+      break;
+    case FTP_SERVER_DTP_COMMAND_RESP_REJECTED:
+      SET_RESPONSE(server, "450", "Requested file action not taken.");
+      break;
+    case FTP_SERVER_DTP_COMMAND_RESP_SUPERFLUOUS:
+    case FTP_SERVER_DTP_COMMAND_RESP_FINISHED:
+      SET_RESPONSE(server, "250", "Requested file action okay, completed.");
+      break;
+    case FTP_SERVER_DTP_COMMAND_RESP_EXITING_ERROR:
+      SET_RESPONSE(server, "451", "Requested action aborted: local error in processing.");
+      break;
+    default:
+      sts = -1;
+      break;
   }
 
   // Check if DTP was closed
-  switch (dtp_to_pi_msg.cmd_resp) {
+  switch (cmd_resp) {
     case FTP_SERVER_DTP_COMMAND_RESP_FINISHED:
     case FTP_SERVER_DTP_COMMAND_RESP_EXITING_ERROR:
       // Mark the thread as closed and clean up the connection
       server->pi.dtp_thread = NULL;
       _close_dtp_channel(server);
+#if FTP_SERVER_STATS
+      _stats_log(server, "Finished");
+#endif /* FTP_SERVER_STATS */
     break;
     default:
     break;
   }
 
   // If the response requires sending a response to the user, send it
-  if (server->pi.send_buff_put_offset != 0) {
+  if (RESPONSE_SET(server)) {
     if (_send_status_msg(server) < 0) {
       sts = -1;
     }
@@ -825,25 +2105,13 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
   char *ptr = buff;
   unsigned int incr;
   cmd_t cmd = NUM_CMD;
+  FTP_STATS_TIMESTAMP(cmd_start);
 
-  FTP_SERVER_PI_DEBUG(3, "Received Command: %s", buff);
+  FTP_SERVER_PI_DEBUG(3, "Received Command: %s\n", buff);
   CLEAR_RESPONSE(server);
 
-  // Check buffer termination
-  if (len < 2 || !(ptr[len-2] == '\r' && ptr[len-1] == '\n')) {
-    // Unknown Command
-    FTP_SERVER_PI_DEBUG(1, "Invalid Command Termination:%s", buff);
-    SET_RESPONSE(server, "500", "Syntax Error: Command too long or invalid termination.");
-    return 0;
-  }
-  // remove CRLN
-  ptr[len-2] = '\0';
-  len -= 2;
-
   // Find the command
-  for (cmd = 0; cmd < NUM_CMD; cmd++) {
-    if (strncmp(ptr, cmd_str[cmd], strlen(cmd_str[cmd])) == 0) break;
-  }
+  cmd = _lookup_cmd(ptr, strcspn(ptr, " "));
 
   // Check if command is valid
   if (cmd >= NUM_CMD) {
@@ -872,6 +2140,11 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
   if (num_args > MAX_NUM_PI_ARGS) num_args = MAX_NUM_PI_ARGS;
   // Extract all arguments
   for (i = 0; i < num_args; i++) {
+    // Skip the spaces separating the arguments
+    while (i > 0 && *ptr == ' ' && len > 0) {
+      ptr++;
+      len--;
+    }
     arglens[i] = strcspn(ptr, " \0");
     if (arglens[i] == 0) {
       args[i] = NULL;
@@ -984,7 +2257,7 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
       _execute_fs_command(server, FTP_SERVER_DTP_COMMAND_APPE, args[0], arglens[0]);
       break;
     case CMD_REST:
-      _execute_fs_command(server, FTP_SERVER_DTP_COMMAND_REST, args[0], arglens[0]);
+      _set_restart_offset(server, args[0], arglens[0]);
       break;
     case CMD_RNFR:
       if (server->pi.path_buffer_used) {
@@ -999,6 +2272,7 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
     case CMD_RNTO:
       if (server->pi.prev_cmd == CMD_RNFR) {
         if (f_rename(server->pi.path_buffer, args[0]) == FR_OK) {
+          _list_cache_invalidate();
           SET_RESPONSE(server, "250", "Requested file action okay, completed.");
         } else {
           SET_RESPONSE(server, "553", "File name not allowed.");
@@ -1013,6 +2287,7 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
       break;
     case CMD_DELE:
       if (f_unlink(args[0]) == FR_OK) {
+        _list_cache_invalidate();
         SET_RESPONSE(server, "250", "Requested file action okay, completed.");
       } else {
         SET_RESPONSE(server, "550", "Request action not taken");
@@ -1020,6 +2295,7 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
       break;
     case CMD_RMD:
       if (f_rmdir(args[0]) == FR_OK) {
+        _list_cache_invalidate();
         SET_RESPONSE(server, "250", "Requested file action okay, completed.");
       } else {
         SET_RESPONSE(server, "550", "Request action not taken");
@@ -1027,6 +2303,7 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
       break;
     case CMD_MKD:
       if (f_mkdir(args[0]) == FR_OK) {
+        _list_cache_invalidate();
         SET_RESPONSE(server, "250", "Requested file action okay, completed.");
       } else {
         SET_RESPONSE(server, "550", "Request action not taken");
@@ -1052,7 +2329,7 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
       _execute_fs_command(server, FTP_SERVER_DTP_COMMAND_NLST, args[0], arglens[0]);
       break;
     case CMD_SITE:
-      SET_RESPONSE(server, "202", "Command not implemented.");
+      _site_command(server, args[0], arglens[0]);
       break;
     case CMD_SYST:
       SET_RESPONSE(server, "215", "ELF system type.");
@@ -1067,6 +2344,15 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
     case CMD_NOOP:
       SET_RESPONSE(server, "200", "Command okay.");
       break;
+    case CMD_FEAT:
+      _get_features(server);
+      break;
+    case CMD_MLSD:
+      _execute_fs_command(server, FTP_SERVER_DTP_COMMAND_MLSD, args[0], arglens[0]);
+      break;
+    case CMD_MLST:
+      _get_mlst(server, args[0]);
+      break;
     default:
       FTP_SERVER_PI_DEBUG(1, "Client requested unimplemented command: %s.\n", cmd_str[cmd]);
       SET_RESPONSE(server, "502", "Command not implemented.");
@@ -1077,7 +2363,14 @@ int _process_ctrl_msg(ftp_server_t *server, char *buff, int len) {
   if (server->pi.prev_cmd == CMD_RNFR) {
     server->pi.path_buffer_used = 0;
   }
+  // The restart offset only applies to the command directly following REST
+  if (cmd != CMD_REST) {
+    server->pi.restart_offset = 0;
+  }
   server->pi.prev_cmd = cmd;
+#if FTP_SERVER_STATS
+  _stats_command(server, cmd, cmd_start);
+#endif /* FTP_SERVER_STATS */
   return 0;
 }
 
@@ -1195,8 +2488,9 @@ void _check_login_credentials(ftp_server_t *server, login_info_type type, const
 }
 
 void _set_type(ftp_server_t *server, int num_args, char *args[], unsigned int arglens[]) {
-  representation_type_t type;
-  representation_subtype_t subtype;
+  representation_type_t type = REP_TYPE_ASCII;
+  // Non-print is the default format of ASCII and EBCDIC
+  representation_subtype_t subtype = REP_SUBTYPE_NON_PRINT;
   int syntax_error = 0;
   int parameter_error = 0;
   int not_supported = 0;
@@ -1223,9 +2517,11 @@ void _set_type(ftp_server_t *server, int num_args, char *args[], unsigned int ar
       default:
         parameter_error = 1;
     }
-    if (type == REP_TYPE_ASCII || type == REP_TYPE_EBCDIC) {
-      if (num_args == 2) {
-        if (arglens[0] != 1){
+    if (parameter_error) {
+      // Unknown type, its remaining arguments are meaningless
+    } else if (type == REP_TYPE_ASCII || type == REP_TYPE_EBCDIC) {
+      if (args[1] != NULL) {
+        if (arglens[1] != 1){
           syntax_error = 1;
         } else {
           switch (*args[1]) {
@@ -1240,12 +2536,13 @@ void _set_type(ftp_server_t *server, int num_args, char *args[], unsigned int ar
               subtype = REP_SUBTYPE_CARRIAGE_CONTROL;
               not_supported = 1;
               break;
+            default:
+              parameter_error = 1;
           }
         }
       }
-    }
-    if (type == REP_TYPE_LOCAL_BYTE) {
-      if (num_args != 2) {
+    } else if (type == REP_TYPE_LOCAL_BYTE) {
+      if (args[1] == NULL) {
         syntax_error = 1;
       } else {
         num_bits = atoi(args[1]);
@@ -1312,17 +2609,21 @@ void _set_transfer_mode(ftp_server_t *server, int num_args, char *args[], unsign
     syntax_error = 1;
   } else {
     switch (*args[0]) {
-      case 'F':
+      case 'S':
         mode = TRANSFER_MODE_STREAM;
         break;
-      case 'R':
+      case 'B':
         mode = TRANSFER_MODE_BLOCK;
         not_supported = 1;
         break;
-      case 'P':
+      case 'C':
         mode = TRANSFER_MODE_COMPRESSED;
         not_supported = 1;
         break;
+      case 'Z':
+        mode = TRANSFER_MODE_DEFLATE;
+        not_supported = !FTP_SERVER_MODE_Z;
+        break;
       default:
         parameter_error = 1;
     }
@@ -1343,7 +2644,7 @@ void _set_passive(ftp_server_t *server) {
   char buff[26];
   unsigned char ip[4];
   unsigned char port[2];
-  unsigned long len;
+  socklen_t len;
 
   // Check if socket already is in passive mode
   if (server->dtp_settings.mode != DTP_MODE_PASSIVE) {
@@ -1382,11 +2683,12 @@ void _set_passive(ftp_server_t *server) {
 
     // Update DTP mode
     server->dtp_settings.mode = DTP_MODE_PASSIVE;
+  }
 
-    // Close the DTP thread if one is alreay open
-    if (server->pi.dtp_thread != NULL) {
-      _close_dtp_channel(server);
-    }
+  // Close the DTP thread if one is alreay open. The client connects anew after
+  // every PASV, while the open DTP may hold the connection of a refused command.
+  if (server->pi.dtp_thread != NULL) {
+    _close_dtp_channel(server);
   }
 
   // Create the DTP thread so the client can connect to it
@@ -1434,15 +2736,99 @@ void _set_data_port(ftp_server_t *server, char *arg, unsigned int arglen) {
   server->dtp_settings.client_address.sin_family = AF_INET;
   server->dtp_settings.client_address.sin_port = (port[1] << 8) | port[0];
   server->dtp_settings.client_address.sin_addr.s_addr = (ip[3] << 24) | (ip[2] << 16) | (ip[1] << 8) | ip[0];
+
+  // The open DTP is connected to the previous data port, or waits for the client in passive mode
+  if (server->pi.dtp_thread != NULL) {
+    _close_dtp_channel(server);
+  }
+  if (server->dtp_settings.mode == DTP_MODE_PASSIVE) {
+    close(server->dtp_settings.passive_sd);
+  }
   server->dtp_settings.mode = DTP_MODE_ACTIVE;
   SET_RESPONSE(server, "200", "Command successful.");
   FTP_SERVER_PI_DEBUG(1, "Set client data port to :%u\n", server->dtp_settings.client_address.sin_port);
 }
 
+void _set_restart_offset(ftp_server_t *server, char *arg, unsigned int arglen) {
+  FSIZE_t offset = 0;
+  // Large enough for the decimal digits of any unsigned long
+  char offset_str[21];
+
+  // Parse the decimal offset
+  for (unsigned int i = 0; i < arglen; i++) {
+    if (arg[i] < '0' || arg[i] > '9' || offset > (((FSIZE_t) -1) - 9) / 10) {
+      SET_RESPONSE(server, "501", "Invalid restart offset.");
+      return;
+    }
+    offset = offset * 10 + (arg[i] - '0');
+  }
+  server->pi.restart_offset = offset;
+
+  snprintf(offset_str, sizeof(offset_str), "%lu", (unsigned long) offset);
+  SET_RESPONSE(server, "350", "Restarting at ");
+  APPEND_RESPONSE_DATA(server, offset_str);
+  APPEND_RESPONSE_MSG(server, ". Send STORE or RETRIEVE.");
+}
+
 void _get_stat(ftp_server_t *server, char *path, unsigned int arglen) {
   SET_RESPONSE(server, "502", "Command not implemented.");
 }
 
+void _site_command(ftp_server_t *server, char *arg, unsigned int arglen) {
+#if FTP_SERVER_STATS
+  if (arglen == 5 && strncmp(arg, "STATS", arglen) == 0) {
+    _get_stats(server);
+    return;
+  }
+#endif /* FTP_SERVER_STATS */
+  SET_RESPONSE(server, "202", "Command not implemented.");
+}
+
+void _get_features(ftp_server_t *server) {
+  SET_RESPONSE(server, "211", "");
+  SET_RESPONSE_MULTILINE(server);
+  APPEND_RESPONSE_DATA(server, "Features:\r\n"
+                               " MLST type*;size*;modify*;perm*;\r\n");
+#if FTP_SERVER_MODE_Z
+  APPEND_RESPONSE_DATA(server, " MODE Z\r\n");
+#endif /* FTP_SERVER_MODE_Z */
+  APPEND_RESPONSE_DATA(server, " REST STREAM\r\n"
+                               "211 End");
+}
+
+void _get_mlst(ftp_server_t *server, char *path) {
+  FILINFO info;
+  FRESULT fres;
+
+  // Without an argument, the current directory is listed
+  if (path == NULL) {
+    path = ".";
+  }
+
+  // The origin directory has no entry and is reported as invalid name. Any
+  // other path FatFS cannot stat does not exist.
+  fres = f_stat(path, &info);
+  if (fres != FR_OK && (fres != FR_INVALID_NAME || (strcmp(path, "/") != 0 && strcmp(path, ".") != 0))) {
+    SET_RESPONSE(server, "550", "File/Path not found.");
+    return;
+  }
+
+  // Single entry on the control connection, prefixed by a space
+  SET_RESPONSE(server, "250", "");
+  SET_RESPONSE_MULTILINE(server);
+  APPEND_RESPONSE_DATA(server, "Listing\r\n ");
+  if (fres == FR_OK) {
+    server->pi.send_buff_put_offset += _mlsx_facts(server->pi.send_buffer + server->pi.send_buff_put_offset,
+                                                   &info,
+                                                   FTP_SERVER_SEND_BUF_LEN - server->pi.send_buff_put_offset - 2);
+  } else {
+    APPEND_RESPONSE_DATA(server, "type=dir;");
+  }
+  APPEND_RESPONSE_DATA(server, " ");
+  APPEND_RESPONSE_DATA(server, path);
+  APPEND_RESPONSE_DATA(server, "\r\n250 End");
+}
+
 void _execute_fs_command(ftp_server_t *server, ftp_server_dtp_command_t fs_cmd, char *path, unsigned int arglen) {
 
   // check arguments
@@ -1450,18 +2836,31 @@ void _execute_fs_command(ftp_server_t *server, ftp_server_dtp_command_t fs_cmd,
 
   // Required vaiables
   int path_exists = 0;
+  FSIZE_t file_size = 0;
+  FILINFO info;
   ftp_server_pi_to_dtp_msg_t pi_to_dtp_msg;
 
   // Check if the path exists
   if (path != NULL) {
-    if (f_stat(path, NULL) == FR_OK || strncmp(path, "/", arglen) == 0) {
+    if (f_stat(path, &info) == FR_OK) {
+      path_exists = 1;
+      file_size = info.fsize;
+    } else if (strncmp(path, "/", arglen) == 0) {
       path_exists = 1;
     }
+#if FTP_SERVER_LIVE_FILES
+    if (fs_cmd == FTP_SERVER_DTP_COMMAND_RETR && _live_file_find(path) != NULL) {
+      path_exists = 1;
+      // Live files are streamed from their current position regardless of the restart offset
+      file_size = (FSIZE_t) -1;
+    }
+#endif /* FTP_SERVER_LIVE_FILES */
   }
 
   // Test if the command requires the file/path to exist
   switch (fs_cmd) {
     case FTP_SERVER_DTP_COMMAND_LIST:
+    case FTP_SERVER_DTP_COMMAND_MLSD:
       if (path == NULL) {
         break;
       }
@@ -1478,9 +2877,21 @@ void _execute_fs_command(ftp_server_t *server, ftp_server_dtp_command_t fs_cmd,
       break;
   }
 
+  // Resuming beyond the end of the file would leave a gap
+  if ((fs_cmd == FTP_SERVER_DTP_COMMAND_RETR || fs_cmd == FTP_SERVER_DTP_COMMAND_STOR) &&
+      server->pi.restart_offset > 0) {
+    if (!path_exists || server->pi.restart_offset > file_size) {
+      FTP_SERVER_PI_DEBUG(2, "Cannot execute FS Command: Restart offset beyond the end of '%s'.\n", path);
+      SET_RESPONSE(server, "554", "Requested action not taken: invalid REST parameter.");
+      return;
+    }
+  }
+
   // Prepare the command to the DTP channel
   pi_to_dtp_msg.command = fs_cmd;
   pi_to_dtp_msg.filename_buff = NULL;
+  pi_to_dtp_msg.offset = server->pi.restart_offset;
+  pi_to_dtp_msg.transfer_mode = server->dtp_settings.transfer_mode;
 
   // If a path was specified, copy the path
   if (path != NULL) {
@@ -1503,8 +2914,10 @@ void _execute_fs_command(ftp_server_t *server, ftp_server_dtp_command_t fs_cmd,
     }
   }
 
-  // Send the command
-  if (osMessageQueuePut(server->pi.pi_to_dtp_msg_queue, &pi_to_dtp_msg, 0, FTP_SERVER_DEFAULT_TIMEOUT) != osOK) {
+  // Send the command to the DTP. Further commands wait until it finished.
+  server->pi.transfer_pending = 1;
+  if (_send_dtp_command(server, &pi_to_dtp_msg) < 0) {
+    server->pi.transfer_pending = 0;
     FTP_SERVER_PI_DEBUG(1, "Could not send message to DTP.\n");
     SET_RESPONSE(server, "451", "Requested action aborted: local error in processing.");
     return;
@@ -1517,13 +2930,13 @@ void _execute_fs_command(ftp_server_t *server, ftp_server_dtp_command_t fs_cmd,
   }
 }
 
+#if !FTP_SERVER_MULTIPLEX
 int _open_dtp_channel(ftp_server_t *server) {
   // Check arguments
   if (server == NULL) return -1;
 
-  // Arguments used for DTP thread creation
-  osThreadAttr_t dtp_thread_attributes;
-  char dtp_thread_name[FTP_MAX_THREAD_NAME_LENGTH];
+  // Arguments used to start the DTP
+  ftp_server_dtp_worker_t *worker = &_dtp_workers[server->pi.pi_index];
   server_dtp_args_t dtp_args;
 
   // Check if server is already open
@@ -1532,32 +2945,33 @@ int _open_dtp_channel(ftp_server_t *server) {
     return 0;
   }
 
-  // Create Message Queues between PI and DTP threads
-  server->pi.pi_to_dtp_msg_queue = osMessageQueueNew(1, sizeof(ftp_server_pi_to_dtp_msg_t), NULL);
-  server->pi.dtp_to_pi_msg_queue = osMessageQueueNew(1, sizeof(ftp_server_dtp_to_pi_msg_t), NULL);
-
-  // Initialize DTP attributes
-  memset(&dtp_thread_attributes, 0x00, sizeof(dtp_thread_attributes));
-  dtp_thread_attributes.name = dtp_thread_name;
-  dtp_thread_attributes.stack_size = FTP_SERVER_DTP_THREAD_STACKSIZE;
+  // A DTP that did not exit in time still occupies the worker
+  if (worker->abandoned) {
+    FTP_SERVER_PI_DEBUG(1, "Cannot open DTP channel: previous DTP did not exit yet.\n");
+    return -1;
+  }
+  worker->stop = 0;
 
-  // Set DTP thread name
-  snprintf(dtp_thread_name, sizeof(dtp_thread_name), "FTP_S_%03u_DTP", server->pi.pi_index);
+  // Make sure no message of a previous DTP is left in the queues
+  osMessageQueueReset(server->pi.pi_to_dtp_msg_queue);
+  osMessageQueueReset(server->pi.dtp_to_pi_msg_queue);
 
-  // Set up the DTP arguments
+  // Set up the DTP arguments. The DTP publishes its wake address once it is ready.
+  memset(&server->pi.dtp_wake_address, 0x00, sizeof(server->pi.dtp_wake_address));
+  dtp_args.pi_index = server->pi.pi_index;
   dtp_args.settings = &server->dtp_settings;
   dtp_args.pi_to_dtp_msg_queue = server->pi.pi_to_dtp_msg_queue;
   dtp_args.dtp_to_pi_msg_queue = server->pi.dtp_to_pi_msg_queue;
+  dtp_args.pi_wake_address = server->pi.wake_address;
+  dtp_args.dtp_wake_address = &server->pi.dtp_wake_address;
 
-  // Create the DTP task
-  server->pi.dtp_thread = osThreadNew(_ftp_server_dtp_thread, (void*) &dtp_args, &dtp_thread_attributes);
-
-  if (server->pi.dtp_thread == NULL) {
-    FTP_SERVER_PI_DEBUG(1, "Failed to create new FTP DTP thread.\n");
+  // Start the DTP worker
+  if (osMessageQueuePut(worker->start_queue, &dtp_args, 0, 0) != osOK) {
+    FTP_SERVER_PI_DEBUG(1, "Failed to start FTP DTP worker.\n");
     return -1;
-  } else {
-    FTP_SERVER_PI_DEBUG(2, "Created new FTP DTP thread.\n");
   }
+  server->pi.dtp_thread = worker->thread;
+  FTP_SERVER_PI_DEBUG(2, "Started FTP DTP worker.\n");
 
   return 0;
 }
@@ -1566,72 +2980,221 @@ int _close_dtp_channel(ftp_server_t *server) {
   // Check Arguments
   if (server == NULL) return -1;
 
-  ftp_server_dtp_to_pi_msg_t dtp_to_pi_msg;
+  ftp_server_dtp_worker_t *worker = &_dtp_workers[server->pi.pi_index];
   ftp_server_pi_to_dtp_msg_t pi_to_dtp_msg;
   int stat = 0;
-  int exited = 0;
-  int exit_tries = 2;
+  int conn;
 
   // Check if a DTP channel is open
   if (server->pi.dtp_thread != NULL) {
     // Make sure the Message Queue to the DTP is clear
     osMessageQueueReset(server->pi.pi_to_dtp_msg_queue);
 
-    // Send a CLOSE command to the DTP
+    // Send a CLOSE command to the DTP. A DTP still waiting for its connection only sees the stop flag.
+    worker->stop = 1;
     pi_to_dtp_msg.command = FTP_SERVER_DTP_COMMAND_CLOSE;
     if (osMessageQueuePut(server->pi.pi_to_dtp_msg_queue, &pi_to_dtp_msg, 0, 0) != osOK) {
       FTP_SERVER_PI_DEBUG(1, "Could not send message to close DTP.\n");
       stat = -1;
     }
-
-    // Wait for the DTP to send a response. Try twice in case an old item was left in the queue
-    do {
-      if (osMessageQueueGet(server->pi.dtp_to_pi_msg_queue, &dtp_to_pi_msg, NULL, FTP_SERVER_DEFAULT_TIMEOUT) != osOK) {
+    _wake_socket_signal(server->pi.wake_sd, &server->pi.dtp_wake_address);
+
+    // The DTP sees the command after its select() timeout at the latest, even if the wake-up got lost
+    if (!_wait_for_dtp_exit(server, FTP_SERVER_SELECT_TIMEOUT + FTP_SERVER_DEFAULT_TIMEOUT)) {
+      // Abort the transfer in progress and wake the DTP once more
+      FTP_SERVER_PI_DEBUG(1, "DTP did not exit, shutting down its connection.\n");
+      conn = worker->conn;
+      if (conn >= 0) shutdown(conn, SHUT_RDWR);
+      _wake_socket_signal(server->pi.wake_sd, &server->pi.dtp_wake_address);
+
+      if (!_wait_for_dtp_exit(server, FTP_SERVER_SELECT_TIMEOUT + FTP_SERVER_DEFAULT_TIMEOUT)) {
+        // Never terminate a thread that may be inside lwIP. The worker is
+        // reused once the DTP returned.
+        FTP_SERVER_PI_DEBUG(1, "DTP did not exit, abandoning the worker.\n");
+        worker->abandoned = 1;
         stat = -1;
       }
-      if (dtp_to_pi_msg.cmd_resp == FTP_SERVER_DTP_COMMAND_RESP_EXITING_ERROR ||
-          dtp_to_pi_msg.cmd_resp == FTP_SERVER_DTP_COMMAND_RESP_FINISHED) {
-        exited = 1;
-      }
-    } while (stat >= 0 && --exit_tries > 0 && !exited);
-
-    if (!exited) {
-      // If it has not exited yet, kill the thread. The socket will be closed by timeout.
-      FTP_SERVER_PI_DEBUG(1, "DTP Thread did not exit, terminating thread.\n");
-      osThreadTerminate(server->pi.dtp_thread);
     }
 
     // delete the reference to the DTP
     server->pi.dtp_thread = NULL;
   }
 
-  // Cleanup Message Queues
-  if (server->pi.dtp_to_pi_msg_queue != NULL) {
-    if (osMessageQueueDelete(server->pi.dtp_to_pi_msg_queue) != osOK) {
-      FTP_SERVER_PI_DEBUG(1, "Failed to delete message queues.\n");
-      stat = -1;
-    }
-    server->pi.dtp_to_pi_msg_queue = NULL;
-  }
-
-  if (server->pi.pi_to_dtp_msg_queue != NULL) {
-    if (osMessageQueueDelete(server->pi.pi_to_dtp_msg_queue) != osOK) {
-      FTP_SERVER_PI_DEBUG(1, "Failed to delete message queues.\n");
-      stat = -1;
-    }
-    server->pi.pi_to_dtp_msg_queue = NULL;
+  // A terminated DTP could not deregister itself
+#if FTP_SERVER_DTP_USE_FORWARD
+  _dtp_forward_channels[server->pi.pi_index] = NULL;
+#endif /* FTP_SERVER_DTP_USE_FORWARD */
+#if FTP_SERVER_MODE_Z
+  _zlib_stream_release(server->pi.pi_index);
+#endif /* FTP_SERVER_MODE_Z */
+
+  // Clear the Message Queues for the next DTP
+  if (osMessageQueueReset(server->pi.dtp_to_pi_msg_queue) != osOK ||
+      osMessageQueueReset(server->pi.pi_to_dtp_msg_queue) != osOK) {
+    FTP_SERVER_PI_DEBUG(1, "Failed to reset message queues.\n");
+    stat = -1;
   }
 
   // Misc cleanup
   server->pi.path_buffer_used = 0;
+  server->pi.transfer_pending = 0;
+  memset(&server->pi.dtp_wake_address, 0x00, sizeof(server->pi.dtp_wake_address));
   FTP_SERVER_PI_DEBUG(1, "Closed DTP.\n");
 
   return stat;
 }
 
+int _wait_for_dtp_exit(ftp_server_t *server, uint32_t timeout) {
+  ftp_server_dtp_to_pi_msg_t dtp_to_pi_msg;
+  uint32_t start = osKernelGetTickCount();
+  uint32_t elapsed;
+
+  // Skip the responses to earlier commands that were left in the queue
+  while ((elapsed = osKernelGetTickCount() - start) < timeout) {
+    if (osMessageQueueGet(server->pi.dtp_to_pi_msg_queue, &dtp_to_pi_msg, NULL, timeout - elapsed) != osOK) {
+      break;
+    }
+    if (dtp_to_pi_msg.cmd_resp == FTP_SERVER_DTP_COMMAND_RESP_EXITING_ERROR ||
+        dtp_to_pi_msg.cmd_resp == FTP_SERVER_DTP_COMMAND_RESP_FINISHED) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int _send_dtp_command(ftp_server_t *server, const ftp_server_pi_to_dtp_msg_t *msg) {
+  // Send the command and wake the DTP
+  if (osMessageQueuePut(server->pi.pi_to_dtp_msg_queue, msg, 0, FTP_SERVER_DEFAULT_TIMEOUT) != osOK) {
+    return -1;
+  }
+  _wake_socket_signal(server->pi.wake_sd, &server->pi.dtp_wake_address);
+  return 0;
+}
+#endif /* !FTP_SERVER_MULTIPLEX */
+
+void _dtp_init(ftp_server_dtp_channel_t *dtp,
+               unsigned int pi_index,
+               const ftp_server_dtp_settings_t *settings,
+               char (*buffers)[FTP_SERVER_DTP_BUFFER_LEN])
+{
+  memcpy(&dtp->settings, settings, sizeof(ftp_server_dtp_settings_t));
+  dtp->pi_index = pi_index;
+  dtp->conn = -1;
+  dtp->active_cmd = FTP_SERVER_DTP_COMMAND_NONE;
+  dtp->finish_pending = 0;
+  dtp->list_cache_entry = NULL;
+  dtp->list_cache_hit = 0;
+#if FTP_SERVER_LIVE_FILES
+  dtp->live_file = NULL;
+#endif /* FTP_SERVER_LIVE_FILES */
+  dtp->thread = osThreadGetId();
+  dtp->forwarding = 0;
+  dtp->forward_error = 0;
+#if FTP_SERVER_MODE_Z
+  dtp->zlib = NULL;
+#endif /* FTP_SERVER_MODE_Z */
+  for (unsigned int i = 0; i < FTP_SERVER_DTP_NUM_BUFFERS; i++) {
+    dtp->buffers[i].data = buffers[i];
+  }
+  _dtp_reset_buffers(dtp);
+#if FTP_SERVER_DTP_USE_FORWARD
+  _dtp_forward_channels[pi_index] = dtp;
+#endif /* FTP_SERVER_DTP_USE_FORWARD */
+}
+
+int _dtp_connected(ftp_server_dtp_channel_t *dtp) {
+  if (_dtp_set_transfer_mode(dtp, dtp->settings.transfer_mode) < 0) {
+    return -1;
+  }
+
+  FTP_SERVER_DTP_DEBUG(1, "Initialized DTP.\n");
+  return 0;
+}
+
+int _dtp_set_transfer_mode(ftp_server_dtp_channel_t *dtp, transfer_mode_t mode) {
+  dtp->settings.transfer_mode = mode;
+#if FTP_SERVER_MODE_Z
+  // A compressed transfer holds a zlib stream until the DTP exits or leaves MODE Z
+  if (mode == TRANSFER_MODE_DEFLATE && dtp->zlib == NULL) {
+    dtp->zlib = _zlib_stream_claim(dtp->pi_index);
+    if (dtp->zlib == NULL) {
+      FTP_SERVER_DTP_DEBUG(1, "No zlib stream available for MODE Z.\n");
+      return -1;
+    }
+  } else if (mode != TRANSFER_MODE_DEFLATE && dtp->zlib != NULL) {
+    _zlib_stream_release(dtp->pi_index);
+    dtp->zlib = NULL;
+  }
+#endif /* FTP_SERVER_MODE_Z */
+  return 0;
+}
+
+void _dtp_cleanup(ftp_server_dtp_channel_t *dtp) {
+  // Make sure to close files/folders in case they are open
+  f_close(&dtp->current_file);
+  f_closedir(&dtp->current_dir);
+  _dtp_list_cache_close(dtp, 0);
+#if FTP_SERVER_LIVE_FILES
+  _dtp_live_file_detach(dtp);
+#endif /* FTP_SERVER_LIVE_FILES */
+
+#if FTP_SERVER_STATS
+  _dtp_stats_end(dtp);
+#endif /* FTP_SERVER_STATS */
+#if FTP_SERVER_MODE_Z
+  _zlib_stream_release(dtp->pi_index);
+#endif /* FTP_SERVER_MODE_Z */
+
+  // An interrupted upload may have left a listing with an intermediate file size
+  if (dtp->active_cmd == FTP_SERVER_DTP_COMMAND_STOR || dtp->active_cmd == FTP_SERVER_DTP_COMMAND_APPE) {
+    _list_cache_invalidate();
+  }
+
+  // Deregister the channel, as it may live on the stack of the DTP
+#if FTP_SERVER_DTP_USE_FORWARD
+  _dtp_forward_channels[dtp->pi_index] = NULL;
+#endif /* FTP_SERVER_DTP_USE_FORWARD */
+}
+
+void _dtp_get_wait(ftp_server_dtp_channel_t *dtp, int *read_sd, int *write_sd, uint32_t *timeout) {
+  // Only wait for the socket if the transfer cannot progress without it
+  *read_sd = -1;
+  *write_sd = -1;
+  switch (dtp->active_cmd) {
+    case FTP_SERVER_DTP_COMMAND_NONE:
+      break;
+    case FTP_SERVER_DTP_COMMAND_STOR:
+    case FTP_SERVER_DTP_COMMAND_APPE:
+      if (_dtp_fill_buffer(dtp) != NULL) *read_sd = dtp->conn;
+      break;
+    default:
+      *write_sd = dtp->conn;
+      break;
+  }
+  *timeout = FTP_SERVER_SELECT_TIMEOUT;
+#if FTP_SERVER_LIVE_FILES
+  // A live file is copied into the buffers without waiting, and sent from them.
+  // Without data to send, the DTP thread waits for the flag set by the MRRB.
+  if (dtp->live_file != NULL) {
+    ftp_live_file_t *file = dtp->live_file;
+    if (dtp->num_ready == 0) {
+      *write_sd = -1;
+    }
+    if (file->abort || (file->pending && _dtp_fill_buffer(dtp) != NULL)) {
+      *write_sd = -1;
+      *timeout = 0;
+    } else {
+      *timeout = FTP_SERVER_LIVE_POLL_INTERVAL;
+    }
+  }
+#endif /* FTP_SERVER_LIVE_FILES */
+}
+
 int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
                          ftp_server_dtp_command_t dtp_cmd,
                          char *args,
+                         FSIZE_t offset,
+                         transfer_mode_t transfer_mode,
                          ftp_server_dtp_to_pi_msg_t *resp)
 {
   // check parameters
@@ -1653,6 +3216,22 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
   }
   FTP_SERVER_DTP_DEBUG(2, "Active command is %s.\n", dtp_cmd_str[dtp->active_cmd]);
 
+  // Transfers use the MODE at the time of the command, not when the DTP was started
+  switch (dtp_cmd) {
+    case FTP_SERVER_DTP_COMMAND_RETR:
+    case FTP_SERVER_DTP_COMMAND_STOR:
+    case FTP_SERVER_DTP_COMMAND_APPE:
+    case FTP_SERVER_DTP_COMMAND_LIST:
+    case FTP_SERVER_DTP_COMMAND_NLST:
+    case FTP_SERVER_DTP_COMMAND_MLSD:
+      if (dtp->active_cmd == FTP_SERVER_DTP_COMMAND_NONE && _dtp_set_transfer_mode(dtp, transfer_mode) < 0) {
+        return 0;
+      }
+      break;
+    default:
+      break;
+  }
+
   // Take action depending on command
   switch (dtp_cmd) {
     case FTP_SERVER_DTP_COMMAND_NONE:
@@ -1663,12 +3242,28 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
       if (dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
         resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
       } else {
-        // Attempt to read the file
-        if (f_open(&dtp->current_file, args, FA_READ) == FR_OK) {
+#if FTP_SERVER_LIVE_FILES
+        // Attach to a live file instead of opening a file. Live files are only
+        // streamed uncompressed, as the compressor would hold back the latest data.
+        if (_live_file_find(args) != NULL) {
+          if (!FTP_DTP_COMPRESSED(dtp) && _dtp_live_file_attach(dtp, args) == 0) {
+            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
+            dtp->active_cmd = dtp_cmd;
+          } else {
+            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+          }
+          break;
+        }
+#endif /* FTP_SERVER_LIVE_FILES */
+        // Attempt to read the file from the restart offset
+        if (f_open(&dtp->current_file, args, FA_READ) != FR_OK) {
+          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+        } else if (_dtp_seek_file(dtp, offset, 1) < 0) {
+          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+          f_close(&dtp->current_file);
+        } else {
           resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
           dtp->active_cmd = dtp_cmd;
-        } else {
-          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
         }
       }
       break;
@@ -1677,12 +3272,25 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
       if (dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
         resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
       } else {
-        // Attempt to read the file
-        if (f_open(&dtp->current_file, args, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK) {
-          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
-          dtp->active_cmd = dtp_cmd;
+        if (offset == 0) {
+          // Attempt to create the file
+          if (f_open(&dtp->current_file, args, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK) {
+            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
+            dtp->active_cmd = dtp_cmd;
+          } else {
+            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+          }
         } else {
-          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+          // Resume the file in place and drop everything after the restart offset
+          if (f_open(&dtp->current_file, args, FA_OPEN_EXISTING | FA_WRITE) != FR_OK) {
+            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+          } else if (_dtp_seek_file(dtp, offset, 0) < 0 || f_truncate(&dtp->current_file) != FR_OK) {
+            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+            f_close(&dtp->current_file);
+          } else {
+            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
+            dtp->active_cmd = dtp_cmd;
+          }
         }
       }
       break;
@@ -1700,26 +3308,6 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
         }
       }
       break;
-    case FTP_SERVER_DTP_COMMAND_REST:
-      // Check if command is allowed
-      switch (dtp->active_cmd) {
-        case FTP_SERVER_DTP_COMMAND_RETR:
-        case FTP_SERVER_DTP_COMMAND_STOR:
-        case FTP_SERVER_DTP_COMMAND_APPE:
-          if (f_lseek(&dtp->current_file, atoi(args)) == FR_OK) {
-            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
-          } else {
-            resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
-          }
-          break;
-        case FTP_SERVER_DTP_COMMAND_LIST:
-        case FTP_SERVER_DTP_COMMAND_NLST:
-          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
-          break;
-        default:
-          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_SUPERFLUOUS;
-      }
-      break;
     case FTP_SERVER_DTP_COMMAND_ABOR:
       switch (dtp->active_cmd) {
         case FTP_SERVER_DTP_COMMAND_RETR:
@@ -1727,10 +3315,15 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
         case FTP_SERVER_DTP_COMMAND_APPE:
           f_close(&dtp->current_file);
           f_closedir(&dtp->current_dir);
+#if FTP_SERVER_LIVE_FILES
+          _dtp_live_file_detach(dtp);
+#endif /* FTP_SERVER_LIVE_FILES */
           resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
           break;
         case FTP_SERVER_DTP_COMMAND_LIST:
         case FTP_SERVER_DTP_COMMAND_NLST:
+        case FTP_SERVER_DTP_COMMAND_MLSD:
+          _dtp_list_cache_close(dtp, 0);
           resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
           break;
         default:
@@ -1748,11 +3341,13 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
       if (fres == FR_OK || fres == FR_INVALID_NAME) {
         // Check if file or directory
         if (fres == FR_INVALID_NAME || dtp->current_info.fattrib & AM_DIR) {
-          // Open Directory and extract first item in directory
-          if (f_opendir(&dtp->current_dir, args) == FR_OK && f_readdir(&dtp->current_dir, &dtp->current_info) == FR_OK) {
+          // Serve from the listing cache, or open Directory and extract first item in directory
+          if (_dtp_list_cache_open(dtp, args, FTP_SERVER_DTP_COMMAND_LIST) > 0 ||
+              (f_opendir(&dtp->current_dir, args) == FR_OK && f_readdir(&dtp->current_dir, &dtp->current_info) == FR_OK)) {
             resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
             dtp->list_file_only = 0;
           } else {
+            _dtp_list_cache_close(dtp, 0);
             resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
             break;
           }
@@ -1771,11 +3366,32 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
       if (dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
         resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
       } else {
-        // Attempt to read the file
-        if (f_opendir(&dtp->current_dir, args) == FR_OK) {
+        // Serve from the listing cache or open the directory
+        if (_dtp_list_cache_open(dtp, args, FTP_SERVER_DTP_COMMAND_NLST) > 0 ||
+            f_opendir(&dtp->current_dir, args) == FR_OK) {
           resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
           dtp->active_cmd = FTP_SERVER_DTP_COMMAND_NLST;
         } else {
+          _dtp_list_cache_close(dtp, 0);
+          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+        }
+      }
+      break;
+    case FTP_SERVER_DTP_COMMAND_MLSD:
+      if (dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
+        resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
+      } else {
+        // If no argument is set, set the default argument (PWD)
+        if (args == NULL) {
+          args = ".";
+        }
+        // Serve from the listing cache, or open Directory and extract first item in directory
+        if (_dtp_list_cache_open(dtp, args, FTP_SERVER_DTP_COMMAND_MLSD) > 0 ||
+            (f_opendir(&dtp->current_dir, args) == FR_OK && f_readdir(&dtp->current_dir, &dtp->current_info) == FR_OK)) {
+          resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED;
+          dtp->active_cmd = FTP_SERVER_DTP_COMMAND_MLSD;
+        } else {
+          _dtp_list_cache_close(dtp, 0);
           resp->cmd_resp = FTP_SERVER_DTP_COMMAND_RESP_REJECTED;
         }
       }
@@ -1791,12 +3407,24 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
       return -1;
   }
 
-  // Flush the buffer if command accpected
+  // Flush the buffers if command accpected
   if (resp->cmd_resp == FTP_SERVER_DTP_COMMAND_RESP_ACCEPTED) {
-    dtp->buff_len_used = 0;
-    dtp->buff_offset = 0;
-    dtp->buff[0] = '\0';
+    _dtp_reset_buffers(dtp);
     dtp->finish_pending = 0;
+#if FTP_SERVER_STATS
+    if (dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
+      _dtp_stats_begin(dtp);
+    }
+#endif /* FTP_SERVER_STATS */
+#if FTP_SERVER_MODE_Z
+    if (FTP_DTP_COMPRESSED(dtp) && dtp->active_cmd != FTP_SERVER_DTP_COMMAND_NONE) {
+      _dtp_zlib_begin(dtp);
+    }
+#endif /* FTP_SERVER_MODE_Z */
+    // Uploads change the directory listing
+    if (dtp_cmd == FTP_SERVER_DTP_COMMAND_STOR || dtp_cmd == FTP_SERVER_DTP_COMMAND_APPE) {
+      _list_cache_invalidate();
+    }
   }
 
   FTP_SERVER_DTP_DEBUG(2, "Processed PI command with response %s.\n", dtp_cmd_resp_str[resp->cmd_resp]);
@@ -1804,41 +3432,154 @@ int _dtp_execute_command(ftp_server_dtp_channel_t *dtp,
   return 0;
 }
 
+int _dtp_seek_file(ftp_server_dtp_channel_t *dtp, FSIZE_t offset, int keep_map) {
+  // Resuming beyond the end of the file would leave a gap
+  if (offset > f_size(&dtp->current_file)) {
+    FTP_SERVER_DTP_DEBUG(1, "Restart offset %lu is beyond the end of the file.\n", (unsigned long) offset);
+    return -1;
+  }
+
+  // Building the map walks the whole cluster chain, which only pays off when seeking
+  if (offset == 0) {
+    return 0;
+  }
+
+#if _USE_FASTSEEK
+  // Map the cluster chain once, so seeking and following clusters does not walk the FAT
+  dtp->clmt[0] = FTP_SERVER_DTP_CLMT_LEN;
+  dtp->current_file.cltbl = dtp->clmt;
+  if (f_lseek(&dtp->current_file, CREATE_LINKMAP) != FR_OK) {
+    // File too fragmented for the table, fall back to walking the FAT
+    FTP_SERVER_DTP_DEBUG(2, "File needs %lu CLMT items, seeking without map.\n", (unsigned long) dtp->clmt[0]);
+    dtp->current_file.cltbl = NULL;
+  }
+#endif /* _USE_FASTSEEK */
+
+  if (f_lseek(&dtp->current_file, offset) != FR_OK) {
+    FTP_SERVER_DTP_DEBUG(1, "Failed to seek to restart offset %lu.\n", (unsigned long) offset);
+    return -1;
+  }
+
+#if _USE_FASTSEEK
+  // A file cannot be extended in fast seek mode
+  if (!keep_map) {
+    dtp->current_file.cltbl = NULL;
+  }
+#endif /* _USE_FASTSEEK */
+  return 0;
+}
+
 int _dtp_send_receive(ftp_server_dtp_channel_t *dtp) {
-  // set up the buffer
   int ret = 0;
-  int sock_sts = 0;
-  int bytes_written = 0;
 
   // check arguments
   if (dtp == NULL || dtp->active_cmd >= FTP_SERVER_DTP_COMMAND_NUM) return -1;
 
-  // fill buffer if send command
-  if (dtp->buff_len_used == 0) {
+  switch (dtp->active_cmd) {
+    case FTP_SERVER_DTP_COMMAND_RETR:
+    case FTP_SERVER_DTP_COMMAND_LIST:
+    case FTP_SERVER_DTP_COMMAND_NLST:
+    case FTP_SERVER_DTP_COMMAND_MLSD:
+#if FTP_SERVER_LIVE_FILES
+      // Live files are sent directly from the MRRB
+      if (dtp->live_file != NULL) {
+        ret = _dtp_live_file_send(dtp);
+        break;
+      }
+#endif /* FTP_SERVER_LIVE_FILES */
+      // Cached listings are sent directly from the cache
+      if (dtp->list_cache_hit) {
+        ret = _dtp_list_cache_send(dtp);
+        break;
+      }
+      // Drain the oldest buffer into the socket, then read ahead into the free buffers
+      ret = _dtp_drain_to_socket(dtp);
+      if (ret >= 0) {
+        ret = _dtp_fill_from_source(dtp);
+      }
+      break;
+    case FTP_SERVER_DTP_COMMAND_STOR:
+    case FTP_SERVER_DTP_COMMAND_APPE:
+      // Take everything the socket has, then write the full buffers behind
+      ret = _dtp_fill_from_socket(dtp);
+      if (ret >= 0) {
+        ret = _dtp_drain_to_file(dtp);
+      }
+      break;
+    default:
+      // Noting to send or receive
+      break;
+  }
+
+  // Check if finish is pending and all data has been processed
+  if (ret >= 0 && dtp->finish_pending && _dtp_buffers_empty(dtp)) {
+#if FTP_SERVER_MODE_Z
+    // A compressed download ends once the end of the stream was sent
+    if (FTP_DTP_COMPRESSED(dtp) && (ret = _dtp_zlib_finish(dtp)) <= 0) {
+      return ret;
+    }
+#endif /* FTP_SERVER_MODE_Z */
+    FTP_SERVER_DTP_DEBUG(1, "Finished current process.\n");
+    dtp->finish_pending = 0;
+    ret = 1;
+    _dtp_list_cache_close(dtp, 1);
+    f_close(&dtp->current_file);
+    f_closedir(&dtp->current_dir);
+  }
+
+  return ret;
+}
+
+int _dtp_send(ftp_server_dtp_channel_t *dtp, const char *data, unsigned int length) {
+#if FTP_SERVER_MODE_Z
+  // Compressed transfers send through the zlib stream, with the same return values
+  if (FTP_DTP_COMPRESSED(dtp)) {
+    return _dtp_zlib_send(dtp, (const unsigned char *) data, length);
+  }
+#endif /* FTP_SERVER_MODE_Z */
+  return send(dtp->conn, data, length, MSG_DONTWAIT);
+}
+
+int _dtp_fill_from_source(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_dtp_buffer_t *buffer;
+  unsigned int bytes_written;
+
+#if FTP_SERVER_DTP_USE_FORWARD
+  // Files are streamed directly into the socket, unless they are compressed.
+  // Data the socket did not take is sent from the buffers first.
+  if (dtp->active_cmd == FTP_SERVER_DTP_COMMAND_RETR && !FTP_DTP_COMPRESSED(dtp)) {
+    return _dtp_buffers_empty(dtp) ? _dtp_forward_file(dtp) : 0;
+  }
+#endif /* FTP_SERVER_DTP_USE_FORWARD */
+
+  // Fill all free buffers
+  while (!dtp->finish_pending && (buffer = _dtp_fill_buffer(dtp)) != NULL) {
     switch (dtp->active_cmd) {
-      case FTP_SERVER_DTP_COMMAND_RETR:
-        // Read from the file
-        if (f_read(&dtp->current_file, dtp->buff, FTP_SERVER_DTP_BUFFER_LEN, &dtp->buff_len_used) != FR_OK) {
+      case FTP_SERVER_DTP_COMMAND_RETR: {
+        // Read whole sectors from the file
+        FTP_STATS_TIMESTAMP(read_start);
+        if (f_read(&dtp->current_file, buffer->data, buffer->capacity, &buffer->length) != FR_OK) {
           FTP_SERVER_DTP_DEBUG(1, "Failed to read file from FS.\n");
-          ret = -1;
-        } else {
-          // Check if finished reading file
-          if (dtp->buff_len_used < FTP_SERVER_DTP_BUFFER_LEN) {
-            dtp->finish_pending = 1;
-          }
+          return -1;
+        }
+        FTP_STATS_ADD_ELAPSED(dtp, fs_us, read_start);
+        // Check if finished reading file
+        if (buffer->length < buffer->capacity) {
+          dtp->finish_pending = 1;
         }
         break;
+      }
       case FTP_SERVER_DTP_COMMAND_LIST:
         // send the info stored in f_info
         if (dtp->list_file_only) {
           // File only
-          bytes_written = _dtp_listitem_unix(dtp->buff, &dtp->current_info, FTP_SERVER_DTP_BUFFER_LEN);
+          buffer->length = _dtp_listitem_unix(buffer->data, &dtp->current_info, buffer->capacity);
           dtp->finish_pending = 1;
         } else {
           while(1) {
             // Attempt to write the current entry into the buffer
-            bytes_written = _dtp_listitem_unix(dtp->buff + dtp->buff_len_used, &dtp->current_info, FTP_SERVER_DTP_BUFFER_LEN - dtp->buff_len_used);
-            dtp->buff_len_used += bytes_written;
+            bytes_written = _dtp_listitem_unix(buffer->data + buffer->length, &dtp->current_info, buffer->capacity - buffer->length);
+            buffer->length += bytes_written;
             // Check if the entry was written into buffer
             if (bytes_written == 0) {
               break;
@@ -1846,7 +3587,7 @@ int _dtp_send_receive(ftp_server_dtp_channel_t *dtp) {
             // Get the next entry in the directory
             if (f_readdir(&dtp->current_dir, &dtp->current_info) != FR_OK) {
               FTP_SERVER_DTP_DEBUG(1, "Failed to read directory from FS.\n");
-              ret = -1;
+              return -1;
             }
             // Check if end of directory reached
             if (*dtp->current_info.fname == '\0') {
@@ -1858,11 +3599,11 @@ int _dtp_send_receive(ftp_server_dtp_channel_t *dtp) {
         break;
       case FTP_SERVER_DTP_COMMAND_NLST:
         // Loop while enough space is available
-        while(dtp->buff_len_used + (_USE_LFN ? _MAX_LFN : 12) + 3 < FTP_SERVER_DTP_BUFFER_LEN) {
+        while(buffer->length + (_USE_LFN ? _MAX_LFN : 12) + 3 < buffer->capacity) {
           // Get the next entry in the directory
           if (f_readdir(&dtp->current_dir, &dtp->current_info) != FR_OK) {
             FTP_SERVER_DTP_DEBUG(1, "Failed to read directory from FS.\n");
-            ret = -1;
+            return -1;
           }
           // Check if end of directory reached
           if (*dtp->current_info.fname == '\0') {
@@ -1870,124 +3611,286 @@ int _dtp_send_receive(ftp_server_dtp_channel_t *dtp) {
             break;
           }
           // Copy the directory name and add CRLF
-          dtp->buff_len_used += strlcpy(dtp->buff + dtp->buff_len_used,
-                                        dtp->current_info.fname,
-                                        FTP_SERVER_DTP_BUFFER_LEN - dtp->buff_len_used);
-          dtp->buff_len_used += strlcpy(dtp->buff + dtp->buff_len_used,
-                                        "\r\n",
-                                        FTP_SERVER_DTP_BUFFER_LEN - dtp->buff_len_used);
+          buffer->length += strlcpy(buffer->data + buffer->length,
+                                    dtp->current_info.fname,
+                                    buffer->capacity - buffer->length);
+          buffer->length += strlcpy(buffer->data + buffer->length,
+                                    "\r\n",
+                                    buffer->capacity - buffer->length);
+        }
+        break;
+      case FTP_SERVER_DTP_COMMAND_MLSD:
+        while(1) {
+          // Check if end of directory reached
+          if (*dtp->current_info.fname == '\0') {
+            dtp->finish_pending = 1;
+            break;
+          }
+          // Attempt to write the current entry into the buffer
+          bytes_written = _dtp_listitem_mlsx(buffer->data + buffer->length, &dtp->current_info, buffer->capacity - buffer->length);
+          buffer->length += bytes_written;
+          if (bytes_written == 0) {
+            break;
+          }
+          // Get the next entry in the directory
+          if (f_readdir(&dtp->current_dir, &dtp->current_info) != FR_OK) {
+            FTP_SERVER_DTP_DEBUG(1, "Failed to read directory from FS.\n");
+            return -1;
+          }
         }
         break;
       default:
         // Not a send command
-        break;
+        return 0;
+    }
+
+    // Hand the buffer over to the socket if data has been added
+    if (buffer->length == 0) {
+      break;
+    }
+    FTP_SERVER_DTP_DEBUG(2, "Added %u Byte to be sent.\n", buffer->length);
+    _dtp_list_cache_append(dtp, buffer->data, buffer->length);
+    _dtp_seal_buffer(dtp);
+  }
+  return 0;
+}
+
+int _dtp_drain_to_socket(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_dtp_buffer_t *buffer;
+  int sock_sts;
+
+  // Send buffers in order until the socket would block
+  while (dtp->num_ready > 0) {
+    buffer = &dtp->buffers[dtp->drain_index];
+    FTP_STATS_TIMESTAMP(send_start);
+    sock_sts = _dtp_send(dtp, buffer->data + buffer->offset, buffer->length - buffer->offset);
+    FTP_STATS_ADD_ELAPSED(dtp, socket_us, send_start);
+    if (sock_sts < 0) {
+      if (errno != EWOULDBLOCK) {
+        FTP_SERVER_DTP_DEBUG(1, "Failed to send data to socket.\n");
+        return -1;
+      }
+      // Cannot send at the moment, wait until later
+      FTP_STATS_ADD(dtp, would_block, 1);
+      break;
+    } else if (sock_sts == 0) {
+      FTP_SERVER_DTP_DEBUG(1, "Send connection closed unexpectedly.\n");
+      return -1;
+    }
+    FTP_SERVER_DTP_DEBUG(2, "Sent %u Bytes.\n", sock_sts);
+#if FTP_SERVER_DTP_DEBUG_LEVEL >= 3
+    _dump_binary((unsigned char *) buffer->data + buffer->offset, sock_sts);
+#endif
+    FTP_STATS_ADD(dtp, bytes, sock_sts);
+    buffer->offset += sock_sts;
+    if (buffer->offset < buffer->length) {
+      // Not all data was sent
+      FTP_SERVER_DTP_DEBUG(2, "%u Bytes remain to be sent.\n", buffer->length - buffer->offset);
+      break;
+    }
+    // All data of the buffer was sent
+    _dtp_release_buffer(dtp);
+  }
+  return 0;
+}
+
+int _dtp_fill_from_socket(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_dtp_buffer_t *buffer;
+  int sock_sts;
+
+  // Receive until the socket is empty or all buffers are full
+  while (!dtp->finish_pending && (buffer = _dtp_fill_buffer(dtp)) != NULL) {
+    FTP_STATS_TIMESTAMP(recv_start);
+    sock_sts = recv(dtp->conn, buffer->data + buffer->length, buffer->capacity - buffer->length, MSG_DONTWAIT);
+    FTP_STATS_ADD_ELAPSED(dtp, socket_us, recv_start);
+    if (sock_sts < 0) {
+      if (errno != EWOULDBLOCK) {
+        FTP_SERVER_DTP_DEBUG(1, "Failed to receive data from socket.\n");
+        return -1;
+      }
+      FTP_STATS_ADD(dtp, would_block, 1);
+      break;
+    } else if (sock_sts == 0) {
+      FTP_SERVER_DTP_DEBUG(1, "Receive connection closed.\n");
+      dtp->finish_pending = 1;
+      break;
+    }
+    FTP_SERVER_DTP_DEBUG(2, "Received %u Bytes.\n", sock_sts);
+#if FTP_SERVER_DTP_DEBUG_LEVEL >= 3
+    _dump_binary((unsigned char *) buffer->data + buffer->length, sock_sts);
+#endif
+    FTP_STATS_ADD(dtp, bytes, sock_sts);
+    buffer->length += sock_sts;
+    // Queue the buffer for writing once it is full
+    if (buffer->length == buffer->capacity) {
+      _dtp_seal_buffer(dtp);
     }
-    // Check if data has been added to the buffer
-    if (dtp->buff_len_used != 0) {
-      FTP_SERVER_DTP_DEBUG(2, "Added %u Byte to be sent.\n", dtp->buff_len_used);
+  }
+  return 0;
+}
+
+int _dtp_drain_to_file(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_dtp_buffer_t *buffer;
+  unsigned int bytes_written;
+
+  // Once the client finished sending, the partially filled buffer is written as well
+  if (dtp->finish_pending && (buffer = _dtp_fill_buffer(dtp)) != NULL && buffer->length > 0) {
+    _dtp_seal_buffer(dtp);
+  }
+
+#if FTP_SERVER_MODE_Z
+  // Compressed buffers are inflated and written from the window of the stream
+  if (FTP_DTP_COMPRESSED(dtp)) {
+    return _dtp_zlib_drain_to_file(dtp);
+  }
+#endif /* FTP_SERVER_MODE_Z */
+
+  // Write back all full buffers. Except for the last one, they cover whole sectors.
+  while (dtp->num_ready > 0) {
+    buffer = &dtp->buffers[dtp->drain_index];
+    FTP_STATS_TIMESTAMP(write_start);
+    if (f_write(&dtp->current_file,
+                buffer->data + buffer->offset,
+                buffer->length - buffer->offset,
+                &bytes_written) != FR_OK ||
+        bytes_written != buffer->length - buffer->offset) {
+      FTP_SERVER_DTP_DEBUG(1, "Could not write buffered data to file.\n");
+      return -1;
     }
+    FTP_STATS_ADD_ELAPSED(dtp, fs_us, write_start);
+    _dtp_release_buffer(dtp);
+  }
+  return 0;
+}
+
+void _dtp_reset_buffers(ftp_server_dtp_channel_t *dtp) {
+  for (unsigned int i = 0; i < FTP_SERVER_DTP_NUM_BUFFERS; i++) {
+    dtp->buffers[i].length = 0;
+    dtp->buffers[i].offset = 0;
+    dtp->buffers[i].capacity = FTP_SERVER_DTP_BUFFER_LEN;
+  }
+  dtp->drain_index = 0;
+  dtp->num_ready = 0;
+
+  // When writing from an unaligned position (APPE), shorten the first buffer
+  // so that all following writes start on a sector boundary.
+  if (dtp->active_cmd == FTP_SERVER_DTP_COMMAND_STOR || dtp->active_cmd == FTP_SERVER_DTP_COMMAND_APPE) {
+    dtp->buffers[0].capacity -= f_tell(&dtp->current_file) % _MAX_SS;
+  }
+}
+
+ftp_server_dtp_buffer_t *_dtp_fill_buffer(ftp_server_dtp_channel_t *dtp) {
+  // The buffer after the last ready one is being filled, if it exists
+  if (dtp->num_ready >= FTP_SERVER_DTP_NUM_BUFFERS) {
+    return NULL;
+  }
+  return &dtp->buffers[(dtp->drain_index + dtp->num_ready) % FTP_SERVER_DTP_NUM_BUFFERS];
+}
+
+void _dtp_seal_buffer(ftp_server_dtp_channel_t *dtp) {
+  dtp->num_ready++;
+}
+
+void _dtp_release_buffer(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_dtp_buffer_t *buffer = &dtp->buffers[dtp->drain_index];
+  buffer->length = 0;
+  buffer->offset = 0;
+  buffer->capacity = FTP_SERVER_DTP_BUFFER_LEN;
+  dtp->drain_index = (dtp->drain_index + 1) % FTP_SERVER_DTP_NUM_BUFFERS;
+  dtp->num_ready--;
+}
+
+int _dtp_buffers_empty(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_dtp_buffer_t *buffer = _dtp_fill_buffer(dtp);
+  return dtp->num_ready == 0 && (buffer == NULL || buffer->length == 0);
+}
+
+#if FTP_SERVER_DTP_USE_FORWARD
+int _dtp_forward_file(ftp_server_dtp_channel_t *dtp) {
+  UINT bytes_forwarded = 0;
+
+  // Forward as much of the file as the socket accepts without blocking
+  dtp->forward_error = 0;
+#if FTP_SERVER_STATS
+  // The time spent sending from the stream function does not count as FS time
+  uint64_t socket_us = dtp->stats->current.socket_us;
+  uint32_t forward_start = osKernelGetSysTimerCount();
+#endif /* FTP_SERVER_STATS */
+  dtp->forwarding = 1;
+  if (f_forward(&dtp->current_file, _dtp_forward_stream, FTP_SERVER_DTP_FORWARD_LEN, &bytes_forwarded) != FR_OK) {
+    dtp->forwarding = 0;
+    FTP_SERVER_DTP_DEBUG(1, "Failed to forward file from FS.\n");
+    return -1;
+  }
+  dtp->forwarding = 0;
+#if FTP_SERVER_STATS
+  dtp->stats->current.fs_us += _stats_elapsed_us(forward_start) - (dtp->stats->current.socket_us - socket_us);
+#endif /* FTP_SERVER_STATS */
+  if (dtp->forward_error) {
+    FTP_SERVER_DTP_DEBUG(1, "Failed to send data to socket.\n");
+    return -1;
+  }
+  if (bytes_forwarded > 0) {
+    FTP_SERVER_DTP_DEBUG(2, "Sent %u Bytes.\n", bytes_forwarded);
   }
 
-  // Send or receive data
-  if (ret >= 0) {
-    switch (dtp->active_cmd) {
-      case FTP_SERVER_DTP_COMMAND_STOR:
-      case FTP_SERVER_DTP_COMMAND_APPE:
-        if (dtp->buff_len_used == 0) {
-          sock_sts = recv(dtp->conn, dtp->buff, FTP_SERVER_DTP_BUFFER_LEN, MSG_DONTWAIT);
-          if (sock_sts < 0) {
-            if (errno != EWOULDBLOCK) {
-              FTP_SERVER_DTP_DEBUG(1, "Failed to receive data from socket.\n");
-              ret = -1;
-            } else {
-              dtp->buff_len_used = 0;
-            }
-          } else if (sock_sts == 0) {
-            FTP_SERVER_DTP_DEBUG(1, "Receive connection closed.\n");
-            dtp->finish_pending = 1;
-          } else {
-            dtp->buff_len_used = sock_sts;
-            FTP_SERVER_DTP_DEBUG(2, "Received %u Bytes.\n", dtp->buff_len_used);
-#if FTP_SERVER_DTP_DEBUG_LEVEL >= 3
-            _dump_binary(dtp->buff, dtp->buff_len_used);
-#endif
-          }
-        }
-        break;
-      case FTP_SERVER_DTP_COMMAND_RETR:
-      case FTP_SERVER_DTP_COMMAND_LIST:
-      case FTP_SERVER_DTP_COMMAND_NLST:
-        if (dtp->buff_len_used > 0) {
-          sock_sts = send(dtp->conn, dtp->buff + dtp->buff_offset, dtp->buff_len_used - dtp->buff_offset, MSG_DONTWAIT);
-          if (sock_sts < 0) {
-            if (errno != EWOULDBLOCK) {
-              FTP_SERVER_DTP_DEBUG(1, "Failed to send data to socket.\n");
-              ret = -1;
-            } else {
-              // Cannot send at the moment, wait until later
-            }
-          } else if (sock_sts == 0) {
-            FTP_SERVER_DTP_DEBUG(1, "Send connection closed unexpectedly.\n");
-            ret = -1;
-          } else {
-            FTP_SERVER_DTP_DEBUG(2, "Sent %u Bytes.\n", sock_sts);
-#if FTP_SERVER_DTP_DEBUG_LEVEL >= 3
-            _dump_binary(dtp->buff, dtp->buff_len_used);
-#endif
-            if (sock_sts >= dtp->buff_len_used - dtp->buff_offset) {
-              // All data was sent
-              dtp->buff_len_used = 0;
-              dtp->buff_offset = 0;
-            } else {
-              // Not all data was sent
-              dtp->buff_offset += sock_sts;
-              FTP_SERVER_DTP_DEBUG(2, "%u Bytes remain to be sent.\n", dtp->buff_len_used - dtp->buff_offset);
-            }
-          }
-        }
-        break;
-      default:
-        // Noting to send or receive
-        break;
-    }
+  // Check if finished reading file
+  if (f_eof(&dtp->current_file)) {
+    dtp->finish_pending = 1;
   }
+  return 0;
+}
 
-  // Write back data to fs
-  if (ret >= 0 && dtp->buff_len_used >= 0) {
-    switch (dtp->active_cmd) {
-      case FTP_SERVER_DTP_COMMAND_STOR:
-      case FTP_SERVER_DTP_COMMAND_APPE:
-        if (f_write(&dtp->current_file,
-                    dtp->buff + dtp->buff_offset,
-                    dtp->buff_len_used - dtp->buff_offset,
-                    &bytes_written) != FR_OK) {
-          FTP_SERVER_DTP_DEBUG(1, "Could not write buffered data to file.\n");
-          ret = -1;
-          break;
-        }
-        dtp->buff_offset += bytes_written;
-        if (dtp->buff_offset == dtp->buff_len_used) {
-          dtp->buff_offset = 0;
-          dtp->buff_len_used = 0;
-        }
-        break;
-      default:
-        // Not a receive command
-        break;
+UINT _dtp_forward_stream(const BYTE *data, UINT length) {
+  ftp_server_dtp_channel_t *dtp = NULL;
+  osThreadId_t thread = osThreadGetId();
+  int sock_sts;
+
+  // Find the channel of the calling DTP
+  for (unsigned int i = 0; i < FTP_SERVER_NUM_SESSIONS; i++) {
+    if (_dtp_forward_channels[i] != NULL &&
+        _dtp_forward_channels[i]->thread == thread &&
+        _dtp_forward_channels[i]->forwarding) {
+      dtp = _dtp_forward_channels[i];
+      break;
     }
   }
+  if (dtp == NULL) {
+    return 0;
+  }
 
-  // Check if finish is pending and all data has been processed
-  if (ret >= 0 && dtp->buff_len_used == 0 && dtp->finish_pending) {
-    FTP_SERVER_DTP_DEBUG(1, "Finished current process.\n");
-    dtp->finish_pending = 0;
-    ret = 1;
-    f_close(&dtp->current_file);
-    f_closedir(&dtp->current_dir);
+  // Sense call: continue until the socket stopped taking data. Writability is
+  // not checked, as lwIP only reports it once all sent data was acknowledged.
+  if (length == 0) {
+    return (!dtp->forward_error && _dtp_buffers_empty(dtp)) ? 1 : 0;
   }
 
-  return ret;
+  // Send directly from the sector buffer. This runs with the volume locked,
+  // so it must never block.
+  FTP_STATS_TIMESTAMP(send_start);
+  sock_sts = send(dtp->conn, data, length, MSG_DONTWAIT);
+  FTP_STATS_ADD_ELAPSED(dtp, socket_us, send_start);
+  if (sock_sts < 0 && errno == EWOULDBLOCK) {
+    FTP_STATS_ADD(dtp, would_block, 1);
+    sock_sts = 0;
+  } else if (sock_sts <= 0) {
+    // Returning 0 would invalidate the file object. Report the error through the channel instead.
+    dtp->forward_error = 1;
+    return length;
+  }
+  FTP_STATS_ADD(dtp, bytes, sock_sts);
+
+  // Keep the rest in a DTP buffer, which is sent once the socket is writable.
+  // The buffers are empty while forwarding, and at most a sector is passed.
+  if ((UINT) sock_sts < length) {
+    ftp_server_dtp_buffer_t *buffer = _dtp_fill_buffer(dtp);
+    memcpy(buffer->data, data + sock_sts, length - sock_sts);
+    buffer->length = length - sock_sts;
+    _dtp_seal_buffer(dtp);
+  }
+  return length;
 }
+#endif /* FTP_SERVER_DTP_USE_FORWARD */
 
 int _dtp_listitem_fat(char *buff, FILINFO* info, unsigned int buff_length) {
   // Check if enough space is avaliable
@@ -2035,6 +3938,674 @@ int _dtp_listitem_unix(char *buff, FILINFO* info, unsigned int buff_length) {
   return len_used;
 }
 
+int _dtp_listitem_mlsx(char *buff, FILINFO* info, unsigned int buff_length) {
+  // Check if enough space is avaliable
+  if (64 + strlen(info->fname) > buff_length) {
+    return 0;
+  }
+  unsigned int len_used = _mlsx_facts(buff, info, buff_length);
+  len_used += snprintf(buff + len_used, buff_length - len_used, " %s\r\n", info->fname);
+  return len_used;
+}
+
+int _mlsx_facts(char *buff, FILINFO* info, unsigned int buff_length) {
+  int len_used = snprintf(buff, buff_length,
+    "type=%s;size=%u;modify=%04u%02u%02u%02u%02u%02u;perm=%s;",
+    (info->fattrib & AM_DIR) ? "dir" : "file",
+    (unsigned int) info->fsize,
+    ((info->fdate >>  9) & 0x7F) + 1980,
+    ((info->fdate >>  5) & 0x0F),
+    ((info->fdate >>  0) & 0x1F),
+    ((info->ftime >> 11) & 0x1F),
+    ((info->ftime >>  5) & 0x3F),
+    ((info->ftime >>  0) & 0x1F) * 2,
+    (info->fattrib & AM_DIR) ? "elcmp" : ((info->fattrib & AM_RDO) ? "r" : "rwadf"));
+  if (len_used < 0) return 0;
+  return ((unsigned int) len_used < buff_length) ? len_used : (int) buff_length - 1;
+}
+
+int _list_cache_init(void) {
+  memset(_list_cache, 0x00, sizeof(_list_cache));
+  _list_cache_generation = 0;
+  _list_cache_next = 0;
+  _list_cache_mutex = osMutexNew(NULL);
+  return (_list_cache_mutex != NULL) ? 0 : -1;
+}
+
+void _list_cache_invalidate(void) {
+  osMutexAcquire(_list_cache_mutex, osWaitForever);
+  // Entries being sent keep their data until released, but are not found anymore
+  _list_cache_generation++;
+  for (unsigned int i = 0; i < FTP_SERVER_LIST_CACHE_NUM; i++) {
+    _list_cache[i].valid = 0;
+  }
+  osMutexRelease(_list_cache_mutex);
+}
+
+int _dtp_list_cache_open(ftp_server_dtp_channel_t *dtp, const char *path, ftp_server_dtp_command_t format) {
+  char key[FTP_SERVER_LIST_CACHE_PATH_LEN];
+  ftp_server_list_cache_entry_t *entry = NULL;
+  unsigned int len;
+
+  dtp->list_cache_entry = NULL;
+  dtp->list_cache_hit = 0;
+  dtp->list_cache_offset = 0;
+
+  // Listings are cached by absolute path
+  if (path[0] == '/') {
+    len = strlcpy(key, path, sizeof(key));
+  } else {
+    if (f_getcwd(key, sizeof(key)) != FR_OK) return 0;
+    len = strlen(key);
+    if (strcmp(path, ".") != 0) {
+      if (len > 0 && key[len - 1] != '/') {
+        len += strlcpy(key + len, "/", sizeof(key) - len);
+      }
+      if (len < sizeof(key)) {
+        len += strlcpy(key + len, path, sizeof(key) - len);
+      }
+    }
+  }
+  if (len >= sizeof(key)) {
+    FTP_SERVER_DTP_DEBUG(2, "Path too long for the listing cache.\n");
+    return 0;
+  }
+
+  osMutexAcquire(_list_cache_mutex, osWaitForever);
+  // Look for an up to date listing
+  for (unsigned int i = 0; i < FTP_SERVER_LIST_CACHE_NUM; i++) {
+    if (_list_cache[i].valid && _list_cache[i].format == format && strcmp(_list_cache[i].path, key) == 0) {
+      entry = &_list_cache[i];
+      dtp->list_cache_hit = 1;
+      break;
+    }
+  }
+  // Otherwise, claim an unused entry to record the listing into
+  for (unsigned int i = 0; entry == NULL && i < FTP_SERVER_LIST_CACHE_NUM; i++) {
+    unsigned int index = (_list_cache_next + i) % FTP_SERVER_LIST_CACHE_NUM;
+    if (_list_cache[index].refs == 0) {
+      entry = &_list_cache[index];
+      _list_cache_next = (index + 1) % FTP_SERVER_LIST_CACHE_NUM;
+      entry->valid = 0;
+      entry->format = format;
+      entry->generation = _list_cache_generation;
+      entry->length = 0;
+      strcpy(entry->path, key);
+    }
+  }
+  if (entry != NULL) {
+    entry->refs++;
+  }
+  osMutexRelease(_list_cache_mutex);
+
+  dtp->list_cache_entry = entry;
+  if (dtp->list_cache_hit) {
+    FTP_SERVER_DTP_DEBUG(2, "Serving %s of '%s' from the listing cache.\n", dtp_cmd_str[format], key);
+  }
+  return dtp->list_cache_hit;
+}
+
+void _dtp_list_cache_append(ftp_server_dtp_channel_t *dtp, const char *data, unsigned int length) {
+  ftp_server_list_cache_entry_t *entry = dtp->list_cache_entry;
+
+  // Only record listings that are being generated
+  if (entry == NULL || dtp->list_cache_hit) return;
+
+  // The entry is owned by this DTP until committed
+  if (entry->length + length > FTP_SERVER_LIST_CACHE_LEN) {
+    FTP_SERVER_DTP_DEBUG(2, "Listing too large for the listing cache.\n");
+    _dtp_list_cache_close(dtp, 0);
+    return;
+  }
+  memcpy(entry->data + entry->length, data, length);
+  entry->length += length;
+}
+
+int _dtp_list_cache_send(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_list_cache_entry_t *entry = dtp->list_cache_entry;
+  int sock_sts;
+
+  // Send as much of the listing as the socket takes
+  if (dtp->list_cache_offset < entry->length) {
+    FTP_STATS_TIMESTAMP(send_start);
+    sock_sts = _dtp_send(dtp, entry->data + dtp->list_cache_offset, entry->length - dtp->list_cache_offset);
+    FTP_STATS_ADD_ELAPSED(dtp, socket_us, send_start);
+    if (sock_sts < 0) {
+      if (errno != EWOULDBLOCK) {
+        FTP_SERVER_DTP_DEBUG(1, "Failed to send data to socket.\n");
+        return -1;
+      }
+      FTP_STATS_ADD(dtp, would_block, 1);
+      return 0;
+    } else if (sock_sts == 0) {
+      FTP_SERVER_DTP_DEBUG(1, "Send connection closed unexpectedly.\n");
+      return -1;
+    }
+    FTP_SERVER_DTP_DEBUG(2, "Sent %u Bytes.\n", sock_sts);
+    FTP_STATS_ADD(dtp, bytes, sock_sts);
+    dtp->list_cache_offset += sock_sts;
+  }
+
+  if (dtp->list_cache_offset >= entry->length) {
+    dtp->finish_pending = 1;
+  }
+  return 0;
+}
+
+void _dtp_list_cache_close(ftp_server_dtp_channel_t *dtp, int commit) {
+  ftp_server_list_cache_entry_t *entry = dtp->list_cache_entry;
+
+  if (entry == NULL) return;
+
+  osMutexAcquire(_list_cache_mutex, osWaitForever);
+  // A recorded listing is only valid if nothing changed while it was generated
+  if (commit && !dtp->list_cache_hit && entry->generation == _list_cache_generation) {
+    entry->valid = 1;
+  }
+  entry->refs--;
+  osMutexRelease(_list_cache_mutex);
+
+  dtp->list_cache_entry = NULL;
+  dtp->list_cache_hit = 0;
+}
+
+#if FTP_SERVER_STATS
+uint32_t _stats_elapsed_us(uint32_t start) {
+  // The system timer wraps after a few seconds, which is plenty for a single call
+  return (uint32_t) (((uint64_t) (osKernelGetSysTimerCount() - start) * 1000000U) / osKernelGetSysTimerFreq());
+}
+
+void _stats_command(ftp_server_t *server, cmd_t cmd, uint32_t start) {
+  ftp_server_cmd_stats_t *cmd_stats = &server->pi.stats->cmds[cmd];
+  uint32_t latency = _stats_elapsed_us(start);
+
+  cmd_stats->count++;
+  cmd_stats->total_us += latency;
+  if (latency > cmd_stats->max_us) {
+    cmd_stats->max_us = latency;
+  }
+}
+
+int _stats_format_transfer(char *buff, unsigned int buff_length, const char *label, const ftp_server_transfer_stats_t *stats) {
+  int len = snprintf(buff, buff_length,
+                     "%s: %lu B in %lu ms, wait %lu ms, socket %lu ms, fs %lu ms, %lu EWOULDBLOCK",
+                     label,
+                     (unsigned long) stats->bytes,
+                     (unsigned long) stats->duration_ms,
+                     (unsigned long) (stats->wait_us / 1000),
+                     (unsigned long) (stats->socket_us / 1000),
+                     (unsigned long) (stats->fs_us / 1000),
+                     (unsigned long) stats->would_block);
+  // Report the length actually written
+  return (len < (int) buff_length) ? len : (int) buff_length - 1;
+}
+
+void _stats_log(ftp_server_t *server, const char *label) {
+  ftp_server_transfer_stats_t stats;
+  char buff[128];
+
+  // Take a copy, as the DTP keeps updating a running transfer
+  memcpy(&stats, &server->pi.stats->current, sizeof(stats));
+  if (server->pi.stats->transfer_active) {
+    stats.duration_ms = osKernelGetTickCount() - stats.start_tick;
+  }
+  _stats_format_transfer(buff, sizeof(buff), dtp_cmd_str[server->pi.stats->current_cmd], &stats);
+
+  // Logged independent of the debug output, through the retarget like any other printf
+  FTP_PRINTF("[FTP STATS %u] %s %s\n", server->pi.pi_index, label, buff);
+}
+
+void _stats_log_running(ftp_server_t *server) {
+  // Periodically report on long running transfers
+  if (server->pi.stats->transfer_active &&
+      osKernelGetTickCount() - server->pi.stats->last_log_tick >= FTP_SERVER_STATS_LOG_INTERVAL) {
+    server->pi.stats->last_log_tick = osKernelGetTickCount();
+    _stats_log(server, "Running");
+  }
+}
+
+void _get_stats(ftp_server_t *server) {
+  ftp_server_stats_t *stats = server->pi.stats;
+  char *buff = server->pi.send_buffer;
+  // Leaves room for the last line behind a line the socket did not take yet
+  unsigned int buff_length = FTP_SERVER_SEND_BUF_LEN - 2 - sizeof("211 End\r\n");
+  int len;
+
+  // The reply does not fit the send buffer, so every line but the last is sent right away
+  len = snprintf(buff, buff_length, "211-Session statistics, %lu transfers", (unsigned long) stats->num_transfers);
+  server->pi.send_buff_put_offset = (len < (int) buff_length) ? (unsigned int) len : buff_length - 1;
+  if (_send_status_msg(server) < 0) return;
+
+  // Transfers, then the latency of all commands used in this session. A client
+  // that does not keep up only gets the lines sent so far.
+  for (unsigned int i = 0; i < NUM_CMD + 2 && server->pi.send_buff_queued == 0; i++) {
+    if (i == 0) {
+      len = _stats_format_transfer(buff, buff_length, " Sent", &stats->sent);
+    } else if (i == 1) {
+      len = _stats_format_transfer(buff, buff_length, " Received", &stats->received);
+    } else if (stats->cmds[i - 2].count == 0) {
+      continue;
+    } else {
+      len = snprintf(buff, buff_length, " %s: %lu calls, avg %lu us, max %lu us",
+                     cmd_str[i - 2],
+                     (unsigned long) stats->cmds[i - 2].count,
+                     (unsigned long) (stats->cmds[i - 2].total_us / stats->cmds[i - 2].count),
+                     (unsigned long) stats->cmds[i - 2].max_us);
+    }
+    server->pi.send_buff_put_offset = (len < (int) buff_length) ? (unsigned int) len : buff_length - 1;
+    if (_send_status_msg(server) < 0) return;
+  }
+
+  SET_RESPONSE(server, "211", "End");
+}
+
+void _dtp_stats_begin(ftp_server_dtp_channel_t *dtp) {
+  memset(&dtp->stats->current, 0x00, sizeof(ftp_server_transfer_stats_t));
+  dtp->stats->current.start_tick = osKernelGetTickCount();
+  dtp->stats->current_cmd = dtp->active_cmd;
+  dtp->stats->last_log_tick = dtp->stats->current.start_tick;
+  dtp->stats->transfer_active = 1;
+}
+
+void _dtp_stats_end(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_transfer_stats_t *total;
+  ftp_server_transfer_stats_t *current = &dtp->stats->current;
+
+  if (!dtp->stats->transfer_active) return;
+
+  // Add the transfer to the session totals, depending on its direction
+  current->duration_ms = osKernelGetTickCount() - current->start_tick;
+  if (dtp->stats->current_cmd == FTP_SERVER_DTP_COMMAND_STOR ||
+      dtp->stats->current_cmd == FTP_SERVER_DTP_COMMAND_APPE) {
+    total = &dtp->stats->received;
+  } else {
+    total = &dtp->stats->sent;
+  }
+  total->duration_ms += current->duration_ms;
+  total->bytes += current->bytes;
+  total->wait_us += current->wait_us;
+  total->socket_us += current->socket_us;
+  total->fs_us += current->fs_us;
+  total->would_block += current->would_block;
+  dtp->stats->num_transfers++;
+  dtp->stats->transfer_active = 0;
+}
+#endif /* FTP_SERVER_STATS */
+
+#if FTP_SERVER_MODE_Z
+ftp_server_zlib_stream_t *_zlib_stream_claim(unsigned int pi_index) {
+  ftp_server_zlib_stream_t *stream = NULL;
+
+  // Streams are shared by all DTPs, claim a free one atomically
+  taskENTER_CRITICAL();
+  for (unsigned int i = 0; i < FTP_SERVER_MODE_Z_NUM_STREAMS; i++) {
+    if (_zlib_streams[i].owner == 0) {
+      _zlib_streams[i].owner = pi_index + 1;
+      stream = &_zlib_streams[i];
+      break;
+    }
+  }
+  taskEXIT_CRITICAL();
+  return stream;
+}
+
+void _zlib_stream_release(unsigned int pi_index) {
+  // Also called by the PI for a DTP that was terminated, release whatever it held
+  taskENTER_CRITICAL();
+  for (unsigned int i = 0; i < FTP_SERVER_MODE_Z_NUM_STREAMS; i++) {
+    if (_zlib_streams[i].owner == pi_index + 1) {
+      _zlib_streams[i].owner = 0;
+    }
+  }
+  taskEXIT_CRITICAL();
+}
+
+void _dtp_zlib_begin(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_zlib_stream_t *stream = dtp->zlib;
+
+  // Every transfer is a separate zlib stream
+  stream->out_length = 0;
+  stream->out_offset = 0;
+  if (dtp->active_cmd == FTP_SERVER_DTP_COMMAND_STOR || dtp->active_cmd == FTP_SERVER_DTP_COMMAND_APPE) {
+    ftp_inflate_init(&stream->codec.inflate);
+  } else {
+    ftp_deflate_init(&stream->codec.deflate);
+  }
+}
+
+int _dtp_zlib_flush(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_zlib_stream_t *stream = dtp->zlib;
+  int sock_sts;
+
+  // Send the compressed data left over from before
+  while (stream->out_offset < stream->out_length) {
+    sock_sts = send(dtp->conn,
+                    stream->out + stream->out_offset,
+                    stream->out_length - stream->out_offset,
+                    MSG_DONTWAIT);
+    if (sock_sts < 0) {
+      return (errno == EWOULDBLOCK) ? 0 : -1;
+    } else if (sock_sts == 0) {
+      errno = ENOTCONN;
+      return -1;
+    }
+    stream->out_offset += sock_sts;
+  }
+  return 1;
+}
+
+int _dtp_zlib_send(ftp_server_dtp_channel_t *dtp, const unsigned char *data, unsigned int length) {
+  ftp_server_zlib_stream_t *stream = dtp->zlib;
+  unsigned int consumed = 0;
+  int sts;
+
+  // Compress until the socket would block or all data is in the compressor
+  while ((sts = _dtp_zlib_flush(dtp)) > 0) {
+    if (consumed < length) {
+      consumed += ftp_deflate_input(&stream->codec.deflate, data + consumed, length - consumed);
+    }
+    stream->out_length = ftp_deflate_output(&stream->codec.deflate, stream->out, FTP_SERVER_MODE_Z_OUTPUT_LEN, 0);
+    stream->out_offset = 0;
+    if (stream->out_length == 0) break;
+  }
+  if (sts < 0) return -1;
+
+  // Behave like a non-blocking send that accepted part of the data
+  if (consumed == 0 && length > 0) {
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+  return consumed;
+}
+
+int _dtp_zlib_finish(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_zlib_stream_t *stream = dtp->zlib;
+  int sts;
+
+  // Uploads were checked to be complete while they were written
+  if (dtp->active_cmd == FTP_SERVER_DTP_COMMAND_STOR || dtp->active_cmd == FTP_SERVER_DTP_COMMAND_APPE) {
+    return 1;
+  }
+
+  // Send the rest of the stream and its checksum
+  while ((sts = _dtp_zlib_flush(dtp)) > 0) {
+    if (ftp_deflate_done(&stream->codec.deflate)) return 1;
+    stream->out_length = ftp_deflate_output(&stream->codec.deflate, stream->out, FTP_SERVER_MODE_Z_OUTPUT_LEN, 1);
+    stream->out_offset = 0;
+  }
+  if (sts < 0) {
+    FTP_SERVER_DTP_DEBUG(1, "Failed to send the end of the compressed stream.\n");
+  }
+  return sts;
+}
+
+int _dtp_zlib_drain_to_file(ftp_server_dtp_channel_t *dtp) {
+  ftp_server_zlib_stream_t *stream = dtp->zlib;
+  ftp_server_dtp_buffer_t *buffer;
+  ftp_inflate_status_t status;
+  const unsigned char *data;
+  unsigned int consumed, length, bytes_written;
+  int progress;
+
+  // Inflate the ready buffers and write the output straight from the window.
+  // Once the client finished sending, the input left in the stream is decoded as well.
+  do {
+    if (dtp->num_ready > 0) {
+      buffer = &dtp->buffers[dtp->drain_index];
+      status = ftp_inflate(&stream->codec.inflate,
+                           (const unsigned char *) buffer->data + buffer->offset,
+                           buffer->length - buffer->offset,
+                           &consumed);
+      buffer->offset += consumed;
+      if (buffer->offset >= buffer->length) {
+        _dtp_release_buffer(dtp);
+      }
+    } else if (dtp->finish_pending) {
+      status = ftp_inflate(&stream->codec.inflate, NULL, 0, &consumed);
+    } else {
+      break;
+    }
+    if (status == FTP_INFLATE_ERROR) {
+      FTP_SERVER_DTP_DEBUG(1, "Received invalid compressed data.\n");
+      return -1;
+    }
+    progress = consumed > 0;
+
+    length = ftp_inflate_take(&stream->codec.inflate, &data);
+    if (length > 0) {
+      FTP_STATS_TIMESTAMP(write_start);
+      if (f_write(&dtp->current_file, data, length, &bytes_written) != FR_OK || bytes_written != length) {
+        FTP_SERVER_DTP_DEBUG(1, "Could not write inflated data to file.\n");
+        return -1;
+      }
+      FTP_STATS_ADD_ELAPSED(dtp, fs_us, write_start);
+      progress = 1;
+    }
+  } while (progress);
+
+  // The connection must not close before the end of the stream
+  if (dtp->finish_pending && dtp->num_ready == 0 && !ftp_inflate_done(&stream->codec.inflate)) {
+    FTP_SERVER_DTP_DEBUG(1, "Compressed data ended before the end of the stream.\n");
+    return -1;
+  }
+  return 0;
+}
+#endif /* FTP_SERVER_MODE_Z */
+
+#if FTP_SERVER_LIVE_FILES
+ftp_live_file_t *_live_file_find(const char *path) {
+  for (unsigned int i = 0; i < FTP_SERVER_MAX_LIVE_FILES; i++) {
+    if (_live_files[i] != NULL && strcmp(_live_files[i]->path, path) == 0) {
+      return _live_files[i];
+    }
+  }
+  return NULL;
+}
+
+int _dtp_live_file_attach(ftp_server_dtp_channel_t *dtp, const char *path) {
+  ftp_live_file_t *file = _live_file_find(path);
+
+  // Only one client may stream a live file at a time
+  if (file == NULL || file->attached) {
+    FTP_SERVER_DTP_DEBUG(1, "Live file %s is not available.\n", path);
+    return -1;
+  }
+
+#if !FTP_SERVER_MULTIPLEX
+  // The MRRB wakes the DTP thread. The multiplexer cannot be woken from its
+  // select() by a thread flag and polls the file instead.
+  file->thread = dtp->thread;
+#endif /* !FTP_SERVER_MULTIPLEX */
+
+  // Send every record as soon as it was written, instead of coalescing small
+  // segments until the client acknowledged the previous ones
+  int nodelay = 1;
+  (void) setsockopt(dtp->conn, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  // Start reading from the current write position of the MRRB
+  file->pending = 0;
+  file->abort = 0;
+  file->attached = 1;
+  if (mrrb_reader_enable(file->mrrb, file->reader) < 0) {
+    file->attached = 0;
+    return -1;
+  }
+  dtp->live_file = file;
+  dtp->live_offset = 0;
+  return 0;
+}
+
+void _dtp_live_file_detach(ftp_server_dtp_channel_t *dtp) {
+  ftp_live_file_t *file = dtp->live_file;
+
+  if (file == NULL) return;
+
+  // Without an attached DTP, the abort of the disabled reader completes immediately
+  dtp->live_file = NULL;
+  file->thread = NULL;
+  file->attached = 0;
+  file->pending = 0;
+  mrrb_reader_disable(file->mrrb, file->reader);
+}
+
+int _dtp_live_file_send(ftp_server_dtp_channel_t *dtp) {
+  ftp_live_file_t *file = dtp->live_file;
+  ftp_server_dtp_buffer_t *buffer;
+  unsigned int length;
+
+  // Copy the span out of the ring buffer, so the MRRB can never overwrite data
+  // that is still queued in the socket. No debug output here, as it would be
+  // written into the very ring buffer that is being streamed.
+  while (!file->abort && file->pending && (buffer = _dtp_fill_buffer(dtp)) != NULL) {
+    length = file->data_length - dtp->live_offset;
+    if (length > buffer->capacity) length = buffer->capacity;
+    memcpy(buffer->data, (const unsigned char *) file->data + dtp->live_offset, length);
+
+    // The writer flags the abort before it overwrites the span, so a copy made
+    // before the flag is seen is intact
+    __sync_synchronize();
+    if (file->abort) break;
+    buffer->length = length;
+    _dtp_seal_buffer(dtp);
+    dtp->live_offset += length;
+
+    // Hand the span back. The MRRB may hand over the next span right away.
+    if (dtp->live_offset >= file->data_length) {
+      dtp->live_offset = 0;
+      file->pending = 0;
+      mrrb_read_complete(file->mrrb, file);
+    }
+  }
+
+  // Drop the rest of the span if the MRRB overwrote it
+  if (file->abort) {
+    file->abort = 0;
+    file->pending = 0;
+    dtp->live_offset = 0;
+    mrrb_abort_complete(file->mrrb, file);
+  }
+
+  return _dtp_drain_to_socket(dtp);
+}
+
+void _live_file_wake(ftp_live_file_t *file) {
+  osThreadId_t thread = file->thread;
+
+  // The writer may be any thread, an ISR or inside a critical section. Setting
+  // a thread flag is safe from all of them, the socket API is not.
+  if (thread != NULL) {
+    (void) osThreadFlagsSet(thread, FTP_LIVE_FILE_FLAG_NEW_DATA);
+  }
+}
+
+void _live_file_data_notify(multi_reader_ring_buffer_t *mrrb,
+                            void *handle,
+                            const unsigned char *data,
+                            const unsigned int data_length) {
+  ftp_live_file_t *file = (ftp_live_file_t *) handle;
+  (void) mrrb;
+
+  // Called from the context of the writer, only record the span for the DTP
+  file->data = data;
+  file->data_length = data_length;
+  file->pending = 1;
+  _live_file_wake(file);
+}
+
+void _live_file_data_abort(multi_reader_ring_buffer_t *mrrb,
+                           void *handle) {
+  ftp_live_file_t *file = (ftp_live_file_t *) handle;
+
+  if (file->attached) {
+    // The DTP completes the abort once it stopped using the span
+    file->abort = 1;
+    _live_file_wake(file);
+  } else {
+    mrrb_abort_complete(mrrb, handle);
+  }
+}
+#endif /* FTP_SERVER_LIVE_FILES */
+
+int _wake_socket_open(struct sockaddr_in *address) {
+  int sd;
+  socklen_t len = sizeof(struct sockaddr_in);
+  struct sockaddr_in local;
+
+  // Open a UDP socket on the loopback address with an arbitrary port
+  if ((sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+    return -1;
+  }
+  memset(&local, 0x00, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = 0;
+  local.sin_addr.s_addr = PP_HTONL(INADDR_LOOPBACK);
+  if (bind(sd, (struct sockaddr *) &local, sizeof(local)) < 0 ||
+      getsockname(sd, (struct sockaddr *) &local, &len) < 0) {
+    close(sd);
+    return -1;
+  }
+
+  // Publish the address, the port last as it marks the address valid
+  address->sin_family = local.sin_family;
+  address->sin_addr.s_addr = local.sin_addr.s_addr;
+  address->sin_port = local.sin_port;
+  return sd;
+}
+
+void _wake_socket_signal(int sd, const struct sockaddr_in *address) {
+  const unsigned char token = 0;
+
+  // Nothing to wake if either side has no wake socket
+  if (sd < 0 || address->sin_port == 0) return;
+
+  // The receiver only needs to become readable, a dropped token is recovered by the select timeout
+  (void) sendto(sd, &token, sizeof(token), MSG_DONTWAIT, (const struct sockaddr *) address, sizeof(struct sockaddr_in));
+}
+
+void _wake_socket_drain(int sd) {
+  unsigned char tokens[8];
+
+  // Consume all pending tokens
+  while (recv(sd, tokens, sizeof(tokens), MSG_DONTWAIT) > 0);
+}
+
+int _wait_for_event(int read_sd, int write_sd, int wake_sd, uint32_t timeout) {
+  fd_set read_set, write_set;
+  struct timeval tv;
+  int max_sd = -1;
+  int events = 0;
+
+  FD_ZERO(&read_set);
+  FD_ZERO(&write_set);
+  if (read_sd >= 0) {
+    FD_SET(read_sd, &read_set);
+    if (read_sd > max_sd) max_sd = read_sd;
+  }
+  if (write_sd >= 0) {
+    FD_SET(write_sd, &write_set);
+    if (write_sd > max_sd) max_sd = write_sd;
+  }
+  if (wake_sd >= 0) {
+    FD_SET(wake_sd, &read_set);
+    if (wake_sd > max_sd) max_sd = wake_sd;
+  } else if (timeout == osWaitForever) {
+    // Without wake socket, never block indefinitely
+    timeout = FTP_SERVER_SELECT_TIMEOUT;
+  }
+
+  // Block until one of the sockets is ready or the timeout expired
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  if (select(max_sd + 1, &read_set, &write_set, NULL, (timeout == osWaitForever) ? NULL : &tv) < 0) {
+    return -1;
+  }
+
+  if (read_sd >= 0 && FD_ISSET(read_sd, &read_set)) events |= FTP_EVENT_READ;
+  if (write_sd >= 0 && FD_ISSET(write_sd, &write_set)) events |= FTP_EVENT_WRITE;
+  if (wake_sd >= 0 && FD_ISSET(wake_sd, &read_set)) events |= FTP_EVENT_WAKE;
+  return events;
+}
+
 void _dump_binary(const unsigned char *buff, unsigned int len) {
   while(len > 0) {
     unsigned int i;
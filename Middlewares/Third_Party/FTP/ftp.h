@@ -15,33 +15,96 @@ extern "C" {
 
 /* Includes ------------------------------------------------------------------*/
 
+// Live files are virtual files that stream the contents of an MRRB
+#ifndef FTP_SERVER_LIVE_FILES
+#define FTP_SERVER_LIVE_FILES             1
+#endif /* FTP_SERVER_LIVE_FILES */
+
+// Record per-session transfer statistics, reported by SITE STATS
+#ifndef FTP_SERVER_STATS
+#define FTP_SERVER_STATS                  1
+#endif /* FTP_SERVER_STATS */
+
+// Compressed transfers (MODE Z) through a static pool of zlib streams
+#ifndef FTP_SERVER_MODE_Z
+#define FTP_SERVER_MODE_Z                 1
+#endif /* FTP_SERVER_MODE_Z */
+
+// Serve all sessions from a single thread that multiplexes the control and data
+// connections with select(), instead of running a PI and a DTP thread per session
+#ifndef FTP_SERVER_MULTIPLEX
+#define FTP_SERVER_MULTIPLEX              0
+#endif /* FTP_SERVER_MULTIPLEX */
+
 // Operating System
 #include "cmsis_os.h"
 
+// Ring buffer for live files
+#if FTP_SERVER_LIVE_FILES
+#include "mrrb.h"
+#endif /* FTP_SERVER_LIVE_FILES */
+
 /* Exported constants --------------------------------------------------------*/
 
 #define FTP_SERVER_MAX_PI_NUM             4
 
 #define FTP_SERVER_RESPONSE_MESSAGE       1
 
+#ifndef FTP_SERVER_DEFAULT_CONTROL_PORT
 #define FTP_SERVER_DEFAULT_CONTROL_PORT   21
+#endif /* FTP_SERVER_DEFAULT_CONTROL_PORT */
 #define FTP_SERVER_DEFAULT_DATA_PORT     (FTP_SERVER_DEFAULT_CONTROL_PORT - 1)
 
 #define FTP_SERVER_RECV_BUF_LEN           200
 #define FTP_SERVER_SEND_BUF_LEN           200
 #define FTP_SERVER_PATH_BUF_LEN           200
-#define FTP_SERVER_DTP_BUFFER_LEN         600
+#ifndef FTP_SERVER_DTP_BUFFER_LEN
+#define FTP_SERVER_DTP_BUFFER_LEN        2048
+#endif /* FTP_SERVER_DTP_BUFFER_LEN */
+#ifndef FTP_SERVER_DTP_NUM_BUFFERS
+#define FTP_SERVER_DTP_NUM_BUFFERS          2
+#endif /* FTP_SERVER_DTP_NUM_BUFFERS */
+#define FTP_SERVER_DTP_FORWARD_LEN       2048
+#define FTP_SERVER_DTP_CLMT_LEN            32
+#define FTP_SERVER_LIST_CACHE_NUM           2
+#define FTP_SERVER_LIST_CACHE_LEN        4096
+#define FTP_SERVER_LIST_CACHE_PATH_LEN     64
 
 #define FTP_SERVER_THREAD_STACKSIZE      1536
 #define FTP_SERVER_PI_THREAD_STACKSIZE   2048
 #define FTP_SERVER_DTP_THREAD_STACKSIZE  3072
 
+// Sessions of the multiplexing server. A session only costs its state and DTP
+// buffers (~6.5 KB), but up to three sockets (control, passive and data).
+#define FTP_SERVER_MUX_MAX_SESSIONS        8
+#define FTP_SERVER_MUX_THREAD_STACKSIZE  4096
+
 #define FTP_MAX_USERNAME_LEN              16
 #define FTP_MAX_PASSWORD_LEN              16
 #define FTP_MAX_ACCOUNT_LEN               16
 
 #define FTP_SERVER_DEFAULT_TIMEOUT        50
 
+// Maximum time in ms a PI or DTP blocks in select() before re-checking its
+// message queue. Only relevant if a wake-up datagram gets lost. The PI waits
+// this long plus FTP_SERVER_DEFAULT_TIMEOUT for a closed DTP to exit.
+#define FTP_SERVER_SELECT_TIMEOUT        1000
+
+// Number of live files that can be registered and the interval in ms at which
+// a streaming DTP checks its live file for new data if the MRRB cannot wake it.
+#define FTP_SERVER_MAX_LIVE_FILES          2
+#define FTP_SERVER_LIVE_POLL_INTERVAL     20
+
+// Interval in ms at which the statistics of a running transfer are logged.
+// Set to 0 to only log a summary at the end of each transfer.
+#define FTP_SERVER_STATS_LOG_INTERVAL   5000
+
+// Number of MODE Z transfers that can run at the same time. Each one holds a
+// zlib stream of about 35 KB (see ftp_zlib.h) and an output buffer for the
+// compressed data waiting to be sent.
+#define FTP_SERVER_MODE_Z_NUM_STREAMS      1
+#define FTP_SERVER_MODE_Z_OUTPUT_LEN    1024
+
 /* Exported macros -----------------------------------------------------------*/
 
 /* Exported types ------------------------------------------------------------*/
@@ -62,12 +125,33 @@ typedef enum {
 
 typedef ftp_login_result_t (*ftp_credentials_check_fn)(char *username, char *password, char *account, ftp_permission_t* perm);
 
+#if FTP_SERVER_LIVE_FILES
+typedef struct {
+  const char *path;
+  multi_reader_ring_buffer_t *mrrb;
+  ring_buffer_reader_t *reader;
+  volatile const unsigned char *data; /*!< Span handed over by the MRRB */
+  volatile unsigned int data_length;
+  volatile int pending;               /*!< Span is waiting to be sent */
+  volatile int abort;                 /*!< MRRB requested to abort the span */
+  volatile int attached;              /*!< A DTP is streaming the file */
+  volatile osThreadId_t thread;       /*!< DTP thread woken when the MRRB notifies */
+} ftp_live_file_t;
+#endif /* FTP_SERVER_LIVE_FILES */
+
 /* Exported variables --------------------------------------------------------*/
 
 /* Exported functions --------------------------------------------------------*/
 
 osThreadId_t ftp_server_init(void);
 
+#if FTP_SERVER_LIVE_FILES
+int ftp_server_live_file_init(ftp_live_file_t *file,
+                              const char *path,
+                              multi_reader_ring_buffer_t *mrrb,
+                              ring_buffer_reader_t *reader);
+#endif /* FTP_SERVER_LIVE_FILES */
+
 #ifdef __cplusplus
 }
 #endif
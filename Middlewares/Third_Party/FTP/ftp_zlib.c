@@ -0,0 +1,834 @@
+/**
+ * @file       ftp_zlib.c
+ * @brief      Streaming zlib (RFC 1950/1951) codec for MODE Z transfers
+ *
+ * The compressor finds matches greedily over hash chains and buffers the
+ * symbols of a block. The block is then written with fixed Huffman codes, or
+ * stored if that is smaller, so incompressible data grows by a few Bytes per
+ * block only. It never needs more than a few Bytes of output space per step,
+ * so it can stop and resume at any point.
+ *
+ * The decompressor buffers its input, so each step (a block header or a
+ * symbol) can be retried from the start once more data arrived. Output is
+ * written into the window, from where the caller takes it.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "ftp_zlib.h"
+
+/* Private defines -----------------------------------------------------------*/
+
+#define ZLIB_MIN_MATCH          3
+#define ZLIB_MAX_MATCH        258
+#define ZLIB_ADLER_BASE    65521U
+#define ZLIB_ADLER_NMAX      5552
+
+// Keep enough data ahead to find a full match, and never reach back further
+// than the window the decompressor was told about
+#define DEFLATE_MIN_LOOKAHEAD (ZLIB_MAX_MATCH + ZLIB_MIN_MATCH + 1)
+#define DEFLATE_MAX_DIST      (FTP_DEFLATE_WINDOW_SIZE - DEFLATE_MIN_LOOKAHEAD)
+#define DEFLATE_WINDOW_MASK   (FTP_DEFLATE_WINDOW_SIZE - 1)
+
+// A block ends early enough that its data stays in the window when it slides,
+// so a stored block can be copied from there
+#define DEFLATE_BLOCK_LEN     (DEFLATE_MAX_DIST - ZLIB_MAX_MATCH)
+#define INFLATE_WINDOW_MASK   (FTP_INFLATE_WINDOW_SIZE - 1)
+
+// check settings
+#if FTP_DEFLATE_WINDOW_BITS < 10 || FTP_DEFLATE_WINDOW_BITS > 15
+#error "Deflate window must be between 1 KB and 32 KB"
+#endif
+
+#if FTP_INFLATE_WINDOW_BITS < 8 || FTP_INFLATE_WINDOW_BITS > 15
+#error "Inflate window must be between 256 Bytes and 32 KB"
+#endif
+
+#if FTP_INFLATE_INPUT_LEN < 600
+#error "Inflate input buffer cannot hold a dynamic block header"
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+
+typedef enum {
+  DEFLATE_STATE_HEADER = 0,
+  DEFLATE_STATE_DATA,
+  DEFLATE_STATE_FIXED,
+  DEFLATE_STATE_STORED,
+  DEFLATE_STATE_DONE,
+} deflate_state_t;
+
+typedef enum {
+  INFLATE_STATE_HEADER = 0,
+  INFLATE_STATE_BLOCK,
+  INFLATE_STATE_STORED,
+  INFLATE_STATE_CODES,
+  INFLATE_STATE_COPY,
+  INFLATE_STATE_CHECK,
+  INFLATE_STATE_DONE,
+  INFLATE_STATE_ERROR,
+} inflate_state_t;
+
+/* Private function prototypes -----------------------------------------------*/
+
+uint32_t _adler32(uint32_t adler, const unsigned char *data, unsigned int length);
+unsigned int _reverse_bits(unsigned int code, unsigned int length);
+
+void _deflate_put_bits(ftp_deflate_t *z, uint32_t value, unsigned int length);
+void _deflate_put_symbol(ftp_deflate_t *z, unsigned int symbol);
+void _deflate_put_match(ftp_deflate_t *z, unsigned int length, unsigned int distance);
+void _deflate_record(ftp_deflate_t *z, unsigned int length, unsigned int distance);
+void _deflate_begin_block(ftp_deflate_t *z);
+void _deflate_end_block(ftp_deflate_t *z);
+unsigned int _deflate_insert(ftp_deflate_t *z, unsigned int pos);
+unsigned int _deflate_longest_match(ftp_deflate_t *z, unsigned int match, unsigned int *distance);
+void _deflate_slide(ftp_deflate_t *z);
+
+uint32_t _inflate_bits(ftp_inflate_t *z, unsigned int length);
+int _inflate_construct(ftp_inflate_huffman_t *h, const unsigned char *lengths, unsigned int n);
+int _inflate_decode(ftp_inflate_t *z, const ftp_inflate_huffman_t *h);
+int _inflate_fixed(ftp_inflate_t *z);
+int _inflate_dynamic(ftp_inflate_t *z);
+void _inflate_put(ftp_inflate_t *z, unsigned char value);
+void _inflate_advance(ftp_inflate_t *z, unsigned int length);
+void _inflate_adler_sync(ftp_inflate_t *z);
+int _inflate_step(ftp_inflate_t *z);
+
+/* Private variables ---------------------------------------------------------*/
+
+// Length and distance codes (RFC 1951, 3.2.5)
+const uint16_t _length_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+const unsigned char _length_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+const uint16_t _dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+
+const unsigned char _dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// Order in which the code length code lengths are sent (RFC 1951, 3.2.7)
+const unsigned char _code_length_order[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+/* Exported functions --------------------------------------------------------*/
+
+void ftp_deflate_init(ftp_deflate_t *z) {
+  memset(z->head, 0x00, sizeof(z->head));
+  memset(z->prev, 0x00, sizeof(z->prev));
+  z->strstart = 0;
+  z->lookahead = 0;
+  z->adler = 1;
+  z->bitbuf = 0;
+  z->bitcnt = 0;
+  z->state = DEFLATE_STATE_HEADER;
+  z->block_start = 0;
+  z->block_bits = 0;
+  z->sym_count = 0;
+  z->sym_pos = 0;
+}
+
+unsigned int ftp_deflate_input(ftp_deflate_t *z, const unsigned char *data, unsigned int data_length) {
+  unsigned int space;
+
+  if (z->state == DEFLATE_STATE_DONE) return 0;
+
+  // Make room once the upper half of the window is mostly compressed. The
+  // current block started in the upper half, see DEFLATE_BLOCK_LEN.
+  if (z->strstart >= FTP_DEFLATE_WINDOW_SIZE + DEFLATE_MAX_DIST) {
+    _deflate_slide(z);
+  }
+
+  // Append as much as fits behind the data not compressed yet
+  space = 2 * FTP_DEFLATE_WINDOW_SIZE - (z->strstart + z->lookahead);
+  if (data_length > space) {
+    data_length = space;
+  }
+  memcpy(&z->window[z->strstart + z->lookahead], data, data_length);
+  z->adler = _adler32(z->adler, data, data_length);
+  z->lookahead += data_length;
+  return data_length;
+}
+
+unsigned int ftp_deflate_output(ftp_deflate_t *z, unsigned char *out, unsigned int out_capacity, int finish) {
+  unsigned int match, length, distance = 0;
+  unsigned int cmf, flg;
+
+  z->out = out;
+  z->out_length = 0;
+  if (out_capacity < FTP_DEFLATE_MIN_OUTPUT) return 0;
+
+  if (z->state == DEFLATE_STATE_HEADER) {
+    // zlib header announcing the window size, without preset dictionary
+    cmf = ((FTP_DEFLATE_WINDOW_BITS - 8) << 4) | 8;
+    flg = 31 - ((cmf << 8) % 31);
+    z->out[z->out_length++] = cmf;
+    z->out[z->out_length++] = (flg == 31) ? 0 : flg;
+    z->state = DEFLATE_STATE_DATA;
+  }
+
+  // Each step writes at most FTP_DEFLATE_MIN_OUTPUT Bytes, except for stored
+  // data, which fills the output
+  while (z->state != DEFLATE_STATE_DONE && out_capacity - z->out_length >= FTP_DEFLATE_MIN_OUTPUT) {
+    if (z->state == DEFLATE_STATE_FIXED) {
+      // Write the buffered symbols, then the end of the block
+      if (z->sym_pos < z->sym_count) {
+        if (z->sym_dist[z->sym_pos] == 0) {
+          _deflate_put_symbol(z, z->sym_value[z->sym_pos]);
+        } else {
+          _deflate_put_match(z, z->sym_value[z->sym_pos] + ZLIB_MIN_MATCH, z->sym_dist[z->sym_pos]);
+        }
+        z->sym_pos++;
+      } else {
+        _deflate_put_symbol(z, 256);
+        _deflate_end_block(z);
+      }
+      continue;
+    }
+
+    if (z->state == DEFLATE_STATE_STORED) {
+      // Copy the data of the block from the window
+      length = z->strstart - z->block_start - z->sym_pos;
+      if (length > out_capacity - z->out_length) {
+        length = out_capacity - z->out_length;
+      }
+      memcpy(&z->out[z->out_length], &z->window[z->block_start + z->sym_pos], length);
+      z->out_length += length;
+      z->sym_pos += length;
+      if (z->block_start + z->sym_pos == z->strstart) {
+        _deflate_end_block(z);
+      }
+      continue;
+    }
+
+    // Write the block once it is full or the stream ends
+    if (z->sym_count == FTP_DEFLATE_BLOCK_SYMBOLS || z->strstart - z->block_start >= DEFLATE_BLOCK_LEN ||
+        (z->sym_count > 0 && z->lookahead == 0 && finish)) {
+      _deflate_begin_block(z);
+      continue;
+    }
+
+    if (z->lookahead == 0) {
+      if (!finish) break;
+      // Append an empty final block and the checksum of the input
+      _deflate_put_bits(z, 0x3, 3);
+      _deflate_put_symbol(z, 256);
+      if (z->bitcnt > 0) {
+        _deflate_put_bits(z, 0, 8 - z->bitcnt);
+      }
+      z->out[z->out_length++] = (z->adler >> 24) & 0xFF;
+      z->out[z->out_length++] = (z->adler >> 16) & 0xFF;
+      z->out[z->out_length++] = (z->adler >> 8) & 0xFF;
+      z->out[z->out_length++] = (z->adler >> 0) & 0xFF;
+      z->state = DEFLATE_STATE_DONE;
+      break;
+    }
+
+    // Wait for more input unless the stream ends, so matches are not cut short
+    if (z->lookahead < DEFLATE_MIN_LOOKAHEAD && !finish) break;
+
+    length = 0;
+    if (z->lookahead >= ZLIB_MIN_MATCH) {
+      match = _deflate_insert(z, z->strstart);
+      length = _deflate_longest_match(z, match, &distance);
+    }
+
+    if (length >= ZLIB_MIN_MATCH) {
+      _deflate_record(z, length, distance);
+      // Hash the skipped positions so later matches can refer to them
+      for (unsigned int i = 1; i < length; i++) {
+        if (z->lookahead - i >= ZLIB_MIN_MATCH) {
+          _deflate_insert(z, z->strstart + i);
+        }
+      }
+      z->strstart += length;
+      z->lookahead -= length;
+    } else {
+      _deflate_record(z, 1, 0);
+      z->strstart++;
+      z->lookahead--;
+    }
+  }
+  return z->out_length;
+}
+
+int ftp_deflate_done(const ftp_deflate_t *z) {
+  return z->state == DEFLATE_STATE_DONE;
+}
+
+void ftp_inflate_init(ftp_inflate_t *z) {
+  z->in_length = 0;
+  z->in_pos = 0;
+  z->bitbuf = 0;
+  z->bitcnt = 0;
+  z->underflow = 0;
+  z->state = INFLATE_STATE_HEADER;
+  z->last_block = 0;
+  z->pos = 0;
+  z->taken = 0;
+  z->have = 0;
+  z->copy_length = 0;
+  z->copy_distance = 0;
+  z->adler = 1;
+  z->adler_pos = 0;
+}
+
+ftp_inflate_status_t ftp_inflate(ftp_inflate_t *z,
+                                 const unsigned char *data,
+                                 unsigned int data_length,
+                                 unsigned int *consumed)
+{
+  unsigned int in_pos, bitcnt;
+  uint32_t bitbuf;
+  int progress;
+
+  *consumed = 0;
+  if (z->state == INFLATE_STATE_ERROR) return FTP_INFLATE_ERROR;
+  if (z->state == INFLATE_STATE_DONE) {
+    // Anything after the end of the stream is ignored
+    *consumed = data_length;
+    return FTP_INFLATE_DONE;
+  }
+
+  // Append the new data behind the input not decoded yet
+  if (z->in_pos > 0) {
+    memmove(z->in, &z->in[z->in_pos], z->in_length - z->in_pos);
+    z->in_length -= z->in_pos;
+    z->in_pos = 0;
+  }
+  if (data_length > FTP_INFLATE_INPUT_LEN - z->in_length) {
+    data_length = FTP_INFLATE_INPUT_LEN - z->in_length;
+  }
+  if (data_length > 0) {
+    memcpy(&z->in[z->in_length], data, data_length);
+    z->in_length += data_length;
+    *consumed = data_length;
+  }
+
+  // Decode until the input runs out or the output must be taken first
+  while (z->state != INFLATE_STATE_DONE && z->state != INFLATE_STATE_ERROR && z->pos < FTP_INFLATE_WINDOW_SIZE) {
+    in_pos = z->in_pos;
+    bitbuf = z->bitbuf;
+    bitcnt = z->bitcnt;
+    progress = _inflate_step(z);
+    if (z->underflow) {
+      // Roll back the incomplete step and retry it with more input
+      z->in_pos = in_pos;
+      z->bitbuf = bitbuf;
+      z->bitcnt = bitcnt;
+      z->underflow = 0;
+      break;
+    }
+    if (!progress) break;
+  }
+
+  if (z->state == INFLATE_STATE_ERROR) return FTP_INFLATE_ERROR;
+  if (z->state == INFLATE_STATE_DONE) return FTP_INFLATE_DONE;
+  return FTP_INFLATE_OK;
+}
+
+unsigned int ftp_inflate_take(ftp_inflate_t *z, const unsigned char **data) {
+  unsigned int length = z->pos - z->taken;
+
+  _inflate_adler_sync(z);
+  *data = &z->window[z->taken];
+  z->taken = z->pos;
+
+  // The end of the window was handed out, continue at its start
+  if (z->pos == FTP_INFLATE_WINDOW_SIZE) {
+    z->pos = 0;
+    z->taken = 0;
+    z->adler_pos = 0;
+  }
+  return length;
+}
+
+int ftp_inflate_done(const ftp_inflate_t *z) {
+  return z->state == INFLATE_STATE_DONE;
+}
+
+/* Private functions ---------------------------------------------------------*/
+
+uint32_t _adler32(uint32_t adler, const unsigned char *data, unsigned int length) {
+  uint32_t a = adler & 0xFFFF;
+  uint32_t b = adler >> 16;
+  unsigned int n;
+
+  // Reduce only every NMAX Bytes, before b can overflow
+  while (length > 0) {
+    n = (length < ZLIB_ADLER_NMAX) ? length : ZLIB_ADLER_NMAX;
+    length -= n;
+    while (n-- > 0) {
+      a += *data++;
+      b += a;
+    }
+    a %= ZLIB_ADLER_BASE;
+    b %= ZLIB_ADLER_BASE;
+  }
+  return (b << 16) | a;
+}
+
+unsigned int _reverse_bits(unsigned int code, unsigned int length) {
+  // Huffman codes are packed starting with the most significant bit
+  code = ((code & 0x5555U) << 1) | ((code >> 1) & 0x5555U);
+  code = ((code & 0x3333U) << 2) | ((code >> 2) & 0x3333U);
+  code = ((code & 0x0F0FU) << 4) | ((code >> 4) & 0x0F0FU);
+  code = ((code & 0x00FFU) << 8) | ((code >> 8) & 0x00FFU);
+  return code >> (16 - length);
+}
+
+void _deflate_put_bits(ftp_deflate_t *z, uint32_t value, unsigned int length) {
+  z->bitbuf |= value << z->bitcnt;
+  z->bitcnt += length;
+  while (z->bitcnt >= 8) {
+    z->out[z->out_length++] = z->bitbuf & 0xFF;
+    z->bitbuf >>= 8;
+    z->bitcnt -= 8;
+  }
+}
+
+void _deflate_put_symbol(ftp_deflate_t *z, unsigned int symbol) {
+  // Fixed literal/length code (RFC 1951, 3.2.6)
+  if (symbol < 144) {
+    _deflate_put_bits(z, _reverse_bits(0x30 + symbol, 8), 8);
+  } else if (symbol < 256) {
+    _deflate_put_bits(z, _reverse_bits(0x190 + symbol - 144, 9), 9);
+  } else if (symbol < 280) {
+    _deflate_put_bits(z, _reverse_bits(symbol - 256, 7), 7);
+  } else {
+    _deflate_put_bits(z, _reverse_bits(0xC0 + symbol - 280, 8), 8);
+  }
+}
+
+void _deflate_put_match(ftp_deflate_t *z, unsigned int length, unsigned int distance) {
+  unsigned int code;
+
+  code = 28;
+  while (_length_base[code] > length) code--;
+  _deflate_put_symbol(z, 257 + code);
+  _deflate_put_bits(z, length - _length_base[code], _length_extra[code]);
+
+  code = 29;
+  while (_dist_base[code] > distance) code--;
+  _deflate_put_bits(z, _reverse_bits(code, 5), 5);
+  _deflate_put_bits(z, distance - _dist_base[code], _dist_extra[code]);
+}
+
+void _deflate_record(ftp_deflate_t *z, unsigned int length, unsigned int distance) {
+  unsigned int code;
+
+  // Count the bits the symbol takes with the fixed codes (RFC 1951, 3.2.6)
+  if (distance == 0) {
+    z->sym_value[z->sym_count] = z->window[z->strstart];
+    z->block_bits += (z->window[z->strstart] < 144) ? 8 : 9;
+  } else {
+    z->sym_value[z->sym_count] = length - ZLIB_MIN_MATCH;
+    code = 28;
+    while (_length_base[code] > length) code--;
+    z->block_bits += ((code < 280 - 257) ? 7 : 8) + _length_extra[code];
+    code = 29;
+    while (_dist_base[code] > distance) code--;
+    z->block_bits += 5 + _dist_extra[code];
+  }
+  z->sym_dist[z->sym_count++] = distance;
+}
+
+void _deflate_begin_block(ftp_deflate_t *z) {
+  unsigned int length = z->strstart - z->block_start;
+  // A stored block starts at a Byte boundary after its header and LEN, NLEN
+  uint32_t stored_bits = 3 + ((8 - ((z->bitcnt + 3) & 7)) & 7) + 32 + 8 * length;
+  uint32_t fixed_bits = 3 + z->block_bits + 7;
+
+  z->sym_pos = 0;
+  if (stored_bits < fixed_bits) {
+    _deflate_put_bits(z, 0x0, 3);
+    if (z->bitcnt > 0) {
+      _deflate_put_bits(z, 0, 8 - z->bitcnt);
+    }
+    z->out[z->out_length++] = length & 0xFF;
+    z->out[z->out_length++] = (length >> 8) & 0xFF;
+    z->out[z->out_length++] = ~length & 0xFF;
+    z->out[z->out_length++] = (~length >> 8) & 0xFF;
+    z->state = DEFLATE_STATE_STORED;
+  } else {
+    _deflate_put_bits(z, 0x2, 3);
+    z->state = DEFLATE_STATE_FIXED;
+  }
+}
+
+void _deflate_end_block(ftp_deflate_t *z) {
+  z->block_start = z->strstart;
+  z->block_bits = 0;
+  z->sym_count = 0;
+  z->sym_pos = 0;
+  z->state = DEFLATE_STATE_DATA;
+}
+
+unsigned int _deflate_insert(ftp_deflate_t *z, unsigned int pos) {
+  const unsigned char *p = &z->window[pos];
+  uint32_t key = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+  unsigned int hash = (key * 2654435761U) >> (32 - FTP_DEFLATE_HASH_BITS);
+  unsigned int match = z->head[hash];
+
+  // Chain the position in front of the previous one with the same hash
+  z->prev[pos & DEFLATE_WINDOW_MASK] = match;
+  z->head[hash] = pos;
+  return match;
+}
+
+unsigned int _deflate_longest_match(ftp_deflate_t *z, unsigned int match, unsigned int *distance) {
+  const unsigned char *scan = &z->window[z->strstart];
+  const unsigned char *candidate;
+  unsigned int limit = (z->strstart > DEFLATE_MAX_DIST) ? z->strstart - DEFLATE_MAX_DIST : 0;
+  unsigned int max_length = (z->lookahead < ZLIB_MAX_MATCH) ? z->lookahead : ZLIB_MAX_MATCH;
+  unsigned int best = ZLIB_MIN_MATCH - 1;
+  unsigned int chain = FTP_DEFLATE_MAX_CHAIN;
+  unsigned int length;
+
+  // Position 0 doubles as the end of a chain and is never matched
+  while (match > limit && chain-- > 0) {
+    candidate = &z->window[match];
+    // Only compare candidates that could beat the best match so far
+    if (candidate[best] == scan[best] && candidate[0] == scan[0] && candidate[1] == scan[1]) {
+      length = 2;
+      while (length < max_length && candidate[length] == scan[length]) {
+        length++;
+      }
+      if (length > best) {
+        best = length;
+        *distance = z->strstart - match;
+        if (length >= FTP_DEFLATE_NICE_MATCH || length == max_length) break;
+      }
+    }
+    match = z->prev[match & DEFLATE_WINDOW_MASK];
+  }
+  return best;
+}
+
+void _deflate_slide(ftp_deflate_t *z) {
+  // Drop the lower half of the window and move all positions along
+  memcpy(z->window, &z->window[FTP_DEFLATE_WINDOW_SIZE], FTP_DEFLATE_WINDOW_SIZE);
+  z->strstart -= FTP_DEFLATE_WINDOW_SIZE;
+  z->block_start -= FTP_DEFLATE_WINDOW_SIZE;
+  for (unsigned int i = 0; i < (1U << FTP_DEFLATE_HASH_BITS); i++) {
+    z->head[i] = (z->head[i] >= FTP_DEFLATE_WINDOW_SIZE) ? z->head[i] - FTP_DEFLATE_WINDOW_SIZE : 0;
+  }
+  for (unsigned int i = 0; i < FTP_DEFLATE_WINDOW_SIZE; i++) {
+    z->prev[i] = (z->prev[i] >= FTP_DEFLATE_WINDOW_SIZE) ? z->prev[i] - FTP_DEFLATE_WINDOW_SIZE : 0;
+  }
+}
+
+uint32_t _inflate_bits(ftp_inflate_t *z, unsigned int length) {
+  uint32_t value;
+
+  while (z->bitcnt < length) {
+    if (z->in_pos >= z->in_length) {
+      z->underflow = 1;
+      return 0;
+    }
+    z->bitbuf |= (uint32_t) z->in[z->in_pos++] << z->bitcnt;
+    z->bitcnt += 8;
+  }
+  value = z->bitbuf & ((1UL << length) - 1);
+  z->bitbuf >>= length;
+  z->bitcnt -= length;
+  return value;
+}
+
+int _inflate_construct(ftp_inflate_huffman_t *h, const unsigned char *lengths, unsigned int n) {
+  uint16_t offs[16];
+  int left;
+
+  // Count the codes of each length
+  memset(h->count, 0x00, sizeof(h->count));
+  for (unsigned int symbol = 0; symbol < n; symbol++) {
+    h->count[lengths[symbol]]++;
+  }
+  if (h->count[0] == n) return 0;
+
+  // Check for an over-subscribed or incomplete set of lengths
+  left = 1;
+  for (unsigned int len = 1; len < 16; len++) {
+    left <<= 1;
+    left -= h->count[len];
+    if (left < 0) return left;
+  }
+
+  // Sort the symbols by code length
+  offs[1] = 0;
+  for (unsigned int len = 1; len < 15; len++) {
+    offs[len + 1] = offs[len] + h->count[len];
+  }
+  for (unsigned int symbol = 0; symbol < n; symbol++) {
+    if (lengths[symbol] != 0) {
+      h->symbol[offs[lengths[symbol]]++] = symbol;
+    }
+  }
+  return left;
+}
+
+int _inflate_decode(ftp_inflate_t *z, const ftp_inflate_huffman_t *h) {
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  int count;
+
+  // Canonical codes of each length follow the ones of the previous length
+  for (unsigned int len = 1; len < 16; len++) {
+    code |= _inflate_bits(z, 1);
+    if (z->underflow) return -1;
+    count = h->count[len];
+    if (code - count < first) {
+      return h->symbol[index + (code - first)];
+    }
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+int _inflate_fixed(ftp_inflate_t *z) {
+  unsigned int symbol;
+
+  // Fixed literal/length and distance codes (RFC 1951, 3.2.6)
+  for (symbol = 0; symbol < 144; symbol++) z->lengths[symbol] = 8;
+  for (; symbol < 256; symbol++) z->lengths[symbol] = 9;
+  for (; symbol < 280; symbol++) z->lengths[symbol] = 7;
+  for (; symbol < 288; symbol++) z->lengths[symbol] = 8;
+  _inflate_construct(&z->lencode, z->lengths, 288);
+  for (symbol = 0; symbol < 30; symbol++) z->lengths[symbol] = 5;
+  _inflate_construct(&z->distcode, z->lengths, 30);
+  return 0;
+}
+
+int _inflate_dynamic(ftp_inflate_t *z) {
+  unsigned int nlen, ndist, ncode, index, repeat;
+  unsigned char len;
+  int symbol, err;
+
+  nlen = _inflate_bits(z, 5) + 257;
+  ndist = _inflate_bits(z, 5) + 1;
+  ncode = _inflate_bits(z, 4) + 4;
+  if (z->underflow) return 0;
+  if (nlen > 286 || ndist > 30) return -1;
+
+  // Code lengths of the code length code
+  for (index = 0; index < ncode; index++) {
+    z->lengths[_code_length_order[index]] = _inflate_bits(z, 3);
+  }
+  for (; index < 19; index++) {
+    z->lengths[_code_length_order[index]] = 0;
+  }
+  if (z->underflow) return 0;
+  if (_inflate_construct(&z->lencode, z->lengths, 19) != 0) return -1;
+
+  // Code lengths of the literal/length and distance codes
+  index = 0;
+  while (index < nlen + ndist) {
+    symbol = _inflate_decode(z, &z->lencode);
+    if (z->underflow) return 0;
+    if (symbol < 0) return -1;
+    if (symbol < 16) {
+      z->lengths[index++] = symbol;
+    } else {
+      len = 0;
+      if (symbol == 16) {
+        if (index == 0) return -1;
+        len = z->lengths[index - 1];
+        repeat = 3 + _inflate_bits(z, 2);
+      } else if (symbol == 17) {
+        repeat = 3 + _inflate_bits(z, 3);
+      } else {
+        repeat = 11 + _inflate_bits(z, 7);
+      }
+      if (z->underflow) return 0;
+      if (index + repeat > nlen + ndist) return -1;
+      while (repeat-- > 0) {
+        z->lengths[index++] = len;
+      }
+    }
+  }
+
+  // A block without end of block code cannot end
+  if (z->lengths[256] == 0) return -1;
+
+  // Only a single code may be incomplete
+  err = _inflate_construct(&z->lencode, z->lengths, nlen);
+  if (err < 0 || (err > 0 && nlen - z->lencode.count[0] != 1)) return -1;
+  err = _inflate_construct(&z->distcode, &z->lengths[nlen], ndist);
+  if (err < 0 || (err > 0 && ndist - z->distcode.count[0] != 1)) return -1;
+  return 0;
+}
+
+void _inflate_put(ftp_inflate_t *z, unsigned char value) {
+  z->window[z->pos] = value;
+  _inflate_advance(z, 1);
+}
+
+void _inflate_advance(ftp_inflate_t *z, unsigned int length) {
+  z->pos += length;
+  z->have = (z->have + length < FTP_INFLATE_WINDOW_SIZE) ? z->have + length : FTP_INFLATE_WINDOW_SIZE;
+}
+
+void _inflate_adler_sync(ftp_inflate_t *z) {
+  z->adler = _adler32(z->adler, &z->window[z->adler_pos], z->pos - z->adler_pos);
+  z->adler_pos = z->pos;
+}
+
+int _inflate_step(ftp_inflate_t *z) {
+  unsigned int cmf, flg, type, length;
+  uint32_t check;
+  int symbol;
+
+  switch (z->state) {
+    case INFLATE_STATE_HEADER:
+      cmf = _inflate_bits(z, 8);
+      flg = _inflate_bits(z, 8);
+      if (z->underflow) return 0;
+      // Deflate without preset dictionary, within the window size
+      if ((cmf & 0x0F) != 8 ||
+          (cmf >> 4) + 8 > FTP_INFLATE_WINDOW_BITS ||
+          ((cmf << 8) | flg) % 31 != 0 ||
+          (flg & 0x20)) {
+        z->state = INFLATE_STATE_ERROR;
+        return 0;
+      }
+      z->state = INFLATE_STATE_BLOCK;
+      return 1;
+    case INFLATE_STATE_BLOCK:
+      z->last_block = _inflate_bits(z, 1);
+      type = _inflate_bits(z, 2);
+      if (z->underflow) return 0;
+      if (type == 0) {
+        // Stored block, its length follows at the next Byte boundary
+        _inflate_bits(z, z->bitcnt & 7);
+        length = _inflate_bits(z, 16);
+        check = _inflate_bits(z, 16);
+        if (z->underflow) return 0;
+        if (length != (~check & 0xFFFF)) {
+          z->state = INFLATE_STATE_ERROR;
+          return 0;
+        }
+        z->copy_length = length;
+        z->state = INFLATE_STATE_STORED;
+      } else if (type == 1) {
+        _inflate_fixed(z);
+        z->state = INFLATE_STATE_CODES;
+      } else if (type == 2) {
+        if (_inflate_dynamic(z) < 0) {
+          z->state = INFLATE_STATE_ERROR;
+          return 0;
+        }
+        if (z->underflow) return 0;
+        z->state = INFLATE_STATE_CODES;
+      } else {
+        z->state = INFLATE_STATE_ERROR;
+        return 0;
+      }
+      return 1;
+    case INFLATE_STATE_STORED:
+      // Output is committed as it is copied, so this step never rolls back
+      while (z->copy_length > 0 && z->pos < FTP_INFLATE_WINDOW_SIZE) {
+        if (z->bitcnt >= 8) {
+          _inflate_put(z, _inflate_bits(z, 8));
+          z->copy_length--;
+        } else if (z->in_pos < z->in_length) {
+          length = z->copy_length;
+          if (length > FTP_INFLATE_WINDOW_SIZE - z->pos) length = FTP_INFLATE_WINDOW_SIZE - z->pos;
+          if (length > z->in_length - z->in_pos) length = z->in_length - z->in_pos;
+          memcpy(&z->window[z->pos], &z->in[z->in_pos], length);
+          z->in_pos += length;
+          z->copy_length -= length;
+          _inflate_advance(z, length);
+        } else {
+          return 0;
+        }
+      }
+      if (z->copy_length == 0) {
+        z->state = z->last_block ? INFLATE_STATE_CHECK : INFLATE_STATE_BLOCK;
+      }
+      return 1;
+    case INFLATE_STATE_CODES:
+      symbol = _inflate_decode(z, &z->lencode);
+      if (z->underflow) return 0;
+      if (symbol < 0 || symbol > 285) {
+        z->state = INFLATE_STATE_ERROR;
+        return 0;
+      }
+      if (symbol < 256) {
+        _inflate_put(z, symbol);
+        return 1;
+      }
+      if (symbol == 256) {
+        z->state = z->last_block ? INFLATE_STATE_CHECK : INFLATE_STATE_BLOCK;
+        return 1;
+      }
+      // Length and distance of a match
+      symbol -= 257;
+      length = _length_base[symbol] + _inflate_bits(z, _length_extra[symbol]);
+      symbol = _inflate_decode(z, &z->distcode);
+      if (z->underflow) return 0;
+      if (symbol < 0 || symbol > 29) {
+        z->state = INFLATE_STATE_ERROR;
+        return 0;
+      }
+      z->copy_distance = _dist_base[symbol] + _inflate_bits(z, _dist_extra[symbol]);
+      if (z->underflow) return 0;
+      if (z->copy_distance > z->have) {
+        z->state = INFLATE_STATE_ERROR;
+        return 0;
+      }
+      z->copy_length = length;
+      z->state = INFLATE_STATE_COPY;
+      return 1;
+    case INFLATE_STATE_COPY:
+      // Copy Byte by Byte, as source and destination may overlap
+      while (z->copy_length > 0 && z->pos < FTP_INFLATE_WINDOW_SIZE) {
+        _inflate_put(z, z->window[(z->pos - z->copy_distance) & INFLATE_WINDOW_MASK]);
+        z->copy_length--;
+      }
+      if (z->copy_length == 0) {
+        z->state = INFLATE_STATE_CODES;
+      }
+      return 1;
+    case INFLATE_STATE_CHECK:
+      // Adler-32 of the output in big endian, at the next Byte boundary
+      _inflate_bits(z, z->bitcnt & 7);
+      check = _inflate_bits(z, 8) << 24;
+      check |= _inflate_bits(z, 8) << 16;
+      check |= _inflate_bits(z, 8) << 8;
+      check |= _inflate_bits(z, 8);
+      if (z->underflow) return 0;
+      _inflate_adler_sync(z);
+      z->state = (check == z->adler) ? INFLATE_STATE_DONE : INFLATE_STATE_ERROR;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,127 @@
+/**
+ * @file       ftp_zlib.h
+ * @brief      Streaming zlib (RFC 1950/1951) codec for MODE Z transfers
+ *
+ * The compressor uses fixed Huffman codes, or stored blocks for data that
+ * does not compress, and a small window, so its state fits in a few KB. The decompressor accepts any valid stream and therefore
+ * needs the full 32 KB window. Neither allocates memory.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __FTP_ZLIB_H
+#define __FTP_ZLIB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+/* Exported constants --------------------------------------------------------*/
+
+// Compressor window (at most 15) and hash table size. Longer hash chains
+// compress better but take more time per Byte.
+#define FTP_DEFLATE_WINDOW_BITS           12
+#define FTP_DEFLATE_HASH_BITS             11
+#define FTP_DEFLATE_MAX_CHAIN             16
+#define FTP_DEFLATE_NICE_MATCH            64
+
+// Symbols buffered per block (3 Bytes each), so a block that would grow with
+// fixed codes can be sent stored instead
+#define FTP_DEFLATE_BLOCK_SYMBOLS       1024
+
+// Output space required by ftp_deflate_output to make progress
+#define FTP_DEFLATE_MIN_OUTPUT             8
+
+// The decompressor window must hold the largest distance a client may use.
+// The input buffer must hold the largest dynamic block header (~570 Bytes).
+#define FTP_INFLATE_WINDOW_BITS           15
+#define FTP_INFLATE_INPUT_LEN           1024
+
+#define FTP_DEFLATE_WINDOW_SIZE          (1U << FTP_DEFLATE_WINDOW_BITS)
+#define FTP_INFLATE_WINDOW_SIZE          (1U << FTP_INFLATE_WINDOW_BITS)
+
+/* Exported types ------------------------------------------------------------*/
+
+typedef enum {
+  FTP_INFLATE_ERROR = -1,
+  FTP_INFLATE_OK = 0,     /*!< More input is expected */
+  FTP_INFLATE_DONE = 1,   /*!< The end of the stream was reached and verified */
+} ftp_inflate_status_t;
+
+typedef struct {
+  unsigned char window[2 * FTP_DEFLATE_WINDOW_SIZE];
+  uint16_t head[1U << FTP_DEFLATE_HASH_BITS];
+  uint16_t prev[FTP_DEFLATE_WINDOW_SIZE];
+  unsigned int strstart;  /*!< Position of the next Byte to compress */
+  unsigned int lookahead; /*!< Number of Bytes not compressed yet */
+  uint32_t adler;
+  uint32_t bitbuf;
+  unsigned int bitcnt;
+  int state;
+  unsigned int block_start; /*!< Window position of the first Byte of the current block */
+  uint32_t block_bits;      /*!< Size of the current block's symbols with fixed codes */
+  unsigned int sym_count;
+  unsigned int sym_pos;     /*!< Next symbol or stored Byte of the block to write */
+  uint16_t sym_dist[FTP_DEFLATE_BLOCK_SYMBOLS];   /*!< 0 for literals */
+  unsigned char sym_value[FTP_DEFLATE_BLOCK_SYMBOLS]; /*!< Literal or match length - 3 */
+  unsigned char *out;
+  unsigned int out_length;
+} ftp_deflate_t;
+
+typedef struct {
+  uint16_t count[16];
+  uint16_t symbol[288];
+} ftp_inflate_huffman_t;
+
+typedef struct {
+  unsigned char window[FTP_INFLATE_WINDOW_SIZE];
+  unsigned char in[FTP_INFLATE_INPUT_LEN];
+  unsigned int in_length;
+  unsigned int in_pos;
+  uint32_t bitbuf;
+  unsigned int bitcnt;
+  int underflow;
+  int state;
+  int last_block;
+  unsigned int pos;       /*!< Window position of the next output Byte */
+  unsigned int taken;     /*!< Window position up to which output was taken */
+  unsigned int have;      /*!< Number of valid history Bytes in the window */
+  unsigned int copy_length;
+  unsigned int copy_distance;
+  uint32_t adler;
+  unsigned int adler_pos;
+  ftp_inflate_huffman_t lencode;
+  ftp_inflate_huffman_t distcode;
+  unsigned char lengths[320];
+} ftp_inflate_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+void ftp_deflate_init(ftp_deflate_t *z);
+unsigned int ftp_deflate_input(ftp_deflate_t *z,
+                               const unsigned char *data,
+                               unsigned int data_length);
+unsigned int ftp_deflate_output(ftp_deflate_t *z,
+                                unsigned char *out,
+                                unsigned int out_capacity,
+                                int finish);
+int ftp_deflate_done(const ftp_deflate_t *z);
+
+void ftp_inflate_init(ftp_inflate_t *z);
+ftp_inflate_status_t ftp_inflate(ftp_inflate_t *z,
+                                 const unsigned char *data,
+                                 unsigned int data_length,
+                                 unsigned int *consumed);
+unsigned int ftp_inflate_take(ftp_inflate_t *z, const unsigned char **data);
+int ftp_inflate_done(const ftp_inflate_t *z);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FTP_ZLIB_H included
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Loopback throughput benchmark for the host build of the FTP server.
+
+Every client logs in on its own control connection and repeatedly stores a
+file, retrieves it again and lists the root directory. The aggregate
+throughput and the time per operation are printed at the end.
+"""
+
+import argparse
+import ftplib
+import io
+import os
+import sys
+import threading
+import time
+
+
+def connect(args, retries=20):
+    for _ in range(retries):
+        try:
+            ftp = ftplib.FTP()
+            ftp.connect(args.host, args.port, timeout=args.timeout)
+            ftp.login(args.user, args.password)
+            return ftp
+        except (ConnectionRefusedError, EOFError):
+            time.sleep(0.1)
+    raise RuntimeError("Could not connect to %s:%u" % (args.host, args.port))
+
+
+def client(index, args, payload, results, errors):
+    name = "/C%u.BIN" % index
+    timings = {"STOR": [], "RETR": [], "LIST": []}
+    try:
+        ftp = connect(args)
+        for _ in range(args.rounds):
+            start = time.perf_counter()
+            ftp.storbinary("STOR " + name, io.BytesIO(payload), blocksize=64 * 1024)
+            timings["STOR"].append(time.perf_counter() - start)
+
+            received = bytearray()
+            start = time.perf_counter()
+            ftp.retrbinary("RETR " + name, received.extend, blocksize=64 * 1024)
+            timings["RETR"].append(time.perf_counter() - start)
+            if received != payload:
+                raise RuntimeError("%s: retrieved %u of %u bytes, or content differs"
+                                   % (name, len(received), len(payload)))
+
+            start = time.perf_counter()
+            ftp.retrlines("LIST /", lambda line: None)
+            timings["LIST"].append(time.perf_counter() - start)
+        ftp.sendcmd("DELE " + name)
+        ftp.quit()
+    except Exception as exc:  # reported by the main thread
+        errors.append("client %u: %s" % (index, exc))
+    results[index] = timings
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=2121)
+    parser.add_argument("--user", default="admin")
+    parser.add_argument("--password", default="password")
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--size", type=float, default=8, help="file size in MiB")
+    parser.add_argument("--rounds", type=int, default=3)
+    parser.add_argument("--timeout", type=float, default=30)
+    args = parser.parse_args()
+
+    payload = os.urandom(int(args.size * 1024 * 1024))
+    results = [None] * args.clients
+    errors = []
+    threads = [threading.Thread(target=client, args=(i, args, payload, results, errors))
+               for i in range(args.clients)]
+
+    start = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - start
+
+    for error in errors:
+        print(error, file=sys.stderr)
+    if errors:
+        return 1
+
+    total = 2 * len(payload) * args.rounds * args.clients
+    print("%u clients, %u rounds of %.1f MiB: %.1f MiB in %.2f s, %.1f MiB/s"
+          % (args.clients, args.rounds, args.size, total / 2**20, elapsed, total / 2**20 / elapsed))
+    for op in ("STOR", "RETR", "LIST"):
+        samples = [t for timings in results for t in timings[op]]
+        line = "%s: avg %7.1f ms, max %7.1f ms" % (op, 1000 * sum(samples) / len(samples), 1000 * max(samples))
+        if op != "LIST":
+            line += ", %.1f MiB/s per client" % (len(payload) * len(samples) / 2**20 / sum(samples))
+        print(line)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,496 @@
+/**
+ * @file       cmsis_os.c
+ * @brief      CMSIS-RTOS2 subset on top of POSIX threads for host builds.
+ *
+ * Ticks are milliseconds. Priorities are recorded but not enforced, as
+ * the host scheduler is not a real time scheduler. Threads not created
+ * through osThreadNew share a descriptor, and thereby their thread flags.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "cmsis_os.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Private typedef -----------------------------------------------------------*/
+
+struct host_thread {
+  pthread_t thread;
+  osThreadFunc_t func;
+  void *argument;
+  osPriority_t priority;
+  char name[configMAX_TASK_NAME_LEN];
+  pthread_mutex_t flags_lock;
+  pthread_cond_t flags_set;
+  uint32_t flags;
+};
+
+struct host_message_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  uint32_t msg_count;
+  uint32_t msg_size;
+  uint32_t head;
+  uint32_t count;
+  unsigned char *data;
+};
+
+struct host_mutex {
+  pthread_mutex_t lock;
+};
+
+struct host_semaphore {
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  uint32_t max_count;
+  uint32_t count;
+};
+
+/* Private variables ---------------------------------------------------------*/
+
+static __thread struct host_thread *_current_thread;
+static struct host_thread _foreign_thread = {
+  .name = "host",
+  .priority = osPriorityNormal,
+  .flags_lock = PTHREAD_MUTEX_INITIALIZER,
+  .flags_set = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t _critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread int _critical_nesting;
+static __thread int _critical_cancel_state;
+
+/* Private functions ---------------------------------------------------------*/
+
+static void _timespec_now(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void _timespec_deadline(struct timespec *ts, uint32_t timeout) {
+  // Condition variables and timed locks use the realtime clock
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += timeout / 1000;
+  ts->tv_nsec += (long) (timeout % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static void *_thread_entry(void *arg) {
+  struct host_thread *thread = (struct host_thread *) arg;
+
+  _current_thread = thread;
+  thread->func(thread->argument);
+  return NULL;
+}
+
+static void _unlock_on_cancel(void *arg) {
+  pthread_mutex_unlock((pthread_mutex_t *) arg);
+}
+
+/* Kernel --------------------------------------------------------------------*/
+
+uint32_t osKernelGetTickCount(void) {
+  struct timespec ts;
+  _timespec_now(&ts);
+  return (uint32_t) (ts.tv_sec * 1000U + ts.tv_nsec / 1000000L);
+}
+
+uint32_t osKernelGetSysTimerCount(void) {
+  struct timespec ts;
+  _timespec_now(&ts);
+  return (uint32_t) (ts.tv_sec * 1000000U + ts.tv_nsec / 1000L);
+}
+
+uint32_t osKernelGetSysTimerFreq(void) {
+  return configCPU_CLOCK_HZ;
+}
+
+osStatus_t osDelay(uint32_t ticks) {
+  struct timespec ts = {
+    .tv_sec = ticks / 1000,
+    .tv_nsec = (long) (ticks % 1000) * 1000000L,
+  };
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+  return osOK;
+}
+
+/* Threads -------------------------------------------------------------------*/
+
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr) {
+  struct host_thread *thread;
+  pthread_attr_t pthread_attr;
+
+  if (func == NULL) return NULL;
+
+  thread = calloc(1, sizeof(struct host_thread));
+  if (thread == NULL) return NULL;
+  thread->func = func;
+  thread->argument = argument;
+  thread->priority = osPriorityNormal;
+  if (attr != NULL) {
+    if (attr->name != NULL) strncpy(thread->name, attr->name, sizeof(thread->name) - 1);
+    if (attr->priority != osPriorityNone) thread->priority = attr->priority;
+  }
+  pthread_mutex_init(&thread->flags_lock, NULL);
+  pthread_cond_init(&thread->flags_set, NULL);
+
+  // Threads are never joined, terminated threads leak their descriptor
+  pthread_attr_init(&pthread_attr);
+  pthread_attr_setdetachstate(&pthread_attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread->thread, &pthread_attr, _thread_entry, thread) != 0) {
+    pthread_attr_destroy(&pthread_attr);
+    free(thread);
+    return NULL;
+  }
+  pthread_attr_destroy(&pthread_attr);
+  return thread;
+}
+
+osThreadId_t osThreadGetId(void) {
+  // Threads not created through osThreadNew share a descriptor
+  return (_current_thread != NULL) ? _current_thread : &_foreign_thread;
+}
+
+const char *osThreadGetName(osThreadId_t thread_id) {
+  return (thread_id != NULL) ? thread_id->name : NULL;
+}
+
+osPriority_t osThreadGetPriority(osThreadId_t thread_id) {
+  return (thread_id != NULL) ? thread_id->priority : osPriorityError;
+}
+
+osStatus_t osThreadTerminate(osThreadId_t thread_id) {
+  if (thread_id == NULL || thread_id == &_foreign_thread) return osErrorParameter;
+  if (thread_id == _current_thread) osThreadExit();
+  return (pthread_cancel(thread_id->thread) == 0) ? osOK : osErrorResource;
+}
+
+void osThreadExit(void) {
+  pthread_exit(NULL);
+}
+
+/* Thread flags --------------------------------------------------------------*/
+
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags) {
+  uint32_t result;
+
+  if (thread_id == NULL || (flags & osFlagsError) != 0) return osFlagsErrorParameter;
+
+  pthread_mutex_lock(&thread_id->flags_lock);
+  thread_id->flags |= flags;
+  result = thread_id->flags;
+  pthread_cond_broadcast(&thread_id->flags_set);
+  pthread_mutex_unlock(&thread_id->flags_lock);
+  return result;
+}
+
+uint32_t osThreadFlagsClear(uint32_t flags) {
+  osThreadId_t thread = osThreadGetId();
+  uint32_t result;
+
+  if ((flags & osFlagsError) != 0) return osFlagsErrorParameter;
+
+  pthread_mutex_lock(&thread->flags_lock);
+  result = thread->flags;
+  thread->flags &= ~flags;
+  pthread_mutex_unlock(&thread->flags_lock);
+  return result;
+}
+
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout) {
+  struct host_thread *volatile thread = osThreadGetId();
+  struct timespec deadline;
+  volatile uint32_t result;
+  uint32_t match;
+
+  if ((flags & osFlagsError) != 0) return osFlagsErrorParameter;
+
+  _timespec_deadline(&deadline, timeout);
+  pthread_mutex_lock(&thread->flags_lock);
+  pthread_cleanup_push(_unlock_on_cancel, &thread->flags_lock);
+  while (1) {
+    match = thread->flags & flags;
+    if ((options & osFlagsWaitAll) ? (match == flags) : (match != 0)) {
+      // Return the flags before clearing, as CMSIS-RTOS2 does
+      result = thread->flags;
+      if ((options & osFlagsNoClear) == 0) thread->flags &= ~flags;
+      break;
+    } else if (timeout == 0) {
+      result = osFlagsErrorResource;
+      break;
+    } else if (timeout == osWaitForever) {
+      pthread_cond_wait(&thread->flags_set, &thread->flags_lock);
+    } else if (pthread_cond_timedwait(&thread->flags_set, &thread->flags_lock, &deadline) == ETIMEDOUT) {
+      result = osFlagsErrorTimeout;
+      break;
+    }
+  }
+  pthread_cleanup_pop(1);
+  return result;
+}
+
+/* Message queues ------------------------------------------------------------*/
+
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr) {
+  struct host_message_queue *mq;
+
+  (void) attr;
+  if (msg_count == 0 || msg_size == 0) return NULL;
+
+  mq = calloc(1, sizeof(struct host_message_queue));
+  if (mq == NULL) return NULL;
+  mq->data = malloc((size_t) msg_count * msg_size);
+  if (mq->data == NULL) {
+    free(mq);
+    return NULL;
+  }
+  mq->msg_count = msg_count;
+  mq->msg_size = msg_size;
+  pthread_mutex_init(&mq->lock, NULL);
+  pthread_cond_init(&mq->not_empty, NULL);
+  pthread_cond_init(&mq->not_full, NULL);
+  return mq;
+}
+
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout) {
+  struct timespec deadline;
+  volatile osStatus_t sts = osOK;
+
+  (void) msg_prio;
+  if (mq_id == NULL || msg_ptr == NULL) return osErrorParameter;
+
+  _timespec_deadline(&deadline, timeout);
+  pthread_mutex_lock(&mq_id->lock);
+  pthread_cleanup_push(_unlock_on_cancel, &mq_id->lock);
+  while (mq_id->count >= mq_id->msg_count) {
+    if (timeout == 0) {
+      sts = osErrorResource;
+      break;
+    } else if (timeout == osWaitForever) {
+      pthread_cond_wait(&mq_id->not_full, &mq_id->lock);
+    } else if (pthread_cond_timedwait(&mq_id->not_full, &mq_id->lock, &deadline) == ETIMEDOUT) {
+      sts = osErrorTimeout;
+      break;
+    }
+  }
+  if (sts == osOK) {
+    memcpy(mq_id->data + ((mq_id->head + mq_id->count) % mq_id->msg_count) * mq_id->msg_size,
+           msg_ptr,
+           mq_id->msg_size);
+    mq_id->count++;
+    pthread_cond_signal(&mq_id->not_empty);
+  }
+  pthread_cleanup_pop(1);
+  return sts;
+}
+
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout) {
+  struct timespec deadline;
+  volatile osStatus_t sts = osOK;
+
+  if (mq_id == NULL || msg_ptr == NULL) return osErrorParameter;
+
+  _timespec_deadline(&deadline, timeout);
+  pthread_mutex_lock(&mq_id->lock);
+  pthread_cleanup_push(_unlock_on_cancel, &mq_id->lock);
+  while (mq_id->count == 0) {
+    if (timeout == 0) {
+      sts = osErrorResource;
+      break;
+    } else if (timeout == osWaitForever) {
+      pthread_cond_wait(&mq_id->not_empty, &mq_id->lock);
+    } else if (pthread_cond_timedwait(&mq_id->not_empty, &mq_id->lock, &deadline) == ETIMEDOUT) {
+      sts = osErrorTimeout;
+      break;
+    }
+  }
+  if (sts == osOK) {
+    memcpy(msg_ptr, mq_id->data + mq_id->head * mq_id->msg_size, mq_id->msg_size);
+    mq_id->head = (mq_id->head + 1) % mq_id->msg_count;
+    mq_id->count--;
+    if (msg_prio != NULL) *msg_prio = 0;
+    pthread_cond_signal(&mq_id->not_full);
+  }
+  pthread_cleanup_pop(1);
+  return sts;
+}
+
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id) {
+  uint32_t count;
+
+  if (mq_id == NULL) return 0;
+  pthread_mutex_lock(&mq_id->lock);
+  count = mq_id->count;
+  pthread_mutex_unlock(&mq_id->lock);
+  return count;
+}
+
+osStatus_t osMessageQueueReset(osMessageQueueId_t mq_id) {
+  if (mq_id == NULL) return osErrorParameter;
+  pthread_mutex_lock(&mq_id->lock);
+  mq_id->head = 0;
+  mq_id->count = 0;
+  pthread_cond_broadcast(&mq_id->not_full);
+  pthread_mutex_unlock(&mq_id->lock);
+  return osOK;
+}
+
+osStatus_t osMessageQueueDelete(osMessageQueueId_t mq_id) {
+  if (mq_id == NULL) return osErrorParameter;
+  pthread_cond_destroy(&mq_id->not_empty);
+  pthread_cond_destroy(&mq_id->not_full);
+  pthread_mutex_destroy(&mq_id->lock);
+  free(mq_id->data);
+  free(mq_id);
+  return osOK;
+}
+
+/* Mutexes -------------------------------------------------------------------*/
+
+osMutexId_t osMutexNew(const osMutexAttr_t *attr) {
+  struct host_mutex *mutex;
+
+  (void) attr;
+  mutex = calloc(1, sizeof(struct host_mutex));
+  if (mutex == NULL) return NULL;
+  pthread_mutex_init(&mutex->lock, NULL);
+  return mutex;
+}
+
+osStatus_t osMutexAcquire(osMutexId_t mutex_id, uint32_t timeout) {
+  struct timespec deadline;
+
+  if (mutex_id == NULL) return osErrorParameter;
+
+  if (timeout == 0) {
+    return (pthread_mutex_trylock(&mutex_id->lock) == 0) ? osOK : osErrorResource;
+  } else if (timeout == osWaitForever) {
+    return (pthread_mutex_lock(&mutex_id->lock) == 0) ? osOK : osError;
+  }
+  _timespec_deadline(&deadline, timeout);
+  return (pthread_mutex_timedlock(&mutex_id->lock, &deadline) == 0) ? osOK : osErrorTimeout;
+}
+
+osStatus_t osMutexRelease(osMutexId_t mutex_id) {
+  if (mutex_id == NULL) return osErrorParameter;
+  return (pthread_mutex_unlock(&mutex_id->lock) == 0) ? osOK : osErrorResource;
+}
+
+osStatus_t osMutexDelete(osMutexId_t mutex_id) {
+  if (mutex_id == NULL) return osErrorParameter;
+  pthread_mutex_destroy(&mutex_id->lock);
+  free(mutex_id);
+  return osOK;
+}
+
+/* Semaphores ----------------------------------------------------------------*/
+
+osSemaphoreId_t osSemaphoreNew(uint32_t max_count, uint32_t initial_count, const osSemaphoreAttr_t *attr) {
+  struct host_semaphore *sem;
+
+  (void) attr;
+  if (max_count == 0 || initial_count > max_count) return NULL;
+
+  sem = calloc(1, sizeof(struct host_semaphore));
+  if (sem == NULL) return NULL;
+  sem->max_count = max_count;
+  sem->count = initial_count;
+  pthread_mutex_init(&sem->lock, NULL);
+  pthread_cond_init(&sem->available, NULL);
+  return sem;
+}
+
+osStatus_t osSemaphoreAcquire(osSemaphoreId_t semaphore_id, uint32_t timeout) {
+  struct timespec deadline;
+  volatile osStatus_t sts = osOK;
+
+  if (semaphore_id == NULL) return osErrorParameter;
+
+  _timespec_deadline(&deadline, timeout);
+  pthread_mutex_lock(&semaphore_id->lock);
+  pthread_cleanup_push(_unlock_on_cancel, &semaphore_id->lock);
+  while (semaphore_id->count == 0) {
+    if (timeout == 0) {
+      sts = osErrorResource;
+      break;
+    } else if (timeout == osWaitForever) {
+      pthread_cond_wait(&semaphore_id->available, &semaphore_id->lock);
+    } else if (pthread_cond_timedwait(&semaphore_id->available, &semaphore_id->lock, &deadline) == ETIMEDOUT) {
+      sts = osErrorTimeout;
+      break;
+    }
+  }
+  if (sts == osOK) {
+    semaphore_id->count--;
+  }
+  pthread_cleanup_pop(1);
+  return sts;
+}
+
+osStatus_t osSemaphoreRelease(osSemaphoreId_t semaphore_id) {
+  osStatus_t sts = osOK;
+
+  if (semaphore_id == NULL) return osErrorParameter;
+
+  pthread_mutex_lock(&semaphore_id->lock);
+  if (semaphore_id->count < semaphore_id->max_count) {
+    semaphore_id->count++;
+    pthread_cond_signal(&semaphore_id->available);
+  } else {
+    sts = osErrorResource;
+  }
+  pthread_mutex_unlock(&semaphore_id->lock);
+  return sts;
+}
+
+uint32_t osSemaphoreGetCount(osSemaphoreId_t semaphore_id) {
+  uint32_t count;
+
+  if (semaphore_id == NULL) return 0;
+  pthread_mutex_lock(&semaphore_id->lock);
+  count = semaphore_id->count;
+  pthread_mutex_unlock(&semaphore_id->lock);
+  return count;
+}
+
+osStatus_t osSemaphoreDelete(osSemaphoreId_t semaphore_id) {
+  if (semaphore_id == NULL) return osErrorParameter;
+  pthread_cond_destroy(&semaphore_id->available);
+  pthread_mutex_destroy(&semaphore_id->lock);
+  free(semaphore_id);
+  return osOK;
+}
+
+/* Critical sections ---------------------------------------------------------*/
+
+void host_enter_critical(void) {
+  int cancel_state;
+
+  // A thread must not be terminated while it holds the critical section
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+  pthread_mutex_lock(&_critical_lock);
+  if (_critical_nesting++ == 0) {
+    _critical_cancel_state = cancel_state;
+  }
+}
+
+void host_exit_critical(void) {
+  int cancel_state = PTHREAD_CANCEL_DISABLE;
+
+  if (--_critical_nesting == 0) {
+    cancel_state = _critical_cancel_state;
+  }
+  pthread_mutex_unlock(&_critical_lock);
+  pthread_setcancelstate(cancel_state, NULL);
+}
@@ -0,0 +1,182 @@
+/**
+ * @file       cmsis_os.h
+ * @brief      Subset of CMSIS-RTOS2 (and FreeRTOS) used by the FTP server
+ *             and the lwIP port, implemented on top of POSIX threads for
+ *             host builds.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __FTP_HOST_CMSIS_OS_H
+#define __FTP_HOST_CMSIS_OS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/* Exported constants --------------------------------------------------------*/
+
+#define osCMSIS                 0x20001U
+#define osWaitForever           0xFFFFFFFFU
+
+// Thread flags options and errors
+#define osFlagsWaitAny          0x00000000U
+#define osFlagsWaitAll          0x00000001U
+#define osFlagsNoClear          0x00000002U
+#define osFlagsError            0x80000000U
+#define osFlagsErrorTimeout     0xFFFFFFFEU
+#define osFlagsErrorResource    0xFFFFFFFDU
+#define osFlagsErrorParameter   0xFFFFFFFCU
+
+// FreeRTOS configuration referenced by the FTP server
+#define configMAX_TASK_NAME_LEN 16
+#define configCPU_CLOCK_HZ      1000000U
+
+/* Exported macros -----------------------------------------------------------*/
+
+// Critical sections only serialize the debug output on the host
+#define taskENTER_CRITICAL() host_enter_critical()
+#define taskEXIT_CRITICAL()  host_exit_critical()
+// There are no interrupts on the host
+#define taskENTER_CRITICAL_FROM_ISR()    (host_enter_critical(), 0U)
+#define taskEXIT_CRITICAL_FROM_ISR(x)    ((void) (x), host_exit_critical())
+#define __get_IPSR()                     0U
+#define portNOP()
+
+// The FreeRTOS heap is the heap of the host
+#define pvPortMalloc(size)   malloc(size)
+#define vPortFree(ptr)       free(ptr)
+
+/* Exported types ------------------------------------------------------------*/
+
+typedef enum {
+  osOK                    =  0,
+  osError                 = -1,
+  osErrorTimeout          = -2,
+  osErrorResource         = -3,
+  osErrorParameter        = -4,
+  osErrorNoMemory         = -5,
+  osErrorISR              = -6,
+  osStatusReserved        = 0x7FFFFFFF
+} osStatus_t;
+
+typedef enum {
+  osPriorityNone          =  0,
+  osPriorityIdle          =  1,
+  osPriorityLow           =  8,
+  osPriorityBelowNormal   = 16,
+  osPriorityNormal        = 24,
+  osPriorityAboveNormal   = 32,
+  osPriorityHigh          = 40,
+  osPriorityRealtime      = 48,
+  osPriorityISR           = 56,
+  osPriorityError         = -1,
+  osPriorityReserved      = 0x7FFFFFFF
+} osPriority_t;
+
+typedef unsigned long UBaseType_t;
+
+typedef void (*osThreadFunc_t) (void *argument);
+
+typedef struct host_thread *osThreadId_t;
+typedef struct host_message_queue *osMessageQueueId_t;
+typedef struct host_mutex *osMutexId_t;
+typedef struct host_semaphore *osSemaphoreId_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+  void *stack_mem;
+  uint32_t stack_size;
+  osPriority_t priority;
+  uint32_t tz_module;
+  uint32_t reserved;
+} osThreadAttr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+  void *mq_mem;
+  uint32_t mq_size;
+} osMessageQueueAttr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+} osMutexAttr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+} osSemaphoreAttr_t;
+
+// Static control blocks are accepted, but the host allocates its own objects
+typedef struct { uint64_t reserved[8]; } StaticTask_t;
+typedef struct { uint64_t reserved[8]; } StaticQueue_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+// Kernel
+uint32_t osKernelGetTickCount(void);
+uint32_t osKernelGetSysTimerCount(void);
+uint32_t osKernelGetSysTimerFreq(void);
+osStatus_t osDelay(uint32_t ticks);
+
+// Threads
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr);
+osThreadId_t osThreadGetId(void);
+const char *osThreadGetName(osThreadId_t thread_id);
+osPriority_t osThreadGetPriority(osThreadId_t thread_id);
+osStatus_t osThreadTerminate(osThreadId_t thread_id);
+__attribute__((noreturn)) void osThreadExit(void);
+
+// Thread flags
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags);
+uint32_t osThreadFlagsClear(uint32_t flags);
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout);
+
+// Message queues
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr);
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout);
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout);
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id);
+osStatus_t osMessageQueueReset(osMessageQueueId_t mq_id);
+osStatus_t osMessageQueueDelete(osMessageQueueId_t mq_id);
+
+// Mutexes
+osMutexId_t osMutexNew(const osMutexAttr_t *attr);
+osStatus_t osMutexAcquire(osMutexId_t mutex_id, uint32_t timeout);
+osStatus_t osMutexRelease(osMutexId_t mutex_id);
+osStatus_t osMutexDelete(osMutexId_t mutex_id);
+
+// Semaphores
+osSemaphoreId_t osSemaphoreNew(uint32_t max_count, uint32_t initial_count, const osSemaphoreAttr_t *attr);
+osStatus_t osSemaphoreAcquire(osSemaphoreId_t semaphore_id, uint32_t timeout);
+osStatus_t osSemaphoreRelease(osSemaphoreId_t semaphore_id);
+uint32_t osSemaphoreGetCount(osSemaphoreId_t semaphore_id);
+osStatus_t osSemaphoreDelete(osSemaphoreId_t semaphore_id);
+
+// Critical sections
+void host_enter_critical(void);
+void host_exit_critical(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FTP_HOST_CMSIS_OS_H included
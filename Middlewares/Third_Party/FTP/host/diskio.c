@@ -0,0 +1,153 @@
+/**
+ * @file       diskio.c
+ * @brief      FatFS disk I/O for host builds, backed by RAM or an image file.
+ *
+ * Replaces the generic driver layer of the target. An image file is mapped
+ * into memory, so both backends serve sectors with a plain memcpy.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "host.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ff.h"
+#include "diskio.h"
+
+/* Exported variables --------------------------------------------------------*/
+
+host_disk_stats_t host_disk_stats;
+
+/* Private variables ---------------------------------------------------------*/
+
+static BYTE *_disk_data;
+static DWORD _disk_num_sectors;
+static int _disk_mapped;
+static DSTATUS _disk_status = STA_NOINIT;
+
+/* Exported functions --------------------------------------------------------*/
+
+int host_disk_init(const char *image, uint32_t num_sectors) {
+  size_t size = (size_t) num_sectors * HOST_DISK_SECTOR_SIZE;
+  struct stat st;
+  int fd;
+
+  if (image == NULL) {
+    // RAM disk, formatted on mount
+    _disk_data = calloc(1, size);
+    if (_disk_data == NULL) return -1;
+    _disk_mapped = 0;
+  } else {
+    // Image file, grown to the requested size if it is smaller
+    fd = open(image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size < size && ftruncate(fd, size) < 0)) {
+      close(fd);
+      return -1;
+    }
+    if ((size_t) st.st_size > size) {
+      size = st.st_size;
+      num_sectors = size / HOST_DISK_SECTOR_SIZE;
+    }
+    _disk_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (_disk_data == MAP_FAILED) {
+      _disk_data = NULL;
+      return -1;
+    }
+    _disk_mapped = 1;
+  }
+  _disk_num_sectors = num_sectors;
+  return 0;
+}
+
+void host_disk_deinit(void) {
+  if (_disk_data == NULL) return;
+  if (_disk_mapped) {
+    munmap(_disk_data, (size_t) _disk_num_sectors * HOST_DISK_SECTOR_SIZE);
+  } else {
+    free(_disk_data);
+  }
+  _disk_data = NULL;
+  _disk_status = STA_NOINIT;
+}
+
+/* FatFS disk interface ------------------------------------------------------*/
+
+DSTATUS disk_initialize(BYTE pdrv) {
+  if (pdrv != 0) return STA_NOINIT;
+  _disk_status = (_disk_data != NULL) ? 0 : STA_NODISK;
+  return _disk_status;
+}
+
+DSTATUS disk_status(BYTE pdrv) {
+  if (pdrv != 0) return STA_NOINIT;
+  return _disk_status;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+  if (pdrv != 0 || count == 0) return RES_PARERR;
+  if (_disk_status & STA_NOINIT) return RES_NOTRDY;
+  if (sector + count > _disk_num_sectors) return RES_PARERR;
+  host_disk_stats.reads++;
+  host_disk_stats.read_sectors += count;
+  memcpy(buff, _disk_data + (size_t) sector * HOST_DISK_SECTOR_SIZE, (size_t) count * HOST_DISK_SECTOR_SIZE);
+  return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+  if (pdrv != 0 || count == 0) return RES_PARERR;
+  if (_disk_status & STA_NOINIT) return RES_NOTRDY;
+  if (sector + count > _disk_num_sectors) return RES_PARERR;
+  host_disk_stats.writes++;
+  host_disk_stats.write_sectors += count;
+  memcpy(_disk_data + (size_t) sector * HOST_DISK_SECTOR_SIZE, buff, (size_t) count * HOST_DISK_SECTOR_SIZE);
+  return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+  if (pdrv != 0) return RES_PARERR;
+  if (_disk_status & STA_NOINIT) return RES_NOTRDY;
+
+  switch (cmd) {
+    case CTRL_SYNC:
+      if (_disk_mapped) {
+        msync(_disk_data, (size_t) _disk_num_sectors * HOST_DISK_SECTOR_SIZE, MS_ASYNC);
+      }
+      return RES_OK;
+    case GET_SECTOR_COUNT:
+      *(DWORD *) buff = _disk_num_sectors;
+      return RES_OK;
+    case GET_SECTOR_SIZE:
+      *(WORD *) buff = HOST_DISK_SECTOR_SIZE;
+      return RES_OK;
+    case GET_BLOCK_SIZE:
+      *(DWORD *) buff = 1;
+      return RES_OK;
+    default:
+      return RES_PARERR;
+  }
+}
+
+DWORD get_fattime(void) {
+  time_t now = time(NULL);
+  struct tm tm;
+
+  localtime_r(&now, &tm);
+  return ((DWORD) (tm.tm_year - 80) << 25) |
+         ((DWORD) (tm.tm_mon + 1) << 21) |
+         ((DWORD) tm.tm_mday << 16) |
+         ((DWORD) tm.tm_hour << 11) |
+         ((DWORD) tm.tm_min << 5) |
+         ((DWORD) tm.tm_sec >> 1);
+}
@@ -0,0 +1,56 @@
+/**
+ * @file       ffconf.h
+ * @brief      FatFS configuration of host builds.
+ *
+ * Uses the configuration of the target. Single options can be overridden
+ * with HOST_<option> macros to compare configurations, e.g. in the fsbench
+ * targets of the Makefile.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __FTP_HOST_FFCONF_H
+#define __FTP_HOST_FFCONF_H
+
+#include "../../../../FATFS/Target/ffconf.h"
+
+#ifdef HOST_FS_TINY
+#undef _FS_TINY
+#define _FS_TINY HOST_FS_TINY
+#endif
+
+#ifdef HOST_USE_FASTSEEK
+#undef _USE_FASTSEEK
+#define _USE_FASTSEEK HOST_USE_FASTSEEK
+#endif
+
+#ifdef HOST_FS_CACHE_WAYS
+#undef _FS_CACHE_WAYS
+#define _FS_CACHE_WAYS HOST_FS_CACHE_WAYS
+#elif _FS_TINY
+// The sector cache is not available at tiny configuration
+#undef _FS_CACHE_WAYS
+#define _FS_CACHE_WAYS 0
+#endif
+
+#ifdef HOST_FS_FREEMAP
+#undef _FS_FREEMAP
+#define _FS_FREEMAP HOST_FS_FREEMAP
+#endif
+
+#ifdef HOST_FS_DIRCACHE
+#undef _FS_DIRCACHE
+#define _FS_DIRCACHE HOST_FS_DIRCACHE
+#endif
+
+#ifdef HOST_FS_PARALLEL_IO
+#undef _FS_PARALLEL_IO
+#define _FS_PARALLEL_IO HOST_FS_PARALLEL_IO
+#elif _FS_TINY
+// Data transfers of tiny file objects go through the volume window
+#undef _FS_PARALLEL_IO
+#define _FS_PARALLEL_IO 0
+#endif
+
+#endif // __FTP_HOST_FFCONF_H included
@@ -0,0 +1,442 @@
+/**
+ * @file       fsbench.c
+ * @brief      FatFS throughput and latency benchmark for host builds.
+ *
+ * Formats the host disk once per cluster size and measures the access
+ * patterns of the FTP server: sequential and random reads and writes, small
+ * synchronized appends (also to an append-only log if enabled), many small
+ * files and directory lookups at growing directory sizes. Besides the time,
+ * the number of sectors read and written per operation is printed, which
+ * does not depend on the host.
+ *
+ * The FatFS configuration is set at compile time, see ffconf.h of the host
+ * and the fsbench targets of the Makefile.
+ *
+ * Usage: fsbench [-i image] [-s size in MiB] [-c cluster sizes] [-f file size in MiB]
+ *                [-b chunk size] [-n operations] [-d max. directory entries] [-r seed]
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ff.h"
+
+/* Private defines -----------------------------------------------------------*/
+
+#define FSBENCH_DEFAULT_DISK_SIZE_MB     64
+#define FSBENCH_DEFAULT_CLUSTERS         "512,4096,32768"
+#define FSBENCH_DEFAULT_FILE_SIZE_MB     8
+#define FSBENCH_DEFAULT_CHUNK_SIZE       4096
+#define FSBENCH_DEFAULT_OPERATIONS       2000
+#define FSBENCH_DEFAULT_MAX_DIR_ENTRIES  1024
+
+// Size of the records appended by the append benchmark
+#define FSBENCH_RECORD_SIZE              64
+// Size of the files created by the small file benchmark
+#define FSBENCH_SMALL_FILE_SIZE          1024
+#define FSBENCH_SMALL_FILES              256
+// Number of entries of the fast seek cluster link map
+#define FSBENCH_LINKMAP_SIZE             1024
+
+/* Private typedef -----------------------------------------------------------*/
+
+typedef struct {
+  uint64_t start_ns;
+  host_disk_stats_t start_stats;
+} fsbench_timer_t;
+
+/* Private variables ---------------------------------------------------------*/
+
+static FATFS _fs;
+static BYTE _mkfs_work[_MAX_SS];
+static BYTE *_buffer;
+static uint32_t *_latencies;
+static uint32_t _seed = 1;
+
+static unsigned long _file_size;
+static unsigned long _chunk_size = FSBENCH_DEFAULT_CHUNK_SIZE;
+static unsigned long _operations = FSBENCH_DEFAULT_OPERATIONS;
+static unsigned long _max_dir_entries = FSBENCH_DEFAULT_MAX_DIR_ENTRIES;
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint32_t _random(void) {
+  // xorshift32, so that runs are repeatable across hosts
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return _seed;
+}
+
+static uint64_t _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void _timer_start(fsbench_timer_t *timer) {
+  timer->start_stats = host_disk_stats;
+  timer->start_ns = _now_ns();
+}
+
+// Print the time per operation (or the throughput if 'bytes' is not 0) and
+// the sectors transferred per operation
+static void _timer_report(const fsbench_timer_t *timer, const char *name, unsigned long ops, uint64_t bytes) {
+  uint64_t elapsed_ns = _now_ns() - timer->start_ns;
+  double read_sectors = host_disk_stats.read_sectors - timer->start_stats.read_sectors;
+  double write_sectors = host_disk_stats.write_sectors - timer->start_stats.write_sectors;
+
+  if (elapsed_ns == 0) elapsed_ns = 1;
+  if (bytes > 0) {
+    printf("  %-26s %10.1f MiB/s ", name, (double) bytes / (1 << 20) / (elapsed_ns / 1e9));
+  } else {
+    printf("  %-26s %10.2f us/op  ", name, elapsed_ns / 1e3 / ops);
+  }
+  printf("  %8.2f rd %8.2f wr sectors/op\n", read_sectors / ops, write_sectors / ops);
+}
+
+static int _compare_latency(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+static int _check(FRESULT fres, const char *what) {
+  if (fres != FR_OK) {
+    printf("  %-26s failed: %d\n", what, fres);
+    return -1;
+  }
+  return 0;
+}
+
+static int _sequential(void) {
+  fsbench_timer_t timer;
+  unsigned long done;
+  UINT bw, br;
+  FIL fil;
+  char name[32];
+
+  snprintf(name, sizeof(name), "seq. write (%lu B chunks)", _chunk_size);
+  if (_check(f_open(&fil, "/SEQ.BIN", FA_CREATE_ALWAYS | FA_WRITE), "seq. write")) return -1;
+  _timer_start(&timer);
+  for (done = 0; done < _file_size; done += bw) {
+    UINT len = (_file_size - done < _chunk_size) ? _file_size - done : _chunk_size;
+    if (f_write(&fil, _buffer, len, &bw) != FR_OK || bw != len) break;
+  }
+  f_close(&fil);
+  if (done < _file_size) {
+    printf("  %-26s failed: disk full\n", name);
+    return -1;
+  }
+  _timer_report(&timer, name, (_file_size + _chunk_size - 1) / _chunk_size, _file_size);
+
+  snprintf(name, sizeof(name), "seq. read (%lu B chunks)", _chunk_size);
+  if (_check(f_open(&fil, "/SEQ.BIN", FA_READ), "seq. read")) return -1;
+  _timer_start(&timer);
+  for (done = 0; done < _file_size; done += br) {
+    if (f_read(&fil, _buffer, _chunk_size, &br) != FR_OK || br == 0) break;
+  }
+  _timer_report(&timer, name, (_file_size + _chunk_size - 1) / _chunk_size, _file_size);
+  f_close(&fil);
+  return 0;
+}
+
+// Sector sized reads and overwrites at random positions of the sequential file
+static void _random_access(void) {
+  fsbench_timer_t timer;
+  unsigned long sectors = _file_size / _MAX_SS;
+  unsigned long i;
+  UINT bx;
+  FIL fil;
+#if _USE_FASTSEEK
+  static DWORD linkmap[FSBENCH_LINKMAP_SIZE];
+  int fastseek;
+#endif /* _USE_FASTSEEK */
+
+  if (sectors == 0) return;
+  if (_check(f_open(&fil, "/SEQ.BIN", FA_READ | FA_WRITE), "random access")) return;
+#if _USE_FASTSEEK
+  // Fragmented files may not fit into the link map, they are accessed normally
+  linkmap[0] = FSBENCH_LINKMAP_SIZE;
+  fil.cltbl = linkmap;
+  fastseek = f_lseek(&fil, CREATE_LINKMAP) == FR_OK;
+  if (!fastseek) fil.cltbl = NULL;
+#endif /* _USE_FASTSEEK */
+
+  _timer_start(&timer);
+  for (i = 0; i < _operations; i++) {
+    f_lseek(&fil, (FSIZE_t) (_random() % sectors) * _MAX_SS);
+    f_read(&fil, _buffer, _MAX_SS, &bx);
+  }
+  _timer_report(&timer, "random read (1 sector)", _operations, 0);
+
+  _timer_start(&timer);
+  for (i = 0; i < _operations; i++) {
+    f_lseek(&fil, (FSIZE_t) (_random() % sectors) * _MAX_SS);
+    f_write(&fil, _buffer, _MAX_SS, &bx);
+  }
+  f_sync(&fil);
+  _timer_report(&timer, "random write (1 sector)", _operations, 0);
+#if _USE_FASTSEEK
+  if (!fastseek) printf("  (fast seek not used, link map too small)\n");
+#endif /* _USE_FASTSEEK */
+  f_close(&fil);
+  f_unlink("/SEQ.BIN");
+}
+
+// Small records, each synchronized to the disk like a log file
+static void _append(void) {
+  fsbench_timer_t timer;
+  unsigned long i;
+  uint64_t start;
+  UINT bw;
+  FIL fil;
+
+  if (_check(f_open(&fil, "/APPEND.LOG", FA_CREATE_ALWAYS | FA_WRITE), "append")) return;
+  _timer_start(&timer);
+  for (i = 0; i < _operations; i++) {
+    start = _now_ns();
+    if (f_write(&fil, _buffer, FSBENCH_RECORD_SIZE, &bw) != FR_OK || f_sync(&fil) != FR_OK) break;
+    _latencies[i] = _now_ns() - start;
+  }
+  f_close(&fil);
+  f_unlink("/APPEND.LOG");
+  if (i < _operations) {
+    printf("  %-26s failed\n", "append");
+    return;
+  }
+  _timer_report(&timer, "append + sync (64 B)", _operations, 0);
+
+  qsort(_latencies, _operations, sizeof(_latencies[0]), _compare_latency);
+  printf("  %-26s p50 %.2f us, p90 %.2f us, p99 %.2f us, max %.2f us\n", "append latency",
+         _latencies[_operations / 2] / 1e3,
+         _latencies[_operations * 9 / 10] / 1e3,
+         _latencies[_operations * 99 / 100] / 1e3,
+         _latencies[_operations - 1] / 1e3);
+}
+
+#if _USE_LOG
+// The same records appended to an append-only log
+static void _log_append(void) {
+  static FFLOG log;
+  fsbench_timer_t timer;
+  unsigned long i;
+  uint64_t start;
+  UINT bw;
+
+  if (_check(f_log_open(&log, "/APPEND.LOG", (FSIZE_t) _operations * FSBENCH_RECORD_SIZE), "log append")) return;
+  _timer_start(&timer);
+  for (i = 0; i < _operations; i++) {
+    start = _now_ns();
+    if (f_log_write(&log, _buffer, FSBENCH_RECORD_SIZE, &bw) != FR_OK || bw != FSBENCH_RECORD_SIZE ||
+        f_log_sync(&log) != FR_OK) break;
+    _latencies[i] = _now_ns() - start;
+  }
+  f_log_close(&log);
+  f_unlink("/APPEND.LOG");
+  if (i < _operations) {
+    printf("  %-26s failed\n", "log append");
+    return;
+  }
+  _timer_report(&timer, "log append + sync (64 B)", _operations, 0);
+
+  qsort(_latencies, _operations, sizeof(_latencies[0]), _compare_latency);
+  printf("  %-26s p50 %.2f us, p90 %.2f us, p99 %.2f us, max %.2f us\n", "log append latency",
+         _latencies[_operations / 2] / 1e3,
+         _latencies[_operations * 9 / 10] / 1e3,
+         _latencies[_operations * 99 / 100] / 1e3,
+         _latencies[_operations - 1] / 1e3);
+}
+#endif /* _USE_LOG */
+
+static void _small_files(void) {
+  fsbench_timer_t timer;
+  char path[32];
+  unsigned int i;
+  UINT bw;
+  FIL fil;
+
+  if (_check(f_mkdir("/SMALL"), "small files")) return;
+  _timer_start(&timer);
+  for (i = 0; i < FSBENCH_SMALL_FILES; i++) {
+    snprintf(path, sizeof(path), "/SMALL/S%05u.BIN", i);
+    if (f_open(&fil, path, FA_CREATE_NEW | FA_WRITE) != FR_OK) break;
+    f_write(&fil, _buffer, FSBENCH_SMALL_FILE_SIZE, &bw);
+    f_close(&fil);
+  }
+  if (i < FSBENCH_SMALL_FILES) {
+    printf("  %-26s failed\n", "small files");
+    return;
+  }
+  _timer_report(&timer, "create 1 KiB file", FSBENCH_SMALL_FILES, 0);
+
+  _timer_start(&timer);
+  for (i = 0; i < FSBENCH_SMALL_FILES; i++) {
+    snprintf(path, sizeof(path), "/SMALL/S%05u.BIN", i);
+    f_unlink(path);
+  }
+  _timer_report(&timer, "delete 1 KiB file", FSBENCH_SMALL_FILES, 0);
+  f_unlink("/SMALL");
+}
+
+// Lookup cost of existing and missing names for growing directories
+static void _directory_lookup(void) {
+  fsbench_timer_t timer;
+  unsigned long entries = 0, target, i;
+  char path[32], name[32];
+  FILINFO fno;
+  FIL fil;
+
+  if (_check(f_mkdir("/DIR"), "directory lookup")) return;
+  for (target = 16; target <= _max_dir_entries; target *= 4) {
+    for (; entries < target; entries++) {
+      snprintf(path, sizeof(path), "/DIR/E%06lu.DAT", entries);
+      if (f_open(&fil, path, FA_CREATE_NEW | FA_WRITE) != FR_OK) break;
+      f_close(&fil);
+    }
+    if (entries < target) {
+      printf("  %-26s failed at %lu entries\n", "directory lookup", entries);
+      break;
+    }
+
+    snprintf(name, sizeof(name), "stat, %lu entries", entries);
+    _timer_start(&timer);
+    for (i = 0; i < _operations; i++) {
+      snprintf(path, sizeof(path), "/DIR/E%06lu.DAT", (unsigned long) (_random() % entries));
+      f_stat(path, &fno);
+    }
+    _timer_report(&timer, name, _operations, 0);
+
+    snprintf(name, sizeof(name), "stat missing, %lu entries", entries);
+    _timer_start(&timer);
+    for (i = 0; i < _operations; i++) {
+      f_stat("/DIR/MISSING.DAT", &fno);
+    }
+    _timer_report(&timer, name, _operations, 0);
+  }
+
+  for (i = 0; i < entries; i++) {
+    snprintf(path, sizeof(path), "/DIR/E%06lu.DAT", i);
+    f_unlink(path);
+  }
+  f_unlink("/DIR");
+}
+
+static void _run(DWORD cluster_size) {
+  static const char *const fs_types[] = { "?", "FAT12", "FAT16", "FAT32", "exFAT" };
+  FRESULT fres;
+
+  f_mount(NULL, "", 0);
+  fres = f_mkfs("", FM_ANY, cluster_size, _mkfs_work, sizeof(_mkfs_work));
+  if (fres == FR_OK) {
+    fres = f_mount(&_fs, "", 1);
+  }
+  if (fres != FR_OK) {
+    printf("Cluster size %lu B: format failed: %d\n", (unsigned long) cluster_size, fres);
+    return;
+  }
+  printf("Cluster size %lu B, %s, %lu clusters\n",
+         (unsigned long) _fs.csize * _MAX_SS,
+         fs_types[(_fs.fs_type <= 4) ? _fs.fs_type : 0],
+         (unsigned long) _fs.n_fatent - 2);
+
+  if (_sequential() == 0) {
+    _random_access();
+  }
+  _append();
+#if _USE_LOG
+  _log_append();
+#endif /* _USE_LOG */
+  _small_files();
+  _directory_lookup();
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+
+  if (size > 0) {
+    size_t copy = (len < size) ? len : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = '\0';
+  }
+  return len;
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = NULL;
+  const char *clusters = FSBENCH_DEFAULT_CLUSTERS;
+  unsigned long size_mb = FSBENCH_DEFAULT_DISK_SIZE_MB;
+  unsigned long file_size_mb = FSBENCH_DEFAULT_FILE_SIZE_MB;
+  unsigned long i;
+  char *end;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:s:c:f:b:n:d:r:")) != -1) {
+    switch (opt) {
+      case 'i': image = optarg; break;
+      case 's': size_mb = strtoul(optarg, NULL, 0); break;
+      case 'c': clusters = optarg; break;
+      case 'f': file_size_mb = strtoul(optarg, NULL, 0); break;
+      case 'b': _chunk_size = strtoul(optarg, NULL, 0); break;
+      case 'n': _operations = strtoul(optarg, NULL, 0); break;
+      case 'd': _max_dir_entries = strtoul(optarg, NULL, 0); break;
+      case 'r': _seed = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-i image] [-s size in MiB] [-c cluster sizes] [-f file size in MiB]\n"
+                "          [-b chunk size] [-n operations] [-d max. directory entries] [-r seed]\n"
+                "The image is formatted for every cluster size.\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (_chunk_size == 0 || _operations == 0 || _seed == 0) {
+    fprintf(stderr, "Chunk size, operations and seed must not be 0.\n");
+    return EXIT_FAILURE;
+  }
+  _file_size = file_size_mb << 20;
+
+  _buffer = malloc(_chunk_size > FSBENCH_SMALL_FILE_SIZE ? _chunk_size : FSBENCH_SMALL_FILE_SIZE);
+  _latencies = malloc(_operations * sizeof(_latencies[0]));
+  if (_buffer == NULL || _latencies == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < _chunk_size || i < FSBENCH_SMALL_FILE_SIZE; i++) {
+    _buffer[i] = (BYTE) _random();
+  }
+
+  if (host_disk_init(image, size_mb * 1024 * 1024 / HOST_DISK_SECTOR_SIZE) < 0) {
+    fprintf(stderr, "Failed to create disk.\n");
+    return EXIT_FAILURE;
+  }
+  printf("FatFS benchmark: %lu MiB %s disk, _FS_TINY %d, _USE_FASTSEEK %d, _FS_CACHE_WAYS %d, _FS_FREEMAP %d, _FS_DIRCACHE %d\n",
+         size_mb, (image != NULL) ? "image" : "RAM",
+         _FS_TINY, _USE_FASTSEEK, _FS_CACHE_WAYS, _FS_FREEMAP, _FS_DIRCACHE);
+
+  // Cluster sizes in Bytes, separated by commas
+  while (*clusters != '\0') {
+    unsigned long cluster_size = strtoul(clusters, &end, 0);
+    if (end == clusters) break;
+    _run(cluster_size);
+    clusters = (*end == ',') ? end + 1 : end;
+  }
+
+  f_mount(NULL, "", 0);
+  host_disk_deinit();
+  free(_latencies);
+  free(_buffer);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file       host.h
+ * @brief      Host port of the FTP server. Included into every source file
+ *             of the host build.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __FTP_HOST_H
+#define __FTP_HOST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Exported constants --------------------------------------------------------*/
+
+#define HOST_DISK_SECTOR_SIZE 512
+
+// The RAM disk regions of the target are ordinary variables on the host
+#define FS_RAM
+#define FS_RAM_DTCM
+#define FS_RAM_D3
+
+/* Exported types ------------------------------------------------------------*/
+
+// Disk accesses since the start. Not synchronized, so only exact if a single
+// thread accesses the disk.
+typedef struct {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t read_sectors;
+  uint64_t write_sectors;
+} host_disk_stats_t;
+
+/* Exported variables --------------------------------------------------------*/
+
+extern host_disk_stats_t host_disk_stats;
+
+/* Exported functions --------------------------------------------------------*/
+
+// newlib provides strlcpy, older glibc versions do not
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+// Back the FatFS drive by RAM, or by the given image file if not NULL
+int host_disk_init(const char *image, uint32_t num_sectors);
+void host_disk_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FTP_HOST_H included
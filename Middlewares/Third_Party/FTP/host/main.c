@@ -0,0 +1,107 @@
+/**
+ * @file       main.c
+ * @brief      Runs the FTP server on the host against a RAM or image backed
+ *             FatFS volume.
+ *
+ * Usage: ftp_host [-i image] [-s size in MiB]
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "host.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmsis_os.h"
+#include "socket.h"
+#include "ff.h"
+#include "ftp.h"
+
+/* Private defines -----------------------------------------------------------*/
+
+#define HOST_DEFAULT_DISK_SIZE_MB 64
+
+/* Private variables ---------------------------------------------------------*/
+
+// The server announces the loopback address in passive mode
+static struct netif _netif_loopback;
+struct netif *netif_default = &_netif_loopback;
+
+static FATFS _fs;
+static BYTE _mkfs_work[_MAX_SS];
+
+/* Exported functions --------------------------------------------------------*/
+
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+
+  if (size > 0) {
+    size_t copy = (len < size) ? len : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = '\0';
+  }
+  return len;
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = NULL;
+  unsigned long size_mb = HOST_DEFAULT_DISK_SIZE_MB;
+  FRESULT fres;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:s:")) != -1) {
+    switch (opt) {
+      case 'i':
+        image = optarg;
+        break;
+      case 's':
+        size_mb = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-i image] [-s size in MiB]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  // Closed data connections must not terminate the server
+  signal(SIGPIPE, SIG_IGN);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  _netif_loopback.ip_addr.addr = PP_HTONL(INADDR_LOOPBACK);
+
+  // Create the disk and mount it, formatting it if it holds no volume yet
+  if (host_disk_init(image, size_mb * 1024 * 1024 / HOST_DISK_SECTOR_SIZE) < 0) {
+    fprintf(stderr, "Failed to create disk.\n");
+    return EXIT_FAILURE;
+  }
+  fres = f_mount(&_fs, "", 1);
+  if (fres == FR_NO_FILESYSTEM) {
+    printf("Formatting %lu MiB volume.\n", size_mb);
+    fres = f_mkfs("", FM_ANY, 0, _mkfs_work, sizeof(_mkfs_work));
+    if (fres == FR_OK) {
+      fres = f_mount(&_fs, "", 1);
+    }
+  }
+  if (fres != FR_OK) {
+    fprintf(stderr, "Failed to mount volume: %d.\n", fres);
+    host_disk_deinit();
+    return EXIT_FAILURE;
+  }
+
+  // Start the server and leave it running
+  if (ftp_server_init() == NULL) {
+    host_disk_deinit();
+    return EXIT_FAILURE;
+  }
+  printf("FTP server listening on port %u.\n", FTP_SERVER_DEFAULT_CONTROL_PORT);
+  while (1) {
+    osDelay(osWaitForever);
+  }
+  return EXIT_SUCCESS;
+}
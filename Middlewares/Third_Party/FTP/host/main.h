@@ -0,0 +1,13 @@
+/**
+ * @file       main.h
+ * @brief      Empty placeholder, so the ffconf.h of the target can be used
+ *             unmodified on the host.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __FTP_HOST_MAIN_H
+#define __FTP_HOST_MAIN_H
+
+#endif // __FTP_HOST_MAIN_H included
@@ -0,0 +1,40 @@
+/**
+ * @file       ramdisk.c
+ * @brief      Runs the host build on the RAM disk driver of the target.
+ *
+ * Replaces diskio.c if the host is built with RAMDISK=1. The generic driver
+ * layer and FATFS/Target/user_diskio.c are then built as on the target, with
+ * the CPU doing all copies, so that changes to the driver can be benchmarked.
+ * The disk size is set by the driver and cannot be backed by an image file.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "host.h"
+
+#include <stdio.h>
+
+#include "ff_gen_drv.h"
+#include "user_diskio.h"
+
+/* Private variables ---------------------------------------------------------*/
+
+static char _disk_path[4];
+
+/* Exported functions --------------------------------------------------------*/
+
+int host_disk_init(const char *image, uint32_t num_sectors) {
+  if (image != NULL) {
+    fprintf(stderr, "The RAM disk cannot be backed by an image file.\n");
+    return -1;
+  }
+  (void) num_sectors;
+  return (FATFS_LinkDriver(&USER_Driver, _disk_path) == 0) ? 0 : -1;
+}
+
+void host_disk_deinit(void) {
+  FATFS_UnLinkDriver(_disk_path);
+}
@@ -0,0 +1,73 @@
+/**
+ * @file       socket.h
+ * @brief      Maps the lwIP socket API used by the FTP server onto the
+ *             POSIX sockets of the host.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __FTP_HOST_SOCKET_H
+#define __FTP_HOST_SOCKET_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Exported constants --------------------------------------------------------*/
+
+// The loopback interface of the host always exists
+#define LWIP_NETIF_LOOPBACK 1
+
+// Mirrors lwipopts.h of the target, only used for buffer size checks. Replaces
+// the socket option of the same name, which the server does not use.
+#undef TCP_MSS
+#define TCP_MSS             1024
+
+/* Exported macros -----------------------------------------------------------*/
+
+#define PP_HTONS(x) ((uint16_t) htons(x))
+#define PP_HTONL(x) ((uint32_t) htonl(x))
+
+/* Exported types ------------------------------------------------------------*/
+
+// Only the address of the default interface is used
+struct netif {
+  struct {
+    uint32_t addr;
+  } ip_addr;
+};
+
+/* Exported variables --------------------------------------------------------*/
+
+extern struct netif *netif_default;
+
+/* Exported functions --------------------------------------------------------*/
+
+// Restarting the server must not wait for the control port to leave TIME_WAIT
+static inline int host_bind(int sd, const struct sockaddr *address, socklen_t address_len) {
+  int reuse = 1;
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  return bind(sd, address, address_len);
+}
+
+#define bind host_bind
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FTP_HOST_SOCKET_H included
@@ -0,0 +1,13 @@
+/**
+ * @file       stm32h7xx_hal.h
+ * @brief      Empty placeholder, so the ffconf.h of the target can be used
+ *             unmodified on the host.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __FTP_HOST_STM32H7XX_HAL_H
+#define __FTP_HOST_STM32H7XX_HAL_H
+
+#endif // __FTP_HOST_STM32H7XX_HAL_H included
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Protocol tests for the host build of the FTP server.
+
+Every test logs in on its own control connection and checks the replies and
+the transferred data of a short command sequence.
+"""
+
+import argparse
+import ftplib
+import io
+import os
+import socket
+import sys
+import time
+import zlib
+
+
+def connect(args, retries=20):
+    for _ in range(retries):
+        try:
+            ftp = ftplib.FTP()
+            ftp.connect(args.host, args.port, timeout=args.timeout)
+            ftp.login(args.user, args.password)
+            return ftp
+        except (ConnectionRefusedError, EOFError):
+            time.sleep(0.1)
+    raise RuntimeError("Could not connect to %s:%u" % (args.host, args.port))
+
+
+def expect_error(code, func, *args):
+    try:
+        func(*args)
+    except ftplib.Error as exc:
+        if not str(exc).startswith(code):
+            raise RuntimeError("expected %s, got '%s'" % (code, exc))
+        return
+    raise RuntimeError("expected %s, command succeeded" % code)
+
+
+def retrieve(ftp, name, rest=None):
+    received = bytearray()
+    ftp.retrbinary("RETR " + name, received.extend, rest=rest)
+    return bytes(received)
+
+
+def transfer_after(ftp, commands, cmd, payload=None):
+    """Opens the data connection, then sends commands before the transfer."""
+    ftp.sendcmd("TYPE I")
+    host, port = ftplib.parse227(ftp.sendcmd("PASV"))
+    data = socket.create_connection((host, port), timeout=ftp.timeout)
+    for command in commands:
+        ftp.sendcmd(command)
+    if not ftp.sendcmd(cmd).startswith("150"):
+        raise RuntimeError("%s was not accepted" % cmd)
+    received = bytearray()
+    if payload is not None:
+        data.sendall(payload)
+    else:
+        while True:
+            chunk = data.recv(8192)
+            if not chunk:
+                break
+            received.extend(chunk)
+    data.close()
+    ftp.voidresp()
+    return bytes(received)
+
+
+def test_rest_beyond_eof(ftp):
+    payload = os.urandom(3000)
+    ftp.storbinary("STOR /REST.BIN", io.BytesIO(payload))
+
+    # The offset is checked before the data connection is used
+    expect_error("554", retrieve, ftp, "/REST.BIN", len(payload) + 1)
+    expect_error("554", ftp.storbinary, "STOR /REST.BIN", io.BytesIO(payload), 8192, None, len(payload) + 1)
+
+    # The session keeps working after the rejected offset
+    if retrieve(ftp, "/REST.BIN", len(payload)) != b"":
+        raise RuntimeError("RETR at the end of the file returned data")
+    if retrieve(ftp, "/REST.BIN", 1000) != payload[1000:]:
+        raise RuntimeError("RETR from offset 1000 returned wrong data")
+    if retrieve(ftp, "/REST.BIN") != payload:
+        raise RuntimeError("RETR returned wrong data")
+    ftp.sendcmd("DELE /REST.BIN")
+
+
+def test_rejected_transfer(ftp):
+    payload = os.urandom(3000)
+    ftp.storbinary("STOR /REJ.BIN", io.BytesIO(payload))
+    ftp.sendcmd("MKD /REJ.DIR")
+
+    # Keep the data connection open across commands
+    ftp.sendcmd("TYPE I")
+    host, port = ftplib.parse227(ftp.sendcmd("PASV"))
+    data = socket.create_connection((host, port), timeout=ftp.timeout)
+
+    # The DTP cannot create a file over a directory
+    expect_error("450", ftp.sendcmd, "STOR /REJ.DIR")
+
+    # The path buffer of the rejected command is released again
+    if not ftp.sendcmd("RETR /REJ.BIN").startswith("150"):
+        raise RuntimeError("RETR after a rejected STOR was not accepted")
+    received = bytearray()
+    while True:
+        chunk = data.recv(8192)
+        if not chunk:
+            break
+        received.extend(chunk)
+    data.close()
+    ftp.voidresp()
+    if received != payload:
+        raise RuntimeError("RETR after a rejected STOR returned wrong data")
+    ftp.sendcmd("RMD /REJ.DIR")
+    ftp.sendcmd("DELE /REJ.BIN")
+
+
+def test_mode_after_pasv(ftp):
+    payload = b"MODE Z after PASV. " * 500
+    ftp.storbinary("STOR /MODE.TXT", io.BytesIO(payload))
+
+    # The mode applies to the next transfer, even if the DTP is already open
+    if zlib.decompress(transfer_after(ftp, ["MODE Z"], "RETR /MODE.TXT")) != payload:
+        raise RuntimeError("RETR in MODE Z returned wrong data")
+    if transfer_after(ftp, ["MODE S"], "RETR /MODE.TXT") != payload:
+        raise RuntimeError("RETR in MODE S returned wrong data")
+
+    # Uploads are inflated the same way
+    transfer_after(ftp, ["MODE Z"], "STOR /MODE.TXT", zlib.compress(payload[::-1]))
+    ftp.sendcmd("MODE S")
+    if retrieve(ftp, "/MODE.TXT") != payload[::-1]:
+        raise RuntimeError("STOR in MODE Z stored wrong data")
+    ftp.sendcmd("DELE /MODE.TXT")
+
+
+def test_mode_z_incompressible(ftp):
+    payload = os.urandom(256 * 1024)
+    ftp.storbinary("STOR /RAND.BIN", io.BytesIO(payload))
+
+    # Data that does not compress is sent in stored blocks
+    compressed = transfer_after(ftp, ["MODE Z"], "RETR /RAND.BIN")
+    ftp.sendcmd("MODE S")
+    if zlib.decompress(compressed) != payload:
+        raise RuntimeError("RETR in MODE Z returned wrong data")
+    if len(compressed) > len(payload) * 1.01:
+        raise RuntimeError("%u Bytes grew to %u in MODE Z" % (len(payload), len(compressed)))
+    ftp.sendcmd("DELE /RAND.BIN")
+
+
+TESTS = [
+    test_rest_beyond_eof,
+    test_rejected_transfer,
+    test_mode_after_pasv,
+    test_mode_z_incompressible,
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=2121)
+    parser.add_argument("--user", default="admin")
+    parser.add_argument("--password", default="password")
+    parser.add_argument("--timeout", type=float, default=10)
+    args = parser.parse_args()
+
+    failures = 0
+    for test in TESTS:
+        try:
+            ftp = connect(args)
+            test(ftp)
+            ftp.quit()
+            print("PASS %s" % test.__name__)
+        except Exception as exc:
+            print("FAIL %s: %s" % (test.__name__, exc))
+            failures += 1
+    print("%u Tests %u Failures" % (len(TESTS), failures))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
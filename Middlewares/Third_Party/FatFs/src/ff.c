@@ -462,7 +462,12 @@
 #endif
 #define	ENTER_FF(fs)		{ if (!lock_fs(fs)) return FR_TIMEOUT; }
 #define	LEAVE_FF(fs, res)	{ unlock_fs(fs, res); return res; }
+#if _FS_PARALLEL_IO && _FS_TINY
+#error _FS_PARALLEL_IO cannot be used with _FS_TINY
+#endif
 #else
+#undef _FS_PARALLEL_IO
+#define _FS_PARALLEL_IO	0
 #define	ENTER_FF(fs)
 #define LEAVE_FF(fs, res)	return res
 #endif
@@ -500,6 +505,33 @@
 #endif
 
 
+/* Sector cache controls */
+#if _FS_CACHE_WAYS
+#if _FS_TINY || _FS_READONLY
+#error _FS_CACHE_WAYS must be 0 at tiny or read-only configuration
+#endif
+#endif
+
+
+/* Append-only log controls */
+#if _USE_LOG && !_FS_READONLY
+#if !_USE_EXPAND || _FS_MINIMIZE != 0
+#error _USE_LOG needs _USE_EXPAND and _FS_MINIMIZE == 0
+#endif
+#endif
+
+
+/* Directory lookup cache controls */
+#if _FS_DIRCACHE
+#if _USE_LFN != 0 || _FS_EXFAT
+#error _FS_DIRCACHE must be 0 at LFN or exFAT configuration
+#endif
+#if _FS_DIRCACHE & (_FS_DIRCACHE - 1)
+#error _FS_DIRCACHE must be a power of 2
+#endif
+#endif
+
+
 /* File lock controls */
 #if _FS_LOCK != 0
 #if _FS_READONLY
@@ -875,6 +907,143 @@ void clear_lock (	/* Clear lock entries of the volume */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Sector cache between the disk access window and the disk              */
+/*-----------------------------------------------------------------------*/
+#if _FS_CACHE_WAYS
+
+static
+void cache_invalidate (
+	FATFS* fs			/* File system object */
+)
+{
+	UINT i;
+
+
+	fs->ctick = 0;
+	for (i = 0; i < _FS_CACHE_WAYS; i++) {
+		fs->csect[i] = 0xFFFFFFFF;
+		fs->cstamp[i] = 0;
+		fs->cflag[i] = 0;
+	}
+}
+
+
+static
+FRESULT cache_write_back (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs,			/* File system object */
+	UINT way			/* Cache way to write back if it is dirty */
+)
+{
+	DWORD wsect;
+	UINT nf;
+
+
+	if (fs->cflag[way] & 1) {
+		wsect = fs->csect[way];
+		if (disk_write(fs->drv, fs->cwin[way], wsect, 1) != RES_OK) return FR_DISK_ERR;
+		fs->cflag[way] = 0;
+		if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
+			for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
+				wsect += fs->fsize;
+				disk_write(fs->drv, fs->cwin[way], wsect, 1);
+			}
+		}
+	}
+	return FR_OK;
+}
+
+
+static
+FRESULT cache_flush (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs			/* File system object */
+)
+{
+	UINT i;
+	FRESULT res = FR_OK;
+
+
+	for (i = 0; i < _FS_CACHE_WAYS; i++) {
+		if (cache_write_back(fs, i) != FR_OK) res = FR_DISK_ERR;
+	}
+	return res;
+}
+
+
+static
+int cache_find (	/* Returns the way holding the sector, or the way to replace with it (-1:error) */
+	FATFS* fs,			/* File system object */
+	DWORD sector,		/* Sector number */
+	int* hit			/* Set if the sector is cached */
+)
+{
+	UINT i, victim = 0;
+
+
+	fs->ctick++;
+	for (i = 0; i < _FS_CACHE_WAYS; i++) {
+		if (fs->csect[i] == sector) {	/* Hit */
+			fs->cstamp[i] = fs->ctick;
+			*hit = 1;
+			return (int)i;
+		}
+		if (fs->csect[victim] != 0xFFFFFFFF && (fs->csect[i] == 0xFFFFFFFF ||
+			fs->ctick - fs->cstamp[i] > fs->ctick - fs->cstamp[victim])) {
+			victim = i;		/* Prefer an empty way, then the least recently used one */
+		}
+	}
+	*hit = 0;
+	if (cache_write_back(fs, victim) != FR_OK) return -1;
+	fs->csect[victim] = 0xFFFFFFFF;
+	fs->cstamp[victim] = fs->ctick;
+	return (int)victim;
+}
+
+
+static
+DRESULT cache_read (
+	FATFS* fs,			/* File system object */
+	BYTE* buff,			/* Data buffer to store read data */
+	DWORD sector		/* Sector number */
+)
+{
+	int way, hit;
+
+
+	way = cache_find(fs, sector, &hit);
+	if (way < 0) return RES_ERROR;
+	if (!hit) {
+		if (disk_read(fs->drv, fs->cwin[way], sector, 1) != RES_OK) return RES_ERROR;
+		fs->csect[way] = sector;
+	}
+	mem_cpy(buff, fs->cwin[way], SS(fs));
+	return RES_OK;
+}
+
+
+static
+DRESULT cache_write (
+	FATFS* fs,			/* File system object */
+	const BYTE* buff,	/* Data to be written */
+	DWORD sector		/* Sector number */
+)
+{
+	int way, hit;
+
+
+	way = cache_find(fs, sector, &hit);
+	if (way < 0) return RES_ERROR;
+	mem_cpy(fs->cwin[way], buff, SS(fs));
+	fs->csect[way] = sector;
+	fs->cflag[way] = 1;		/* Written back on eviction or synchronization */
+	return RES_OK;
+}
+
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the file system object               */
 /*-----------------------------------------------------------------------*/
@@ -891,6 +1060,14 @@ FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 
 	if (fs->wflag) {	/* Write back the sector if it is dirty */
 		wsect = fs->winsect;	/* Current sector number */
+#if _FS_CACHE_WAYS
+		(void)nf;
+		if (cache_write(fs, fs->win, wsect) != RES_OK) {	/* FAT copies are updated by the cache */
+			res = FR_DISK_ERR;
+		} else {
+			fs->wflag = 0;
+		}
+#else
 		if (disk_write(fs->drv, fs->win, wsect, 1) != RES_OK) {
 			res = FR_DISK_ERR;
 		} else {
@@ -902,6 +1079,7 @@ FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 				}
 			}
 		}
+#endif
 	}
 	return res;
 }
@@ -922,7 +1100,11 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 		res = sync_window(fs);		/* Write-back changes */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
+#if _FS_CACHE_WAYS
+			if (cache_read(fs, fs->win, sector) != RES_OK) {
+#else
 			if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {
+#endif
 				sector = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
 				res = FR_DISK_ERR;
 			}
@@ -961,9 +1143,17 @@ FRESULT sync_fs (	/* FR_OK:succeeded, !=0:error */
 			st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);
 			/* Write it into the FSInfo sector */
 			fs->winsect = fs->volbase + 1;
+#if _FS_CACHE_WAYS
+			cache_write(fs, fs->win, fs->winsect);
+#else
 			disk_write(fs->drv, fs->win, fs->winsect, 1);
+#endif
 			fs->fsi_flag = 0;
 		}
+#if _FS_CACHE_WAYS
+		/* Write back the sector cache */
+		res = cache_flush(fs);
+#endif
 		/* Make sure that no pending write process in the physical drive */
 		if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
 	}
@@ -1072,6 +1262,120 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Cluste
 
 
 
+#if _FS_FREEMAP && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Free cluster bitmap                                    */
+/*-----------------------------------------------------------------------*/
+
+static
+void fmap_set (
+	FATFS* fs,		/* File system object */
+	DWORD clst,		/* Cluster# */
+	int free		/* Cluster is free */
+)
+{
+	if (free) {
+		fs->fmap[clst / 32] |= (DWORD)1 << (clst % 32);
+	} else {
+		fs->fmap[clst / 32] &= ~((DWORD)1 << (clst % 32));
+	}
+}
+
+
+static
+UINT fmap_ctz (	/* Returns the index of the lowest set bit */
+	DWORD w			/* Non-zero word */
+)
+{
+#if defined(__GNUC__)
+	return (UINT)__builtin_ctz(w);
+#else
+	UINT n = 0;
+
+	while (!(w & 1)) { w >>= 1; n++; }
+	return n;
+#endif
+}
+
+
+static
+FRESULT fmap_build (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs		/* File system object */
+)
+{
+	DWORD clst, sect, stat, nfree = 0;
+	UINT i = 0;
+	BYTE *p = 0;
+	_FDID obj;
+
+
+	if (fs->n_fatent > _FS_FREEMAP) {	/* Volume too large for the bitmap */
+		fs->fmap_stat = 2;
+		return FR_OK;
+	}
+	mem_set(fs->fmap, 0, sizeof fs->fmap);
+	if (fs->fs_type == FS_FAT12) {	/* FAT12: Sector unaligned FAT entries */
+		obj.fs = fs;
+		for (clst = 2; clst < fs->n_fatent; clst++) {
+			stat = get_fat(&obj, clst);
+			if (stat == 0xFFFFFFFF) return FR_DISK_ERR;
+			if (stat == 1) return FR_INT_ERR;
+			if (stat == 0) { fmap_set(fs, clst, 1); nfree++; }
+		}
+	} else {						/* FAT16/32: Sector aligned FAT entries */
+		sect = fs->fatbase;
+		for (clst = 0; clst < fs->n_fatent; clst++) {
+			if (i == 0) {
+				if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
+				p = fs->win;
+				i = SS(fs);
+			}
+			if (fs->fs_type == FS_FAT16) {
+				stat = ld_word(p);
+				p += 2; i -= 2;
+			} else {
+				stat = ld_dword(p) & 0x0FFFFFFF;
+				p += 4; i -= 4;
+			}
+			if (stat == 0 && clst >= 2) { fmap_set(fs, clst, 1); nfree++; }
+		}
+	}
+	fs->free_clst = nfree;	/* The free cluster count comes for free */
+	fs->fsi_flag |= 1;
+	fs->fmap_stat = 1;
+	return FR_OK;
+}
+
+
+static
+DWORD fmap_find (	/* 0:No free cluster, >=2:Free cluster# */
+	FATFS* fs,		/* File system object */
+	DWORD scl		/* Search starts after this cluster# */
+)
+{
+	DWORD clst, w;
+	UINT n, nw = (UINT)((fs->n_fatent + 31) / 32);
+
+
+	clst = scl + 1;
+	if (clst >= fs->n_fatent) clst = 2;
+	for (n = 0; n <= nw; n++) {		/* Up to one lap over all words, the first one twice */
+		w = fs->fmap[clst / 32] & ((DWORD)0xFFFFFFFF << (clst % 32));
+		if (w) {
+			clst = clst / 32 * 32 + fmap_ctz(w);
+			if (clst < fs->n_fatent) return clst;
+		}
+		clst = (clst / 32 + 1) * 32;	/* Next word */
+		if (clst >= fs->n_fatent) clst = 0;
+	}
+	return 0;
+}
+
+#endif /* _FS_FREEMAP && !_FS_READONLY */
+
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* FAT access - Change value of a FAT entry                              */
@@ -1124,6 +1428,11 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			fs->wflag = 1;
 			break;
 		}
+#if _FS_FREEMAP
+		if (res == FR_OK && fs->fmap_stat == 1) {	/* Keep the free cluster bitmap in sync */
+			fmap_set(fs, clst, val == 0);
+		}
+#endif
 	}
 	return res;
 }
@@ -1397,17 +1706,29 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 	} else
 #endif
 	{	/* On the FAT12/16/32 volume */
-		ncl = scl;	/* Start cluster */
-		for (;;) {
-			ncl++;							/* Next cluster */
-			if (ncl >= fs->n_fatent) {		/* Check wrap-around */
-				ncl = 2;
-				if (ncl > scl) return 0;	/* No free cluster */
+#if _FS_FREEMAP
+		if (fs->fmap_stat == 0) {			/* Build the free cluster bitmap if needed */
+			res = fmap_build(fs);
+			if (res != FR_OK) return (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;
+		}
+		if (fs->fmap_stat == 1) {			/* Look up a free cluster in the bitmap */
+			ncl = fmap_find(fs, scl);
+			if (ncl == 0) return 0;			/* No free cluster */
+		} else
+#endif
+		{
+			ncl = scl;	/* Start cluster */
+			for (;;) {
+				ncl++;							/* Next cluster */
+				if (ncl >= fs->n_fatent) {		/* Check wrap-around */
+					ncl = 2;
+					if (ncl > scl) return 0;	/* No free cluster */
+				}
+				cs = get_fat(obj, ncl);			/* Get the cluster status */
+				if (cs == 0) break;				/* Found a free cluster */
+				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
+				if (ncl == scl) return 0;		/* No free cluster */
 			}
-			cs = get_fat(obj, ncl);			/* Get the cluster status */
-			if (cs == 0) break;				/* Found a free cluster */
-			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
-			if (ncl == scl) return 0;		/* No free cluster */
 		}
 		res = put_fat(fs, ncl, 0xFFFFFFFF);	/* Mark the new cluster 'EOC' */
 		if (res == FR_OK && clst != 0) {
@@ -2202,6 +2523,101 @@ FRESULT dir_read (
 
 
 
+#if _FS_DIRCACHE
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Directory lookup cache                           */
+/*-----------------------------------------------------------------------*/
+
+static
+UINT dcache_slot (	/* Returns the cache entry of the name */
+	DWORD dclst,	/* Directory start cluster (0:root) */
+	const BYTE* fn	/* SFN */
+)
+{
+	DWORD h = 2166136261;	/* FNV-1a hash of the directory and the name */
+	UINT i;
+
+
+	for (i = 0; i < 4; i++) {
+		h = (h ^ (BYTE)(dclst >> (i * 8))) * 16777619;
+	}
+	for (i = 0; i < 11; i++) {
+		h = (h ^ fn[i]) * 16777619;
+	}
+	return (UINT)(h ^ h >> 16) & (_FS_DIRCACHE - 1);
+}
+
+
+static
+void dcache_invalidate (
+	FATFS* fs		/* File system object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_DIRCACHE; i++) fs->dc_ofs[i] = 0xFFFFFFFF;
+}
+
+
+static
+void dcache_put (
+	DIR* dp			/* Directory object pointing the entry of dp->fn */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	UINT i = dcache_slot(dp->obj.sclust, dp->fn);
+
+
+	fs->dc_clust[i] = dp->obj.sclust;
+	fs->dc_ofs[i] = dp->dptr;
+	mem_cpy(fs->dc_name[i], dp->fn, 11);
+}
+
+
+#if !_FS_READONLY && _FS_MINIMIZE == 0
+static
+void dcache_drop (
+	DIR* dp			/* Directory object pointing the entry to be removed */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	UINT i = dcache_slot(dp->obj.sclust, dp->dir);
+
+
+	if (fs->dc_ofs[i] == dp->dptr && fs->dc_clust[i] == dp->obj.sclust) fs->dc_ofs[i] = 0xFFFFFFFF;
+}
+#endif
+
+
+static
+FRESULT dcache_find (	/* FR_OK:found and dp points the entry, FR_NO_FILE:not cached, !=0:error */
+	DIR* dp			/* Pointer to the directory object with the file name */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	UINT i = dcache_slot(dp->obj.sclust, dp->fn);
+
+
+	if (fs->dc_ofs[i] == 0xFFFFFFFF || fs->dc_clust[i] != dp->obj.sclust || mem_cmp(fs->dc_name[i], dp->fn, 11)) {
+		return FR_NO_FILE;
+	}
+	res = dir_sdi(dp, fs->dc_ofs[i]);
+	if (res == FR_OK) res = move_window(fs, dp->sect);
+	if (res != FR_OK) return res;
+	if ((dp->dir[DIR_Attr] & AM_VOL) || mem_cmp(dp->dir, dp->fn, 11)) {	/* Is the entry still the object? */
+		fs->dc_ofs[i] = 0xFFFFFFFF;
+		return FR_NO_FILE;
+	}
+	dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+	return FR_OK;
+}
+#endif	/* _FS_DIRCACHE */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
@@ -2218,6 +2634,10 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	BYTE a, ord, sum;
 #endif
 
+#if _FS_DIRCACHE
+	res = dcache_find(dp);			/* Try the position of a previous lookup */
+	if (res != FR_NO_FILE) return res;
+#endif
 	res = dir_sdi(dp, 0);			/* Rewind directory object */
 	if (res != FR_OK) return res;
 #if _FS_EXFAT
@@ -2276,6 +2696,9 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 #endif
 		res = dir_next(dp, 0);	/* Next entry */
 	} while (res == FR_OK);
+#if _FS_DIRCACHE
+	if (res == FR_OK) dcache_put(dp);	/* Remember the position of the object */
+#endif
 
 	return res;
 }
@@ -2377,6 +2800,9 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 			dp->dir[DIR_NTres] = dp->fn[NSFLAG] & (NS_BODY | NS_EXT);	/* Put NT flag */
 #endif
 			fs->wflag = 1;
+#if _FS_DIRCACHE
+			dcache_put(dp);		/* Remember the position of the new object */
+#endif
 		}
 	}
 
@@ -2423,6 +2849,9 @@ FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 
 	res = move_window(fs, dp->sect);
 	if (res == FR_OK) {
+#if _FS_DIRCACHE
+		dcache_drop(dp);		/* Forget the position of the object */
+#endif
 		dp->dir[DIR_Name] = DDEM;
 		fs->wflag = 1;
 	}
@@ -2968,6 +3397,9 @@ BYTE check_fs (	/* 0:FAT, 1:exFAT, 2:Valid BS but not FAT, 3:Not a BS, 4:Disk er
 )
 {
 	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;		/* Invaidate window */
+#if _FS_CACHE_WAYS
+	cache_invalidate(fs);							/* Invalidate sector cache */
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load boot record */
 
 	if (ld_word(fs->win + BS_55AA) != 0xAA55) return 3;	/* Check boot record signature (always placed here even if the sector size is >512) */
@@ -3190,6 +3622,12 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 
 	fs->fs_type = fmt;		/* FAT sub-type */
 	fs->id = ++Fsid;		/* File system mount ID */
+#if _FS_FREEMAP && !_FS_READONLY
+	fs->fmap_stat = 0;		/* Build free cluster bitmap on first allocation */
+#endif
+#if _FS_DIRCACHE
+	dcache_invalidate(fs);	/* Forget the lookups of the previous volume */
+#endif
 #if _USE_LFN == 1
 	fs->lfnbuf = LfnBuf;	/* Static LFN working buffer */
 #if _FS_EXFAT
@@ -3504,6 +3942,52 @@ FRESULT f_open (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Transfer File Data Sectors                                            */
+/*-----------------------------------------------------------------------*/
+/* With _FS_PARALLEL_IO, the volume is unlocked while file data is moved
+/  from/to the disk, so that the other files on the volume can be accessed in
+/  the meantime. The sectors belong to the clusters of this file object, which
+/  is used by one task only, and cannot be freed by another object while the
+/  file is open (_FS_LOCK), so only the volume has to be checked on re-lock. */
+
+static
+FRESULT file_io (	/* FR_OK/FR_DISK_ERR:volume locked, FR_TIMEOUT/FR_INVALID_OBJECT:volume unlocked */
+	FIL* fp,		/* Pointer to the file object */
+	BYTE* buff,		/* Data buffer */
+	DWORD sect,		/* Start sector */
+	UINT cc,		/* Number of sectors */
+	int write		/* 0:read, 1:write */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	DRESULT dr;
+
+
+#if _FS_PARALLEL_IO
+	unlock_fs(fs, FR_OK);
+#endif
+#if !_FS_READONLY
+	if (write) {
+		dr = disk_write(fs->drv, buff, sect, cc);
+	} else
+#endif
+	{
+		dr = disk_read(fs->drv, buff, sect, cc);
+	}
+#if _FS_PARALLEL_IO
+	if (!lock_fs(fs)) return FR_TIMEOUT;
+	if (!fs->fs_type || fp->obj.id != fs->id) {	/* Has the volume been unmounted meanwhile? */
+		unlock_fs(fs, FR_OK);
+		return FR_INVALID_OBJECT;
+	}
+#endif
+	return (dr == RES_OK) ? FR_OK : FR_DISK_ERR;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
@@ -3559,7 +4043,9 @@ FRESULT f_read (
 				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
 					cc = fs->csize - csect;
 				}
-				if (disk_read(fs->drv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				res = file_io(fp, rbuff, sect, cc, 0);
+				if (res == FR_DISK_ERR) ABORT(fs, res);
+				if (res != FR_OK) return res;	/* Volume has been left by file_io() */
 #if !_FS_READONLY && _FS_MINIMIZE <= 2			/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if _FS_TINY
 				if (fs->wflag && fs->winsect - sect < cc) {
@@ -3674,7 +4160,9 @@ FRESULT f_write (
 				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
 					cc = fs->csize - csect;
 				}
-				if (disk_write(fs->drv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				res = file_io(fp, (BYTE*)wbuff, sect, cc, 1);
+				if (res == FR_DISK_ERR) ABORT(fs, res);
+				if (res != FR_OK) return res;	/* Volume has been left by file_io() */
 #if _FS_MINIMIZE <= 2
 #if _FS_TINY
 				if (fs->winsect - sect < cc) {	/* Refill sector cache if it gets invalidated by the direct write */
@@ -5222,6 +5710,240 @@ FRESULT f_expand (
 
 
 
+#if _USE_LOG && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Append-only Log                                                       */
+/*-----------------------------------------------------------------------*/
+/* A log is a file with one contiguous block of clusters. While the log is
+/  open, the directory entry holds the size of the whole block and the data
+/  is written to the block in whole sectors, without changing the FAT or the
+/  directory entry. The last sector of the block is a journal that holds the
+/  index of the tail sector. All sectors before the tail are full and the
+/  tail sector ends at its last non-zero byte, so a log left open by a reset
+/  is resumed by f_log_open(). A new log gets its journal before the
+/  directory entry refers to the block, so a reset leaves an empty file at
+/  worst. The journal is only rewritten when the tail has moved to another
+/  sector since the last f_log_sync(). f_log_close() sets the size of the
+/  file and frees the unused clusters.
+*/
+
+#define LOG_MAGIC		0x474F4C46	/* Journal signature "FLOG" */
+#define LOG_Magic		0			/* Journal signature (DWORD) */
+#define LOG_Sect		4			/* First sector of the block (DWORD) */
+#define LOG_NSect		8			/* Number of data sectors (DWORD) */
+#define LOG_Tail		12			/* Index of the tail sector (DWORD) */
+#define LOG_Sum			16			/* Sum of the fields above (DWORD) */
+
+
+static
+FRESULT log_journal (	/* FR_OK(0):succeeded, !=0:error */
+	FFLOG* lp,		/* Pointer to the log object */
+	FATFS* fs,		/* File system object */
+	DWORD tail		/* Tail sector index to be stored */
+)
+{
+	FRESULT res;
+	BYTE *jb = fs->win;
+
+
+	res = sync_window(fs);		/* Borrow the window as journal buffer */
+	if (res != FR_OK) return res;
+	fs->winsect = 0xFFFFFFFF;
+	mem_set(jb, 0, SS(fs));
+	st_dword(jb + LOG_Magic, LOG_MAGIC);
+	st_dword(jb + LOG_Sect, lp->sect);
+	st_dword(jb + LOG_NSect, lp->nsect);
+	st_dword(jb + LOG_Tail, tail);
+	st_dword(jb + LOG_Sum, LOG_MAGIC + lp->sect + lp->nsect + tail);
+	if (disk_write(fs->drv, jb, lp->sect + lp->nsect, 1) != RES_OK) return FR_DISK_ERR;
+	lp->jsect = tail;
+	return FR_OK;
+}
+
+
+static
+FRESULT log_load (	/* FR_OK(0):succeeded, FR_EXIST:not a log, !=0:error */
+	FFLOG* lp,		/* Pointer to the log object */
+	int create		/* The block has just been allocated */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD csz, clst, ncl, n, tail;
+	BYTE *jb = lp->buf;
+
+
+	res = validate(&lp->fil.obj, &fs);
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	/* Check if the file consists of one contiguous block of clusters */
+	csz = (DWORD)fs->csize * SS(fs);
+	if (lp->fil.obj.sclust == 0 || lp->fil.obj.objsize % csz || lp->fil.obj.objsize / SS(fs) < 2) LEAVE_FF(fs, FR_EXIST);
+	ncl = (DWORD)(lp->fil.obj.objsize / csz);
+	for (clst = lp->fil.obj.sclust; --ncl; clst++) {
+		n = get_fat(&lp->fil.obj, clst);
+		if (n == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+		if (n != clst + 1) LEAVE_FF(fs, FR_EXIST);
+	}
+	lp->sect = clust2sect(fs, lp->fil.obj.sclust);
+	lp->nsect = (DWORD)(lp->fil.obj.objsize / SS(fs)) - 1;
+	lp->lflag = 0;
+
+	if (create) {	/* New log: clear the tail sector before the journal refers to it */
+		lp->len = 0;
+		mem_set(lp->buf, 0, SS(fs));
+		if (disk_write(fs->drv, lp->buf, lp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+		res = log_journal(lp, fs, 0);
+		LEAVE_FF(fs, res);
+	}
+
+	/* Resume a log left open: check the journal */
+	if (disk_read(fs->drv, jb, lp->sect + lp->nsect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+	tail = ld_dword(jb + LOG_Tail);
+	if (ld_dword(jb + LOG_Magic) != LOG_MAGIC || ld_dword(jb + LOG_Sect) != lp->sect
+		|| ld_dword(jb + LOG_NSect) != lp->nsect || tail > lp->nsect
+		|| ld_dword(jb + LOG_Sum) != LOG_MAGIC + lp->sect + lp->nsect + tail) {
+		LEAVE_FF(fs, FR_EXIST);
+	}
+	lp->jsect = tail;
+	mem_set(lp->buf, 0, SS(fs));
+	n = 0;
+	if (tail < lp->nsect) {	/* Find the end of the data in the tail sector */
+		if (disk_read(fs->drv, lp->buf, lp->sect + tail, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+		for (n = SS(fs); n && !lp->buf[n - 1]; n--) ;
+	}
+	lp->len = (FSIZE_t)tail * SS(fs) + n;
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+FRESULT f_log_open (
+	FFLOG* lp,			/* Pointer to the blank log object */
+	const TCHAR* path,	/* Pointer to the file name */
+	FSIZE_t capacity	/* Maximum length of a new log */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD csz;
+	int create = 0;
+
+
+	if (!lp) return FR_INVALID_OBJECT;
+	res = f_open(&lp->fil, path, FA_OPEN_ALWAYS | FA_READ | FA_WRITE);
+	if (res != FR_OK) return res;
+
+	if (f_size(&lp->fil) == 0) {	/* Allocate the block of a new log, plus the journal sector */
+		fs = lp->fil.obj.fs;
+		csz = (DWORD)fs->csize * SS(fs);
+		res = (capacity == 0) ? FR_INVALID_PARAMETER : FR_OK;
+		if (res == FR_OK) res = f_expand(&lp->fil, (capacity + SS(fs) + csz - 1) / csz * csz, 1);
+		if (res == FR_OK) res = log_load(lp, 1);	/* Write the journal before the directory entry refers to the block */
+		if (res == FR_OK) res = f_sync(&lp->fil);	/* Store the block on the FAT and in the directory */
+		create = 1;
+	} else {
+		res = log_load(lp, 0);
+	}
+	if (res != FR_OK) {
+		f_close(&lp->fil);
+		if (create) f_unlink(path);	/* Do not leave an empty file behind */
+	}
+	return res;
+}
+
+
+FRESULT f_log_write (
+	FFLOG* lp,			/* Pointer to the log object */
+	const void* buff,	/* Pointer to the data to be appended */
+	UINT btw,			/* Number of bytes to append */
+	UINT* bw			/* Pointer to number of bytes appended (less than btw:log full) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD sect, cc;
+	UINT ofs, n;
+	const BYTE *wbuff = (const BYTE*)buff;
+
+
+	*bw = 0;
+	res = validate(&lp->fil.obj, &fs);
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	for ( ; btw; wbuff += n, lp->len += n, *bw += n, btw -= n) {
+		sect = (DWORD)(lp->len / SS(fs));
+		if (sect >= lp->nsect) break;		/* Log full? */
+		ofs = (UINT)(lp->len % SS(fs));
+		if (ofs == 0 && btw >= SS(fs)) {	/* Write whole sectors directly */
+			cc = btw / SS(fs);
+			if (cc > lp->nsect - sect) cc = lp->nsect - sect;
+			res = file_io(&lp->fil, (BYTE*)wbuff, lp->sect + sect, cc, 1);
+			if (res == FR_DISK_ERR) LEAVE_FF(fs, res);
+			if (res != FR_OK) return res;
+			n = (UINT)(cc * SS(fs));
+			continue;
+		}
+		n = SS(fs) - ofs;					/* Fill the tail sector */
+		if (n > btw) n = btw;
+		mem_cpy(lp->buf + ofs, wbuff, n);
+		lp->lflag |= 1;
+		if (ofs + n == SS(fs)) {			/* Write the tail sector when it is full */
+			res = file_io(&lp->fil, lp->buf, lp->sect + sect, 1, 1);
+			if (res == FR_DISK_ERR) LEAVE_FF(fs, res);
+			if (res != FR_OK) return res;
+			mem_set(lp->buf, 0, SS(fs));
+			lp->lflag &= (BYTE)~1;
+		}
+	}
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+FRESULT f_log_sync (
+	FFLOG* lp			/* Pointer to the log object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD tail;
+
+
+	res = validate(&lp->fil.obj, &fs);
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	tail = (DWORD)(lp->len / SS(fs));
+	if ((lp->lflag & 1) || (tail != lp->jsect && tail < lp->nsect)) {	/* Write the tail sector, also when it is empty and new */
+		if (disk_write(fs->drv, lp->buf, lp->sect + tail, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+		lp->lflag &= (BYTE)~1;
+	}
+	if (tail != lp->jsect) {	/* Has the tail moved to another sector? */
+		res = log_journal(lp, fs, tail);
+	}
+	if (res == FR_OK && disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+
+	LEAVE_FF(fs, res);
+}
+
+
+FRESULT f_log_close (
+	FFLOG* lp			/* Pointer to the log object */
+)
+{
+	FRESULT res;
+
+
+	res = f_log_sync(lp);		/* Flush the tail sector */
+	if (res == FR_OK) res = f_lseek(&lp->fil, lp->len);
+	if (res == FR_OK) res = f_truncate(&lp->fil);	/* Set the size and free the rest of the block */
+	if (res == FR_OK) res = f_close(&lp->fil);
+	return res;
+}
+
+#endif /* _USE_LOG && !_FS_READONLY */
+
+
+
 #if _USE_FORWARD
 /*-----------------------------------------------------------------------*/
 /* Forward data to the stream directly                                   */
@@ -123,6 +123,22 @@ typedef struct {
 	DWORD	database;		/* Data base sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
+#if _FS_CACHE_WAYS
+	DWORD	ctick;			/* Sector cache access counter */
+	DWORD	csect[_FS_CACHE_WAYS];	/* Sector held by each cache way (0xFFFFFFFF:empty) */
+	DWORD	cstamp[_FS_CACHE_WAYS];	/* Last access of each cache way */
+	BYTE	cflag[_FS_CACHE_WAYS];	/* Cache way flags (b0:dirty) */
+	BYTE	cwin[_FS_CACHE_WAYS][_MAX_SS];	/* Sector cache for Directory and FAT */
+#endif
+#if _FS_FREEMAP && !_FS_READONLY
+	BYTE	fmap_stat;		/* Free cluster bitmap status (0:not built, 1:valid, 2:not available) */
+	DWORD	fmap[(_FS_FREEMAP + 31) / 32];	/* Free cluster bitmap (b:1 free) */
+#endif
+#if _FS_DIRCACHE
+	DWORD	dc_clust[_FS_DIRCACHE];	/* Directory start cluster of each dir cache entry */
+	DWORD	dc_ofs[_FS_DIRCACHE];	/* Offset of the entry in the directory (0xFFFFFFFF:empty) */
+	BYTE	dc_name[_FS_DIRCACHE][11];	/* SFN of the entry */
+#endif
 } FATFS;
 
 
@@ -173,6 +189,22 @@ typedef struct {
 
 
 
+#if _USE_LOG && !_FS_READONLY
+/* Append-only log object structure (FFLOG) */
+
+typedef struct {
+	FIL		fil;			/* File object of the preallocated block */
+	DWORD	sect;			/* First sector of the block */
+	DWORD	nsect;			/* Number of data sectors (the journal sector follows) */
+	DWORD	jsect;			/* Tail sector index held by the journal */
+	FSIZE_t	len;			/* Length of the log */
+	BYTE	lflag;			/* Log status flags (b0:tail sector modified) */
+	BYTE	buf[_MAX_SS];	/* Tail sector */
+} FFLOG;
+#endif
+
+
+
 /* Directory object structure (DIR) */
 
 typedef struct {
@@ -265,6 +297,10 @@ FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FIL* fp, FSIZE_t szf, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_log_open (FFLOG* lp, const TCHAR* path, FSIZE_t capacity);	/* Create an append-only log or resume one left open */
+FRESULT f_log_write (FFLOG* lp, const void* buff, UINT btw, UINT* bw);	/* Append data to the log */
+FRESULT f_log_sync (FFLOG* lp);										/* Make the appended data durable */
+FRESULT f_log_close (FFLOG* lp);									/* Commit the size of the log and close it */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, BYTE opt, DWORD au, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const DWORD* szt, void* work);			/* Divide a physical drive into some partitions */
@@ -277,6 +313,7 @@ TCHAR* f_gets (TCHAR* buff, int len, FIL* fp);						/* Get a string from the fil
 #define f_error(fp) ((fp)->err)
 #define f_tell(fp) ((fp)->fptr)
 #define f_size(fp) ((fp)->obj.objsize)
+#define f_log_size(lp) ((lp)->len)
 #define f_rewind(fp) f_lseek((fp), 0)
 #define f_rewinddir(dp) f_readdir((dp), 0)
 #define f_rmdir(path) f_unlink(path)
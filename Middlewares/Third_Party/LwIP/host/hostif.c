@@ -0,0 +1,278 @@
+/**
+ * @file       hostif.c
+ * @brief      Ethernet interfaces of the host build of lwIP.
+ *
+ * A frame sent by an interface is copied into pool buffers, like the DMA of
+ * the target copies received frames into the RX buffers, and queued at the
+ * linked interface. A receive thread per interface hands the queued frames
+ * to the stack in batches under the core lock, like ethernetif_input() of the
+ * target. Frames are dropped if the queue is full or the pool is exhausted.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "hostif.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "cmsis_os.h"
+
+#include "lwip/etharp.h"
+#include "lwip/pbuf.h"
+#include "lwip/stats.h"
+#include "lwip/tcpip.h"
+#include "netif/ethernet.h"
+
+/* Private defines -----------------------------------------------------------*/
+
+#define HOSTIF_MTU           1500
+
+#define HOSTIF_PCAP_MAGIC    0xA1B2C3D4U
+#define HOSTIF_PCAP_SNAPLEN  65535U
+#define HOSTIF_PCAP_ETHERNET 1U
+
+/* Private typedef -----------------------------------------------------------*/
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t network;
+} hostif_pcap_header_t;
+
+typedef struct {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} hostif_pcap_record_t;
+
+/* Private variables ---------------------------------------------------------*/
+
+// Frames are only written under the core lock, which serializes the links
+static FILE *_pcap;
+
+/* Private functions ---------------------------------------------------------*/
+
+static void _pcap_write(struct pbuf *p) {
+  struct timespec ts;
+  hostif_pcap_record_t record;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record.ts_sec = (uint32_t) ts.tv_sec;
+  record.ts_usec = (uint32_t) (ts.tv_nsec / 1000);
+  record.incl_len = p->tot_len;
+  record.orig_len = p->tot_len;
+  fwrite(&record, sizeof(record), 1, _pcap);
+  for (struct pbuf *q = p; q != NULL; q = q->next) {
+    fwrite(q->payload, 1, q->len, _pcap);
+  }
+}
+
+static err_t _hostif_linkoutput(struct netif *netif, struct pbuf *p) {
+  hostif_t *hif = (hostif_t *) netif->state;
+  hostif_t *peer = hif->peer;
+  struct pbuf *q;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  if (_pcap != NULL) {
+    _pcap_write(p);
+  }
+
+  SYS_ARCH_PROTECT(old_level);
+  hif->stats.tx_frames++;
+  hif->stats.tx_bytes += p->tot_len;
+  SYS_ARCH_UNPROTECT(old_level);
+  LINK_STATS_INC(link.xmit);
+
+  // A frame on an unplugged cable is lost
+  if (peer == NULL || !netif_is_up(peer->netif)) {
+    return ERR_OK;
+  }
+
+  // Receive into pool buffers, the frame of the sender may be reused
+  q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_POOL);
+  if (q == NULL) {
+    LINK_STATS_INC(link.memerr);
+  } else if (pbuf_copy(q, p) != ERR_OK || sys_mbox_trypost(&peer->rx_queue, q) != ERR_OK) {
+    pbuf_free(q);
+    q = NULL;
+  }
+  if (q == NULL) {
+    LINK_STATS_INC(link.drop);
+    SYS_ARCH_PROTECT(old_level);
+    peer->stats.rx_drops++;
+    SYS_ARCH_UNPROTECT(old_level);
+  }
+  return ERR_OK;
+}
+
+static void _hostif_rx_thread(void *arg) {
+  hostif_t *hif = (hostif_t *) arg;
+  struct netif *netif = hif->netif;
+  struct pbuf *batch[HOSTIF_RX_BATCH_SIZE];
+  void *msg;
+  u32_t i, n;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  while (1) {
+    // Wait for a frame, then collect the others that are ready
+    sys_arch_mbox_fetch(&hif->rx_queue, &msg, 0);
+    batch[0] = (struct pbuf *) msg;
+    LINK_STATS_INC(link.recv);
+    for (n = 1; n < HOSTIF_RX_BATCH_SIZE; n++) {
+      if (sys_arch_mbox_tryfetch(&hif->rx_queue, &msg) == SYS_MBOX_EMPTY) {
+        break;
+      }
+      batch[n] = (struct pbuf *) msg;
+      LINK_STATS_INC(link.recv);
+    }
+    SYS_ARCH_PROTECT(old_level);
+    hif->stats.rx_frames += n;
+    SYS_ARCH_UNPROTECT(old_level);
+
+#if LWIP_TCPIP_CORE_LOCKING
+    LOCK_TCPIP_CORE();
+    for (i = 0; i < n; i++) {
+      if (ethernet_input(batch[i], netif) != ERR_OK) {
+        pbuf_free(batch[i]);
+      }
+    }
+    UNLOCK_TCPIP_CORE();
+#else
+    for (i = 0; i < n; i++) {
+      if (netif->input(batch[i], netif) != ERR_OK) {
+        pbuf_free(batch[i]);
+      }
+    }
+#endif /* LWIP_TCPIP_CORE_LOCKING */
+  }
+}
+
+static int _is_hostif(struct netif *netif) {
+  return netif->linkoutput == _hostif_linkoutput;
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+void hostif_link(hostif_t *a, hostif_t *b) {
+  a->peer = b;
+  b->peer = a;
+}
+
+err_t hostif_init(struct netif *netif) {
+  static u8_t num;
+  hostif_t *hif = (hostif_t *) netif->state;
+
+  if (hif == NULL) return ERR_ARG;
+
+  hif->netif = netif;
+  if (sys_mbox_new(&hif->rx_queue, HOSTIF_RX_QUEUE_LEN) != ERR_OK) {
+    return ERR_MEM;
+  }
+
+  netif->name[0] = 'h';
+  netif->name[1] = 'o';
+  netif->output = etharp_output;
+  netif->linkoutput = _hostif_linkoutput;
+
+  // Locally administered MAC address
+  netif->hwaddr_len = ETH_HWADDR_LEN;
+  netif->hwaddr[0] = 0x02;
+  netif->hwaddr[1] = 0x00;
+  netif->hwaddr[2] = 0x00;
+  netif->hwaddr[3] = 0x00;
+  netif->hwaddr[4] = 0x00;
+  netif->hwaddr[5] = ++num;
+
+  netif->mtu = HOSTIF_MTU;
+  // The cable is always plugged in
+  netif->flags |= NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+
+  if (sys_thread_new("hostif_rx",
+                     _hostif_rx_thread,
+                     hif,
+                     HOSTIF_RX_THREAD_STACKSIZE,
+                     HOSTIF_RX_THREAD_PRIO) == NULL) {
+    sys_mbox_free(&hif->rx_queue);
+    return ERR_MEM;
+  }
+  return ERR_OK;
+}
+
+int hostif_pcap_open(const char *path) {
+  hostif_pcap_header_t header = {
+    .magic = HOSTIF_PCAP_MAGIC,
+    .version_major = 2,
+    .version_minor = 4,
+    .snaplen = HOSTIF_PCAP_SNAPLEN,
+    .network = HOSTIF_PCAP_ETHERNET,
+  };
+  FILE *file = fopen(path, "wb");
+
+  if (file == NULL) return -1;
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    fclose(file);
+    return -1;
+  }
+  LOCK_TCPIP_CORE();
+  _pcap = file;
+  UNLOCK_TCPIP_CORE();
+  return 0;
+}
+
+void hostif_pcap_close(void) {
+  FILE *file;
+
+  LOCK_TCPIP_CORE();
+  file = _pcap;
+  _pcap = NULL;
+  UNLOCK_TCPIP_CORE();
+  if (file != NULL) {
+    fclose(file);
+  }
+}
+
+void hostif_get_stats(hostif_t *hif, hostif_stats_t *stats) {
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  SYS_ARCH_PROTECT(old_level);
+  *stats = hif->stats;
+  SYS_ARCH_UNPROTECT(old_level);
+}
+
+struct netif *hostif_route(const ip4_addr_t *src, const ip4_addr_t *dest) {
+  struct netif *netif;
+
+  // Send from the interface that owns the source address
+  if (src != NULL && !ip4_addr_isany(src)) {
+    NETIF_FOREACH(netif) {
+      if (_is_hostif(netif) && ip4_addr_cmp(src, netif_ip4_addr(netif))) {
+        return netif;
+      }
+    }
+  }
+  // Traffic to a linked interface leaves through the other end of its link
+  NETIF_FOREACH(netif) {
+    if (_is_hostif(netif) && ip4_addr_cmp(dest, netif_ip4_addr(netif))) {
+      hostif_t *hif = (hostif_t *) netif->state;
+      return (hif->peer != NULL) ? hif->peer->netif : NULL;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Returns the current time in milliseconds, see sys_now() in
+ *         ethernetif.c of the target
+ */
+u32_t sys_now(void) {
+  return osKernelGetTickCount();
+}
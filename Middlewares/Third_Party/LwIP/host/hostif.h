@@ -0,0 +1,81 @@
+/**
+ * @file       hostif.h
+ * @brief      Ethernet interfaces of the host build of lwIP. Two interfaces
+ *             of the same stack are linked like by a cable, so the frames
+ *             sent by one are received by the other. The frames on all links
+ *             can be captured into a pcap file.
+ *
+ * Also included into the lwIP sources as LWIP_HOOK_FILENAME, see lwipopts.h
+ * of the host.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __LWIP_HOST_HOSTIF_H
+#define __LWIP_HOST_HOSTIF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+#include "lwip/err.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/netif.h"
+#include "lwip/sys.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+// Frames waiting for the receive thread, like the RX buffers of the target
+#define HOSTIF_RX_QUEUE_LEN          12
+// Frames passed to the stack per core lock, like ETH_RX_BATCH_SIZE of the target
+#define HOSTIF_RX_BATCH_SIZE          8
+
+#define HOSTIF_RX_THREAD_STACKSIZE 2048
+#define HOSTIF_RX_THREAD_PRIO        48
+
+/* Exported types ------------------------------------------------------------*/
+
+// Frames of an interface since it was added
+typedef struct {
+  uint64_t tx_frames;
+  uint64_t tx_bytes;
+  uint64_t rx_frames;
+  uint64_t rx_drops;  /*!< Receive queue full or out of pool buffers */
+} hostif_stats_t;
+
+// State of an interface, passed to netif_add() as state
+typedef struct hostif {
+  struct netif *netif;
+  struct hostif *peer;
+  sys_mbox_t rx_queue;
+  hostif_stats_t stats;
+} hostif_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+// Link two interfaces before adding them with netif_add()
+void hostif_link(hostif_t *a, hostif_t *b);
+
+// Initialization function for netif_add()
+err_t hostif_init(struct netif *netif);
+
+// Capture the frames of all links into a pcap file
+int hostif_pcap_open(const char *path);
+void hostif_pcap_close(void);
+
+void hostif_get_stats(hostif_t *hif, hostif_stats_t *stats);
+
+// LWIP_HOOK_IP4_ROUTE_SRC: sends traffic between the linked interfaces over
+// the link instead of the loopback
+struct netif *hostif_route(const ip4_addr_t *src, const ip4_addr_t *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __LWIP_HOST_HOSTIF_H included
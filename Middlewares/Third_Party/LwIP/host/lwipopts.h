@@ -0,0 +1,49 @@
+/**
+ * @file       lwipopts.h
+ * @brief      lwIP configuration of host builds.
+ *
+ * Uses the configuration of the target. The device and its peer are two
+ * interfaces of the same stack, linked by hostif.c.
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+#ifndef __LWIP_HOST_LWIPOPTS_H
+#define __LWIP_HOST_LWIPOPTS_H
+
+#include "../../../../LWIP/Target/lwipopts.h"
+
+// The heap is an ordinary array on the host
+#undef LWIP_RAM_HEAP_POINTER
+
+#undef LWIP_SINGLE_NETIF
+#define LWIP_SINGLE_NETIF 0
+
+// Traffic between the two interfaces must pass the link, not the loopback
+#define LWIP_HOOK_FILENAME "hostif.h"
+#define LWIP_HOOK_IP4_ROUTE_SRC(src, dest) hostif_route(src, dest)
+
+// Use errno of the host C library. cc.h of the port defines
+// LWIP_PROVIDE_ERRNO, which would declare errno as a plain variable unless
+// it is already the macro of the C library.
+#include <errno.h>
+
+// The target offloads the checksums to the MAC, which the host has not. Both
+// ends of the link skip them by default, or compute them in software.
+#ifdef HOST_LWIP_CHECKSUMS
+#undef CHECKSUM_GEN_IP
+#undef CHECKSUM_GEN_UDP
+#undef CHECKSUM_GEN_TCP
+#undef CHECKSUM_CHECK_IP
+#undef CHECKSUM_CHECK_UDP
+#undef CHECKSUM_CHECK_TCP
+#define CHECKSUM_GEN_IP    HOST_LWIP_CHECKSUMS
+#define CHECKSUM_GEN_UDP   HOST_LWIP_CHECKSUMS
+#define CHECKSUM_GEN_TCP   HOST_LWIP_CHECKSUMS
+#define CHECKSUM_CHECK_IP  HOST_LWIP_CHECKSUMS
+#define CHECKSUM_CHECK_UDP HOST_LWIP_CHECKSUMS
+#define CHECKSUM_CHECK_TCP HOST_LWIP_CHECKSUMS
+#endif
+
+#endif // __LWIP_HOST_LWIPOPTS_H
@@ -0,0 +1,645 @@
+/**
+ * @file       netbench.c
+ * @brief      Network path benchmark of the log sinks for host builds of lwIP.
+ *
+ * Runs the lwIP stack of the target with two linked interfaces: the device,
+ * with the address of the target, and the peer, with the address the UDP
+ * sink sends to. Records are written into the retarget ring buffer, like
+ * printf() on the target, and received by the peer from the UDP sink and
+ * from the live file of the FTP server. Every record carries a sequence
+ * number and its write time, so the peer measures the throughput, the lost
+ * records and the latency of every sink. The allocations of lwIP per frame on
+ * the link are counted by wrapping memp_malloc() and mem_malloc().
+ *
+ * Every rate is run with the UDP sink alone, then again while an FTP client
+ * streams the live file. A rate of 0 writes as fast as possible.
+ *
+ * Usage: netbench [-t seconds per run] [-r rates in records/s] [-l record length]
+ *                 [-w pcap file]
+ *
+ * @author     Luca Rufer, luca.rufer@swissloop.ch
+ * @date       \today
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "host.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmsis_os.h"
+#include "ff.h"
+#include "ftp.h"
+#include "hostif.h"
+#include "mrrb_retarget.h"
+
+#include "lwip/mem.h"
+#include "lwip/memp.h"
+#include "lwip/sockets.h"
+#include "lwip/stats.h"
+#include "lwip/tcpip.h"
+
+/* Private defines -----------------------------------------------------------*/
+
+// Address of the target, see MX_LWIP_Init()
+#define NETBENCH_DEVICE_IP           "192.168.0.10"
+#define NETBENCH_NETMASK             "255.255.255.0"
+#define NETBENCH_GATEWAY             "192.168.0.1"
+
+#define NETBENCH_DEFAULT_SECONDS     5
+#define NETBENCH_DEFAULT_RATES       "1000,10000,0"
+#define NETBENCH_DEFAULT_RECORD_LEN  64
+
+#define NETBENCH_DISK_SIZE_MB        8
+
+// "<sequence> <write time in us> " followed by padding and a newline
+#define NETBENCH_RECORD_HEADER_LEN   26
+#define NETBENCH_MIN_RECORD_LEN      (NETBENCH_RECORD_HEADER_LEN + 1)
+#define NETBENCH_MAX_RECORD_LEN      256
+
+// Time for records in flight to arrive after a run
+#define NETBENCH_DRAIN_MS            500
+#define NETBENCH_ATTACH_TIMEOUT_MS   2000
+#define NETBENCH_POLL_MS             100
+
+// Latencies kept per sink and run, later records are not included
+#define NETBENCH_MAX_LATENCIES       (1U << 22)
+
+#define NETBENCH_UDP_BUFFER_LEN      2048
+#define NETBENCH_FTP_BUFFER_LEN      4096
+#define NETBENCH_FTP_REPLY_LEN       512
+
+/* Private typedef -----------------------------------------------------------*/
+
+// Records received by one sink of the peer
+typedef struct {
+  const char *name;
+  pthread_mutex_t lock;
+  char line[NETBENCH_MAX_RECORD_LEN];
+  unsigned int line_len;
+  // Records with sequence numbers of the current run are counted
+  uint32_t seq_start;
+  uint32_t seq_end;
+  uint64_t bytes;
+  uint64_t records;
+  uint64_t corrupt;
+  uint32_t *latencies;
+  size_t num_latencies;
+} netbench_sink_t;
+
+typedef struct {
+  int ctrl;
+  int data;
+  char reply[NETBENCH_FTP_REPLY_LEN];
+  size_t reply_len;
+} netbench_ftp_client_t;
+
+// lwIP counters at the start of a run
+typedef struct {
+  uint64_t memp_allocs[MEMP_MAX];
+  uint64_t mem_allocs;
+  uint32_t memp_err[MEMP_MAX];
+  uint32_t mem_err;
+  hostif_stats_t device;
+  hostif_stats_t peer;
+} netbench_counters_t;
+
+/* Private variables ---------------------------------------------------------*/
+
+static struct netif _device_netif;
+static struct netif _peer_netif;
+static hostif_t _device_if;
+static hostif_t _peer_if;
+
+static FATFS _fs;
+static BYTE _mkfs_work[_MAX_SS];
+
+static netbench_sink_t _udp_sink = { .name = "udp", .lock = PTHREAD_MUTEX_INITIALIZER };
+static netbench_sink_t _ftp_sink = { .name = "ftp", .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int _record_len = NETBENCH_DEFAULT_RECORD_LEN;
+static uint32_t _seq;
+
+static osSemaphoreId_t _ftp_attached;
+static volatile int _ftp_stop;
+
+// Allocations since the start, counted by the wrappers below
+static uint64_t _memp_allocs[MEMP_MAX];
+static uint64_t _mem_allocs;
+
+static const char *const _memp_names[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name, num, size, desc) #name,
+#include "lwip/priv/memp_std.h"
+};
+
+// Retarget of printf() in mrrb_retarget.c, writes into the retarget ring buffer
+int _write(int file, char *ptr, int len);
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint64_t _now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000U + (uint64_t) ts.tv_nsec / 1000U;
+}
+
+static int _compare_latency(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Parse a complete record, the newline is already removed
+static void _sink_record(netbench_sink_t *sink, uint64_t now) {
+  unsigned int seq;
+  unsigned long long written;
+
+  if (sink->line_len != _record_len - 1 ||
+      sscanf(sink->line, "%8x %16llx", &seq, &written) != 2) {
+    sink->corrupt++;
+    return;
+  }
+  // Records of an earlier run that arrive late are ignored
+  if (seq - sink->seq_start >= sink->seq_end - sink->seq_start) {
+    return;
+  }
+  sink->records++;
+  if (sink->num_latencies < NETBENCH_MAX_LATENCIES) {
+    sink->latencies[sink->num_latencies++] = (uint32_t) (now - written);
+  }
+}
+
+static void _sink_feed(netbench_sink_t *sink, const char *data, size_t len) {
+  uint64_t now = _now_us();
+
+  pthread_mutex_lock(&sink->lock);
+  sink->bytes += len;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == '\n') {
+      sink->line[sink->line_len] = '\0';
+      _sink_record(sink, now);
+      sink->line_len = 0;
+    } else if (sink->line_len < sizeof(sink->line) - 1) {
+      sink->line[sink->line_len++] = data[i];
+    }
+  }
+  pthread_mutex_unlock(&sink->lock);
+}
+
+static void _sink_start(netbench_sink_t *sink, uint32_t seq_start) {
+  pthread_mutex_lock(&sink->lock);
+  sink->seq_start = seq_start;
+  sink->seq_end = seq_start;
+  sink->bytes = 0;
+  sink->records = 0;
+  sink->corrupt = 0;
+  sink->num_latencies = 0;
+  pthread_mutex_unlock(&sink->lock);
+}
+
+static void _sink_set_end(netbench_sink_t *sink, uint32_t seq_end) {
+  pthread_mutex_lock(&sink->lock);
+  sink->seq_end = seq_end;
+  pthread_mutex_unlock(&sink->lock);
+}
+
+static void _sink_report(netbench_sink_t *sink, uint32_t written, uint64_t elapsed_us) {
+  uint32_t *lat;
+  size_t n;
+
+  pthread_mutex_lock(&sink->lock);
+  // Stop counting, late records belong to no run
+  sink->seq_end = sink->seq_start;
+  lat = sink->latencies;
+  n = sink->num_latencies;
+  printf("  %-6s %10llu of %10lu records %8.2f MiB/s %8llu corrupt",
+         sink->name,
+         (unsigned long long) sink->records,
+         (unsigned long) written,
+         (double) sink->bytes / (1 << 20) / (elapsed_us / 1e6),
+         (unsigned long long) sink->corrupt);
+  if (n > 0) {
+    qsort(lat, n, sizeof(lat[0]), _compare_latency);
+    printf("   latency p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+           lat[n / 2] / 1e3, lat[(n * 99) / 100] / 1e3, lat[n - 1] / 1e3);
+  }
+  printf("\n");
+  pthread_mutex_unlock(&sink->lock);
+}
+
+static void _counters_get(netbench_counters_t *counters) {
+  for (int i = 0; i < MEMP_MAX; i++) {
+    counters->memp_allocs[i] = __atomic_load_n(&_memp_allocs[i], __ATOMIC_RELAXED);
+    counters->memp_err[i] = lwip_stats.memp[i]->err;
+  }
+  counters->mem_allocs = __atomic_load_n(&_mem_allocs, __ATOMIC_RELAXED);
+  counters->mem_err = lwip_stats.mem.err;
+  hostif_get_stats(&_device_if, &counters->device);
+  hostif_get_stats(&_peer_if, &counters->peer);
+}
+
+// Print the frames on the link, the allocations per frame and the failed
+// allocations since 'start'
+static void _counters_report(const netbench_counters_t *start) {
+  netbench_counters_t end;
+  uint64_t frames, drops, allocs;
+
+  _counters_get(&end);
+  frames = (end.device.tx_frames - start->device.tx_frames) + (end.peer.tx_frames - start->peer.tx_frames);
+  drops = (end.device.rx_drops - start->device.rx_drops) + (end.peer.rx_drops - start->peer.rx_drops);
+  allocs = end.mem_allocs - start->mem_allocs;
+  for (int i = 0; i < MEMP_MAX; i++) {
+    allocs += end.memp_allocs[i] - start->memp_allocs[i];
+  }
+  if (frames == 0) frames = 1;
+
+  printf("  %-6s %10llu frames %8llu dropped %6.2f allocations/frame:",
+         "link", (unsigned long long) frames, (unsigned long long) drops, (double) allocs / frames);
+  if (end.mem_allocs != start->mem_allocs) {
+    printf(" heap %.2f", (double) (end.mem_allocs - start->mem_allocs) / frames);
+  }
+  for (int i = 0; i < MEMP_MAX; i++) {
+    if (end.memp_allocs[i] != start->memp_allocs[i]) {
+      printf(" %s %.2f", _memp_names[i], (double) (end.memp_allocs[i] - start->memp_allocs[i]) / frames);
+    }
+  }
+  printf("\n");
+
+  if (end.mem_err != start->mem_err) {
+    printf("  %-6s %10lu failed heap allocations\n", "lwip", (unsigned long) (end.mem_err - start->mem_err));
+  }
+  for (int i = 0; i < MEMP_MAX; i++) {
+    if (end.memp_err[i] != start->memp_err[i]) {
+      printf("  %-6s %10lu failed %s allocations\n",
+             "lwip", (unsigned long) (end.memp_err[i] - start->memp_err[i]), _memp_names[i]);
+    }
+  }
+}
+
+// Write records into the retarget ring buffer for 'seconds', paced to 'rate'
+// records per second or as fast as possible if 0. Returns the number written.
+static uint32_t _write_records(unsigned long rate, unsigned long seconds) {
+  char record[NETBENCH_MAX_RECORD_LEN];
+  uint64_t start = _now_us();
+  uint64_t end = start + (uint64_t) seconds * 1000000U;
+  uint64_t now = start;
+  uint32_t written = 0;
+
+  memset(record, 'x', sizeof(record));
+  record[_record_len - 1] = '\n';
+  while (now < end) {
+    if (rate != 0) {
+      uint64_t due = start + (uint64_t) written * 1000000U / rate;
+      if (due > now) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = (long) (due - now) * 1000L };
+        nanosleep(&ts, NULL);
+        now = _now_us();
+        continue;
+      }
+    }
+    // The header overwrites the previous one, the padding stays in place
+    snprintf(record, NETBENCH_RECORD_HEADER_LEN + 1, "%08x %016llx ", (unsigned int) _seq, (unsigned long long) now);
+    record[NETBENCH_RECORD_HEADER_LEN] = 'x';
+    _write(1, record, (int) _record_len);
+    _seq++;
+    written++;
+    now = _now_us();
+  }
+  return written;
+}
+
+static void _run(unsigned long rate, unsigned long seconds, int ftp) {
+  netbench_counters_t counters;
+  uint32_t seq_start = _seq;
+  uint32_t written;
+
+  if (rate != 0) {
+    printf("%lu records/s, %s\n", rate, ftp ? "UDP and FTP live file sinks" : "UDP sink");
+  } else {
+    printf("As fast as possible, %s\n", ftp ? "UDP and FTP live file sinks" : "UDP sink");
+  }
+
+  _sink_start(&_udp_sink, seq_start);
+  _sink_start(&_ftp_sink, seq_start);
+  _sink_set_end(&_udp_sink, seq_start + 0x80000000U);
+  if (ftp) _sink_set_end(&_ftp_sink, seq_start + 0x80000000U);
+  _counters_get(&counters);
+
+  written = _write_records(rate, seconds);
+  osDelay(NETBENCH_DRAIN_MS);
+
+  _sink_report(&_udp_sink, written, seconds * 1000000U);
+  if (ftp) _sink_report(&_ftp_sink, written, seconds * 1000000U);
+  _counters_report(&counters);
+}
+
+/* Peer ----------------------------------------------------------------------*/
+
+static void _peer_address(struct sockaddr_in *addr, uint32_t ip, uint16_t port) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_len = sizeof(*addr);
+  addr->sin_family = AF_INET;
+  addr->sin_port = lwip_htons(port);
+  addr->sin_addr.s_addr = ip;
+}
+
+// Open a socket bound to the address of the peer, so it is routed over the link
+static int _peer_socket(int type) {
+  struct sockaddr_in addr;
+  int sd = socket(AF_INET, type, 0);
+
+  if (sd < 0) return -1;
+  _peer_address(&addr, MRRB_RETARGET_UDP_RECV_IP, (type == SOCK_DGRAM) ? MRRB_RETARGET_UDP_RECV_PORT : 0);
+  if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+static void _udp_peer_thread(void *args) {
+  static char buffer[NETBENCH_UDP_BUFFER_LEN];
+  int sd = _peer_socket(SOCK_DGRAM);
+
+  if (sd < 0) {
+    fprintf(stderr, "UDP peer: failed to open the socket.\n");
+    osThreadExit();
+  }
+  while (1) {
+    int len = recv(sd, buffer, sizeof(buffer), 0);
+    if (len > 0) {
+      _sink_feed(&_udp_sink, buffer, (size_t) len);
+    }
+  }
+}
+
+// Receive the next reply on the control connection. Returns the reply code,
+// or -1 if the connection failed.
+static int _ftp_reply(netbench_ftp_client_t *client) {
+  while (1) {
+    // A reply ends with a line starting with the code and a space
+    char *line = client->reply;
+    char *end;
+    while ((end = memchr(line, '\n', client->reply_len - (size_t) (line - client->reply))) != NULL) {
+      if (end - line >= 4 && line[3] == ' ') {
+        int code = atoi(line);
+        client->reply_len -= (size_t) (end + 1 - client->reply);
+        memmove(client->reply, end + 1, client->reply_len);
+        return code;
+      }
+      line = end + 1;
+    }
+    if (client->reply_len == sizeof(client->reply)) {
+      // Drop the lines of a long multi-line reply
+      client->reply_len -= (size_t) (line - client->reply);
+      memmove(client->reply, line, client->reply_len);
+      if (client->reply_len == sizeof(client->reply)) return -1;
+    }
+    int len = recv(client->ctrl, client->reply + client->reply_len, sizeof(client->reply) - client->reply_len, 0);
+    if (len <= 0) return -1;
+    client->reply_len += (size_t) len;
+  }
+}
+
+static int _ftp_command(netbench_ftp_client_t *client, const char *command) {
+  size_t len = strlen(command);
+
+  if (send(client->ctrl, command, len, 0) != (int) len) return -1;
+  return _ftp_reply(client);
+}
+
+// Log in, and open the live file over a passive data connection
+static int _ftp_open(netbench_ftp_client_t *client) {
+  struct sockaddr_in addr;
+  unsigned int h[4], p[2];
+  char *args;
+  int code;
+
+  client->ctrl = _peer_socket(SOCK_STREAM);
+  if (client->ctrl < 0) return -1;
+  _peer_address(&addr, ipaddr_addr(NETBENCH_DEVICE_IP), FTP_SERVER_DEFAULT_CONTROL_PORT);
+  if (connect(client->ctrl, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+  if (_ftp_reply(client) != 220) return -1;
+
+  code = _ftp_command(client, "USER anonymous\r\n");
+  if (code == 331) code = _ftp_command(client, "PASS netbench\r\n");
+  if (code != 230) return -1;
+  if (_ftp_command(client, "TYPE I\r\n") != 200) return -1;
+
+  if (send(client->ctrl, "PASV\r\n", 6, 0) != 6) return -1;
+  // The address is in the reply line, which _ftp_reply() consumes
+  client->reply[client->reply_len] = '\0';
+  while (strchr(client->reply, ')') == NULL) {
+    int len = recv(client->ctrl, client->reply + client->reply_len, sizeof(client->reply) - client->reply_len - 1, 0);
+    if (len <= 0) return -1;
+    client->reply_len += (size_t) len;
+    client->reply[client->reply_len] = '\0';
+  }
+  args = strchr(client->reply, '(');
+  if (args == NULL || sscanf(args, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6) return -1;
+  if (_ftp_reply(client) != 227) return -1;
+
+  client->data = _peer_socket(SOCK_STREAM);
+  if (client->data < 0) return -1;
+  _peer_address(&addr, PP_HTONL(LWIP_MAKEU32(h[0], h[1], h[2], h[3])), (uint16_t) (p[0] * 256 + p[1]));
+  if (connect(client->data, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+
+  code = _ftp_command(client, "RETR " MRRB_RETARGET_FTP_PATH "\r\n");
+  return (code == 125 || code == 150) ? 0 : -1;
+}
+
+static void _ftp_peer_thread(void *args) {
+  static char buffer[NETBENCH_FTP_BUFFER_LEN];
+  netbench_ftp_client_t client = { .ctrl = -1, .data = -1 };
+
+  if (_ftp_open(&client) < 0) {
+    fprintf(stderr, "FTP peer: failed to open the live file.\n");
+  } else {
+    osSemaphoreRelease(_ftp_attached);
+    while (!_ftp_stop) {
+      struct timeval timeout = { .tv_sec = 0, .tv_usec = NETBENCH_POLL_MS * 1000 };
+      fd_set read_set;
+      FD_ZERO(&read_set);
+      FD_SET(client.data, &read_set);
+      if (select(client.data + 1, &read_set, NULL, NULL, &timeout) > 0) {
+        int len = recv(client.data, buffer, sizeof(buffer), 0);
+        if (len <= 0) break;
+        _sink_feed(&_ftp_sink, buffer, (size_t) len);
+      }
+    }
+    // Closing the data connection ends the transfer
+    close(client.data);
+    client.data = -1;
+    _ftp_reply(&client);
+    _ftp_command(&client, "QUIT\r\n");
+  }
+  if (client.data >= 0) close(client.data);
+  if (client.ctrl >= 0) close(client.ctrl);
+  osSemaphoreRelease(_ftp_attached);
+  osThreadExit();
+}
+
+/* Setup ---------------------------------------------------------------------*/
+
+static void _tcpip_init_done(void *arg) {
+  sys_sem_signal((sys_sem_t *) arg);
+}
+
+static int _net_init(void) {
+  ip4_addr_t ip, netmask, gateway;
+  sys_sem_t init_done;
+  int sts = 0;
+
+  if (sys_sem_new(&init_done, 0) != ERR_OK) return -1;
+  tcpip_init(_tcpip_init_done, &init_done);
+  sys_sem_wait(&init_done);
+  sys_sem_free(&init_done);
+
+  hostif_link(&_device_if, &_peer_if);
+  ip4addr_aton(NETBENCH_NETMASK, &netmask);
+  ip4addr_aton(NETBENCH_GATEWAY, &gateway);
+
+  LOCK_TCPIP_CORE();
+  ip4addr_aton(NETBENCH_DEVICE_IP, &ip);
+  if (netif_add(&_device_netif, &ip, &netmask, &gateway, &_device_if, hostif_init, tcpip_input) == NULL) {
+    sts = -1;
+  }
+  ip4_addr_set_u32(&ip, MRRB_RETARGET_UDP_RECV_IP);
+  if (netif_add(&_peer_netif, &ip, &netmask, &gateway, &_peer_if, hostif_init, tcpip_input) == NULL) {
+    sts = -1;
+  }
+  if (sts == 0) {
+    netif_set_default(&_device_netif);
+    netif_set_up(&_device_netif);
+    netif_set_up(&_peer_netif);
+  }
+  UNLOCK_TCPIP_CORE();
+  return sts;
+}
+
+static int _fs_init(void) {
+  FRESULT fres;
+
+  if (host_disk_init(NULL, NETBENCH_DISK_SIZE_MB * 1024 * 1024 / HOST_DISK_SECTOR_SIZE) < 0) return -1;
+  fres = f_mkfs("", FM_ANY, 0, _mkfs_work, sizeof(_mkfs_work));
+  if (fres == FR_OK) {
+    fres = f_mount(&_fs, "", 1);
+  }
+  return (fres == FR_OK) ? 0 : -1;
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+// Count the allocations of lwIP, see the linker flags in the Makefile
+void *__real_memp_malloc(memp_t type);
+void *__wrap_memp_malloc(memp_t type) {
+  __atomic_fetch_add(&_memp_allocs[type], 1, __ATOMIC_RELAXED);
+  return __real_memp_malloc(type);
+}
+
+void *__real_mem_malloc(mem_size_t size);
+void *__wrap_mem_malloc(mem_size_t size) {
+  __atomic_fetch_add(&_mem_allocs, 1, __ATOMIC_RELAXED);
+  return __real_mem_malloc(size);
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+
+  if (size > 0) {
+    size_t copy = (len < size) ? len : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = '\0';
+  }
+  return len;
+}
+
+int main(int argc, char *argv[]) {
+  const char *rates = NETBENCH_DEFAULT_RATES;
+  const char *pcap = NULL;
+  unsigned long seconds = NETBENCH_DEFAULT_SECONDS;
+  const osThreadAttr_t udp_attr = { .name = "udp_peer" };
+  const osThreadAttr_t ftp_attr = { .name = "ftp_peer" };
+  const char *r;
+  char *end;
+  int attached;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:r:l:w:")) != -1) {
+    switch (opt) {
+      case 't': seconds = strtoul(optarg, NULL, 0); break;
+      case 'r': rates = optarg; break;
+      case 'l': _record_len = (unsigned int) strtoul(optarg, NULL, 0); break;
+      case 'w': pcap = optarg; break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-t seconds per run] [-r rates in records/s] [-l record length]\n"
+                "          [-w pcap file]\n"
+                "A rate of 0 writes as fast as possible.\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (seconds == 0 || _record_len < NETBENCH_MIN_RECORD_LEN || _record_len > NETBENCH_MAX_RECORD_LEN) {
+    fprintf(stderr, "The run time must not be 0 and records must be %u to %u Bytes long.\n",
+            NETBENCH_MIN_RECORD_LEN, NETBENCH_MAX_RECORD_LEN);
+    return EXIT_FAILURE;
+  }
+
+  _udp_sink.latencies = malloc(NETBENCH_MAX_LATENCIES * sizeof(uint32_t));
+  _ftp_sink.latencies = malloc(NETBENCH_MAX_LATENCIES * sizeof(uint32_t));
+  _ftp_attached = osSemaphoreNew(1, 0, NULL);
+  if (_udp_sink.latencies == NULL || _ftp_sink.latencies == NULL || _ftp_attached == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return EXIT_FAILURE;
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  if (_fs_init() < 0) {
+    fprintf(stderr, "Failed to create the volume of the FTP server.\n");
+    return EXIT_FAILURE;
+  }
+  if (_net_init() < 0) {
+    fprintf(stderr, "Failed to initialize lwIP.\n");
+    return EXIT_FAILURE;
+  }
+  if (pcap != NULL && hostif_pcap_open(pcap) < 0) {
+    fprintf(stderr, "Failed to open %s.\n", pcap);
+    return EXIT_FAILURE;
+  }
+  if (osThreadNew(_udp_peer_thread, NULL, &udp_attr) == NULL ||
+      mrrb_retarget_init() < 0 ||
+      ftp_server_init() == NULL) {
+    fprintf(stderr, "Failed to start the sinks.\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("lwIP network benchmark: %lu s per run, %u B records, TCP_MSS %d, PBUF_POOL_SIZE %d, checksums %s\n",
+         seconds, _record_len, TCP_MSS, PBUF_POOL_SIZE, CHECKSUM_GEN_TCP ? "on" : "off");
+
+  // Rates in records per second, separated by commas
+  for (r = rates; *r != '\0'; r = (*end == ',') ? end + 1 : end) {
+    unsigned long rate = strtoul(r, &end, 0);
+    if (end == r) break;
+    _run(rate, seconds, 0);
+  }
+
+  // Stream the live file while the UDP sink keeps running
+  attached = osThreadNew(_ftp_peer_thread, NULL, &ftp_attr) != NULL &&
+             osSemaphoreAcquire(_ftp_attached, NETBENCH_ATTACH_TIMEOUT_MS) == osOK;
+  for (r = rates; attached && *r != '\0'; r = (*end == ',') ? end + 1 : end) {
+    unsigned long rate = strtoul(r, &end, 0);
+    if (end == r) break;
+    _run(rate, seconds, 1);
+  }
+  _ftp_stop = 1;
+  osSemaphoreAcquire(_ftp_attached, NETBENCH_ATTACH_TIMEOUT_MS);
+
+  hostif_pcap_close();
+  return attached ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -45,6 +45,289 @@
 int errno;
 #endif
 
+#if SYS_MBOX_RING
+/*-----------------------------------------------------------------------------------*/
+/*
+  Mailboxes are rings of message pointers, protected by a critical section.
+  When the tcpip thread finds its mailbox empty, it registers as the waiter
+  and blocks on SYS_MBOX_FLAG, which the next post sets with a thread flag (a
+  FreeRTOS task notification). The tcpip thread is never terminated, so the
+  posts can always use its handle. Every other consumer, e.g. a socket reader
+  that may be terminated while blocked, waits on the counting semaphore of
+  the mailbox instead.
+  A post to a full mailbox retries every tick, which is rare as lwIP posts
+  with sys_mbox_trypost() from the tcpip thread.
+*/
+#define SYS_MBOX_FLAG 0x40000000U
+
+// Set by LWIP_MARK_TCPIP_THREAD() once the tcpip thread runs
+static osThreadId_t tcpip_thread_id = NULL;
+
+struct sys_mbox
+{
+  u16_t size;                 // Number of messages the ring holds
+  u16_t head;                 // Index of the oldest message
+  u16_t count;                // Number of messages in the ring
+  u16_t shared_waiters;       // Consumers blocked on 'shared'
+  osThreadId_t waiter;        // tcpip thread blocked on SYS_MBOX_FLAG
+  osSemaphoreId_t shared;
+  void *msgs[];
+};
+
+// Enter/exit the critical section from thread or interrupt context
+static UBaseType_t _mbox_lock(void)
+{
+  if (__get_IPSR() != 0U)
+  {
+    return taskENTER_CRITICAL_FROM_ISR();
+  }
+  taskENTER_CRITICAL();
+  return 0;
+}
+
+static void _mbox_unlock(UBaseType_t state)
+{
+  if (__get_IPSR() != 0U)
+  {
+    taskEXIT_CRITICAL_FROM_ISR(state);
+  }
+  else
+  {
+    taskEXIT_CRITICAL();
+  }
+}
+
+// Put a message into the ring and wake the consumers. Returns 0 if the
+// message was stored and -1 if the ring is full.
+static int _mbox_put(struct sys_mbox *mb, void *msg)
+{
+  UBaseType_t state = _mbox_lock();
+  if (mb->count == mb->size)
+  {
+    _mbox_unlock(state);
+    return -1;
+  }
+  mb->msgs[(mb->head + mb->count) % mb->size] = msg;
+  mb->count++;
+  // The tcpip thread is never terminated, so its handle stays valid
+  if (mb->waiter != NULL)
+  {
+    osThreadFlagsSet(mb->waiter, SYS_MBOX_FLAG);
+  }
+  if (mb->shared_waiters != 0U)
+  {
+    osSemaphoreRelease(mb->shared);
+  }
+  _mbox_unlock(state);
+  return 0;
+}
+
+/*-----------------------------------------------------------------------------------*/
+//  Creates an empty mailbox.
+err_t sys_mbox_new(sys_mbox_t *mbox, int size)
+{
+  struct sys_mbox *mb = NULL;
+
+  if (size > 0 && size <= UINT16_MAX)
+  {
+    mb = pvPortMalloc(sizeof(struct sys_mbox) + (size_t)size * sizeof(void *));
+  }
+  if (mb != NULL)
+  {
+    mb->size = (u16_t)size;
+    mb->head = 0;
+    mb->count = 0;
+    mb->shared_waiters = 0;
+    mb->waiter = NULL;
+    mb->shared = osSemaphoreNew((uint32_t)size, 0, NULL);
+    if (mb->shared == NULL)
+    {
+      vPortFree(mb);
+      mb = NULL;
+    }
+  }
+  *mbox = mb;
+#if SYS_STATS
+  ++lwip_stats.sys.mbox.used;
+  if(lwip_stats.sys.mbox.max < lwip_stats.sys.mbox.used)
+  {
+    lwip_stats.sys.mbox.max = lwip_stats.sys.mbox.used;
+  }
+#endif /* SYS_STATS */
+  if(*mbox == NULL)
+    return ERR_MEM;
+
+  return ERR_OK;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/*
+  Deallocates a mailbox. If there are messages still present in the
+  mailbox when the mailbox is deallocated, it is an indication of a
+  programming error in lwIP and the developer should be notified.
+*/
+void sys_mbox_free(sys_mbox_t *mbox)
+{
+  if((*mbox)->count)
+  {
+    /* Line for breakpoint.  Should never break here! */
+    portNOP();
+#if SYS_STATS
+    lwip_stats.sys.mbox.err++;
+#endif /* SYS_STATS */
+  }
+  osSemaphoreDelete((*mbox)->shared);
+  vPortFree(*mbox);
+#if SYS_STATS
+  --lwip_stats.sys.mbox.used;
+#endif /* SYS_STATS */
+}
+
+/*-----------------------------------------------------------------------------------*/
+//   Posts the "msg" to the mailbox.
+void sys_mbox_post(sys_mbox_t *mbox, void *data)
+{
+  while(_mbox_put(*mbox, data) != 0)
+  {
+    osDelay(1);
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+//   Try to post the "msg" to the mailbox.
+err_t sys_mbox_trypost(sys_mbox_t *mbox, void *msg)
+{
+  if(_mbox_put(*mbox, msg) == 0)
+  {
+    return ERR_OK;
+  }
+  // could not post, queue must be full
+#if SYS_STATS
+  lwip_stats.sys.mbox.err++;
+#endif /* SYS_STATS */
+  return ERR_MEM;
+}
+
+/*-----------------------------------------------------------------------------------*/
+//   Try to post the "msg" to the mailbox.
+err_t sys_mbox_trypost_fromisr(sys_mbox_t *mbox, void *msg)
+{
+  return sys_mbox_trypost(mbox, msg);
+}
+
+/*-----------------------------------------------------------------------------------*/
+/*
+  Blocks the thread until a message arrives in the mailbox, but does
+  not block the thread longer than "timeout" milliseconds (similar to
+  the sys_arch_sem_wait() function). The "msg" argument is a result
+  parameter that is set by the function (i.e., by doing "*msg =
+  ptr"). The "msg" parameter maybe NULL to indicate that the message
+  should be dropped.
+  The return values are the same as for the sys_arch_sem_wait() function:
+  Number of milliseconds spent waiting or SYS_ARCH_TIMEOUT if there was a
+  timeout.
+
+  Note that a function with a similar name, sys_mbox_fetch(), is
+  implemented by lwIP.
+*/
+u32_t sys_arch_mbox_fetch(sys_mbox_t *mbox, void **msg, u32_t timeout)
+{
+  struct sys_mbox *mb = *mbox;
+  uint32_t starttime = osKernelGetTickCount();
+  uint32_t elapsed, wait = osWaitForever;
+  int own;
+
+  for(;;)
+  {
+    elapsed = osKernelGetTickCount() - starttime;
+    taskENTER_CRITICAL();
+    if(mb->count)
+    {
+      if(msg != NULL)
+      {
+        *msg = mb->msgs[mb->head];
+      }
+      mb->head = (mb->head + 1U) % mb->size;
+      mb->count--;
+      taskEXIT_CRITICAL();
+      return elapsed;
+    }
+    if(timeout != 0)
+    {
+      if(elapsed >= timeout)
+      {
+        taskEXIT_CRITICAL();
+        return SYS_ARCH_TIMEOUT;
+      }
+      wait = timeout - elapsed;
+    }
+    // Only the tcpip thread waits on a thread flag. A stale flag from an
+    // earlier wait only causes another round.
+    own = (tcpip_thread_id != NULL && osThreadGetId() == tcpip_thread_id);
+    if(own)
+    {
+      mb->waiter = osThreadGetId();
+    }
+    else
+    {
+      mb->shared_waiters++;
+    }
+    taskEXIT_CRITICAL();
+
+    if(own)
+    {
+      osThreadFlagsWait(SYS_MBOX_FLAG, osFlagsWaitAny, wait);
+    }
+    else
+    {
+      osSemaphoreAcquire(mb->shared, wait);
+    }
+
+    taskENTER_CRITICAL();
+    if(own)
+    {
+      mb->waiter = NULL;
+    }
+    else
+    {
+      mb->shared_waiters--;
+    }
+    taskEXIT_CRITICAL();
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+/*
+  Similar to sys_arch_mbox_fetch, but if message is not ready immediately, we'll
+  return with SYS_MBOX_EMPTY.  On success, 0 is returned.
+*/
+u32_t sys_arch_mbox_tryfetch(sys_mbox_t *mbox, void **msg)
+{
+  struct sys_mbox *mb = *mbox;
+  UBaseType_t state = _mbox_lock();
+
+  if(mb->count == 0)
+  {
+    _mbox_unlock(state);
+    return SYS_MBOX_EMPTY;
+  }
+  if(msg != NULL)
+  {
+    *msg = mb->msgs[mb->head];
+  }
+  mb->head = (mb->head + 1U) % mb->size;
+  mb->count--;
+  _mbox_unlock(state);
+  return ERR_OK;
+}
+
+/*-----------------------------------------------------------------------------------*/
+//  Called by the tcpip thread when it starts, see LWIP_MARK_TCPIP_THREAD().
+void sys_mark_tcpip_thread(void)
+{
+  tcpip_thread_id = osThreadGetId();
+}
+#else
 /*-----------------------------------------------------------------------------------*/
 //  Creates an empty mailbox.
 err_t sys_mbox_new(sys_mbox_t *mbox, int size)
@@ -231,6 +514,13 @@ u32_t sys_arch_mbox_tryfetch(sys_mbox_t *mbox, void **msg)
     return SYS_MBOX_EMPTY;
   }
 }
+
+/*-----------------------------------------------------------------------------------*/
+//  Message queues do not need to know their consumers.
+void sys_mark_tcpip_thread(void)
+{
+}
+#endif /* SYS_MBOX_RING */
 /*----------------------------------------------------------------------------------*/
 int sys_mbox_valid(sys_mbox_t *mbox)
 {
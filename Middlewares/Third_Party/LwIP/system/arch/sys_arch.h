@@ -55,15 +55,33 @@ typedef osMessageQId  sys_mbox_t;
 typedef osThreadId    sys_thread_t;
 #else
 
+/* Mailboxes are pointer rings that wake their consumer with a thread flag,
+   instead of CMSIS-RTOS2 message queues (see sys_arch.c) */
+#ifndef SYS_MBOX_RING
+#define SYS_MBOX_RING 1
+#endif
+
+#if SYS_MBOX_RING
+#define SYS_MBOX_NULL (struct sys_mbox *)0
+#else
 #define SYS_MBOX_NULL (osMessageQueueId_t)0
+#endif
 #define SYS_SEM_NULL  (osSemaphoreId_t)0
 
 typedef osSemaphoreId_t     sys_sem_t;
-typedef osSemaphoreId_t     sys_mutex_t;
+typedef osMutexId_t         sys_mutex_t;
+#if SYS_MBOX_RING
+typedef struct sys_mbox    *sys_mbox_t;
+#else
 typedef osMessageQueueId_t  sys_mbox_t;
+#endif
 typedef osThreadId_t        sys_thread_t;
 #endif
 
+/* Records the tcpip thread, the only mailbox consumer that waits on a thread
+   flag. Called through LWIP_MARK_TCPIP_THREAD() in lwipopts.h. */
+void sys_mark_tcpip_thread(void);
+
 #ifdef  __cplusplus
 }
 #endif